@@ -24,6 +24,28 @@
 */
 
 #include "exif.h"
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <thread>
+
+#ifdef EXIF_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using std::string;
 
@@ -96,6 +118,9 @@ exif::TagInfo tagInfoData[] = {
         {EXIF_TAG_EXIF_VERSION, ENTRY_FORMAT_UNDEFINED, EXIF_IFD_DIRECTORY, 4, "Exif Version",""},
         {EXIF_TAG_ORIGINAL_DATE, ENTRY_FORMAT_ASCII, EXIF_IFD_DIRECTORY, 0, "Original date/time",""},
         {EXIF_TAG_DIGITIZATION_DATE, ENTRY_FORMAT_ASCII, EXIF_IFD_DIRECTORY, 0, "Digitize date/time",""},
+        {EXIF_TAG_OFFSET_TIME, ENTRY_FORMAT_ASCII, EXIF_IFD_DIRECTORY, 7, "Offset time",""},
+        {EXIF_TAG_OFFSET_TIME_ORIG, ENTRY_FORMAT_ASCII, EXIF_IFD_DIRECTORY, 7, "Offset orig time",""},
+        {EXIF_TAG_OFFSET_TIME_DIGITIZED, ENTRY_FORMAT_ASCII, EXIF_IFD_DIRECTORY, 7, "Offset digitize time",""},
         {EXIF_TAG_COMPONENTS_CONFIG, ENTRY_FORMAT_UNDEFINED, EXIF_IFD_DIRECTORY, 4, "Components Configuration",""},
         {EXIF_TAG_COMPRESSED_BPP, ENTRY_FORMAT_RATIONAL, EXIF_IFD_DIRECTORY, 1, "Compressed BitsPerPixel",""},
         {EXIF_TAG_SHUTTER_SPEED, ENTRY_FORMAT_SRATIONAL, EXIF_IFD_DIRECTORY, 1, "Shutter Speed Value"," s"},
@@ -204,19 +229,33 @@ exif::TagInfo tagInfoData[] = {
 };
 
 /**
- * Check to see if tag is in directory by checking tagInfoData
- * @param tag   Input tag id to find
- * @param dir   Input directory id
- * @return True if tag is in given directory, otherwise return false
+ * Find the information for a tag without creating an entry for unknown tags
+ * @param tag   Tag to find
+ * @param dir   Directory of the tag
+ * @return TagInfo for the tag or NULL if it isn't known
  */
-bool exif::EXIFInfo::isInDirectory(uint16_t tag, uint8_t dir) {
-  int len = sizeof(tagInfoData)/sizeof(exif::TagInfo);
+exif::TagInfo* findTagInfo(uint16_t tag, uint8_t dir) {
+    int len = sizeof(tagInfoData)/sizeof(exif::TagInfo);
+    for (int i=0; i< len; i++) {
+        if (tag == tagInfoData[i].tag && dir == tagInfoData[i].directory)
+            return &tagInfoData[i];
+    }
+    return NULL;
+}
 
-  for (int i=0; i< len; i++) {
-      if (tag == tagInfoData[i].tag && dir == tagInfoData[i].directory)
-          return true;
-  }
-  return false;
+/**
+ * Check whether the IFD the EXIF IFD offset points to is really IFD1, as written by some cameras.  The first
+ * entry of the IFD is read from the source, so tags dropped by a tag filter don't change the answer.
+ * @param src               Source containing the TIFF data
+ * @param offset            Offset of the IFD
+ * @param isLittleEndian    Byte order of the TIFF data
+ * @return True if the first entry is an IFD0 tag and not an EXIF IFD tag
+ */
+bool isMisplacedIFD1(exif::ByteSource &src, unsigned long offset, bool isLittleEndian) {
+    const unsigned char *buf = src.readAt(offset, 4);
+    if (buf == NULL || exif::parse_value<uint16_t>(buf, isLittleEndian) == 0) return false;
+    uint16_t tag = exif::parse_value<uint16_t>(buf + 2, isLittleEndian);
+    return findTagInfo(tag, EXIF_IFD_DIRECTORY) == NULL && findTagInfo(tag, IFD0_DIRECTORY) != NULL;
 }
 
 /**
@@ -226,13 +265,8 @@ bool exif::EXIFInfo::isInDirectory(uint16_t tag, uint8_t dir) {
  * @return Pointer to TagInfo or a default value if no TagInfo found
  */
 exif::TagInfo* exif::getTagInfo(uint16_t tag, uint8_t dir) {
-
-    int len = sizeof(tagInfoData)/sizeof(exif::TagInfo);
-
-    for (int i=0; i< len; i++) {
-        if (tag == tagInfoData[i].tag && dir == tagInfoData[i].directory)
-            return &tagInfoData[i];
-    }
+    exif::TagInfo *tagInfo = findTagInfo(tag, dir);
+    if (tagInfo != NULL) return tagInfo;
     LOGD("Couldn't find tag %x %d",tag, dir);
     char *tagName = (char*)malloc(6);
     sprintf(tagName,"%x",tag);
@@ -240,41 +274,74 @@ exif::TagInfo* exif::getTagInfo(uint16_t tag, uint8_t dir) {
 }
 
 /**
- * Locates the EXIF segment and returns the length including the JPEG_SOI & EXIF header
+ * Check whether a marker is kept as an App marker.  These are the types isAppMarker accepts: APPn, JPGn and COM.
+ * @param type  Marker type
+ * @return True if the marker is kept
+ */
+bool isHeaderMarker(uint16_t type) {
+    return (type & 0xFFE0) == 0xFFE0;
+}
+
+/**
+ * Locates the end of the App markers and returns the length including the JPEG_SOI.  Segments such as DQT
+ * found between App markers are part of the header since decodeJPEG keeps them with the App markers.
  * @param buf   Buffer containing the JPEG EXIF data, staring with JPEG_SOI (FFD8)
  * @param len   Input length of the buffer
- * @return The size of the EXIF segment within the given buffer
+ * @return The size of the header within the given buffer, where the image data written after
+ *         encodeJPEGHeader starts
  */
 unsigned long exif::getDataStart(const unsigned char *buf, unsigned long len) {
     // Sanity check: all JPEG files start with JPEG_SOI
     if (!buf || len < 4) return 0;
     if (parse_value<uint16_t>(buf,false) != JPEG_SOI) return 0;
 
+    MemorySource src(buf, len);
     unsigned long offs = 2; // Skip JPEG_SOI
-    uint16_t type;
-    uint16_t length;
-    while (isAppMarker(&buf[offs],&type,&length)) {
-        offs += length+2; //Marker type and length
+    unsigned long start = offs;
+    JPEGMarker marker;
+    while (nextJPEGMarker(src, offs, &marker) && marker.type != JPEG_SOS && marker.type != JPEG_EOI) {
+        offs = marker.offset + 2 + marker.length;
+        if (isHeaderMarker(marker.type)) start = offs;
     }
-
-    return offs;
+    return start;
 }
 
 /**
- * Get an Application Marker starting at buf location.  An App Marker is a JPEG marker of type 0xFFEx
+ * Get an Application Marker starting at buf location.  An App Marker is a JPEG marker of type 0xFFEx.
+ * A marker kept by reset() is reused when there is one, its buffer only grows when it is too small.
  * @param buf   Buffer containing App marker
- * @return  Pointer to a new AppMarker
+ * @return  Pointer to the AppMarker
  */
 exif::AppMarker* exif::EXIFInfo::getAppMarker(const unsigned char *buf) {
-    AppMarker *newMarker = new AppMarker();
+    AppMarker *newMarker;
+    if (spareMarkers_.empty()) {
+        newMarker = new AppMarker();
+        newMarker->buffer = NULL;
+        newMarker->capacity = 0;
+    } else {
+        newMarker = spareMarkers_.back();
+        spareMarkers_.pop_back();
+    }
     newMarker->type = parse_value<uint16_t>(buf, false);
     newMarker->length = parse_value<uint16_t>(&buf[2], false);
-    int bufLen = newMarker->length-2; //Don't include length field
-    newMarker->buffer = (unsigned char*)malloc((size_t)bufLen);
+    uint32_t bufLen = newMarker->length-2; //Don't include length field
+    if (newMarker->capacity < bufLen) {
+        free(newMarker->buffer);
+        newMarker->buffer = (unsigned char*)malloc((size_t)bufLen);
+        newMarker->capacity = bufLen;
+    }
     memcpy(newMarker->buffer,&buf[4],(size_t)bufLen);
     return newMarker;
 }
 
+/**
+ * Keep a marker which is no longer used so getAppMarker can reuse it
+ * @param marker    Marker to keep
+ */
+void exif::EXIFInfo::releaseMarker(AppMarker *marker) {
+    spareMarkers_.push_back(marker);
+}
+
 /**
  * Check if next item in the buffer is an app marker
  * @param buf       Start of buffer to check for App marker
@@ -288,89 +355,712 @@ bool exif::isAppMarker(const unsigned char *buf, uint16_t *type, uint16_t *lengt
     return (*type & 0xFFE0) == 0xFFE0;
 }
 
+/**
+ * Check whether a marker stands alone without a length and segment: TEM, RSTn, SOI and EOI
+ * @param type  Marker type
+ * @return True if no segment follows the marker
+ */
+bool isStandaloneMarker(uint16_t type) {
+    return type == 0xFF01 || (type >= 0xFFD0 && type <= JPEG_EOI);
+}
+
+/**
+ * Search for the next 0xFF byte with memchr, which reads a word or vector at a time
+ * @param src   Source to search
+ * @param pos   Offset to start at
+ * @param end   Offset to stop at
+ * @return Offset of the byte, or end if there is none
+ */
+unsigned long findMarkerByte(exif::ByteSource &src, unsigned long pos, unsigned long end) {
+    while (pos < end) {
+        unsigned long n = std::min(end - pos, (unsigned long)PREFETCH_GAP);
+        const unsigned char *buf = src.readAt(pos, n);
+        if (buf == NULL) return end;
+        const unsigned char *found = (const unsigned char *)memchr(buf, 0xFF, (size_t)n);
+        if (found != NULL) return pos + (unsigned long)(found - buf);
+        pos += n;
+    }
+    return end;
+}
+
+/**
+ * Find the next JPEG marker.  Every marker type is understood: the ones without a segment (RSTn, TEM, SOI and
+ * EOI) have length 0 and fill bytes (0xFF) before a marker are skipped.  Normally the marker is right at offs.
+ * Only when it isn't are the following bytes searched for one, up to JPEG_RECOVERY_WINDOW bytes, so some
+ * garbage between segments doesn't end the header.  The caller stops at SOS, the scan data isn't read.
+ * @param src       Source of the JPEG file
+ * @param offs      Offset the marker should be at, following the previous segment
+ * @param marker    Output marker
+ * @return False if no marker was found before the end of the source or the recovery window
+ */
+bool exif::nextJPEGMarker(ByteSource &src, unsigned long offs, JPEGMarker *marker) {
+    const unsigned long end = std::min(src.size(), offs + JPEG_RECOVERY_WINDOW);
+    unsigned long pos = offs;
+    while (pos < end && pos + 2 <= src.size()) {
+        const unsigned char *buf = src.readAt(pos, 2);
+        if (buf == NULL) return false;
+        if (buf[0] == 0xFF && buf[1] == 0xFF) {
+            pos++;
+            continue;
+        }
+        // 0x00 is a stuffed byte in scan data and 0x02-0xBF are reserved
+        if (buf[0] == 0xFF && (buf[1] == 0x01 || buf[1] >= 0xC0)) {
+            uint16_t type = (uint16_t)(0xFF00 | buf[1]);
+            unsigned long length = 0;
+            if (!isStandaloneMarker(type)) {
+                buf = src.readAt(pos + 2, 2);
+                if (buf == NULL) return false;
+                length = parse_value<uint16_t>(buf, false);
+            }
+            if (length == 0 ? isStandaloneMarker(type) : length >= 2) {
+                if (pos != offs) {
+                    LOGD("Skipped %lu bytes before marker %x", pos - offs, type);
+                }
+                marker->type = type;
+                marker->offset = pos;
+                marker->length = length;
+                return true;
+            }
+        }
+        pos = findMarkerByte(src, pos + 1, end);
+    }
+    return false;
+}
+
+/**
+ * Check whether the buffer starts with a TIFF header ("II*\0" or "MM\0*")
+ * @param buf   Buffer to check
+ * @param len   Length of the buffer
+ * @return True if buf starts with a TIFF header
+ */
+bool exif::isTIFFHeader(const unsigned char *buf, unsigned long len) {
+    if (!buf || len < 4) return false;
+    return (buf[0] == 'I' && buf[1] == 'I' && buf[2] == 0x2a && buf[3] == 0) ||
+           (buf[0] == 'M' && buf[1] == 'M' && buf[2] == 0 && buf[3] == 0x2a);
+}
+
+/**
+ * Open the given file for positioned reads
+ * @param inputFile     Full path of file to read
+ */
+exif::FileSource::FileSource(const std::string &inputFile) : size_(0) {
+    fp_ = fopen(inputFile.c_str(), "rb");
+    if (fp_) {
+        fseek(fp_, 0, SEEK_END);
+        size_ = (unsigned long)ftell(fp_);
+    }
+}
+
+exif::FileSource::~FileSource() {
+    if (fp_) fclose(fp_);
+}
+
+/**
+ * Read bytes from the file into the internal buffer
+ * @param offset    Offset of the first byte to read
+ * @param len       Number of bytes to read
+ * @return Pointer to the data which stays valid until the next read, or NULL if the range can't be read
+ */
+const unsigned char* exif::FileSource::readAt(unsigned long offset, unsigned long len) {
+    if (!fp_ || len == 0 || offset > size_ || len > size_ - offset) return NULL;
+    data_.resize(len);
+    if (fseek(fp_, (long)offset, SEEK_SET) != 0 || fread(data_.data(), 1, len, fp_) != len) {
+        return NULL;
+    }
+    return data_.data();
+}
+
+/**
+ * Read bytes, fetching them from the underlying source if they haven't been fetched yet
+ * @param offset    Offset of the first byte to read
+ * @param len       Number of bytes to read
+ * @return Pointer to the data which stays valid until the next read, or NULL if the range can't be read
+ */
+const unsigned char* exif::PrefetchSource::readAt(unsigned long offset, unsigned long len) {
+    unsigned long size = src_.size();
+    if (len == 0 || offset > size || len > size - offset) return NULL;
+    for (unsigned long i = 0; i < ranges_.size(); i++) {
+        const Range &range = ranges_.at(i);
+        if (range.offset <= offset && offset + len <= range.offset + range.data.size()) {
+            return &range.data[offset - range.offset];
+        }
+    }
+
+    // Fetch at least a window and merge with the ranges close to it
+    unsigned long lo = offset;
+    unsigned long hi = offset + std::max(len, std::min(window_, size - offset));
+    unsigned long first = ranges_.size(), last = 0;
+    for (unsigned long i = 0; i < ranges_.size(); i++) {
+        const Range &range = ranges_.at(i);
+        unsigned long end = range.offset + range.data.size();
+        if (end + gap_ < lo || range.offset > hi + gap_) continue;
+        lo = std::min(lo, range.offset);
+        hi = std::max(hi, end);
+        first = std::min(first, i);
+        last = i + 1;
+    }
+    if (first == ranges_.size() && len > window_) {
+        // Nothing cached nearby, don't keep a copy of large reads
+        requests_++;
+        fetched_ += len;
+        return src_.readAt(offset, len);
+    }
+
+    // Only the part between the cached ranges at either end is requested
+    unsigned long fetchLo = lo, fetchHi = hi;
+    for (unsigned long i = first; i < last && ranges_.at(i).offset <= fetchLo; i++) {
+        fetchLo = std::max(fetchLo, ranges_.at(i).offset + ranges_.at(i).data.size());
+    }
+    for (unsigned long i = last; i > first; i--) {
+        const Range &range = ranges_.at(i - 1);
+        if (range.offset + range.data.size() < fetchHi) break;
+        fetchHi = std::min(fetchHi, range.offset);
+    }
+    const unsigned char *data = src_.readAt(fetchLo, fetchHi - fetchLo);
+    requests_++;
+    if (data == NULL) return NULL;
+    fetched_ += fetchHi - fetchLo;
+
+    Range merged;
+    merged.offset = lo;
+    merged.data.resize(hi - lo);
+    for (unsigned long i = first; i < last; i++) {
+        const Range &range = ranges_.at(i);
+        memcpy(&merged.data[range.offset - lo], range.data.data(), range.data.size());
+    }
+    memcpy(&merged.data[fetchLo - lo], data, fetchHi - fetchLo);
+    if (first < last) {
+        ranges_.erase(ranges_.begin() + first, ranges_.begin() + last);
+    } else {
+        first = 0;
+        while (first < ranges_.size() && ranges_.at(first).offset < lo) first++;
+    }
+    ranges_.insert(ranges_.begin() + first, std::move(merged));
+    return &ranges_.at(first).data[offset - lo];
+}
+
 /**
  * Check if given App Marker is an Exif Marker.  Type is 0xFFE1 and starts with "Exif\0\0"
  * @param marker    AppMarker to check
  * @return True if Marker is an Exif Marker, otherwise false
  */
 bool isExifMarker(exif::AppMarker *marker) {
-    if (marker->type != EXIF_MARKER) return false;
+    if (marker->type != EXIF_MARKER || marker->length < 2 + EXIF_START) return false;
 
     return (std::equal(marker->buffer, marker->buffer + 6, "Exif\0\0"));
 }
 
 /**
- * Decode JPEG file given a unsigned char buf.
+ * Decode a JPEG file from a source.
  * Starts with JPEG_SOI (0xFFD8) followed by different markers.  We store any App markers
- * (ones of type 0xFFEx) and decode the Exif App Marker (0xFFE1) further.  Other Markers
- * such as FFC4 (Huffman Table) and FFDB (Quantization Table) are not saved since they are
- * part of the Image data
- * @param buf       buffer to decode
- * @param bufLen    Length of buffer to decode
+ * (ones of type 0xFFEx, and COM) and decode the Exif App Marker (0xFFE1) further.  Other Markers
+ * such as FFC4 (Huffman Table) and FFDB (Quantization Table) are part of the Image data and are skipped,
+ * up to the start of scan (SOS).  One of those found before an App marker is saved with the App markers
+ * though, so encodeJPEGHeader keeps the order of the file.  Only the saved markers are read from the
+ * source, the image data isn't.
+ * @param src   Source of the JPEG file
  * @return True if decoding was successful, otherwise false
  */
-bool exif::EXIFInfo::decodeJPEGFile(const unsigned char *buf, unsigned long bufLen) {
+bool exif::EXIFInfo::decodeJPEG(ByteSource &src) {
     bool retVal = true;
     // Sanity check: all JPEG files start with JPEG_SOI.
-    if (!buf || bufLen < 4) return 0;
+    const unsigned char *buf = src.readAt(0, 4);
+    if (buf == NULL) return false;
     if (parse_value<uint16_t>(buf,false) != JPEG_SOI) return false;
 
     unsigned long offs = 2; // Skip JPEG_SOI
-    uint16_t type, length;
-    while (offs < bufLen && isAppMarker(&buf[offs],&type,&length)) {
-        AppMarker *marker = getAppMarker(&buf[offs]);
-        offs += marker->length+2;
-        if (isExifMarker(marker)) {
-            retVal &= decodeEXIFsegment(marker);
-            free(marker);
-        } else {
-            AppMarkers.push_back(marker);
-            LOGD("Found marker %x len %x", marker->type, marker->length);
+    JPEGMarker found;
+    std::vector<JPEGMarker> skipped;    // Image data segments since the last App marker
+    while (nextJPEGMarker(src, offs, &found) && found.type != JPEG_SOS && found.type != JPEG_EOI) {
+        offs = found.offset + 2 + found.length;
+        if (found.length == 0) continue;
+        if (!isHeaderMarker(found.type)) {
+            skipped.push_back(found);
+            continue;
+        }
+        for (unsigned long i = 0; i < skipped.size(); i++) {
+            buf = src.readAt(skipped.at(i).offset, skipped.at(i).length + 2);
+            if (buf != NULL) AppMarkers.push_back(getAppMarker(buf));
+        }
+        skipped.clear();
+        buf = src.readAt(found.offset, found.length + 2);
+        if (buf == NULL) {
+            ERROR("Marker %x past the end of the file", found.type);
+            break;
+        }
+        AppMarker *marker = getAppMarker(buf);
+        if (isExifMarker(marker) && marker->length == JPEG_SEGMENT_MAX) {
+            offs = gatherExtendedExif(src, offs, marker);
         }
+        retVal &= addJPEGMarker(marker, found.offset);
     }
     return retVal;
 }
 
+/**
+ * Add an App marker read from a JPEG file.  The Exif marker is decoded and MPF image lists are parsed.
+ * @param marker    Marker to add, with any Extended EXIF data already gathered.  Owned by the EXIFInfo after.
+ * @param offset    Offset of the marker in the file
+ * @return False if the EXIF data couldn't be decoded
+ */
+bool exif::EXIFInfo::addJPEGMarker(AppMarker *marker, unsigned long offset) {
+    if (isExifMarker(marker)) {
+        bool retVal = decodeEXIFsegment(marker);
+        // Keep the segment since the thumbnail points into it
+        releaseExifMarker();
+        exifMarker_ = marker;
+        return retVal;
+    }
+    if (marker->type == MPF_MARKER && marker->length >= 2 + MPF_START &&
+        std::equal(marker->buffer, marker->buffer + MPF_START, "MPF\0")) {
+        // Image offsets are relative to the MP header following "MPF\0"
+        parseMPIndex(marker->buffer + MPF_START, (unsigned long)marker->length - 2 - MPF_START,
+                     offset + 4 + MPF_START, &MPImages);
+    }
+    AppMarkers.push_back(marker);
+    LOGD("Found marker %x len %x", marker->type, marker->length);
+    return true;
+}
+
+/**
+ * Start decoding a stream.  The EXIFInfo is reset and filled in as the markers arrive.
+ * @param info      EXIFInfo to decode into, must outlive the decoder
+ * @param maxExif   Largest Extended EXIF data to gather, larger data is an error
+ */
+exif::StreamDecoder::StreamDecoder(EXIFInfo *info, unsigned long maxExif)
+        : info_(info), maxExif_(maxExif), state_(STATE_SOI), status_(STREAM_NEED_MORE), ok_(true), offset_(0),
+          need_(2), scan_(0), carry_(0), metadataLength_(0), exif_(NULL), exifOffset_(0), exifContinues_(false) {
+    info_->reset();
+    pending_.reserve(JPEG_SEGMENT_MAX + 2);
+}
+
+exif::StreamDecoder::~StreamDecoder() {
+    if (exif_ != NULL) info_->releaseMarker(exif_);
+}
+
+/**
+ * Decode the next chunk of the stream
+ * @param data  Chunk data
+ * @param len   Length of the chunk
+ * @param used  Output number of bytes of the chunk belonging to the metadata, may be NULL.  Once done, the
+ *              rest of the stream is carry() followed by the chunk from this offset.
+ * @return STREAM_NEED_MORE, STREAM_DONE or STREAM_ERROR
+ */
+int exif::StreamDecoder::push(const unsigned char *data, unsigned long len, unsigned long *used) {
+    const unsigned long start = offset_;
+    const bool wasDone = state_ == STATE_DONE;
+    unsigned long pos = 0;
+    while (state_ != STATE_DONE) {
+        if (pending_.size() < need_) {
+            if (pos == len) break;
+            unsigned long take = std::min(len - pos, need_ - pending_.size());
+            pending_.insert(pending_.end(), data + pos, data + pos + take);
+            pos += take;
+            offset_ += take;
+            if (pending_.size() < need_) break;
+        }
+        step();
+    }
+    if (state_ == STATE_DONE && !wasDone) {
+        // The image data starts at the end of the metadata, part of it may have come in earlier chunks
+        pos = metadataLength_ > start ? metadataLength_ - start : 0;
+        carry_ = metadataLength_ < start ? start - metadataLength_ : 0;
+    }
+    if (used != NULL) *used = pos;
+    return status_;
+}
+
+/**
+ * Decode a complete SOI, marker header or segment
+ */
+void exif::StreamDecoder::step() {
+    // pending_ holds the stream from the end of the last App marker, or from the start before SOI
+    const unsigned long base = offset_ - pending_.size();
+    switch (state_) {
+        case STATE_SOI:
+            if (parse_value<uint16_t>(pending_.data(), false) != JPEG_SOI) {
+                ERROR("Not a JPEG stream");
+                done(0);
+                status_ = STREAM_ERROR;
+                return;
+            }
+            pending_.clear();
+            state_ = STATE_MARKER;
+            need_ = 4;
+            break;
+        case STATE_MARKER: {
+            MemorySource src(pending_.data(), pending_.size());
+            if (!nextJPEGMarker(src, scan_, &marker_)) {
+                // Garbage, search on for a marker until the recovery window is in
+                unsigned long window = scan_ + JPEG_RECOVERY_WINDOW + 4;
+                if (pending_.size() >= window) {
+                    done(base);
+                } else {
+                    need_ = std::min(pending_.size() + PREFETCH_GAP, window);
+                }
+                return;
+            }
+            if (marker_.type == JPEG_SOS || marker_.type == JPEG_EOI) {
+                done(base);
+                return;
+            }
+            if (marker_.length == 0) {
+                scan_ = marker_.offset + 2;
+                need_ = scan_ + 4;
+                return;
+            }
+            if (!isHeaderMarker(marker_.type) && marker_.offset + 2 + marker_.length > JPEG_SEGMENT_MAX + 2) {
+                // More image data segments than fit in one segment, they aren't buffered any further.  The
+                // metadata ends at the last App marker and they are passed on with the image data.
+                done(base);
+                return;
+            }
+            state_ = STATE_SEGMENT;
+            need_ = marker_.offset + 2 + marker_.length;
+            break;
+        }
+        case STATE_SEGMENT: {
+            unsigned long end = marker_.offset + 2 + marker_.length;
+            if (!isHeaderMarker(marker_.type)) {
+                // Image data such as DQT, kept only if an App marker follows.  Extended EXIF must be contiguous.
+                finishExif();
+                skipped_.push_back(marker_.offset);
+                scan_ = end;
+                state_ = STATE_MARKER;
+                need_ = scan_ + 4;
+                return;
+            }
+            for (unsigned long i = 0; i < skipped_.size(); i++) {
+                info_->AppMarkers.push_back(info_->getAppMarker(&pending_[skipped_.at(i)]));
+            }
+            skipped_.clear();
+            AppMarker *marker = info_->getAppMarker(&pending_[marker_.offset]);
+            unsigned long markerOffset = base + marker_.offset;
+            if (exif_ != NULL && exifContinues_ && isExifMarker(marker)) {
+                // Extended EXIF, the TIFF data continues after "Exif\0\0"
+                unsigned long piece = marker->length - 2 - EXIF_START;
+                unsigned long total = exif_->length - 2 + piece;
+                if (total > maxExif_) {
+                    ERROR("Extended EXIF larger than %lu bytes", maxExif_);
+                    info_->releaseMarker(marker);
+                    ok_ = false;
+                    finishExif();
+                    done(markerOffset);
+                    return;
+                }
+                if (exif_->capacity < total) {
+                    unsigned char *grown = (unsigned char *)realloc(exif_->buffer, (size_t)total);
+                    if (grown == NULL) {
+                        ERROR("Can't allocate %lu bytes of Extended EXIF", total);
+                        info_->releaseMarker(marker);
+                        ok_ = false;
+                        finishExif();
+                        done(markerOffset);
+                        return;
+                    }
+                    exif_->buffer = grown;
+                    exif_->capacity = (uint32_t)total;
+                }
+                memcpy(exif_->buffer + exif_->length - 2, marker->buffer + EXIF_START, (size_t)piece);
+                exif_->length = (uint32_t)(total + 2);
+                exifContinues_ = marker->length == JPEG_SEGMENT_MAX;
+                info_->releaseMarker(marker);
+            } else {
+                finishExif();
+                if (isExifMarker(marker) && marker->length == JPEG_SEGMENT_MAX) {
+                    exif_ = marker;
+                    exifOffset_ = markerOffset;
+                    exifContinues_ = true;
+                } else {
+                    ok_ &= info_->addJPEGMarker(marker, markerOffset);
+                }
+            }
+            pending_.erase(pending_.begin(), pending_.begin() + (long)end);
+            scan_ = 0;
+            state_ = STATE_MARKER;
+            need_ = 4;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/**
+ * Decode the Extended EXIF data gathered so far
+ */
+void exif::StreamDecoder::finishExif() {
+    if (exif_ == NULL) return;
+    ok_ &= info_->addJPEGMarker(exif_, exifOffset_);
+    exif_ = NULL;
+}
+
+/**
+ * Finish decoding
+ * @param length    Length of the metadata
+ */
+void exif::StreamDecoder::done(unsigned long length) {
+    finishExif();
+    state_ = STATE_DONE;
+    metadataLength_ = length;
+    status_ = ok_ ? STREAM_DONE : STREAM_ERROR;
+}
+
+/**
+ * End the stream, decoding what has arrived if the metadata wasn't done yet
+ * @return STREAM_DONE or STREAM_ERROR
+ */
+int exif::StreamDecoder::finish() {
+    if (state_ == STATE_DONE) return status_;
+    if (state_ == STATE_SOI) ok_ = false;
+    if (state_ == STATE_SEGMENT && isHeaderMarker(marker_.type)) ERROR("Marker past the end of the stream");
+    done(offset_ - pending_.size());
+    // Everything after the metadata has been pushed
+    carry_ = offset_ - metadataLength_;
+    return status_;
+}
+
+/**
+ * Get the bytes following the metadata which arrived in chunks before the last one
+ * @return Bytes to pass on before the rest of the last chunk
+ */
+exif::ByteView exif::StreamDecoder::carry() const {
+    ByteView view = {NULL, 0};
+    if (state_ != STATE_DONE) return view;
+    view.data = pending_.data() + (metadataLength_ - (offset_ - pending_.size()));
+    view.size = carry_;
+    return view;
+}
+
+
+/**
+ * Find the continuation segments of Extended EXIF data.  When the EXIF data doesn't fit in one segment, every
+ * full size segment is followed by another APP1 segment starting with "Exif\0\0" which continues the TIFF data.
+ * @param src       Source of the JPEG file
+ * @param offs      Offset following a full size EXIF segment
+ * @param pieces    Output offset and length of the TIFF data in each continuation segment
+ * @return Offset following the last continuation segment
+ */
+unsigned long findExifContinuations(exif::ByteSource &src, unsigned long offs,
+                                    std::vector<std::pair<unsigned long, unsigned long> > *pieces) {
+    uint16_t type, length = JPEG_SEGMENT_MAX;
+    const unsigned char *buf;
+    while (length == JPEG_SEGMENT_MAX && (buf = src.readAt(offs, 4 + EXIF_START)) != NULL &&
+           exif::isAppMarker(buf, &type, &length) && type == EXIF_MARKER && length >= 2 + EXIF_START &&
+           offs + 2 + length <= src.size() && std::equal(buf + 4, buf + 4 + EXIF_START, "Exif\0\0")) {
+        pieces->push_back(std::make_pair(offs + 4 + EXIF_START, (unsigned long)length - 2 - EXIF_START));
+        offs += length + 2;
+    }
+    return offs;
+}
+
+/**
+ * Gather Extended EXIF data split over several APP1 segments into the marker.  The total size is found first
+ * so the data is copied into a single allocation.
+ * @param src       Source of the JPEG file
+ * @param offs      Offset following the first EXIF segment
+ * @param marker    First EXIF segment, its buffer is replaced with the gathered data
+ * @return Offset following the last continuation segment, or offs and the marker unchanged if the data
+ *         can't be allocated
+ */
+unsigned long exif::EXIFInfo::gatherExtendedExif(ByteSource &src, unsigned long offs, AppMarker *marker) {
+    std::vector<std::pair<unsigned long, unsigned long> > pieces;
+    unsigned long end = findExifContinuations(src, offs, &pieces);
+    if (pieces.empty()) return offs;
+
+    unsigned long total = marker->length - 2;
+    for (unsigned long i = 0; i < pieces.size(); i++) {
+        total += pieces.at(i).second;
+    }
+    if (marker->capacity < total) {
+        unsigned char *grown = (unsigned char *)realloc(marker->buffer, (size_t)total);
+        if (grown == NULL) {
+            ERROR("Can't allocate %lu bytes of Extended EXIF", total);
+            return offs;
+        }
+        marker->buffer = grown;
+        marker->capacity = (uint32_t)total;
+    }
+    unsigned long pos = marker->length - 2;
+    for (unsigned long i = 0; i < pieces.size(); i++) {
+        const unsigned char *piece = src.readAt(pieces.at(i).first, pieces.at(i).second);
+        if (piece == NULL) break;
+        memcpy(&marker->buffer[pos], piece, (size_t)pieces.at(i).second);
+        pos += pieces.at(i).second;
+    }
+    LOGD("Gathered %lu bytes of Extended EXIF data", pos);
+    marker->length = (uint32_t)(pos + 2);
+    return end;
+}
 
 /**
- * Read in given file and parse into EXIFInfo structure
+ * Read in given file and parse into EXIFInfo structure.
  * @param inputFile     Full path of file to read
  * @return  True if reading/parsing were successful
  */
 bool exif::EXIFInfo::readEXIF(std::string inputFile) {
-    // Read the JPEG file into a buffer
-    FILE *fp = fopen(inputFile.data(), "rb");
-    if (!fp) {
+    FileSource file(inputFile);
+    if (!file.isOpen()) {
         ERROR("File not found %s",inputFile.c_str());
         return false;
     }
-    fseek(fp, 0, SEEK_END);
-    unsigned long fsize = (unsigned long)ftell(fp);
-    rewind(fp);
-    unsigned char *buf = new unsigned char[fsize];
-    if (fread(buf, 1, fsize, fp) != fsize) {
-        ERROR("Cannot read file %s ",inputFile.c_str());
-        delete[] buf;
-        fclose(fp);
-        return false;
-    }
-
-    fclose(fp);
-    bool rval = readEXIF(buf,fsize);
-    LOGD("Free buf");
-    free(buf);
-    return rval;
+    PrefetchSource src(file);
+    return readEXIF(src);
 }
 
 
 /**
  * Parse the given buffer into EXIFInfo
- * @param buf       Input buffer to parse
+ * @param buf       Input buffer to parse, any of the formats supported by readEXIF(ByteSource &)
  * @param bufLen    Length of input buffer
  * @return True if parsing was succesful
  */
 bool exif::EXIFInfo::readEXIF(unsigned char *buf, unsigned long bufLen) {
-    return decodeJPEGFile(buf, bufLen);
+    MemorySource src(buf, bufLen);
+    return readEXIF(src);
+}
+
+/**
+ * Detect the container format of the source and parse its EXIF data into EXIFInfo.  JPEG, TIFF based RAW
+ * files, HEIF, PNG and WebP are supported.  Only the container structure and the metadata are read from the
+ * source so large image data is skipped without being read.  Wrap sources where every read is a round trip
+ * in a PrefetchSource.
+ * @param src   Source to parse
+ * @return True if parsing was succesful
+ */
+bool exif::EXIFInfo::readEXIF(ByteSource &src) {
+    reset();
+    const unsigned char *buf = src.readAt(0, std::min(src.size(), 12UL));
+    switch (detectContainer(buf, std::min(src.size(), 12UL))) {
+        case CONTAINER_TIFF:
+            return decodeTIFF(src, NULL);
+        case CONTAINER_HEIF:
+            return decodeHEIF(src);
+        case CONTAINER_PNG:
+            return decodePNG(src);
+        case CONTAINER_WEBP:
+            return decodeWebP(src);
+        default:
+            break;
+    }
+
+    return decodeJPEG(src);
+}
+
+/**
+ * Search a source for the next "Exif\0\0" followed by a TIFF header, comparing only at the 'E' bytes found
+ * @param src   Source to search
+ * @param pos   Offset to start at
+ * @param end   Offset to stop at
+ * @return Offset of the "Exif" signature, or end if there is none
+ */
+unsigned long findExifSignature(exif::ByteSource &src, unsigned long pos, unsigned long end) {
+    const unsigned long sigLen = EXIF_START + 4;
+    while (pos + sigLen <= end) {
+        unsigned long n = std::min(end - pos, (unsigned long)PREFETCH_WINDOW);
+        const unsigned char *buf = src.readAt(pos, n);
+        if (buf == NULL) return end;
+        const unsigned char *p = buf;
+        while ((p = (const unsigned char *)memchr(p, 'E', (size_t)(buf + n - p))) != NULL &&
+               p + sigLen <= buf + n) {
+            if (memcmp(p, "Exif\0\0", EXIF_START) == 0 && exif::isTIFFHeader(p + EXIF_START, 4)) {
+                return pos + (unsigned long)(p - buf);
+            }
+            p++;
+        }
+        if (pos + n == end) break;
+        // The next chunk overlaps so a signature across the boundary is found
+        pos += n - sigLen + 1;
+    }
+    return end;
+}
+
+/**
+ * Score how plausible recovered EXIF data is
+ * @param info      EXIF data decoded from the candidate
+ * @param decoded   The TIFF data decoded without errors
+ * @param inSegment The candidate is the start of a well formed APP1 segment
+ * @return Score from 0, no IFD0 entries, to 100
+ */
+int recoveryScore(const exif::EXIFInfo &info, bool decoded, bool inSegment) {
+    const exif::IFDirectory *ifd0 = info.findDirectory(IFD0_DIRECTORY);
+    if (ifd0 == NULL || ifd0->entries->empty()) return 0;
+    exif::CaptureTime time;
+    int score = 20 + 2 * (int)std::min(ifd0->entries->size(), (size_t)10);
+    if (decoded) score += 15;
+    if (inSegment) score += 15;
+    if (info.findDirectory(EXIF_IFD_DIRECTORY) != NULL) score += 10;
+    if (info.getTagData(EXIF_TAG_DIGICAM_MAKE, IFD0_DIRECTORY) != NULL ||
+        info.getTagData(EXIF_TAG_DIGICAM_MODEL, IFD0_DIRECTORY) != NULL) score += 10;
+    if (info.captureTime(&time)) score += 10;
+    return score;
+}
+
+/**
+ * Decode a candidate found by recoverEXIF
+ * @param src       Source being searched
+ * @param pos       Offset of the "Exif\0\0" signature
+ * @param segment   Scratch buffer to build the APP1 segment in
+ * @return Score of the candidate, 0 if it couldn't be read
+ */
+int exif::EXIFInfo::recoverCandidate(ByteSource &src, unsigned long pos, std::vector<unsigned char> *segment) {
+    reset();
+    // Inside an APP1 segment the length is known, otherwise take what fits in one
+    unsigned long len = std::min(src.size() - pos, (unsigned long)JPEG_SEGMENT_MAX - 2);
+    const unsigned char *buf = pos >= 4 ? src.readAt(pos - 4, 4) : NULL;
+    bool inSegment = buf != NULL && parse_value<uint16_t>(buf, false) == EXIF_MARKER &&
+                     parse_value<uint16_t>(buf + 2, false) >= 2 + EXIF_START + 8 &&
+                     pos - 2 + parse_value<uint16_t>(buf + 2, false) <= src.size();
+    if (inSegment) len = parse_value<uint16_t>(buf + 2, false) - 2;
+    buf = src.readAt(pos, len);
+    if (buf == NULL) return 0;
+    // getAppMarker expects the marker type and length before the data
+    const unsigned char header[4] = {EXIF_MARKER >> 8, EXIF_MARKER & 0xFF,
+                                     (unsigned char)((len + 2) >> 8), (unsigned char)((len + 2) & 0xFF)};
+    segment->assign(header, header + 4);
+    segment->insert(segment->end(), buf, buf + len);
+
+    AppMarker *marker = getAppMarker(segment->data());
+    if (inSegment && marker->length == JPEG_SEGMENT_MAX) gatherExtendedExif(src, pos + len, marker);
+    bool decoded = addJPEGMarker(marker, pos >= 4 ? pos - 4 : 0);
+    int score = recoveryScore(*this, decoded, inSegment);
+    LOGD("Exif candidate at %lu scores %d", pos, score);
+    return score;
+}
+
+/**
+ * Salvage EXIF data from a damaged or truncated file which readEXIF rejects.  The start of the source is
+ * searched for "Exif\0\0" followed by a TIFF header, wherever it is, and every candidate is decoded and
+ * scored.  The EXIF data of the most plausible one is kept.
+ * @param src           Source to search
+ * @param window        Number of bytes at the start of the source to search
+ * @param confidence    Output score of the kept candidate from 1 to 100, may be NULL
+ * @return True if a candidate with at least some IFD0 entries was found
+ */
+bool exif::EXIFInfo::recoverEXIF(ByteSource &src, unsigned long window, int *confidence) {
+    const unsigned long end = std::min(src.size(), window);
+    std::vector<unsigned char> segment;
+    unsigned long pos = 0, best = 0, last = 0;
+    int bestScore = 0, score;
+    for (int i = 0; i < RECOVER_MAX_CANDIDATES && bestScore < 100; i++) {
+        pos = findExifSignature(src, pos, end);
+        if (pos == end) break;
+        score = recoverCandidate(src, pos, &segment);
+        last = pos;
+        if (score > bestScore) {
+            bestScore = score;
+            best = pos;
+        }
+        pos++;
+    }
+    if (bestScore == 0) {
+        reset();
+        return false;
+    }
+    // Keep the best candidate, decoded again if a later one was decoded after it
+    if (last != best) recoverCandidate(src, best, &segment);
+    if (confidence != NULL) *confidence = bestScore;
+    return true;
 }
 
 /**
@@ -378,7 +1068,7 @@ bool exif::EXIFInfo::readEXIF(unsigned char *buf, unsigned long bufLen) {
  * @param entry     Input entry to get value for
  * @return  Value of entry as a string
  */
-std::string getValStr(exif::IFEntry entry) {
+std::string getValStr(const exif::IFEntry &entry) {
     char tmp[20];
     string tmpStr;
     //LOGD("Tag %x Format %d length %d",entry.tag(),entry.format(),entry.length());
@@ -439,10 +1129,20 @@ std::string getValStr(exif::IFEntry entry) {
  * @param j     Second IFEntry to compare
  * @return True if first entry is smaller than 2nd entry
  */
-bool tagComparator(exif::IFEntry i, exif::IFEntry j) {
+bool tagComparator(const exif::IFEntry &i, const exif::IFEntry &j) {
     return (i.tag() < j.tag());
 }
 
+/**
+ * Comparison function used to sort pointers to entries by tag
+ * @param i     First entry to compare
+ * @param j     Second entry to compare
+ * @return True if first entry is smaller than 2nd entry
+ */
+bool tagPtrComparator(const exif::IFEntry *i, const exif::IFEntry *j) {
+    return (i->tag() < j->tag());
+}
+
 /**
  * Get the name of the directory as a string
  * @param dir Input directory ID from exif.h
@@ -470,20 +1170,27 @@ std::string getDirName(uint8_t dir) {
  * @param entries   Input entries to output
  * @return String outputing all IFEntries
  */
-std::string entries_toString(exif::IFDirectory *directory) {
+std::string entries_toString(const exif::IFDirectory *directory) {
     std::string str;
-    std::vector<exif::IFEntry> *entries = directory->entries;
+    // Sort pointers to the entries so reading doesn't change the directory
+    std::vector<const exif::IFEntry *> entries;
+    entries.reserve(directory->entries->size());
+    for (unsigned long i = 0; i < directory->entries->size(); i++) {
+        entries.push_back(&directory->entries->at(i));
+    }
     std::string dirName = getDirName(directory->type);
-    std::sort(entries->begin(),entries->end(),tagComparator); // Sort in case of new entries
-    for (unsigned long i = 0; i < entries->size(); i++) {
-        exif::IFEntry entry = entries->at(i);
-        exif::TagInfo *tagInfo = exif::getTagInfo(entry.tag(),entry.directory());
+    std::sort(entries.begin(),entries.end(),tagPtrComparator); // Sort in case of new entries
+    for (unsigned long i = 0; i < entries.size(); i++) {
+        const exif::IFEntry &entry = *entries.at(i);
+        const exif::TagInfo *tagInfo = findTagInfo(entry.tag(),entry.directory());
+        char tagName[8];
+        sprintf(tagName,"%x",entry.tag());
         str.append(dirName);
         str.append(": ");
-        str.append(tagInfo->name);
+        str.append(tagInfo != NULL ? tagInfo->name : tagName);
         str.append(": ");
         str.append(getValStr(entry));
-        str.append(tagInfo->desc);
+        if (tagInfo != NULL) str.append(tagInfo->desc);
         str.append("\n");
     }
     return str;
@@ -493,7 +1200,7 @@ std::string entries_toString(exif::IFDirectory *directory) {
  * Output the EXIF data as a string.  Includes all directories.
  * @return EXIF data as a string
  */
-std::string exif::EXIFInfo::toString() {
+std::string exif::EXIFInfo::toString() const {
     string str;
 
     for (unsigned long i=0; i<IFDirectories.size(); i++) {
@@ -508,9 +1215,23 @@ std::string exif::EXIFInfo::toString() {
  * @param directory     Directory to output
  * @return Directory data as a String
  */
-std::string exif::EXIFInfo::toString(int directory) {
+std::string exif::EXIFInfo::toString(int directory) const {
+    const IFDirectory *dir = findDirectory((uint8_t)directory);
+    return dir == NULL ? std::string() : entries_toString(dir);
+}
 
-    return entries_toString(getDirectory(directory));
+/**
+ * Find a directory without creating it
+ * @param type  Directory type to find
+ * @return Directory or NULL if there is none
+ */
+const exif::IFDirectory* exif::EXIFInfo::findDirectory(uint8_t type) const {
+    for (unsigned long i=0; i<IFDirectories.size(); i++) {
+        if (IFDirectories.at(i)->type == type) {
+            return IFDirectories.at(i);
+        }
+    }
+    return NULL;
 }
 
 /**
@@ -524,7 +1245,18 @@ exif::IFDirectory* exif::EXIFInfo::getDirectory(int type) {
             return IFDirectories.at(i);
         }
     }
-    return addDirectory(type,new std::vector<exif::IFEntry>);
+    return addDirectory(type,newEntries());
+}
+
+/**
+ * Get an empty entry list, reusing one kept by reset() when there is one
+ * @return Entry list to pass to addDirectory
+ */
+std::vector<exif::IFEntry> *exif::EXIFInfo::newEntries() {
+    if (spareEntries_.empty()) return new std::vector<exif::IFEntry>;
+    std::vector<exif::IFEntry> *entries = spareEntries_.back();
+    spareEntries_.pop_back();
+    return entries;
 }
 
 /**
@@ -534,7 +1266,15 @@ exif::IFDirectory* exif::EXIFInfo::getDirectory(int type) {
  * @return pointer new new IFDirectory
  */
 exif::IFDirectory* exif::EXIFInfo::addDirectory(int type, std::vector<exif::IFEntry> *entries) {
-    IFDirectory *directory = new IFDirectory((uint8_t)type,entries);
+    IFDirectory *directory;
+    if (spareDirectories_.empty()) {
+        directory = new IFDirectory((uint8_t)type,entries);
+    } else {
+        directory = spareDirectories_.back();
+        spareDirectories_.pop_back();
+        directory->type = (uint8_t)type;
+        directory->entries = entries;
+    }
     IFDirectories.push_back(directory);
     return directory;
 }
@@ -546,200 +1286,328 @@ exif::IFDirectory* exif::EXIFInfo::addDirectory(int type, std::vector<exif::IFEn
  */
 bool exif::EXIFInfo::decodeEXIFsegment(AppMarker *marker) {
     LOGD("In decodeExif");
-    bool isLittleEndian;        // byte alignment (defined in EXIF header)
-    unsigned long offs = 0;     // current offset into buffer
 
     if (!isExifMarker(marker)) {
         ERROR("Not an Exif Marker");
         return false;
     }
-    unsigned char *buf = marker->buffer;
-    offs += 6; // Skip "Exif\0\0"
 
-    // Now parsing the TIFF header. The first two bytes are either "II" or
-    // "MM" for Intel or Motorola byte alignment. Sanity check by parsing
-    // the unsigned short that follows, making sure it equals 0x2a. The
-    // last 4 bytes are an offset into the first IFD, which are added to
-    // the global offset counter. For this block, we expect the following
-    // minimum size:
-    //  2 bytes: 'II' or 'MM'
-    //  2 bytes: 0x002a
-    //  4 bytes: offset to first IDF
-    // -----------------------------
-    //  8 bytes
-    if (offs + 8 > marker->length) {
+    // The TIFF data follows "Exif\0\0".  The marker length includes the 2 bytes storing the length.
+    MemorySource src(marker->buffer + EXIF_START, (unsigned long)marker->length - 2 - EXIF_START);
+    return decodeTIFF(src, marker->buffer + EXIF_START);
+}
+
+/**
+ * Read the IFD at the given offset.  The entry table is read first and then any values which don't fit
+ * in the entries themselves, so only the IFD and the data it points to are read from the source.
+ * @param src               Source containing the TIFF data
+ * @param offset            Offset of the IFD relative to the TIFF header
+ * @param isLittleEndian    Byte order of the TIFF data
+ * @param dir               Directory type to assign to the entries
+ * @param entries           List the entries are added to
+ * @param next_ifd          Output offset of the next linked IFD or 0 if there is none.  May be NULL.
+ * @return False if the IFD doesn't fit in the source
+ */
+bool exif::EXIFInfo::readIFD(ByteSource &src, unsigned long offset, bool isLittleEndian, uint8_t dir,
+                             std::vector<exif::IFEntry> *entries, unsigned long *next_ifd) {
+    // An IFD consists of a variable number of 12-byte directory entries. The
+    // first two bytes of the IFD section contain the number of directory
+    // entries in the section. The last 4 bytes of the IFD contain an offset
+    // to the next IFD, which means this IFD must contain exactly 6 + 12 * num
+    // bytes of data.
+    const unsigned char *buf = src.readAt(offset, 2);
+    if (buf == NULL) {
         ERROR("Marker not long enough");
         return false;
     }
-    unsigned long tiff_header_start = offs;
-    if (buf[offs] == 'I' && buf[offs + 1] == 'I')
-        isLittleEndian = true;
-    else {
-        if (buf[offs] == 'M' && buf[offs + 1] == 'M')
-            isLittleEndian = false;
-        else {
-            ERROR("Unknown byte align");
-            return false;
-        }
-    }
+    int num_entries = parse_value<uint16_t>(buf, isLittleEndian);
+    LOGD("IFD %d entries %d", dir, num_entries);
 
-    offs += 2;
-    if (0x2a != parse_value<uint16_t>(buf + offs, isLittleEndian)) {
-        ERROR("0x2a value is missing");
+    buf = src.readAt(offset + 2, (unsigned long)num_entries * ENTRY_SIZE + 4);
+    if (buf == NULL) {
+        ERROR("Marker not long enough");
         return false;
     }
+    if (next_ifd != NULL) {
+        *next_ifd = parse_value<uint32_t>(buf + num_entries * ENTRY_SIZE, isLittleEndian);
+    }
 
-    offs += 2;
-    unsigned long first_ifd_offset =
-            parse_value<uint32_t>(buf + offs, isLittleEndian);
-    offs += first_ifd_offset - 4;
-    if (offs >= marker->length) {
-        ERROR("Marker not long enough");
+    // Parse all of the entry headers and the values stored in the entries themselves first since
+    // reading any out of line values from the source invalidates buf.  Tags removed by the filter are skipped.
+    unsigned long first = entries->size();
+    unsigned long last = first;
+    entries->resize(first + num_entries);
+    for (int i = 0; i < num_entries; i++) {
+        if (!keepTag(parse_value<uint16_t>(buf + i * ENTRY_SIZE, isLittleEndian), dir)) continue;
+        IFEntry &entry = entries->at(last++);
+        // Take an entry of the same format kept by reset(), its value storage is reused
+        uint16_t format = parse_value<uint16_t>(buf + i * ENTRY_SIZE + 2, isLittleEndian);
+        if (format >= ENTRY_FORMAT_BYTE && format <= ENTRY_FORMAT_SRATIONAL && !spareValues_[format].empty()) {
+            entry = std::move(spareValues_[format].back());
+            spareValues_[format].pop_back();
+        }
+        parseIFEntryHeader(buf + i * ENTRY_SIZE, isLittleEndian, dir, entry);
+        if ((unsigned long)formatSize(entry.format()) * entry.length() <= 4) {
+            parseIFEntryValue(entry, buf + i * ENTRY_SIZE + 8, isLittleEndian);
+        }
+    }
+    entries->resize(last);
+
+    // The values are normally stored together after the IFD, so read them with one request when there is
+    // little space between them.  Otherwise each value is read on its own.
+    unsigned long valuesLo = src.size(), valuesHi = 0, valuesSize = 0;
+    for (unsigned long i = first; i < last; i++) {
+        const IFEntry &entry = entries->at(i);
+        unsigned long size = (unsigned long)formatSize(entry.format()) * entry.length();
+        if (size <= 4 || entry.data() > src.size() || size > src.size() - entry.data()) continue;
+        valuesLo = std::min(valuesLo, (unsigned long)entry.data());
+        valuesHi = std::max(valuesHi, entry.data() + size);
+        valuesSize += size;
+    }
+    const unsigned char *values = NULL;
+    if (valuesLo < valuesHi && valuesHi - valuesLo <= valuesSize + PREFETCH_GAP) {
+        values = src.readAt(valuesLo, valuesHi - valuesLo);
+    }
+
+    for (unsigned long i = first; i < last; i++) {
+        IFEntry &entry = entries->at(i);
+        unsigned long size = (unsigned long)formatSize(entry.format()) * entry.length();
+        if (size <= 4) continue;
+
+        const unsigned char *data;
+        if (values == NULL) {
+            data = src.readAt(entry.data(), size);
+        } else if (entry.data() >= valuesLo && entry.data() + size <= valuesHi) {
+            data = values + (entry.data() - valuesLo);
+        } else {
+            data = NULL; // Outside the source, reading it would only invalidate values
+        }
+        if (data == NULL) {
+            ERROR("Error extracting value for %x",entry.tag());
+            continue;
+        }
+        parseIFEntryValue(entry, data, isLittleEndian);
+    }
+
+    if (stringPool_ != NULL) {
+        for (unsigned long i = first; i < last; i++) {
+            IFEntry &entry = entries->at(i);
+            if (entry.format() == ENTRY_FORMAT_ASCII &&
+                std::binary_search(internTags_.begin(), internTags_.end(), (uint32_t)dir << 16 | entry.tag())) {
+                entry.intern(*stringPool_);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Get the first value of a numeric entry, as used for the offsets and lengths stored in the entries
+ * @param entry     Entry to get the value from
+ * @param value     Output value
+ * @return True if the entry is a SHORT or LONG with at least one value
+ */
+bool getOffsetValue(exif::IFEntry &entry, unsigned long *value) {
+    if (entry.format() == ENTRY_FORMAT_LONG && entry.val_long().size() > 0) {
+        *value = entry.val_long().front();
+    } else if (entry.format() == ENTRY_FORMAT_SHORT && entry.val_short().size() > 0) {
+        *value = entry.val_short().front();
+    } else {
         return false;
     }
-    LOGD("First IFD offset 0x%x", (int)first_ifd_offset);
+    return true;
+}
 
-    // Now parsing the first Image File Directory (IFD0, for the main image).
-    // An IFD consists of a variable number of 12-byte directory entries. The
-    // first two bytes of the IFD section contain the number of directory
-    // entries in the section. The last 4 bytes of the IFD contain an offset
-    // to the next IFD, which means this IFD must contain exactly 6 + 12 * num
-    // bytes of data.
-    if (offs + 2 > marker->length) {
+/**
+ * Find the thumbnail range described by the IFD1 entries
+ * @param entries   IFD1 entries
+ * @param tiffLen   Length of the TIFF data, the range has to fit inside it
+ * @param offset    Output offset of the thumbnail relative to the TIFF header
+ * @param length    Output length of the thumbnail
+ * @return True if IFD1 has a valid non empty thumbnail
+ */
+bool getThumbnailRange(std::vector<exif::IFEntry> *entries, unsigned long tiffLen, unsigned long *offset,
+                       unsigned long *length) {
+    bool hasOffset = false, hasLength = false;
+    for (unsigned long i = 0; i < entries->size(); i++) {
+        if (entries->at(i).tag() == EXIF_TAG_JPEG_SOI_OFFSET) {
+            hasOffset = getOffsetValue(entries->at(i), offset);
+        } else if (entries->at(i).tag() == EXIF_TAG_JPEG_DATA_BYTES) {
+            hasLength = getOffsetValue(entries->at(i), length);
+        }
+    }
+    if (!hasOffset || !hasLength || *length == 0) return false;
+    if (*offset > tiffLen || *length > tiffLen - *offset) {
+        ERROR("Thumbnail outside of EXIF data");
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Decode the TIFF structure holding the EXIF data into list of IFDirectories.  Only the TIFF header, the
+ * IFDs and their values are read from the source so it can be used directly on TIFF based RAW files.
+ * @param src       Source starting with the TIFF header.  All offsets in the TIFF data are relative to its start.
+ * @param retained  Buffer holding the same TIFF data which outlives the decode, so the thumbnail can point into
+ *                  it.  If NULL the thumbnail is copied out of the source.
+ * @return True if decoding was successful, otherwise return false
+ */
+bool exif::EXIFInfo::decodeTIFF(ByteSource &src, const unsigned char *retained) {
+    bool isLittleEndian;        // byte alignment (defined in EXIF header)
+
+    thumbnailData_.clear();
+    thumbnail_.data = NULL;
+    thumbnail_.size = 0;
+    dirty_ = 0;
+    if (retained == NULL) releaseExifMarker(); // Only JPEG keeps the segment for encodeIncremental
+
+    // Now parsing the TIFF header. The first two bytes are either "II" or
+    // "MM" for Intel or Motorola byte alignment. Sanity check by parsing
+    // the unsigned short that follows, making sure it equals 0x2a. The
+    // last 4 bytes are an offset into the first IFD. For this block, we
+    // expect the following minimum size:
+    //  2 bytes: 'II' or 'MM'
+    //  2 bytes: 0x002a
+    //  4 bytes: offset to first IDF
+    // -----------------------------
+    //  8 bytes
+    const unsigned char *buf = src.readAt(0, 8);
+    if (buf == NULL) {
         ERROR("Marker not long enough");
         return false;
     }
-    int num_entries = parse_value<uint16_t>(buf + offs, isLittleEndian);
-    LOGD("IFD entries %d", num_entries);
+    if (buf[0] == 'I' && buf[1] == 'I')
+        isLittleEndian = true;
+    else {
+        if (buf[0] == 'M' && buf[1] == 'M')
+            isLittleEndian = false;
+        else {
+            ERROR("Unknown byte align");
+            return false;
+        }
+    }
+
+    if (0x2a != parse_value<uint16_t>(buf + 2, isLittleEndian)) {
+        ERROR("0x2a value is missing");
+        return false;
+    }
 
-    if (offs + 6 + 12 * num_entries > marker->length) {
+    unsigned long first_ifd_offset = parse_value<uint32_t>(buf + 4, isLittleEndian);
+    if (first_ifd_offset >= src.size()) {
         ERROR("Marker not long enough");
         return false;
     }
-    offs += 2;
+    LOGD("First IFD offset 0x%x", (int)first_ifd_offset);
+
+    // Now parsing the first Image File Directory (IFD0, for the main image).
     unsigned long exif_ifd_offset = 0;
     unsigned long ifd_offset_interop = 0;
     unsigned long ifd_offset_gps = 0;
     unsigned long ifd_offset_10 = 0;
     unsigned long ifd1_offset = 0;
 
-    std::vector<exif::IFEntry> *IFD0_IFentries = new std::vector<exif::IFEntry>;
+    std::vector<exif::IFEntry> &entries = scratchEntries_;
+    entries.clear();
+    if (!readIFD(src, first_ifd_offset, isLittleEndian, IFD0_DIRECTORY, &entries, &ifd1_offset)) {
+        return false;
+    }
 
-    while (--num_entries >= 0) {
-        IFEntry result = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, IFD0_DIRECTORY);
+    std::vector<exif::IFEntry> *IFD0_IFentries = newEntries();
+    for (unsigned long i = 0; i < entries.size(); i++) {
+        IFEntry &result = entries.at(i);
         LOGD("Entry %x %d %d", result.tag(), result.format(), result.length());
-        offs += 12;
         switch (result.tag()) {
             case EXIF_TAG_EXIF_IFD_OFFSET:
-                exif_ifd_offset = tiff_header_start + result.data();
+                exif_ifd_offset = result.data();
                 break;
             case EXIF_TAG_GPS_IFD_OFFSET:
-                ifd_offset_gps = tiff_header_start + result.data();
+                ifd_offset_gps = result.data();
                 break;
             case EXIF_TAG_10_IFD_OFFSET:
-                ifd_offset_10 = tiff_header_start + result.data();
+                ifd_offset_10 = result.data();
                 break;
             default:
-                IFD0_IFentries->push_back(result);
+                IFD0_IFentries->push_back(std::move(result));
                 break;
         }
     }
     addDirectory(IFD0_DIRECTORY,IFD0_IFentries);
 
     LOGD("IFD0 %d IFentries added to directory", (int) IFD0_IFentries->size());
-
-    ifd1_offset = (unsigned long)parse<int32_t>(&buf[offs],isLittleEndian);
-    if (ifd1_offset != 0) ifd1_offset += tiff_header_start;
     LOGD("ifd1_offset %x",(unsigned int)ifd1_offset);
-    offs += 4 ; //Account for link to next IFD
 
     LOGD("EXIF IFD offset %x ",(unsigned int)exif_ifd_offset);
     // Jump to the EXIF IFD if it exists and parse all the information
     // there. Note that it's possible that the EXIF IFD doesn't exist.
     // The EXIF IFD contains most of the interesting information that a
     // typical user might want.
-    if (exif_ifd_offset != 0 && exif_ifd_offset + 4 <= marker->length) {
-        std::vector<exif::IFEntry> *EXIF_IFentries = new std::vector<exif::IFEntry>;
-
-        offs = exif_ifd_offset;
-        num_entries = parse_value<uint16_t>(buf + offs, isLittleEndian);
-        LOGD("EXIF IFD entries %d", num_entries);
-        if (offs + 6 + 12 * num_entries > marker->length) {
-            ERROR("Marker not long enough");
+    if (exif_ifd_offset != 0 && exif_ifd_offset + 4 <= src.size()) {
+        entries.clear();
+        // The IFD might be IFD1 and not SubIFD, decided before the tag filter is applied
+        if (isMisplacedIFD1(src, exif_ifd_offset, isLittleEndian)) {
+            LOGD("EXIF IFD was actually IFD1");
+            ifd1_offset = exif_ifd_offset;
+        } else if (!readIFD(src, exif_ifd_offset, isLittleEndian, EXIF_IFD_DIRECTORY, &entries, NULL)) {
             return false;
         }
-        offs += 2;
 
-        // These entries might be IFD1 and not SubIFD - check first entry to decide
-        if (num_entries > 0) {
-          IFEntry firstEntry = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, EXIF_IFD_DIRECTORY);
-          if (!isInDirectory(firstEntry.tag(),EXIF_IFD_DIRECTORY)) {
-            if (isInDirectory(firstEntry.tag(),IFD0_DIRECTORY)){
-              LOGD("EXIF IFD was actually IFD1");
-              ifd1_offset = exif_ifd_offset;
-              num_entries = 0;
-            }
-          }
-        }
-        while (--num_entries >= 0) {
-            IFEntry result = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, EXIF_IFD_DIRECTORY);
-            offs += 12;
+        std::vector<exif::IFEntry> *EXIF_IFentries = newEntries();
+        for (unsigned long i = 0; i < entries.size(); i++) {
+            IFEntry &result = entries.at(i);
             switch (result.tag()) {
                 case EXIF_TAG_INTEROP_OFFSET:
-                    ifd_offset_interop = tiff_header_start + result.data();
+                    ifd_offset_interop = result.data();
                     break;
                 default:
-                    EXIF_IFentries->push_back(result);
+                    EXIF_IFentries->push_back(std::move(result));
                     break;
             }
         }
         if ( EXIF_IFentries->size() > 0) {
           addDirectory(EXIF_IFD_DIRECTORY,EXIF_IFentries);
           LOGD("EXIF %d IFentries added to directory", (int) EXIF_IFentries->size());
+        } else {
+          spareEntries_.push_back(EXIF_IFentries);
         }
         // Note that no next IFD link
     }
 
-    if (ifd1_offset != 0 && ifd1_offset + 4 <= marker->length) {
-        std::vector<exif::IFEntry> *IFD1_IFentries = new std::vector<exif::IFEntry>;
-
-        offs = ifd1_offset;
-        num_entries = parse_value<uint16_t>(buf + offs, isLittleEndian);
-        LOGD("IFD1 entries %d", num_entries);
-        if (offs + 6 + 12 * num_entries > marker->length) {
-            ERROR("Marker not long enough");
+    if (ifd1_offset != 0 && ifd1_offset + 4 <= src.size()) {
+        std::vector<exif::IFEntry> *IFD1_IFentries = newEntries();
+        if (!readIFD(src, ifd1_offset, isLittleEndian, IFD0_DIRECTORY, IFD1_IFentries, NULL)) {
+            IFD1_IFentries->clear();
+            spareEntries_.push_back(IFD1_IFentries);
             return false;
         }
-        offs += 2;
-        while (--num_entries >= 0) {
-            IFEntry result = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, IFD0_DIRECTORY);
-            offs += 12;
-            IFD1_IFentries->push_back(result);
-        }
-
         addDirectory(IFD1_DIRECTORY,IFD1_IFentries);
         LOGD("IFD1 %d IFentries added to directory", (int) IFD1_IFentries->size());
         // Note that no next IFD link
+
+        unsigned long thumb_offset, thumb_length;
+        if (getThumbnailRange(IFD1_IFentries, src.size(), &thumb_offset, &thumb_length)) {
+            if (retained != NULL) {
+                thumbnail_.data = retained + thumb_offset;
+            } else {
+                const unsigned char *thumb = src.readAt(thumb_offset, thumb_length);
+                if (thumb != NULL) {
+                    thumbnailData_.assign(thumb, thumb + thumb_length);
+                    thumbnail_.data = thumbnailData_.data();
+                }
+            }
+            if (thumbnail_.data != NULL) thumbnail_.size = thumb_length;
+            LOGD("Thumbnail at %lx length %lu", thumb_offset, thumb_length);
+        }
     }
 
     // Jump to the GPS SubIFD if it exists and parse all the information
     // there. Note that it's possible that the GPS SubIFD doesn't exist.
-    if (ifd_offset_gps != 0 && ifd_offset_gps + 4 <= marker->length) {
-        std::vector<exif::IFEntry> *GPS_IFentries = new std::vector<exif::IFEntry>;
-
-        offs = ifd_offset_gps;
-        num_entries = parse_value<uint16_t>(buf + offs, isLittleEndian);
-        LOGD("Num GPS entries %d", num_entries);
-        if (offs + 6 + 12 * num_entries > marker->length) {
-            ERROR("Marker not long enough");
+    if (ifd_offset_gps != 0 && ifd_offset_gps + 4 <= src.size()) {
+        std::vector<exif::IFEntry> *GPS_IFentries = newEntries();
+        if (!readIFD(src, ifd_offset_gps, isLittleEndian, GPS_IFD_DIRECTORY, GPS_IFentries, NULL)) {
+            GPS_IFentries->clear();
+            spareEntries_.push_back(GPS_IFentries);
             return false;
         }
-        offs += 2;
-        while (--num_entries >= 0) {
-            IFEntry result = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, GPS_IFD_DIRECTORY);
-            GPS_IFentries->push_back(result);
-            offs += 12;
-        }
         addDirectory(GPS_IFD_DIRECTORY,GPS_IFentries);
         LOGD("GPS %d Entries added to directory",(int)GPS_IFentries->size());
         // Note that no next IFD link
@@ -747,21 +1615,13 @@ bool exif::EXIFInfo::decodeEXIFsegment(AppMarker *marker) {
 
     // Jump to the 10 SubIFD if it exists and parse all the information
     // there. Note that it's possible that the IFD doesn't exist.
-    if (ifd_offset_10 != 0 && ifd_offset_10 + 4 <= marker->length) {
-        std::vector<exif::IFEntry> *IFentries = new std::vector<exif::IFEntry>;
-
-        offs = ifd_offset_10;
-        num_entries = parse_value<uint16_t>(buf + offs, isLittleEndian);
-        if (offs + 6 + 12 * num_entries > marker->length) {
-            ERROR("Marker not long enough");
+    if (ifd_offset_10 != 0 && ifd_offset_10 + 4 <= src.size()) {
+        std::vector<exif::IFEntry> *IFentries = newEntries();
+        if (!readIFD(src, ifd_offset_10, isLittleEndian, EXIF_10_DIRECTORY, IFentries, NULL)) {
+            IFentries->clear();
+            spareEntries_.push_back(IFentries);
             return false;
         }
-        offs += 2;
-        while (--num_entries >= 0) {
-            IFEntry result = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, EXIF_10_DIRECTORY);
-            IFentries->push_back(result);
-            offs += 12;
-        }
         addDirectory(EXIF_10_DIRECTORY,IFentries);
         LOGD("%d entries added to 10 direcotry", (int)IFentries->size());
         // Note that no next IFD link
@@ -769,21 +1629,13 @@ bool exif::EXIFInfo::decodeEXIFsegment(AppMarker *marker) {
 
     // Jump to the Interop IFD if it exists and parse all the information
     // there. Note that it's possible that the IFD doesn't exist.
-    if (ifd_offset_interop != 0 && ifd_offset_interop + 4 <= marker->length) {
-        std::vector<exif::IFEntry> *IFentries = new std::vector<exif::IFEntry>;
-
-        offs = ifd_offset_interop;
-        num_entries = parse_value<uint16_t>(buf + offs, isLittleEndian);
-        if (offs + 6 + 12 * num_entries > marker->length) {
-            ERROR("Marker not long enough");
+    if (ifd_offset_interop != 0 && ifd_offset_interop + 4 <= src.size()) {
+        std::vector<exif::IFEntry> *IFentries = newEntries();
+        if (!readIFD(src, ifd_offset_interop, isLittleEndian, INTEROP_IFD_DIRECTORY, IFentries, NULL)) {
+            IFentries->clear();
+            spareEntries_.push_back(IFentries);
             return false;
         }
-        offs += 2;
-        while (--num_entries >= 0) {
-            IFEntry result = parseIFEntry(buf, offs, isLittleEndian, tiff_header_start, marker->length, INTEROP_IFD_DIRECTORY);
-            IFentries->push_back(result);
-            offs += 12;
-        }
         addDirectory(INTEROP_IFD_DIRECTORY,IFentries);
         LOGD("Num Interop entries added to directory %d", (int)IFentries->size());
         // Note that no next IFD link
@@ -794,180 +1646,2188 @@ bool exif::EXIFInfo::decodeEXIFsegment(AppMarker *marker) {
 }
 
 /**
- * Write 2 bytes in big endian format
- * @param buf   Buffer location to write data
- * @param val   16 bit value to write
- * @return  length of data written (2)
+ * Check whether the buffer starts with an ISOBMFF "ftyp" box as used by HEIF/HEIC files
+ * @param buf   Buffer to check
+ * @param len   Length of the buffer
+ * @return True if buf starts with an ftyp box
  */
-int write_buffer_2(unsigned char *buf, uint16_t val) {
-    buf[0] = (unsigned char) (val >> 8);
-    buf[1] = (unsigned char) (val & 0xFF);
-    return 2;
+bool exif::isHEIFHeader(const unsigned char *buf, unsigned long len) {
+    if (!buf || len < 8) return false;
+    return parse_value<uint32_t>(buf + 4, false) == BOX_FTYP;
 }
 
 /**
- * Write 4 bytes in big endian format
- * @param buf   Buffer location to write data
- * @param val   32 bit value to write
- * @return  length of data written (4)
+ * Detect the container format of a file from its first bytes
+ * @param buf   Start of the file, at least 12 bytes are needed to detect all formats
+ * @param len   Length of the buffer
+ * @return One of the CONTAINER_ types
  */
-int write_buffer_4(unsigned char *buf, uint32_t val) {
-    write_buffer_2(buf, (uint16_t) (val >> 16));
-    write_buffer_2(&buf[2], (uint16_t) (val & 0xFFFF));
-    return 4;
+int exif::detectContainer(const unsigned char *buf, unsigned long len) {
+    if (!buf || len < 4) return CONTAINER_UNKNOWN;
+    if (parse_value<uint16_t>(buf, false) == JPEG_SOI) return CONTAINER_JPEG;
+    if (isTIFFHeader(buf, len)) return CONTAINER_TIFF;
+    if (isHEIFHeader(buf, len)) return CONTAINER_HEIF;
+    if (len >= 8 && memcmp(buf, "\x89PNG\r\n\x1A\n", 8) == 0) return CONTAINER_PNG;
+    if (len >= 12 && std::equal(buf, buf + 4, "RIFF") && std::equal(buf + 8, buf + 12, "WEBP")) return CONTAINER_WEBP;
+    return CONTAINER_UNKNOWN;
 }
 
 /**
- * Get the value from the entry itself or write the value in the data buffer and return the address of the data
- * @param entry         Input entry to get value from
- * @param buf           Starting address of the EXIF buffer for getting the data buffer address
- * @param dataOffset    Offset of data buffer from EXIF buffer
- * @return  Either the actual value of the entry or the address where the value is stored
+ * Read a big endian value of 0, 2, 4 or 8 bytes as used for the variable sized fields of ISOBMFF boxes
+ * @param buf   Buffer holding the value
+ * @param size  Size of the value in bytes
+ * @return The value
  */
-u_int32_t get_val(exif::IFEntry entry, unsigned char *buf, u_int32_t *dataOffset) {
-    u_int32_t dataAddr = *dataOffset - EXIF_START;
-    //LOGD("Entry %x format %d length %d",entry.tag(),entry.format(),entry.length());
-    unsigned char *dataBuf = &buf[*dataOffset];
-    int offset = 0;
-    switch (entry.format()) {
-        case ENTRY_FORMAT_BYTE:
-        case ENTRY_FORMAT_UNDEFINED:
-            if (entry.val_byte().size() > 4) {
-                memcpy(dataBuf, entry.val_byte().data(), entry.val_byte().size());
-                *dataOffset += entry.val_byte().size();
-            } else {
-                return entry.val_byte()[0] << 24 |
-                       entry.val_byte()[1] << 16 |
-                       entry.val_byte()[2] << 8 |
-                       entry.val_byte()[3];
-            }
-            break;
-        case ENTRY_FORMAT_ASCII:
-            if (entry.length() > 4) { // Use original length since we might have removed the \0
-                memcpy(dataBuf, entry.val_string().c_str(), entry.val_string().length());
-                if (entry.length() - entry.val_string().length() == 1) { // account for the \0
-                    dataBuf[entry.length() - 1] = 0;
-                }
-                *dataOffset += entry.length();
-            } else {
-                return (u_int32_t ) entry.val_string()[0] << 24 |
-                                    entry.val_string()[1] << 16 |
-                                    entry.val_string()[2] << 8 |
-                                    entry.val_string()[3];
-            }
-
-            break;
-        case ENTRY_FORMAT_SHORT:
-            if (entry.val_short().size() > 2) {
-                for (unsigned long i=0; i<entry.val_short().size(); i++) {
-                    offset += write_buffer_2(&dataBuf[offset],entry.val_short().at(i));
-                }
-                *dataOffset += offset;
-            } else {
-                return entry.val_short()[0] << 16 |
-                       entry.val_short()[1];
-            }
-            break;
-        case ENTRY_FORMAT_LONG:
-            if (entry.val_long().size() > 1) {
-                for (unsigned long i=0; i<entry.val_long().size(); i++) {
-                    offset += write_buffer_4(&dataBuf[offset],entry.val_long().at(i));
-                }
-                *dataOffset += offset;
-            } else
-                return entry.val_long().front();
-            break;
-        case ENTRY_FORMAT_RATIONAL:
-            for (unsigned long i=0; i<entry.val_rational().size(); i++) {
-                offset += write_buffer_4(&dataBuf[offset], entry.val_rational().at(i).numerator);
-                offset += write_buffer_4(&dataBuf[offset], entry.val_rational().at(i).denominator);
-            }
-            *dataOffset += offset;
-            break;
-        case ENTRY_FORMAT_SRATIONAL:
-            for (unsigned long i=0; i<entry.val_srational().size(); i++) {
-                offset += write_buffer_4(&dataBuf[offset], (u_int32_t) entry.val_srational().at(i).numerator);
-                offset += write_buffer_4(&dataBuf[offset], (u_int32_t) entry.val_srational().at(i).denominator);
-            }
-            *dataOffset += offset;
-            break;
-        default:
-            ERROR("Unsupported format %d",entry.format());
-            return 0;
+uint64_t read_box_value(const unsigned char *buf, unsigned size) {
+    uint64_t val = 0;
+    for (unsigned i = 0; i < size; i++) {
+        val = (val << 8) | buf[i];
     }
-    return dataAddr;
+    return val;
 }
 
 /**
- * Write the given entry to the buffer in big endian format
- *      Each directory entry is composed of:
- *          2 bytes: tag number (data field)
- *          2 bytes: data format
- *          4 bytes: number of components
- *          4 bytes: data value or offset to data value
- * @param buf           Starting address of the EXIF buffer
- * @param entry_offset  Offset to write entry
- * @param entry         Entry to write
- * @param dataOffset    Offset for data buffer to write values
+ * Read the header of the ISOBMFF box at the given offset
+ * @param src       Source to read from
+ * @param offset    Offset of the box
+ * @param end       End of the enclosing box or file
+ * @param type      Output box type
+ * @param header    Output size of the box header
+ * @param size      Output size of the whole box including the header
+ * @return False and the outputs unchanged if there isn't a valid box at offset
  */
-void write_entry(unsigned char *buf, u_int32_t entry_offset, exif::IFEntry entry, u_int32_t *dataOffset) {
-    unsigned char *entryBuf = &buf[entry_offset];
-    write_buffer_2(entryBuf, entry.tag());
-    write_buffer_2(&entryBuf[2], entry.format());
-    write_buffer_4(&entryBuf[4], entry.length());
-    u_int32_t val = get_val(entry, buf, dataOffset);
-    write_buffer_4(&entryBuf[8], val);
-    //LOGD("Writing entry %x format %d length %d val %x",entry.tag(),entry.format(),entry.length(),val);
+bool readBoxHeader(exif::ByteSource &src, unsigned long offset, unsigned long end, uint32_t *type,
+                   unsigned long *header, unsigned long *size) {
+    if (offset + 8 > end) return false;
+    const unsigned char *buf = src.readAt(offset, 8);
+    if (buf == NULL) return false;
+    uint64_t boxSize = exif::parse_value<uint32_t>(buf, false);
+    uint32_t boxType = exif::parse_value<uint32_t>(buf + 4, false);
+    unsigned long headerSize = 8;
+    if (boxSize == 1) {
+        // 64 bit size follows the type
+        if (offset + 16 > end || (buf = src.readAt(offset + 8, 8)) == NULL) return false;
+        boxSize = read_box_value(buf, 8);
+        headerSize = 16;
+    } else if (boxSize == 0) {
+        // Box extends to the end of the enclosing box
+        boxSize = end - offset;
+    }
+    if (boxSize < headerSize || boxSize > end - offset) return false;
+    *type = boxType;
+    *header = headerSize;
+    *size = (unsigned long)boxSize;
+    return true;
 }
 
 /**
- * Write given list of IFD entries to the buffer with any data values following the entry data.  Data is written in big endian format.
- * @param entries   List of entries to write
- * @param buf       Starting location of the EXIF buffer
- * @param offset    Starting offset relative to buffer
- * @param link_offset Offset to write link data.  Default is to not link another directory.
- * @return  Ending offset of group of entries including the entry data
+ * Find the ID of the first item of the given type in the body of an iinf box
+ * @param buf       Body of the iinf box
+ * @param len       Length of the body
+ * @param itemType  Item type to find
+ * @param itemId    Output item ID
+ * @return True if an item of the given type was found
  */
-unsigned long write_ifd_entries(std::vector<exif::IFEntry> *entries, unsigned char *buf, unsigned long offset, unsigned long *link_offset) {
-    offset += write_buffer_2(&buf[offset], (uint16_t) entries->size());
-    u_int32_t dataOffset = (u_int32_t) (offset + entries->size() * ENTRY_SIZE + 4); // End of fixed section.  4 bytes for next IFD
+bool findHEIFItem(const unsigned char *buf, unsigned long len, uint32_t itemType, uint32_t *itemId) {
+    if (buf == NULL || len < 6) return false;
+    // Full box with version, flags and the entry count
+    unsigned long offs = buf[0] == 0 ? 6 : 8;
+    while (offs + 8 <= len) {
+        unsigned long size = exif::parse_value<uint32_t>(buf + offs, false);
+        uint32_t type = exif::parse_value<uint32_t>(buf + offs + 4, false);
+        if (size < 8 || size > len - offs) return false;
 
-    for (unsigned long i = 0; i < entries->size(); i++) {
-        exif::IFEntry entry = entries->at(i);
-        write_entry(buf, (u_int32_t) offset, entry, &dataOffset);
-        offset += ENTRY_SIZE;
+        // infe versions 2 and 3 hold item_ID, item_protection_index and item_type.  Older
+        // versions don't have an item type.
+        const unsigned char *infe = buf + offs + 8;
+        if (type == BOX_INFE && size >= 8 + 4 + 8 && infe[0] >= 2) {
+            unsigned idSize = infe[0] == 2 ? 2 : 4;
+            if (size >= 8 + 4 + idSize + 2 + 4 &&
+                exif::parse_value<uint32_t>(infe + 4 + idSize + 2, false) == itemType) {
+                *itemId = (uint32_t)read_box_value(infe + 4, idSize);
+                return true;
+            }
+        }
+        offs += size;
     }
-    *link_offset = offset;
-    write_buffer_4(&buf[*link_offset],0); // Don't link the next IFD directory yet
+    return false;
+}
 
-    return dataOffset;
+/**
+ * Find the location of an item from the body of an iloc box
+ * @param buf           Body of the iloc box
+ * @param len           Length of the body
+ * @param itemId        Item to find
+ * @param idatOffset    File offset of the idat box data, for items stored in the meta box
+ * @param extents       Output list of offset and length pairs making up the item
+ * @return True if the item was found and is stored in this file
+ */
+bool findHEIFItemLocation(const unsigned char *buf, unsigned long len, uint32_t itemId, unsigned long idatOffset,
+                          std::vector<std::pair<unsigned long, unsigned long> > *extents) {
+    if (buf == NULL || len < 8) return false;
+    unsigned version = buf[0];
+    unsigned offset_size = buf[4] >> 4;
+    unsigned length_size = buf[4] & 0xF;
+    unsigned base_offset_size = buf[5] >> 4;
+    unsigned index_size = (version == 1 || version == 2) ? buf[5] & 0xF : 0;
+    unsigned idSize = version < 2 ? 2 : 4;
+    unsigned long offs = 6;
+    if (offs + idSize > len) return false;
+    unsigned long item_count = (unsigned long)read_box_value(buf + offs, idSize);
+    offs += idSize;
+
+    for (unsigned long i = 0; i < item_count; i++) {
+        unsigned construction_method = 0;
+        if (offs + idSize > len) return false;
+        uint32_t id = (uint32_t)read_box_value(buf + offs, idSize);
+        offs += idSize;
+        if (version == 1 || version == 2) {
+            if (offs + 2 > len) return false;
+            construction_method = exif::parse_value<uint16_t>(buf + offs, false) & 0xF;
+            offs += 2;
+        }
+        if (offs + 2 + base_offset_size + 2 > len) return false;
+        uint16_t data_reference_index = exif::parse_value<uint16_t>(buf + offs, false);
+        offs += 2;
+        uint64_t base_offset = read_box_value(buf + offs, base_offset_size);
+        offs += base_offset_size;
+        unsigned extent_count = exif::parse_value<uint16_t>(buf + offs, false);
+        offs += 2;
+        unsigned long extent_size = (unsigned long)index_size + offset_size + length_size;
+        if (offs + extent_count * extent_size > len) return false;
+
+        if (id == itemId) {
+            // Only data in this file (data_reference_index 0), either at a file offset or in the idat box
+            if (data_reference_index != 0 || construction_method > 1) return false;
+            if (construction_method == 1) base_offset += idatOffset;
+            for (unsigned j = 0; j < extent_count; j++) {
+                const unsigned char *extent = buf + offs + j * extent_size + index_size;
+                uint64_t extent_offset = base_offset + read_box_value(extent, offset_size);
+                uint64_t extent_length = read_box_value(extent + offset_size, length_size);
+                extents->push_back(std::make_pair((unsigned long)extent_offset, (unsigned long)extent_length));
+            }
+            return !extents->empty();
+        }
+        offs += extent_count * extent_size;
+    }
+    return false;
 }
 
 /**
- * Write the given App Marker to the buffer.  Data is written in big endian format.
- * @param buff      Buffer location to write the AppMarker data
- * @param marker    The AppMarker data
- * @return The offset after writing the AppMarker
+ * Find the extents of the Exif item of a HEIF/HEIC file.  The top level boxes are walked to find the meta box,
+ * and only its iinf and iloc boxes are read to find the Exif item, so none of the image data is read.
+ * @param src       Source starting with the ftyp box
+ * @param extents   Output list of offset and length pairs making up the item, each inside the source
+ * @return True if the Exif item was found
  */
-unsigned long write_app_marker(unsigned char* buff,exif::AppMarker *marker) {
+bool findHEIFExif(exif::ByteSource &src, std::vector<std::pair<unsigned long, unsigned long> > *extents) {
+    uint32_t type = 0;
+    unsigned long header = 0, size = 0;
     unsigned long offset = 0;
-    offset += write_buffer_2(buff,marker->type);
-    offset += write_buffer_2(&buff[offset],marker->length);
-    unsigned long bufLen = (unsigned long)marker->length-2; // Remove bytes to store length
-    memcpy(&buff[offset],marker->buffer,bufLen);
-    LOGD("Wrote %x %x %x %x %x %x",buff[0],buff[1],buff[2],buff[3],buff[4],buff[5]);
-    offset += bufLen;
-    return offset;
+
+    // Find the meta box at the top level, skipping other boxes such as mdat by their size.  A meta box which
+    // doesn't fit in the file isn't found.
+    bool found = false;
+    while (!found && readBoxHeader(src, offset, src.size(), &type, &header, &size)) {
+        if (type == BOX_META) {
+            found = true;
+        } else {
+            offset += size;
+        }
+    }
+    if (!found) {
+        ERROR("No meta box found");
+        return false;
+    }
+
+    // meta is a full box so its children follow the version and flags
+    unsigned long meta_end = offset + size;
+    unsigned long iinf_offset = 0, iinf_size = 0;
+    unsigned long iloc_offset = 0, iloc_size = 0;
+    unsigned long idat_offset = 0;
+    offset += header + 4;
+    while (readBoxHeader(src, offset, meta_end, &type, &header, &size)) {
+        switch (type) {
+            case BOX_IINF:
+                iinf_offset = offset + header;
+                iinf_size = size - header;
+                break;
+            case BOX_ILOC:
+                iloc_offset = offset + header;
+                iloc_size = size - header;
+                break;
+            case BOX_IDAT:
+                idat_offset = offset + header;
+                break;
+            default:
+                break;
+        }
+        offset += size;
+    }
+
+    uint32_t exif_id;
+    if (iinf_size == 0 || !findHEIFItem(src.readAt(iinf_offset, iinf_size), iinf_size, ITEM_TYPE_EXIF, &exif_id)) {
+        ERROR("No Exif item found");
+        return false;
+    }
+    if (iloc_size == 0 ||
+        !findHEIFItemLocation(src.readAt(iloc_offset, iloc_size), iloc_size, exif_id, idat_offset, extents)) {
+        ERROR("Exif item %d location not found", exif_id);
+        return false;
+    }
+    for (unsigned long i = 0; i < extents->size(); i++) {
+        std::pair<unsigned long, unsigned long> &extent = extents->at(i);
+        if (extent.first > src.size()) return false;
+        if (extent.second == 0 || extent.second > src.size() - extent.first) {
+            extent.second = src.size() - extent.first;
+        }
+    }
+    return true;
 }
 
 /**
- * Generate the EXIF header buffer starting from the "Exif" string. The data is written in big endian format.
- * Note that we aren't putting the IFD's in the suggested order (IFD0, EXIF, GPS, INTEROP, IFD1) since it is
- * easier to put them in order where we know the pointers (INTEROP, EXIF, GPS, 10, IFD0, IFD1)
- * @param buf           Buffer to place header (starts at EXIF_START (6))
- * @return The offset after the segment was written
+ * Decode the Exif item of a HEIF/HEIC file.  The item is found with findHEIFExif, so none of the image data
+ * is read.  The TIFF data of the Exif item is then decoded with positioned reads like any other TIFF data.
+ * @param src   Source starting with the ftyp box
+ * @return True if decoding was successful, otherwise return false
  */
-uint16_t exif::EXIFInfo::encodeEXIFsegment(unsigned char *buf) {
+bool exif::EXIFInfo::decodeHEIF(ByteSource &src) {
+    std::vector<std::pair<unsigned long, unsigned long> > extents;
+    if (!findHEIFExif(src, &extents)) return false;
+
+    // The item is normally a single extent which can be decoded in place.  Otherwise gather the extents.
+    std::vector<unsigned char> payload;
+    MemorySource payloadSrc(NULL, 0);
+    SubSource itemSrc(src, extents[0].first, extents[0].second);
+    ByteSource *item = &itemSrc;
+    if (extents.size() > 1) {
+        for (unsigned long i = 0; i < extents.size(); i++) {
+            const unsigned char *buf = src.readAt(extents[i].first, extents[i].second);
+            if (buf == NULL) return false;
+            payload.insert(payload.end(), buf, buf + extents[i].second);
+        }
+        payloadSrc = MemorySource(payload.data(), payload.size());
+        item = &payloadSrc;
+    }
+
+    // The Exif item starts with the offset to the TIFF header from the end of the offset field
+    const unsigned char *buf = item->readAt(0, 4);
+    if (buf == NULL) return false;
+    unsigned long tiff_offset = 4 + (unsigned long)parse_value<uint32_t>(buf, false);
+    if (tiff_offset > item->size()) {
+        ERROR("Exif item too short");
+        return false;
+    }
+    return decodeEmbeddedTIFF(*item, tiff_offset, item->size() - tiff_offset);
+}
+
+/**
+ * Find the eXIf chunk of a PNG file.  Chunks are walked by their length so IDAT data is never read.
+ * @param src       Source starting with the PNG signature
+ * @param offset    Output offset of the chunk data
+ * @param length    Output length of the chunk data
+ * @return True if the chunk was found
+ */
+bool findPNGExif(exif::ByteSource &src, unsigned long *offset, unsigned long *length) {
+    // Each chunk is made up of:
+    //  4 bytes: data length (big endian)
+    //  4 bytes: chunk type
+    //  length bytes: data
+    //  4 bytes: CRC
+    unsigned long offs = 8; // Skip PNG signature
+    const unsigned char *buf;
+    while ((buf = src.readAt(offs, 8)) != NULL) {
+        unsigned long chunk_length = exif::parse_value<uint32_t>(buf, false);
+        uint32_t type = exif::parse_value<uint32_t>(buf + 4, false);
+        if (type == PNG_CHUNK_EXIF) {
+            *offset = offs + 8;
+            *length = chunk_length;
+            return true;
+        }
+        if (type == PNG_CHUNK_IEND) break;
+        offs += 8 + chunk_length + 4;
+    }
+    return false;
+}
+
+/**
+ * Find the EXIF chunk of a WebP file.  Chunks are walked by their size so the image data is never read.
+ * @param src       Source starting with the RIFF header
+ * @param offset    Output offset of the chunk data
+ * @param length    Output length of the chunk data
+ * @return True if the chunk was found
+ */
+bool findWebPExif(exif::ByteSource &src, unsigned long *offset, unsigned long *length) {
+    // Each chunk is made up of:
+    //  4 bytes: chunk type
+    //  4 bytes: data size (little endian)
+    //  size bytes: data, padded to an even size
+    unsigned long offs = 12; // Skip "RIFF", file size and "WEBP"
+    const unsigned char *buf;
+    while ((buf = src.readAt(offs, 8)) != NULL) {
+        uint32_t type = exif::parse_value<uint32_t>(buf, false);
+        unsigned long size = exif::parse_value<uint32_t>(buf + 4, true);
+        if (type == RIFF_CHUNK_EXIF) {
+            *offset = offs + 8;
+            *length = size;
+            return true;
+        }
+        offs += 8 + size + (size & 1);
+    }
+    return false;
+}
+
+/**
+ * Decode the Exif chunk of a PNG file.  Chunks are walked by their length so IDAT data is never read.
+ * @param src   Source starting with the PNG signature
+ * @return True if decoding was successful, otherwise return false
+ */
+bool exif::EXIFInfo::decodePNG(ByteSource &src) {
+    unsigned long offset, length;
+    if (!findPNGExif(src, &offset, &length)) {
+        ERROR("No eXIf chunk found");
+        return false;
+    }
+    return decodeEmbeddedTIFF(src, offset, length);
+}
+
+/**
+ * Decode the EXIF chunk of a WebP file.  Chunks are walked by their size so image data is never read.
+ * @param src   Source starting with the RIFF header
+ * @return True if decoding was successful, otherwise return false
+ */
+bool exif::EXIFInfo::decodeWebP(ByteSource &src) {
+    unsigned long offset, length;
+    if (!findWebPExif(src, &offset, &length)) {
+        ERROR("No EXIF chunk found");
+        return false;
+    }
+    return decodeEmbeddedTIFF(src, offset, length);
+}
+
+/**
+ * Decode TIFF data embedded in a container.  The data may be preceded by "Exif\0\0" as in a JPEG APP1 segment.
+ * @param src       Source of the container
+ * @param offset    Offset of the embedded data
+ * @param len       Length of the embedded data
+ * @return True if decoding was successful, otherwise return false
+ */
+bool exif::EXIFInfo::decodeEmbeddedTIFF(ByteSource &src, unsigned long offset, unsigned long len) {
+    if (offset > src.size() || len > src.size() - offset) {
+        ERROR("EXIF data extends past the end of the file");
+        return false;
+    }
+    // The prefix must be inside the embedded data, readAt alone could read past its end
+    const unsigned char *buf = len >= EXIF_START ? src.readAt(offset, EXIF_START) : NULL;
+    if (buf != NULL && std::equal(buf, buf + EXIF_START, "Exif\0\0")) {
+        offset += EXIF_START;
+        len -= EXIF_START;
+    }
+    SubSource tiffSrc(src, offset, len);
+    return decodeTIFF(tiffSrc, NULL);
+}
+
+/**
+ * Find the first APP segment of the given type and identifier in a JPEG file by walking the marker headers
+ * @param src       Source of the JPEG file
+ * @param type      Marker type to find (0xFFEx)
+ * @param id        Identifier the segment data starts with, such as "Exif\0\0"
+ * @param idLen     Length of the identifier
+ * @param offset    Output offset of the segment data following the identifier
+ * @param len       Output length of the segment data following the identifier
+ * @return True if the segment was found
+ */
+bool findAppSegment(exif::ByteSource &src, uint16_t type, const char *id, unsigned idLen, unsigned long *offset,
+                    unsigned long *len) {
+    unsigned long offs = 2; // Skip JPEG_SOI
+    exif::JPEGMarker marker;
+    while (exif::nextJPEGMarker(src, offs, &marker) && marker.type != JPEG_SOS && marker.type != JPEG_EOI) {
+        if (marker.type == type && marker.length >= 2 + idLen) {
+            const unsigned char *buf = src.readAt(marker.offset + 4, idLen);
+            if (buf != NULL && memcmp(buf, id, idLen) == 0) {
+                *offset = marker.offset + 4 + idLen;
+                *len = marker.length - 2 - idLen;
+                return true;
+            }
+        }
+        offs = marker.offset + 2 + marker.length;
+    }
+    return false;
+}
+
+/**
+ * Locate the TIFF data holding the EXIF data of a JPEG, TIFF, HEIF, PNG or WebP file.  Only the container
+ * structure is read.  Any "Exif\0\0" prefix is skipped.  A HEIF Exif item split over several extents isn't
+ * contiguous in the file, so it can only be decoded by readEXIF.
+ * @param src       Source of the file
+ * @param offset    Output offset of the TIFF header within the source
+ * @param len       Output length of the TIFF data
+ * @return True if EXIF data was found
+ */
+bool exif::locateTIFF(ByteSource &src, unsigned long *offset, unsigned long *len) {
+    const unsigned char *buf = src.readAt(0, std::min(src.size(), 12UL));
+    std::vector<std::pair<unsigned long, unsigned long> > extents;
+    bool found;
+    switch (detectContainer(buf, std::min(src.size(), 12UL))) {
+        case CONTAINER_JPEG:
+            return findAppSegment(src, EXIF_MARKER, "Exif\0\0", EXIF_START, offset, len);
+        case CONTAINER_TIFF:
+            *offset = 0;
+            *len = src.size();
+            return true;
+        case CONTAINER_HEIF:
+            if (!findHEIFExif(src, &extents) || extents.size() != 1) return false;
+            // The Exif item starts with the offset to the TIFF header from the end of the offset field
+            buf = extents[0].second >= 4 ? src.readAt(extents[0].first, 4) : NULL;
+            if (buf == NULL) return false;
+            *offset = 4 + (unsigned long)parse_value<uint32_t>(buf, false);
+            if (*offset > extents[0].second) return false;
+            *len = extents[0].second - *offset;
+            *offset += extents[0].first;
+            found = true;
+            break;
+        case CONTAINER_PNG:
+            found = findPNGExif(src, offset, len);
+            break;
+        case CONTAINER_WEBP:
+            found = findWebPExif(src, offset, len);
+            break;
+        default:
+            return false;
+    }
+    if (!found || *offset > src.size() || *len > src.size() - *offset) return false;
+    buf = *len >= EXIF_START ? src.readAt(*offset, EXIF_START) : NULL;
+    if (buf != NULL && std::equal(buf, buf + EXIF_START, "Exif\0\0")) {
+        *offset += EXIF_START;
+        *len -= EXIF_START;
+    }
+    return true;
+}
+
+/**
+ * Locate the embedded IFD1 thumbnail of a JPEG, TIFF, HEIF, PNG or WebP file without decoding the rest of the
+ * EXIF data.  Only the container structure, the TIFF header, the entry count and next link of IFD0 and the IFD1
+ * entry table are read from the source.
+ * @param src       Source to search
+ * @param offset    Output offset of the thumbnail within the source
+ * @param length    Output length of the thumbnail
+ * @return True if a thumbnail was found
+ */
+bool exif::findThumbnail(ByteSource &src, unsigned long *offset, unsigned long *length) {
+    unsigned long tiff_start, tiff_len;
+    if (!locateTIFF(src, &tiff_start, &tiff_len)) return false;
+
+    SubSource tiff(src, tiff_start, tiff_len);
+    const unsigned char *buf = tiff.readAt(0, 8);
+    if (buf == NULL || !isTIFFHeader(buf, 8)) return false;
+    bool isLittleEndian = buf[0] == 'I';
+    unsigned long ifd0_offset = parse_value<uint32_t>(buf + 4, isLittleEndian);
+
+    // Skip over the IFD0 entries straight to its link to IFD1
+    buf = tiff.readAt(ifd0_offset, 2);
+    if (buf == NULL) return false;
+    unsigned long link_offset = ifd0_offset + 2 + (unsigned long)parse_value<uint16_t>(buf, isLittleEndian) * ENTRY_SIZE;
+    buf = tiff.readAt(link_offset, 4);
+    if (buf == NULL) return false;
+    unsigned long ifd1_offset = parse_value<uint32_t>(buf, isLittleEndian);
+    if (ifd1_offset == 0) return false;
+
+    buf = tiff.readAt(ifd1_offset, 2);
+    if (buf == NULL) return false;
+    int num_entries = parse_value<uint16_t>(buf, isLittleEndian);
+    buf = tiff.readAt(ifd1_offset + 2, (unsigned long)num_entries * ENTRY_SIZE);
+    if (buf == NULL) return false;
+
+    // The offset and length are single values so they are always stored in the entries themselves
+    std::vector<exif::IFEntry> entries;
+    for (int i = 0; i < num_entries; i++) {
+        uint16_t tag = parse_value<uint16_t>(buf + i * ENTRY_SIZE, isLittleEndian);
+        if (tag != EXIF_TAG_JPEG_SOI_OFFSET && tag != EXIF_TAG_JPEG_DATA_BYTES) continue;
+        entries.push_back(IFEntry());
+        parseIFEntryHeader(buf + i * ENTRY_SIZE, isLittleEndian, IFD0_DIRECTORY, entries.back());
+        if ((unsigned long)formatSize(entries.back().format()) * entries.back().length() <= 4) {
+            parseIFEntryValue(entries.back(), buf + i * ENTRY_SIZE + 8, isLittleEndian);
+        }
+    }
+    if (!getThumbnailRange(&entries, tiff_len, offset, length)) return false;
+    *offset += tiff_start;
+    return true;
+}
+
+/**
+ * Read the embedded IFD1 thumbnail of a JPEG, TIFF, HEIF, PNG or WebP file using findThumbnail
+ * @param inputFile     Full path of file to read
+ * @param thumbnail     Output thumbnail data, normally a JPEG stream
+ * @return True if a thumbnail was found and read
+ */
+bool exif::readThumbnail(const std::string &inputFile, std::vector<unsigned char> *thumbnail) {
+    FileSource src(inputFile);
+    if (!src.isOpen()) {
+        ERROR("File not found %s",inputFile.c_str());
+        return false;
+    }
+    unsigned long offset, length;
+    if (!findThumbnail(src, &offset, &length)) return false;
+    const unsigned char *buf = src.readAt(offset, length);
+    if (buf == NULL) return false;
+    thumbnail->assign(buf, buf + length);
+    return true;
+}
+
+/**
+ * Parse the MP Index IFD of a Multi-Picture Format segment
+ * @param buf           MP header data following "MPF\0", starting with the byte order mark
+ * @param len           Length of the MP header data
+ * @param headerOffset  Offset of the MP header in the file, image offsets are relative to it
+ * @param images        List the images are added to
+ * @return True if the MP Index IFD was parsed
+ */
+bool exif::parseMPIndex(const unsigned char *buf, unsigned long len, unsigned long headerOffset,
+                        std::vector<MPImage> *images) {
+    // The MP header has the same layout as a TIFF header and is followed by the MP Index IFD
+    if (!isTIFFHeader(buf, len) || len < 8) {
+        ERROR("Bad MP header");
+        return false;
+    }
+    bool isLittleEndian = buf[0] == 'I';
+    unsigned long ifd_offset = parse_value<uint32_t>(buf + 4, isLittleEndian);
+    if (ifd_offset > len || len - ifd_offset < 2) return false;
+    unsigned long num_entries = parse_value<uint16_t>(buf + ifd_offset, isLittleEndian);
+    if ((len - ifd_offset - 2) / ENTRY_SIZE < num_entries) return false;
+
+    for (unsigned long i = 0; i < num_entries; i++) {
+        const unsigned char *entry = buf + ifd_offset + 2 + i * ENTRY_SIZE;
+        if (parse_value<uint16_t>(entry, isLittleEndian) != MPF_TAG_MP_ENTRY) continue;
+
+        // Each MP entry is 16 bytes: attribute, size, offset and two dependent image entry numbers
+        unsigned long count = parse_value<uint32_t>(entry + 4, isLittleEndian);
+        unsigned long data_offset = parse_value<uint32_t>(entry + 8, isLittleEndian);
+        if (data_offset > len || count > len - data_offset) {
+            ERROR("MP entries outside of MPF segment");
+            return false;
+        }
+        for (unsigned long j = 0; j + MP_ENTRY_SIZE <= count; j += MP_ENTRY_SIZE) {
+            const unsigned char *mp_entry = buf + data_offset + j;
+            MPImage image;
+            image.attribute = parse_value<uint32_t>(mp_entry, isLittleEndian);
+            image.size = parse_value<uint32_t>(mp_entry + 4, isLittleEndian);
+            // The first image starts at the beginning of the file and has offset 0
+            unsigned long image_offset = parse_value<uint32_t>(mp_entry + 8, isLittleEndian);
+            image.offset = image_offset == 0 ? 0 : headerOffset + image_offset;
+            images->push_back(image);
+            LOGD("MP image type %x offset %lx size %lu", image.type(), image.offset, image.size);
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * List the images of a Multi-Picture Format JPEG.  Only the APP marker headers and the MPF segment are read.
+ * @param src       Source of the JPEG file
+ * @param images    List the images are added to
+ * @return True if an MPF segment was found
+ */
+bool exif::findMPImages(ByteSource &src, std::vector<MPImage> *images) {
+    const unsigned char *buf = src.readAt(0, std::min(src.size(), 12UL));
+    if (detectContainer(buf, std::min(src.size(), 12UL)) != CONTAINER_JPEG) return false;
+
+    unsigned long offset, len;
+    if (!findAppSegment(src, MPF_MARKER, "MPF\0", MPF_START, &offset, &len)) return false;
+    buf = src.readAt(offset, len);
+    if (buf == NULL) return false;
+    return parseMPIndex(buf, len, offset, images);
+}
+
+/**
+ * Read the largest preview image of a Multi-Picture Format JPEG.  Only the MPF segment and the byte range
+ * of the chosen preview are read from the file.
+ * @param inputFile     Full path of file to read
+ * @param preview       Output preview data, a complete JPEG stream
+ * @return True if the file has a large thumbnail image and it was read
+ */
+bool exif::readMPPreview(const std::string &inputFile, std::vector<unsigned char> *preview) {
+    FileSource src(inputFile);
+    if (!src.isOpen()) {
+        ERROR("File not found %s",inputFile.c_str());
+        return false;
+    }
+    std::vector<MPImage> images;
+    if (!findMPImages(src, &images)) return false;
+
+    const MPImage *best = NULL;
+    for (unsigned long i = 0; i < images.size(); i++) {
+        uint32_t type = images.at(i).type();
+        if (type != MP_TYPE_LARGE_THUMBNAIL_VGA && type != MP_TYPE_LARGE_THUMBNAIL_FULLHD) continue;
+        if (best == NULL || images.at(i).size > best->size) best = &images.at(i);
+    }
+    if (best == NULL) return false;
+
+    const unsigned char *buf = src.readAt(best->offset, best->size);
+    if (buf == NULL) {
+        ERROR("MP image outside of file");
+        return false;
+    }
+    preview->assign(buf, buf + best->size);
+    return true;
+}
+
+/**
+ * Walk one IFD and pass its entries to the visitor
+ * @param src               Source containing the TIFF data
+ * @param offset            Offset of the IFD relative to the TIFF header
+ * @param isLittleEndian    Byte order of the TIFF data
+ * @param dir               Directory type of the IFD
+ * @param visitor           Visitor receiving the entries
+ * @param table             Buffer reused to hold the entry table while values are read
+ * @param links             Offsets of the linked directories indexed by directory type, updated from the entries
+ * @return False if the IFD doesn't fit in the source
+ */
+bool walkIFD(exif::ByteSource &src, unsigned long offset, bool isLittleEndian, uint8_t dir, exif::TagVisitor &visitor,
+             std::vector<unsigned char> &table, unsigned long *links) {
+    const unsigned char *buf = src.readAt(offset, 2);
+    if (buf == NULL) return false;
+    unsigned long num_entries = exif::parse_value<uint16_t>(buf, isLittleEndian);
+    buf = src.readAt(offset + 2, num_entries * ENTRY_SIZE + 4);
+    if (buf == NULL) return false;
+    // Copy the table since reading out of line values invalidates buf
+    table.assign(buf, buf + num_entries * ENTRY_SIZE + 4);
+    if (dir == IFD0_DIRECTORY) {
+        links[IFD1_DIRECTORY] = exif::parse_value<uint32_t>(&table[num_entries * ENTRY_SIZE], isLittleEndian);
+    }
+
+    for (unsigned long i = 0; i < num_entries; i++) {
+        const unsigned char *entry = &table[i * ENTRY_SIZE];
+        uint16_t tag = exif::parse_value<uint16_t>(entry, isLittleEndian);
+        uint16_t format = exif::parse_value<uint16_t>(entry + 2, isLittleEndian);
+        uint32_t count = exif::parse_value<uint32_t>(entry + 4, isLittleEndian);
+        uint32_t data = exif::parse_value<uint32_t>(entry + 8, isLittleEndian);
+        if (dir == IFD0_DIRECTORY && tag == EXIF_TAG_EXIF_IFD_OFFSET) links[EXIF_IFD_DIRECTORY] = data;
+        else if (dir == IFD0_DIRECTORY && tag == EXIF_TAG_GPS_IFD_OFFSET) links[GPS_IFD_DIRECTORY] = data;
+        else if (dir == IFD0_DIRECTORY && tag == EXIF_TAG_10_IFD_OFFSET) links[EXIF_10_DIRECTORY] = data;
+        else if (dir == EXIF_IFD_DIRECTORY && tag == EXIF_TAG_INTEROP_OFFSET) links[INTEROP_IFD_DIRECTORY] = data;
+
+        if (!visitor.wants(dir, tag)) continue;
+        unsigned long size = (unsigned long)exif::formatSize(format) * count;
+        const unsigned char *value = size <= 4 ? entry + 8 : src.readAt(data, size);
+        visitor.visit(dir, tag, format, count, value, isLittleEndian);
+    }
+    return true;
+}
+
+/**
+ * Walk the IFD0, EXIF, GPS, Interop, 10 and IFD1 directories of TIFF data without building IFEntries
+ * @param src       Source starting with the TIFF header
+ * @param visitor   Visitor receiving the entries
+ * @return False if the TIFF header or IFD0 can't be read
+ */
+bool exif::walkTIFF(ByteSource &src, TagVisitor &visitor) {
+    const unsigned char *buf = src.readAt(0, 8);
+    if (buf == NULL || !isTIFFHeader(buf, 8)) return false;
+    bool isLittleEndian = buf[0] == 'I';
+
+    unsigned long links[EXIF_10_DIRECTORY + 1] = {0};
+    links[IFD0_DIRECTORY] = parse_value<uint32_t>(buf + 4, isLittleEndian);
+    std::vector<unsigned char> table;
+    if (!walkIFD(src, links[IFD0_DIRECTORY], isLittleEndian, IFD0_DIRECTORY, visitor, table, links)) return false;
+    // Like decodeTIFF, an EXIF IFD link pointing at IFD1 is followed as IFD1
+    if (links[EXIF_IFD_DIRECTORY] != 0 && isMisplacedIFD1(src, links[EXIF_IFD_DIRECTORY], isLittleEndian)) {
+        links[IFD1_DIRECTORY] = links[EXIF_IFD_DIRECTORY];
+        links[EXIF_IFD_DIRECTORY] = 0;
+    }
+
+    // Same order as decodeTIFF, the Interop link is found in the EXIF IFD
+    static const uint8_t order[] = {EXIF_IFD_DIRECTORY, INTEROP_IFD_DIRECTORY, GPS_IFD_DIRECTORY, EXIF_10_DIRECTORY,
+                                    IFD1_DIRECTORY};
+    for (unsigned i = 0; i < sizeof(order); i++) {
+        if (links[order[i]] != 0) {
+            walkIFD(src, links[order[i]], isLittleEndian, order[i], visitor, table, links);
+        }
+    }
+    return true;
+}
+
+/**
+ * Get the field of decodeBatch a tag is used for
+ * @param dir   Directory of the tag
+ * @param tag   Tag id
+ * @return One of the BATCH_FIELD_ values or -1
+ */
+int getBatchField(uint8_t dir, uint16_t tag) {
+    switch (dir) {
+        case IFD0_DIRECTORY:
+            switch (tag) {
+                case EXIF_TAG_DIGICAM_MAKE: return BATCH_FIELD_MAKE;
+                case EXIF_TAG_DIGICAM_MODEL: return BATCH_FIELD_MODEL;
+                case EXIF_TAG_ORIENTATION: return BATCH_FIELD_ORIENTATION;
+                case EXIF_TAG_IFD_IMAGE_WIDTH: return BATCH_FIELD_IMAGE_WIDTH;
+                case EXIF_TAG_IFD_IMAGE_HEIGHT: return BATCH_FIELD_IMAGE_HEIGHT;
+            }
+            break;
+        case EXIF_IFD_DIRECTORY:
+            switch (tag) {
+                case EXIF_TAG_LENS_MODEL: return BATCH_FIELD_LENS_MODEL;
+                case EXIF_TAG_IMAGE_WIDTH: return BATCH_FIELD_IMAGE_WIDTH;
+                case EXIF_TAG_IMAGE_HEIGHT: return BATCH_FIELD_IMAGE_HEIGHT;
+                case EXIF_TAG_ORIGINAL_DATE: return BATCH_FIELD_CAPTURE_TIME;
+                case EXIF_TAG_EXPOSURE_TIME: return BATCH_FIELD_EXPOSURE_TIME;
+                case EXIF_TAG_FNUMBER: return BATCH_FIELD_FNUMBER;
+                case EXIF_TAG_ISO_SPEED_RATING: return BATCH_FIELD_ISO;
+                case EXIF_TAG_FOCAL_LENGTH: return BATCH_FIELD_FOCAL_LENGTH;
+            }
+            break;
+        case GPS_IFD_DIRECTORY:
+            switch (tag) {
+                case EXIF_TAG_GPS_LATITUDE_REF:
+                case EXIF_TAG_GPS_LATITUDE: return BATCH_FIELD_GPS_LATITUDE;
+                case EXIF_TAG_GPS_LONGITUDE_REF:
+                case EXIF_TAG_GPS_LONGITUDE: return BATCH_FIELD_GPS_LONGITUDE;
+                case EXIF_TAG_GPS_ALTITUDE_REF:
+                case EXIF_TAG_GPS_ALTITUDE: return BATCH_FIELD_GPS_ALTITUDE;
+            }
+            break;
+    }
+    return -1;
+}
+
+/**
+ * Get the column type of a decodeBatch field
+ * @param field     One of the BATCH_FIELD_ values
+ * @return One of the COLUMN_ types or -1 if the field is unknown
+ */
+int getBatchColumnType(int field) {
+    switch (field) {
+        case BATCH_FIELD_MAKE:
+        case BATCH_FIELD_MODEL:
+        case BATCH_FIELD_LENS_MODEL:
+            return COLUMN_STRING;
+        case BATCH_FIELD_ORIENTATION:
+        case BATCH_FIELD_IMAGE_WIDTH:
+        case BATCH_FIELD_IMAGE_HEIGHT:
+        case BATCH_FIELD_CAPTURE_TIME:
+        case BATCH_FIELD_ISO:
+            return COLUMN_INT64;
+        case BATCH_FIELD_EXPOSURE_TIME:
+        case BATCH_FIELD_FNUMBER:
+        case BATCH_FIELD_FOCAL_LENGTH:
+        case BATCH_FIELD_GPS_LATITUDE:
+        case BATCH_FIELD_GPS_LONGITUDE:
+        case BATCH_FIELD_GPS_ALTITUDE:
+            return COLUMN_DOUBLE;
+        default:
+            return -1;
+    }
+}
+
+/**
+ * Read an unsigned integer value of any integer format
+ * @param format            Entry format
+ * @param value             Raw value data
+ * @param isLittleEndian    Byte order of the value data
+ * @param out               Output value
+ * @return False if the format isn't an integer format
+ */
+bool readInteger(uint16_t format, const unsigned char *value, bool isLittleEndian, int64_t *out) {
+    switch (format) {
+        case ENTRY_FORMAT_BYTE: *out = value[0]; return true;
+        case ENTRY_FORMAT_SHORT: *out = exif::parse_value<uint16_t>(value, isLittleEndian); return true;
+        case ENTRY_FORMAT_LONG: *out = exif::parse_value<uint32_t>(value, isLittleEndian); return true;
+        default: return false;
+    }
+}
+
+/**
+ * Read a signed or unsigned rational value
+ * @param format            Entry format
+ * @param value             Raw value data
+ * @param isLittleEndian    Byte order of the value data
+ * @param out               Output value
+ * @return False if the format isn't a rational format
+ */
+bool readRational(uint16_t format, const unsigned char *value, bool isLittleEndian, double *out) {
+    if (format == ENTRY_FORMAT_RATIONAL) {
+        *out = exif::parse_value<exif::Rational>(value, isLittleEndian);
+    } else if (format == ENTRY_FORMAT_SRATIONAL) {
+        *out = exif::parse_value<exif::SRational>(value, isLittleEndian);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Visitor collecting the decodeBatch fields of one image
+ */
+class BatchVisitor : public exif::TagVisitor {
+public:
+    explicit BatchVisitor(const bool *wanted) : wanted_(wanted) { reset(); }
+
+    bool has[BATCH_NUM_FIELDS];
+    int64_t ints[BATCH_NUM_FIELDS];
+    double doubles[BATCH_NUM_FIELDS];
+    std::vector<char> strings;                      // String values, copied in visit since the value is only valid there
+    unsigned long stringOffsets[BATCH_NUM_FIELDS];  // Where the value of each string field is in strings
+    unsigned long stringLengths[BATCH_NUM_FIELDS];
+
+    /**
+     * Clear the values before walking the next image
+     */
+    void reset() {
+        for (int i = 0; i < BATCH_NUM_FIELDS; i++) {
+            has[i] = false;
+            ints[i] = 0;
+            doubles[i] = 0;
+            stringOffsets[i] = stringLengths[i] = 0;
+        }
+        strings.clear();    // Keeps its capacity for the next image
+        for (int i = 0; i < 3; i++) {
+            latitude_[i] = longitude_[i] = 0;
+        }
+        latitudeCount_ = longitudeCount_ = 0;
+        south_ = west_ = belowSeaLevel_ = false;
+        ifd0Width_ = ifd0Height_ = 0;
+        hasIfd0Width_ = hasIfd0Height_ = false;
+    }
+
+    bool wants(uint8_t dir, uint16_t tag) {
+        int field = getBatchField(dir, tag);
+        return field >= 0 && wanted_[field];
+    }
+
+    void visit(uint8_t dir, uint16_t tag, uint16_t format, uint32_t count, const unsigned char *value,
+               bool isLittleEndian) {
+        if (value == NULL || count == 0) return;
+        int field = getBatchField(dir, tag);
+        switch (field) {
+            case BATCH_FIELD_MAKE:
+            case BATCH_FIELD_MODEL:
+            case BATCH_FIELD_LENS_MODEL:
+                if (format != ENTRY_FORMAT_ASCII) return;
+                // Values are NUL terminated, stop at the first NUL
+                stringOffsets[field] = strings.size();
+                strings.insert(strings.end(), (const char *)value, (const char *)std::find(value, value + count, 0));
+                stringLengths[field] = strings.size() - stringOffsets[field];
+                has[field] = true;
+                break;
+            case BATCH_FIELD_IMAGE_WIDTH:
+            case BATCH_FIELD_IMAGE_HEIGHT:
+                if (dir == IFD0_DIRECTORY) {
+                    // Only used if the EXIF IFD has no image size
+                    if (field == BATCH_FIELD_IMAGE_WIDTH) {
+                        hasIfd0Width_ = readInteger(format, value, isLittleEndian, &ifd0Width_);
+                    } else {
+                        hasIfd0Height_ = readInteger(format, value, isLittleEndian, &ifd0Height_);
+                    }
+                    return;
+                }
+                has[field] = readInteger(format, value, isLittleEndian, &ints[field]);
+                break;
+            case BATCH_FIELD_ORIENTATION:
+            case BATCH_FIELD_ISO:
+                has[field] = readInteger(format, value, isLittleEndian, &ints[field]);
+                break;
+            case BATCH_FIELD_CAPTURE_TIME:
+                if (format != ENTRY_FORMAT_ASCII) return;
+                has[field] = exif::parseDateTime((const char *)value, count, &ints[field]);
+                break;
+            case BATCH_FIELD_EXPOSURE_TIME:
+            case BATCH_FIELD_FNUMBER:
+            case BATCH_FIELD_FOCAL_LENGTH:
+                has[field] = readRational(format, value, isLittleEndian, &doubles[field]);
+                break;
+            case BATCH_FIELD_GPS_LATITUDE:
+                if (tag == EXIF_TAG_GPS_LATITUDE_REF) {
+                    south_ = format == ENTRY_FORMAT_ASCII && value[0] == 'S';
+                } else if (count >= 3) {
+                    latitudeCount_ = 0;
+                    while (latitudeCount_ < 3 &&
+                           readRational(format, value + latitudeCount_ * 8, isLittleEndian, &latitude_[latitudeCount_])) {
+                        latitudeCount_++;
+                    }
+                }
+                break;
+            case BATCH_FIELD_GPS_LONGITUDE:
+                if (tag == EXIF_TAG_GPS_LONGITUDE_REF) {
+                    west_ = format == ENTRY_FORMAT_ASCII && value[0] == 'W';
+                } else if (count >= 3) {
+                    longitudeCount_ = 0;
+                    while (longitudeCount_ < 3 &&
+                           readRational(format, value + longitudeCount_ * 8, isLittleEndian, &longitude_[longitudeCount_])) {
+                        longitudeCount_++;
+                    }
+                }
+                break;
+            case BATCH_FIELD_GPS_ALTITUDE:
+                if (tag == EXIF_TAG_GPS_ALTITUDE_REF) {
+                    belowSeaLevel_ = format == ENTRY_FORMAT_BYTE && value[0] == 1;
+                } else {
+                    has[field] = readRational(format, value, isLittleEndian, &doubles[field]);
+                }
+                break;
+        }
+    }
+
+    /**
+     * Combine values which depend on several tags once the walk is done
+     */
+    void finish() {
+        if (!has[BATCH_FIELD_IMAGE_WIDTH] && hasIfd0Width_) {
+            ints[BATCH_FIELD_IMAGE_WIDTH] = ifd0Width_;
+            has[BATCH_FIELD_IMAGE_WIDTH] = true;
+        }
+        if (!has[BATCH_FIELD_IMAGE_HEIGHT] && hasIfd0Height_) {
+            ints[BATCH_FIELD_IMAGE_HEIGHT] = ifd0Height_;
+            has[BATCH_FIELD_IMAGE_HEIGHT] = true;
+        }
+        if (latitudeCount_ == 3 && longitudeCount_ == 3) {
+            double latitude = latitude_[0] + latitude_[1] / 60 + latitude_[2] / 3600;
+            double longitude = longitude_[0] + longitude_[1] / 60 + longitude_[2] / 3600;
+            doubles[BATCH_FIELD_GPS_LATITUDE] = south_ ? -latitude : latitude;
+            doubles[BATCH_FIELD_GPS_LONGITUDE] = west_ ? -longitude : longitude;
+            has[BATCH_FIELD_GPS_LATITUDE] = has[BATCH_FIELD_GPS_LONGITUDE] = true;
+        }
+        if (has[BATCH_FIELD_GPS_ALTITUDE] && belowSeaLevel_) {
+            doubles[BATCH_FIELD_GPS_ALTITUDE] = -doubles[BATCH_FIELD_GPS_ALTITUDE];
+        }
+    }
+
+private:
+    const bool *wanted_;
+    double latitude_[3], longitude_[3];
+    int latitudeCount_, longitudeCount_;
+    bool south_, west_, belowSeaLevel_;
+    int64_t ifd0Width_, ifd0Height_;
+    bool hasIfd0Width_, hasIfd0Height_;
+};
+
+/**
+ * Walk the EXIF data of an image in memory with a BatchVisitor.  Extended EXIF split over several APP1
+ * segments is gathered into one buffer first.
+ * @param image     Complete JPEG, TIFF, HEIF, PNG or WebP file
+ * @param visitor   Visitor to walk with, reset by the caller
+ * @param pieces    Scratch list of continuation segments, reused between calls
+ * @param gathered  Scratch buffer for Extended EXIF, reused between calls
+ * @return True if EXIF data was found
+ */
+bool walkImage(const exif::ByteView &image, BatchVisitor &visitor,
+               std::vector<std::pair<unsigned long, unsigned long> > *pieces, std::vector<unsigned char> *gathered) {
+    exif::MemorySource src(image.data, image.size);
+    unsigned long offset, len;
+    if (!exif::locateTIFF(src, &offset, &len)) return false;
+
+    // Extended EXIF continues in the following APP1 segments
+    pieces->clear();
+    if (len == JPEG_SEGMENT_MAX - 2 - EXIF_START && exif::parse_value<uint16_t>(image.data, false) == JPEG_SOI) {
+        findExifContinuations(src, offset + len, pieces);
+    }
+    if (pieces->empty()) {
+        exif::SubSource tiff(src, offset, len);
+        exif::walkTIFF(tiff, visitor);
+    } else {
+        gathered->assign(image.data + offset, image.data + offset + len);
+        for (unsigned long i = 0; i < pieces->size(); i++) {
+            gathered->insert(gathered->end(), image.data + pieces->at(i).first,
+                             image.data + pieces->at(i).first + pieces->at(i).second);
+        }
+        exif::MemorySource tiff(gathered->data(), gathered->size());
+        exif::walkTIFF(tiff, visitor);
+    }
+    visitor.finish();
+    return true;
+}
+
+/**
+ * String value of a row of a string column, stored in the arena of the thread which decoded the row
+ */
+struct BatchString {
+    unsigned arena;
+    unsigned long offset;
+    unsigned long length;
+};
+
+/**
+ * String values and validity of decodeBatch and scanFiles rows until they are put into the columns.  Each
+ * thread appends to its own arena, which grows to size once, so decoding a row doesn't allocate.  Rows of
+ * scanFiles are stored in any order, so a flag per row is kept rather than setting bits in shared validity bytes.
+ */
+struct BatchStrings {
+    std::vector<std::vector<BatchString> > rows;    // Per column, the value of each row of string columns
+    std::vector<std::vector<char> > valid;          // Per column, whether each row has a value
+    std::vector<std::vector<char> > arenas;         // Per thread
+};
+
+/**
+ * Store the values found by the visitor in a row of the batch columns
+ * @param visitor       Visitor which walked the image of the row
+ * @param row           Row to store
+ * @param columns       Output columns
+ * @param strings       String values of the rows
+ * @param arena         Arena of the calling thread
+ */
+void storeBatchRow(BatchVisitor &visitor, unsigned long row, std::vector<exif::BatchColumn> *columns,
+                   BatchStrings *strings, unsigned arena) {
+    // Write the values straight into the row slot of each column
+    for (unsigned long c = 0; c < columns->size(); c++) {
+        exif::BatchColumn &column = columns->at(c);
+        if (!visitor.has[column.field]) continue;
+        strings->valid.at(c)[row] = 1;
+        switch (column.type) {
+            case COLUMN_INT64:
+                column.int64Values[row] = visitor.ints[column.field];
+                break;
+            case COLUMN_DOUBLE:
+                column.doubleValues[row] = visitor.doubles[column.field];
+                break;
+            case COLUMN_STRING: {
+                // A field may be asked for in several columns, so the value is copied rather than moved
+                std::vector<char> &data = strings->arenas.at(arena);
+                BatchString &value = strings->rows.at(c)[row];
+                value.arena = arena;
+                value.offset = data.size();
+                value.length = visitor.stringLengths[column.field];
+                const char *start = visitor.strings.data() + visitor.stringOffsets[column.field];
+                data.insert(data.end(), start, start + value.length);
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Decode a range of rows of decodeBatch.  Each thread takes the rows a chunk at a time.
+ * @param spans         Images to decode
+ * @param n             Number of images
+ * @param next          Next row to decode, shared by the threads
+ * @param wanted        Fields to extract indexed by BATCH_FIELD_ value
+ * @param columns       Output columns
+ * @param strings       String values of the rows, concatenated once all rows are done
+ * @param arena         Arena of the calling thread
+ */
+void decodeBatchRows(const exif::ByteView spans[], unsigned long n, std::atomic<unsigned long> *next,
+                     const bool *wanted, std::vector<exif::BatchColumn> *columns, BatchStrings *strings,
+                     unsigned arena) {
+    const unsigned long chunk = 64; // Whole cache lines of row flags, so threads rarely write the same line
+    BatchVisitor visitor(wanted);
+    std::vector<std::pair<unsigned long, unsigned long> > pieces;
+    std::vector<unsigned char> gathered;
+    unsigned long start;
+    while ((start = next->fetch_add(chunk)) < n) {
+        unsigned long end = std::min(n, start + chunk);
+        for (unsigned long row = start; row < end; row++) {
+            visitor.reset();
+            walkImage(spans[row], visitor, &pieces, &gathered);
+            storeBatchRow(visitor, row, columns, strings, arena);
+        }
+    }
+}
+
+/**
+ * Decoder of ExifSummary records.  Unlike walkTIFF with a visitor it reads the few tags it needs straight out of
+ * the TIFF data in memory, without copying entry tables or strings, and interns the strings from the image bytes,
+ * so a summary is decoded without allocating unless the pool sees a new string.
+ */
+class SummaryDecoder {
+public:
+    SummaryDecoder(const unsigned char *tiff, unsigned long len, exif::StringPool *pool,
+                   exif::ExifSummary *summary) : tiff_(tiff), len_(len), pool_(pool), summary_(summary) {}
+
+    /**
+     * Decode IFD0, the EXIF IFD and the GPS IFD into the summary
+     * @return False if the TIFF header or IFD0 can't be read
+     */
+    bool decode() {
+        if (len_ < 8 || !exif::isTIFFHeader(tiff_, 8)) return false;
+        isLittleEndian_ = tiff_[0] == 'I';
+        exifOffset_ = gpsOffset_ = 0;
+        hasIfd0Width_ = hasIfd0Height_ = hasWidth_ = hasHeight_ = false;
+        latitudeCount_ = longitudeCount_ = 0;
+        south_ = west_ = belowSeaLevel_ = false;
+
+        if (!decodeIFD(exif::parse_value<uint32_t>(tiff_ + 4, isLittleEndian_), IFD0_DIRECTORY)) return false;
+        exif::MemorySource src(tiff_, len_);
+        if (exifOffset_ != 0 && !isMisplacedIFD1(src, exifOffset_, isLittleEndian_)) {
+            decodeIFD(exifOffset_, EXIF_IFD_DIRECTORY);
+        }
+        if (gpsOffset_ != 0) decodeIFD(gpsOffset_, GPS_IFD_DIRECTORY);
+
+        if (!hasWidth_ && hasIfd0Width_) {
+            width_ = ifd0Width_;
+            hasWidth_ = true;
+        }
+        if (!hasHeight_ && hasIfd0Height_) {
+            height_ = ifd0Height_;
+            hasHeight_ = true;
+        }
+        if (hasWidth_ && hasHeight_) {
+            summary_->width = (uint32_t)width_;
+            summary_->height = (uint32_t)height_;
+            summary_->flags |= SUMMARY_HAS_SIZE;
+        }
+        if (latitudeCount_ == 3 && longitudeCount_ == 3) {
+            double latitude = latitude_[0] + latitude_[1] / 60 + latitude_[2] / 3600;
+            double longitude = longitude_[0] + longitude_[1] / 60 + longitude_[2] / 3600;
+            summary_->latitude = south_ ? -latitude : latitude;
+            summary_->longitude = west_ ? -longitude : longitude;
+            summary_->flags |= SUMMARY_HAS_GPS;
+        }
+        if ((summary_->flags & SUMMARY_HAS_ALTITUDE) && belowSeaLevel_) summary_->altitude = -summary_->altitude;
+        return true;
+    }
+
+private:
+    const unsigned char *tiff_;
+    unsigned long len_;
+    exif::StringPool *pool_;
+    exif::ExifSummary *summary_;
+    bool isLittleEndian_;
+    unsigned long exifOffset_, gpsOffset_;
+    int64_t width_, height_, ifd0Width_, ifd0Height_;
+    bool hasWidth_, hasHeight_, hasIfd0Width_, hasIfd0Height_;
+    double latitude_[3], longitude_[3];
+    int latitudeCount_, longitudeCount_;
+    bool south_, west_, belowSeaLevel_;
+
+    /**
+     * Decode the summary tags of one IFD
+     * @param offset    Offset of the IFD relative to the TIFF header
+     * @param dir       Directory type of the IFD
+     * @return False if the IFD doesn't fit in the TIFF data
+     */
+    bool decodeIFD(unsigned long offset, uint8_t dir) {
+        if (offset > len_ || len_ - offset < 2) return false;
+        unsigned long num_entries = exif::parse_value<uint16_t>(tiff_ + offset, isLittleEndian_);
+        if (len_ - offset - 2 < num_entries * ENTRY_SIZE + 4) return false;
+
+        for (unsigned long i = 0; i < num_entries; i++) {
+            const unsigned char *entry = tiff_ + offset + 2 + i * ENTRY_SIZE;
+            uint16_t tag = exif::parse_value<uint16_t>(entry, isLittleEndian_);
+            uint16_t format = exif::parse_value<uint16_t>(entry + 2, isLittleEndian_);
+            uint32_t count = exif::parse_value<uint32_t>(entry + 4, isLittleEndian_);
+            uint32_t data = exif::parse_value<uint32_t>(entry + 8, isLittleEndian_);
+            if (dir == IFD0_DIRECTORY && tag == EXIF_TAG_EXIF_IFD_OFFSET) exifOffset_ = data;
+            else if (dir == IFD0_DIRECTORY && tag == EXIF_TAG_GPS_IFD_OFFSET) gpsOffset_ = data;
+            if (count == 0) continue;
+
+            unsigned long size = (unsigned long)exif::formatSize(format) * count;
+            const unsigned char *value = entry + 8;
+            if (size > 4) {
+                if (data > len_ || size > len_ - data) continue;
+                value = tiff_ + data;
+            }
+            decodeEntry(dir, tag, format, count, value);
+        }
+        return true;
+    }
+
+    void decodeEntry(uint8_t dir, uint16_t tag, uint16_t format, uint32_t count, const unsigned char *value) {
+        int64_t integer;
+        double rational;
+        switch (getBatchField(dir, tag)) {
+            case BATCH_FIELD_MAKE:
+                internString(format, count, value, &summary_->make);
+                break;
+            case BATCH_FIELD_MODEL:
+                internString(format, count, value, &summary_->model);
+                break;
+            case BATCH_FIELD_LENS_MODEL:
+                internString(format, count, value, &summary_->lens);
+                break;
+            case BATCH_FIELD_ORIENTATION:
+                if (readInteger(format, value, isLittleEndian_, &integer)) summary_->orientation = (uint8_t)integer;
+                break;
+            case BATCH_FIELD_IMAGE_WIDTH:
+                // IFD0 is only used if the EXIF IFD has no image size
+                if (dir == IFD0_DIRECTORY) hasIfd0Width_ = readInteger(format, value, isLittleEndian_, &ifd0Width_);
+                else hasWidth_ = readInteger(format, value, isLittleEndian_, &width_);
+                break;
+            case BATCH_FIELD_IMAGE_HEIGHT:
+                if (dir == IFD0_DIRECTORY) hasIfd0Height_ = readInteger(format, value, isLittleEndian_, &ifd0Height_);
+                else hasHeight_ = readInteger(format, value, isLittleEndian_, &height_);
+                break;
+            case BATCH_FIELD_CAPTURE_TIME:
+                if (format == ENTRY_FORMAT_ASCII && exif::parseDateTime((const char *)value, count, &integer)) {
+                    summary_->captureTime = integer;
+                    summary_->flags |= SUMMARY_HAS_CAPTURE_TIME;
+                }
+                break;
+            case BATCH_FIELD_ISO:
+                if (readInteger(format, value, isLittleEndian_, &integer)) {
+                    summary_->iso = (uint32_t)integer;
+                    summary_->flags |= SUMMARY_HAS_ISO;
+                }
+                break;
+            case BATCH_FIELD_EXPOSURE_TIME:
+                if (readRational(format, value, isLittleEndian_, &rational)) {
+                    summary_->exposureTime = (float)rational;
+                    summary_->flags |= SUMMARY_HAS_EXPOSURE_TIME;
+                }
+                break;
+            case BATCH_FIELD_FNUMBER:
+                if (readRational(format, value, isLittleEndian_, &rational)) {
+                    summary_->fNumber = (float)rational;
+                    summary_->flags |= SUMMARY_HAS_FNUMBER;
+                }
+                break;
+            case BATCH_FIELD_FOCAL_LENGTH:
+                if (readRational(format, value, isLittleEndian_, &rational)) {
+                    summary_->focalLength = (float)rational;
+                    summary_->flags |= SUMMARY_HAS_FOCAL_LENGTH;
+                }
+                break;
+            case BATCH_FIELD_GPS_LATITUDE:
+                if (tag == EXIF_TAG_GPS_LATITUDE_REF) {
+                    south_ = format == ENTRY_FORMAT_ASCII && value[0] == 'S';
+                } else if (count >= 3) {
+                    latitudeCount_ = readDegrees(format, value, latitude_);
+                }
+                break;
+            case BATCH_FIELD_GPS_LONGITUDE:
+                if (tag == EXIF_TAG_GPS_LONGITUDE_REF) {
+                    west_ = format == ENTRY_FORMAT_ASCII && value[0] == 'W';
+                } else if (count >= 3) {
+                    longitudeCount_ = readDegrees(format, value, longitude_);
+                }
+                break;
+            case BATCH_FIELD_GPS_ALTITUDE:
+                if (tag == EXIF_TAG_GPS_ALTITUDE_REF) {
+                    belowSeaLevel_ = format == ENTRY_FORMAT_BYTE && value[0] == 1;
+                } else if (readRational(format, value, isLittleEndian_, &rational)) {
+                    summary_->altitude = (float)rational;
+                    summary_->flags |= SUMMARY_HAS_ALTITUDE;
+                }
+                break;
+        }
+    }
+
+    void internString(uint16_t format, uint32_t count, const unsigned char *value, const std::string **out) {
+        if (pool_ == NULL || format != ENTRY_FORMAT_ASCII) return;
+        // Values are NUL terminated, stop at the first NUL
+        *out = pool_->intern((const char *)value, std::find(value, value + count, 0) - value);
+    }
+
+    int readDegrees(uint16_t format, const unsigned char *value, double *degrees) {
+        int n = 0;
+        while (n < 3 && readRational(format, value + n * 8, isLittleEndian_, &degrees[n])) n++;
+        return n;
+    }
+};
+
+/**
+ * Decode the summary of an image in a single pass over its EXIF data, without building an EXIFInfo
+ * @param image     Complete JPEG, TIFF, HEIF, PNG or WebP file in memory
+ * @param pool      Pool to intern the make, model and lens in, NULL to skip them
+ * @param summary   Output summary, missing values are 0 or NULL
+ * @return True if EXIF data was found
+ */
+bool exif::summarize(const ByteView &image, StringPool *pool, ExifSummary *summary) {
+    memset(summary, 0, sizeof(ExifSummary));
+    MemorySource src(image.data, image.size);
+    unsigned long offset, len;
+    if (!locateTIFF(src, &offset, &len)) return false;
+
+    // Extended EXIF continues in the following APP1 segments, only then the TIFF data is copied
+    std::vector<std::pair<unsigned long, unsigned long> > pieces;
+    if (len == JPEG_SEGMENT_MAX - 2 - EXIF_START && parse_value<uint16_t>(image.data, false) == JPEG_SOI) {
+        findExifContinuations(src, offset + len, &pieces);
+    }
+    if (pieces.empty()) {
+        SummaryDecoder(image.data + offset, len, pool, summary).decode();
+        return true;
+    }
+    std::vector<unsigned char> gathered(image.data + offset, image.data + offset + len);
+    for (unsigned long i = 0; i < pieces.size(); i++) {
+        gathered.insert(gathered.end(), image.data + pieces.at(i).first,
+                        image.data + pieces.at(i).first + pieces.at(i).second);
+    }
+    SummaryDecoder(gathered.data(), gathered.size(), pool, summary).decode();
+    return true;
+}
+
+/**
+ * Set up the output columns of decodeBatch and scanFiles
+ * @param fields        BATCH_FIELD_ values to extract, one column is output per field
+ * @param n             Number of rows
+ * @param wanted        Output flags of the fields to extract indexed by BATCH_FIELD_ value
+ * @param columns       Output columns with n empty rows
+ * @param strings       Output empty string values with an arena per thread
+ * @param threads       Number of threads storing rows
+ * @return False if a field is unknown
+ */
+bool initBatchColumns(const std::vector<int> &fields, unsigned long n, bool *wanted,
+                      std::vector<exif::BatchColumn> *columns, BatchStrings *strings, unsigned threads) {
+    columns->clear();
+    columns->resize(fields.size());
+    strings->rows.assign(fields.size(), std::vector<BatchString>());
+    strings->valid.assign(fields.size(), std::vector<char>(n, 0));
+    strings->arenas.assign(threads, std::vector<char>());
+    for (unsigned long c = 0; c < fields.size(); c++) {
+        exif::BatchColumn &column = columns->at(c);
+        column.field = fields.at(c);
+        column.type = getBatchColumnType(column.field);
+        if (column.type < 0) {
+            ERROR("Unknown batch field %d", column.field);
+            columns->clear();
+            return false;
+        }
+        wanted[column.field] = true;
+        column.validity.assign((n + 7) / 8, 0);
+        if (column.type == COLUMN_INT64) column.int64Values.assign(n, 0);
+        if (column.type == COLUMN_DOUBLE) column.doubleValues.assign(n, 0);
+        if (column.type == COLUMN_STRING) {
+            BatchString empty = {0, 0, 0};
+            strings->rows.at(c).assign(n, empty);
+        }
+    }
+    return true;
+}
+
+/**
+ * Set the validity bits of the rows and concatenate the string values of the rows into the string columns with a
+ * single allocation per column
+ * @param n             Number of rows
+ * @param columns       Output columns
+ * @param strings       String values and validity of the rows
+ */
+void finishBatchColumns(unsigned long n, std::vector<exif::BatchColumn> *columns, const BatchStrings &strings) {
+    for (unsigned long c = 0; c < columns->size(); c++) {
+        exif::BatchColumn &column = columns->at(c);
+        const std::vector<char> &valid = strings.valid.at(c);
+        for (unsigned long row = 0; row < n; row++) {
+            if (valid[row]) column.validity[row / 8] |= (uint8_t)(1 << (row % 8));
+        }
+        if (column.type != COLUMN_STRING) continue;
+        const std::vector<BatchString> &rows = strings.rows.at(c);
+        unsigned long total = 0;
+        for (unsigned long row = 0; row < n; row++) total += rows.at(row).length;
+        column.data.resize(total);
+        column.offsets.resize(n + 1);
+        column.offsets[0] = 0;
+        for (unsigned long row = 0; row < n; row++) {
+            const BatchString &value = rows.at(row);
+            if (value.length > 0) {
+                memcpy(&column.data[column.offsets[row]], &strings.arenas.at(value.arena)[value.offset], value.length);
+            }
+            column.offsets[row + 1] = column.offsets[row] + (int32_t)value.length;
+        }
+    }
+}
+
+/**
+ * Decode a set of fields from many images straight into columns, without building an EXIFInfo per image
+ * @param spans     Images to decode, each a complete JPEG, TIFF, HEIF, PNG or WebP file in memory
+ * @param n         Number of images
+ * @param fields    BATCH_FIELD_ values to extract, one column is output per field
+ * @param columns   Output columns in the order of fields, each with n rows
+ * @param threads   Number of threads to use, 0 for the number of cores
+ * @return False if a field is unknown
+ */
+bool exif::decodeBatch(const ByteView spans[], unsigned long n, const std::vector<int> &fields,
+                       std::vector<BatchColumn> *columns, unsigned threads) {
+    if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+    threads = (unsigned)std::max(1UL, std::min((unsigned long)threads, (n + 63) / 64));
+    bool wanted[BATCH_NUM_FIELDS] = {false};
+    BatchStrings strings;
+    if (!initBatchColumns(fields, n, wanted, columns, &strings, threads)) return false;
+
+    std::atomic<unsigned long> next(0);
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < threads; i++) {
+        pool.push_back(std::thread(decodeBatchRows, spans, n, &next, wanted, columns, &strings, i));
+    }
+    decodeBatchRows(spans, n, &next, wanted, columns, &strings, 0);
+    for (unsigned long i = 0; i < pool.size(); i++) {
+        pool.at(i).join();
+    }
+    finishBatchColumns(n, columns, strings);
+    return true;
+}
+
+/**
+ * File being read by scanFiles
+ */
+struct ScanJob {
+    unsigned long row;
+    const std::string *path;
+    unsigned long size;                 // File size, set when the file is opened
+    std::vector<unsigned char> data;    // Bytes read so far from the start of the file
+    unsigned long offset;               // Pending read
+    unsigned long len;
+    long result;                        // Bytes read by the pending read, negative on error
+    FILE *fp;
+    int fd;
+};
+
+/**
+ * Limit the pending read of a job to the file size and make room for it in the data
+ * @param job   Job with an open file
+ */
+void clampRead(ScanJob *job) {
+    job->offset = std::min(job->offset, job->size);
+    job->len = std::min(job->len, job->size - job->offset);
+    job->data.resize(job->offset + job->len);
+}
+
+/**
+ * Find how much of a file is needed to read all of its JPEG APPn markers, which may follow other segments
+ * up to the start of scan
+ * @param buf   Start of the file read so far
+ * @param len   Number of bytes read
+ * @param size  Size of the file
+ * @return Bytes needed, at most size.  len if the file isn't a JPEG or all APPn markers have been read.
+ */
+unsigned long jpegHeaderLength(const unsigned char *buf, unsigned long len, unsigned long size) {
+    if (len < 2 || exif::parse_value<uint16_t>(buf, false) != JPEG_SOI) return len;
+    exif::MemorySource src(buf, len);
+    unsigned long offs = 2;
+    exif::JPEGMarker marker;
+    while (exif::nextJPEGMarker(src, offs, &marker)) {
+        if (marker.type == JPEG_SOS || marker.type == JPEG_EOI) return len;
+        offs = marker.offset + 2 + marker.length;
+    }
+    // The header of the next marker tells whether the chain continues.  When garbage was found instead
+    // the search for a marker goes on over the recovery window.
+    unsigned long needed = offs + 4 > len ? offs + 4 : offs + JPEG_RECOVERY_WINDOW + 2;
+    return std::min(size, std::max(len, needed));
+}
+
+/**
+ * ByteSource over the start of a file read so far.  It has the size of the whole file, and remembers how far the
+ * reads past the part read so far went, so the rest can be read before decoding.
+ */
+class PrefixSource : public exif::ByteSource {
+public:
+    PrefixSource(const unsigned char *buf, unsigned long len, unsigned long size) :
+            buf_(buf), len_(len), size_(size), needed_(len) {}
+
+    const unsigned char *readAt(unsigned long offset, unsigned long len) {
+        if (offset <= len_ && len <= len_ - offset) return buf_ + offset;
+        if (offset <= size_ && len <= size_ - offset) needed_ = std::max(needed_, offset + len);
+        return NULL;
+    }
+
+    unsigned long size() const { return size_; }
+
+    /**
+     * Get how much of the file the reads so far needed
+     * @return Bytes needed from the start of the file, at least the length read
+     */
+    unsigned long needed() const { return needed_; }
+
+private:
+    const unsigned char *buf_;
+    unsigned long len_;
+    unsigned long size_;
+    unsigned long needed_;
+};
+
+/**
+ * Find how much of a file is needed to decode the wanted fields.  The APPn markers of a JPEG are followed
+ * with jpegHeaderLength.  For other containers the container structure and the TIFF data are walked over the
+ * part read so far, so each call finds the next piece.
+ * @param buf       Start of the file read so far
+ * @param len       Number of bytes read
+ * @param size      Size of the file
+ * @param visitor   Visitor for the wanted fields, reset before walking
+ * @return Bytes needed, at most size.  len if everything the walk reached has been read.
+ */
+unsigned long scanLength(const unsigned char *buf, unsigned long len, unsigned long size, BatchVisitor &visitor) {
+    if (len >= 2 && exif::parse_value<uint16_t>(buf, false) == JPEG_SOI) return jpegHeaderLength(buf, len, size);
+    PrefixSource src(buf, len, size);
+    unsigned long offset, tiffLen;
+    if (exif::locateTIFF(src, &offset, &tiffLen)) {
+        // TIFF data embedded in a container is only decoded once all of it has been read
+        if (offset > 0) src.readAt(offset, tiffLen);
+        exif::SubSource tiff(src, offset, tiffLen);
+        visitor.reset();
+        exif::walkTIFF(tiff, visitor);
+    }
+    return std::min(size, src.needed());
+}
+
+/**
+ * Reads of scanFiles, which may complete in any order
+ */
+class HeaderReader {
+public:
+    virtual ~HeaderReader() {}
+
+    /**
+     * Start the pending read of a job, opening its file first if needed.  The read is limited to the file size.
+     * @param job   Job to read, not touched by the caller until wait returns it
+     */
+    virtual void read(ScanJob *job) = 0;
+
+    /**
+     * Wait for a read to complete
+     * @return Job of the read with its result set, or NULL if reading failed altogether
+     */
+    virtual ScanJob *wait() = 0;
+
+    /**
+     * Close the file of a job without a pending read
+     * @param job   Job to close
+     */
+    virtual void close(ScanJob *job) = 0;
+};
+
+/**
+ * HeaderReader with a pool of threads each making one blocking read at a time
+ */
+class ThreadReader : public HeaderReader {
+public:
+    explicit ThreadReader(unsigned threads) : done_(false) {
+        for (unsigned i = 0; i < threads; i++) {
+            threads_.push_back(std::thread(&ThreadReader::run, this));
+        }
+    }
+
+    ~ThreadReader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            done_ = true;
+        }
+        pendingReady_.notify_all();
+        for (unsigned long i = 0; i < threads_.size(); i++) {
+            threads_.at(i).join();
+        }
+    }
+
+    void read(ScanJob *job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(job);
+        pendingReady_.notify_one();
+    }
+
+    ScanJob *wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (completed_.empty()) completedReady_.wait(lock);
+        ScanJob *job = completed_.front();
+        completed_.pop_front();
+        return job;
+    }
+
+    void close(ScanJob *job) {
+        if (job->fp != NULL) fclose(job->fp);
+        job->fp = NULL;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable pendingReady_;
+    std::condition_variable completedReady_;
+    std::deque<ScanJob *> pending_;
+    std::deque<ScanJob *> completed_;
+    std::vector<std::thread> threads_;
+    bool done_;
+
+    void run() {
+        for (;;) {
+            ScanJob *job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                while (pending_.empty() && !done_) pendingReady_.wait(lock);
+                if (pending_.empty()) return;
+                job = pending_.front();
+                pending_.pop_front();
+            }
+            readJob(job);
+            std::lock_guard<std::mutex> lock(mutex_);
+            completed_.push_back(job);
+            completedReady_.notify_one();
+        }
+    }
+
+    static void readJob(ScanJob *job) {
+        job->result = -1;
+        if (job->fp == NULL) {
+            job->fp = fopen(job->path->c_str(), "rb");
+            if (job->fp == NULL) return;
+            setvbuf(job->fp, NULL, _IONBF, 0); // Read straight into the job
+            if (fseek(job->fp, 0, SEEK_END) != 0) return;
+            job->size = (unsigned long)ftell(job->fp);
+        }
+        clampRead(job);
+        if (job->len > 0 && fseek(job->fp, (long)job->offset, SEEK_SET) != 0) return;
+        job->result = job->len > 0 ? (long)fread(&job->data[job->offset], 1, job->len, job->fp) : 0;
+    }
+};
+
+#ifdef EXIF_IO_URING
+/**
+ * HeaderReader using io_uring through the raw system calls, so liburing isn't needed.  All reads are made by the
+ * kernel, the calling thread only fills the submission queue and reaps completions.
+ */
+class UringReader : public HeaderReader {
+public:
+    UringReader() : ring_(-1), sq_(MAP_FAILED), cq_(MAP_FAILED), sqes_(MAP_FAILED), unsubmitted_(0), submitted_(0) {}
+
+    ~UringReader() {
+        // The kernel may still write to the buffers of submitted reads, so wait for them unless the ring is broken
+        while (submitted_ > 0) {
+            unsigned head = *cqHead_;
+            if (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+                submitted_--;
+                continue;
+            }
+            if (syscall(__NR_io_uring_enter, ring_, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                break;
+            }
+        }
+        if (sqes_ != MAP_FAILED) munmap(sqes_, sqesSize_);
+        if (cq_ != MAP_FAILED && cq_ != sq_) munmap(cq_, cqSize_);
+        if (sq_ != MAP_FAILED) munmap(sq_, sqSize_);
+        if (ring_ >= 0) ::close(ring_);
+    }
+
+    /**
+     * Set up the rings
+     * @param depth     Number of reads which can be in flight
+     * @return False if io_uring isn't available
+     */
+    bool init(unsigned depth) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_ = (int)syscall(__NR_io_uring_setup, depth, &params);
+        if (ring_ < 0) return false;
+
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        sqSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (single) sqSize_ = cqSize_ = std::max(sqSize_, cqSize_);
+        sq_ = mmap(NULL, sqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+        if (sq_ == MAP_FAILED) return false;
+        cq_ = single ? sq_ : mmap(NULL, cqSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_,
+                                  IORING_OFF_CQ_RING);
+        if (cq_ == MAP_FAILED) return false;
+        sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(NULL, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_, IORING_OFF_SQES);
+        if (sqes_ == MAP_FAILED) return false;
+
+        unsigned char *sq = (unsigned char *)sq_;
+        unsigned char *cq = (unsigned char *)cq_;
+        sqTail_ = (unsigned *)(sq + params.sq_off.tail);
+        sqMask_ = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray_ = (unsigned *)(sq + params.sq_off.array);
+        cqHead_ = (unsigned *)(cq + params.cq_off.head);
+        cqTail_ = (unsigned *)(cq + params.cq_off.tail);
+        cqMask_ = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    void read(ScanJob *job) {
+        if (job->fd < 0) {
+            // Opening is left synchronous, it is cheap next to the reads
+            struct stat st;
+            job->fd = open(job->path->c_str(), O_RDONLY | O_CLOEXEC);
+            if (job->fd < 0 || fstat(job->fd, &st) != 0) {
+                job->result = -1;
+                failed_.push_back(job);
+                return;
+            }
+            job->size = (unsigned long)st.st_size;
+        }
+        clampRead(job);
+
+        // Only this thread writes the tail
+        unsigned tail = *sqTail_;
+        unsigned index = tail & sqMask_;
+        io_uring_sqe *sqe = &((io_uring_sqe *)sqes_)[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = job->fd;
+        sqe->addr = (uint64_t)(uintptr_t)(job->data.data() + job->offset);
+        sqe->len = (uint32_t)job->len;
+        sqe->off = job->offset;
+        sqe->user_data = (uint64_t)(uintptr_t)job;
+        sqArray_[index] = index;
+        __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+        unsubmitted_++;
+    }
+
+    ScanJob *wait() {
+        if (!failed_.empty()) {
+            ScanJob *job = failed_.back();
+            failed_.pop_back();
+            return job;
+        }
+        for (;;) {
+            unsigned head = *cqHead_;
+            if (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe *cqe = &cqes_[head & cqMask_];
+                ScanJob *job = (ScanJob *)(uintptr_t)cqe->user_data;
+                job->result = cqe->res;
+                __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+                submitted_--;
+                return job;
+            }
+            // Submit the new reads and wait for at least one completion in the same call
+            int submitted = (int)syscall(__NR_io_uring_enter, ring_, unsubmitted_, 1, IORING_ENTER_GETEVENTS,
+                                         NULL, 0);
+            if (submitted < 0) {
+                if (errno == EINTR) continue;
+                ERROR("io_uring_enter failed %d", errno);
+                return NULL;
+            }
+            unsubmitted_ -= (unsigned)submitted;
+            submitted_ += (unsigned)submitted;
+        }
+    }
+
+    void close(ScanJob *job) {
+        if (job->fd >= 0) ::close(job->fd);
+        job->fd = -1;
+    }
+
+private:
+    int ring_;
+    void *sq_, *cq_, *sqes_;
+    size_t sqSize_, cqSize_, sqesSize_;
+    unsigned *sqTail_, *sqArray_, *cqHead_, *cqTail_;
+    unsigned sqMask_, cqMask_;
+    io_uring_cqe *cqes_;
+    unsigned unsubmitted_;
+    unsigned submitted_;                // Reads submitted to the kernel whose completion hasn't been reaped
+    std::vector<ScanJob *> failed_;     // Jobs whose file couldn't be opened, returned by the next wait
+};
+#endif
+
+/**
+ * Create the reader for scanFiles, io_uring when it was built in and can be set up
+ * @param queueDepth    Number of reads to keep in flight
+ * @param ioUring       Output true if io_uring is used
+ * @return New reader
+ */
+HeaderReader *createHeaderReader(unsigned queueDepth, bool *ioUring) {
+#ifdef EXIF_IO_URING
+    UringReader *uring = new UringReader;
+    if (uring->init(queueDepth)) {
+        *ioUring = true;
+        return uring;
+    }
+    LOGD("io_uring not available, using reader threads");
+    delete uring;
+#endif
+    *ioUring = false;
+    // Each thread makes one blocking read at a time, more of them than cores only adds context switches
+    return new ThreadReader(std::min(queueDepth, std::max(1U, std::thread::hardware_concurrency())));
+}
+
+/**
+ * Queue of files read by scanFiles waiting to be decoded.  Pushing blocks while the queue is full so reading
+ * can't run ahead of decoding by more than the capacity.
+ */
+class ScanQueue {
+public:
+    explicit ScanQueue(unsigned long capacity) : capacity_(capacity), done_(false) {}
+
+    void push(ScanJob *job) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (jobs_.size() >= capacity_) notFull_.wait(lock);
+        jobs_.push_back(job);
+        notEmpty_.notify_one();
+    }
+
+    /**
+     * Take the next job
+     * @return Job or NULL once finish was called and the queue is empty
+     */
+    ScanJob *pop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (jobs_.empty() && !done_) notEmpty_.wait(lock);
+        if (jobs_.empty()) return NULL;
+        ScanJob *job = jobs_.front();
+        jobs_.pop_front();
+        notFull_.notify_one();
+        return job;
+    }
+
+    /**
+     * Let the workers stop once the queue is empty
+     */
+    void finish() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_ = true;
+        notEmpty_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+    std::deque<ScanJob *> jobs_;
+    unsigned long capacity_;
+    bool done_;
+};
+
+/**
+ * Decode the files read by scanFiles until the queue is finished
+ * @param queue         Files to decode
+ * @param wanted        Fields to extract indexed by BATCH_FIELD_ value
+ * @param columns       Output columns
+ * @param strings       String values of the rows
+ * @param arena         Arena of the worker
+ */
+void scanDecodeWorker(ScanQueue *queue, const bool *wanted, std::vector<exif::BatchColumn> *columns,
+                      BatchStrings *strings, unsigned arena) {
+    BatchVisitor visitor(wanted);
+    std::vector<std::pair<unsigned long, unsigned long> > pieces;
+    std::vector<unsigned char> gathered;
+    ScanJob *job;
+    while ((job = queue->pop()) != NULL) {
+        visitor.reset();
+        exif::ByteView image = {job->data.data(), job->data.size()};
+        walkImage(image, visitor, &pieces, &gathered);
+        storeBatchRow(visitor, job->row, columns, strings, arena);
+        delete job;
+    }
+}
+
+/**
+ * Decode a set of fields from many files straight into columns like decodeBatch, keeping many header reads in
+ * flight.  Only a prefix of each file is read and the completed prefixes are decoded by worker threads while
+ * the next reads are under way.  A file whose APPn markers, container structure or wanted EXIF values extend
+ * past the prefix gets follow up reads for the rest of them.
+ * @param paths         Files to read
+ * @param fields        BATCH_FIELD_ values to extract, one column is output per field
+ * @param columns       Output columns in the order of fields, one row per path
+ * @param threads       Number of decode threads, 0 for the number of cores
+ * @param queueDepth    Number of reads to keep in flight, normally SCAN_QUEUE_DEPTH
+ * @param prefix        Bytes to read from the start of each file, normally PREFETCH_WINDOW
+ * @param stats         Output statistics, may be NULL
+ * @return False if a field is unknown or the reads failed
+ */
+bool exif::scanFiles(const std::vector<std::string> &paths, const std::vector<int> &fields,
+                     std::vector<BatchColumn> *columns, unsigned threads, unsigned queueDepth, unsigned long prefix,
+                     ScanStats *stats) {
+    unsigned long n = paths.size();
+    if (threads == 0) threads = std::max(1U, std::thread::hardware_concurrency());
+    bool wanted[BATCH_NUM_FIELDS] = {false};
+    BatchStrings strings;
+    if (!initBatchColumns(fields, n, wanted, columns, &strings, threads)) return false;
+
+    ScanStats counts;
+    memset(&counts, 0, sizeof(counts));
+    queueDepth = std::max(1U, queueDepth);
+    prefix = std::max(4UL, prefix);
+
+    ScanQueue queue(queueDepth);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++) {
+        workers.push_back(std::thread(scanDecodeWorker, &queue, wanted, columns, &strings, i));
+    }
+
+    bool ok = true;
+    std::unique_ptr<HeaderReader> reader(createHeaderReader(queueDepth, &counts.ioUring));
+    BatchVisitor visitor(wanted);
+    std::set<ScanJob *> inFlight;
+    unsigned long next = 0;
+    while (next < n || !inFlight.empty()) {
+        while (next < n && inFlight.size() < queueDepth) {
+            ScanJob *job = new ScanJob;
+            job->row = next;
+            job->path = &paths.at(next++);
+            job->size = 0;
+            job->offset = 0;
+            job->len = prefix;
+            job->fp = NULL;
+            job->fd = -1;
+            reader->read(job);
+            inFlight.insert(job);
+            counts.reads++;
+        }
+
+        ScanJob *job = reader->wait();
+        if (job == NULL) {
+            // The reader waits for the reads still in flight when it is destroyed, then their jobs can go
+            for (std::set<ScanJob *>::iterator i = inFlight.begin(); i != inFlight.end(); ++i) {
+                reader->close(*i);
+            }
+            reader.reset();
+            for (std::set<ScanJob *>::iterator i = inFlight.begin(); i != inFlight.end(); ++i) {
+                delete *i;
+            }
+            counts.failed += inFlight.size() + (n - next);
+            ok = false;
+            break;
+        }
+        inFlight.erase(job);
+        if (job->result < 0) {
+            counts.failed++;
+            reader->close(job);
+            delete job;
+            continue;
+        }
+        job->data.resize(job->offset + (unsigned long)job->result);
+        counts.bytesRead += (unsigned long)job->result;
+
+        unsigned long needed = scanLength(job->data.data(), job->data.size(), job->size, visitor);
+        if (job->result > 0 && needed > job->data.size()) {
+            // Read the rest of the APPn markers or the EXIF data, at least as much again as was read so far so
+            // long chains and EXIF data far into a large file take few reads
+            job->offset = job->data.size();
+            job->len = std::max(needed - job->offset, std::max(prefix, job->offset));
+            reader->read(job);
+            inFlight.insert(job);
+            counts.reads++;
+            counts.followUps++;
+            continue;
+        }
+        reader->close(job);
+        counts.files++;
+        queue.push(job);
+    }
+
+    queue.finish();
+    for (unsigned long i = 0; i < workers.size(); i++) {
+        workers.at(i).join();
+    }
+    finishBatchColumns(n, columns, strings);
+    if (stats != NULL) *stats = counts;
+    return ok;
+}
+
+/**
+ * Write 2 bytes in big endian format
+ * @param buf   Buffer location to write data
+ * @param val   16 bit value to write
+ * @return  length of data written (2)
+ */
+int write_buffer_2(unsigned char *buf, uint16_t val) {
+    buf[0] = (unsigned char) (val >> 8);
+    buf[1] = (unsigned char) (val & 0xFF);
+    return 2;
+}
+
+/**
+ * Write 4 bytes in big endian format
+ * @param buf   Buffer location to write data
+ * @param val   32 bit value to write
+ * @return  length of data written (4)
+ */
+int write_buffer_4(unsigned char *buf, uint32_t val) {
+    write_buffer_2(buf, (uint16_t) (val >> 16));
+    write_buffer_2(&buf[2], (uint16_t) (val & 0xFFFF));
+    return 4;
+}
+
+/**
+ * Get the value from the entry itself or write the value in the data buffer and return the address of the data
+ * @param entry         Input entry to get value from
+ * @param buf           Starting address of the EXIF buffer for getting the data buffer address
+ * @param dataOffset    Offset of data buffer from EXIF buffer
+ * @return  Either the actual value of the entry or the address where the value is stored
+ */
+u_int32_t get_val(const exif::IFEntry &entry, unsigned char *buf, u_int32_t *dataOffset) {
+    u_int32_t dataAddr = *dataOffset - EXIF_START;
+    //LOGD("Entry %x format %d length %d",entry.tag(),entry.format(),entry.length());
+    unsigned char *dataBuf = &buf[*dataOffset];
+    int offset = 0;
+    switch (entry.format()) {
+        case ENTRY_FORMAT_BYTE:
+        case ENTRY_FORMAT_UNDEFINED:
+            if (entry.val_byte().size() > 4) {
+                memcpy(dataBuf, entry.val_byte().data(), entry.val_byte().size());
+                *dataOffset += entry.val_byte().size();
+            } else {
+                // Values shorter than 4 bytes are left aligned and padded with 0
+                u_int32_t val = 0;
+                for (unsigned long i=0; i<entry.val_byte().size(); i++) {
+                    val |= (u_int32_t) entry.val_byte()[i] << (24 - 8*i);
+                }
+                return val;
+            }
+            break;
+        case ENTRY_FORMAT_ASCII:
+            if (entry.length() > 4) { // Use original length since we might have removed the \0
+                // Clamp the string to the length so the data stays where the directory says it is
+                unsigned long copied = std::min((unsigned long) entry.val_string().length(),
+                                                (unsigned long) entry.length());
+                memcpy(dataBuf, entry.val_string().c_str(), copied);
+                memset(dataBuf + copied, 0, entry.length() - copied); // account for the \0
+                *dataOffset += entry.length();
+            } else {
+                u_int32_t val = 0;
+                for (unsigned long i=0; i<entry.val_string().length() && i<entry.length() && i<4; i++) {
+                    val |= (u_int32_t) (unsigned char) entry.val_string()[i] << (24 - 8*i);
+                }
+                return val;
+            }
+
+            break;
+        case ENTRY_FORMAT_SHORT:
+            if (entry.val_short().size() > 2) {
+                for (unsigned long i=0; i<entry.val_short().size(); i++) {
+                    offset += write_buffer_2(&dataBuf[offset],entry.val_short().at(i));
+                }
+                *dataOffset += offset;
+            } else {
+                u_int32_t val = 0;
+                for (unsigned long i=0; i<entry.val_short().size(); i++) {
+                    val |= (u_int32_t) entry.val_short()[i] << (16 - 16*i);
+                }
+                return val;
+            }
+            break;
+        case ENTRY_FORMAT_LONG:
+            if (entry.val_long().size() > 1) {
+                for (unsigned long i=0; i<entry.val_long().size(); i++) {
+                    offset += write_buffer_4(&dataBuf[offset],entry.val_long().at(i));
+                }
+                *dataOffset += offset;
+            } else
+                return entry.val_long().empty() ? 0 : entry.val_long().front();
+            break;
+        case ENTRY_FORMAT_RATIONAL:
+            for (unsigned long i=0; i<entry.val_rational().size(); i++) {
+                offset += write_buffer_4(&dataBuf[offset], entry.val_rational().at(i).numerator);
+                offset += write_buffer_4(&dataBuf[offset], entry.val_rational().at(i).denominator);
+            }
+            *dataOffset += offset;
+            break;
+        case ENTRY_FORMAT_SRATIONAL:
+            for (unsigned long i=0; i<entry.val_srational().size(); i++) {
+                offset += write_buffer_4(&dataBuf[offset], (u_int32_t) entry.val_srational().at(i).numerator);
+                offset += write_buffer_4(&dataBuf[offset], (u_int32_t) entry.val_srational().at(i).denominator);
+            }
+            *dataOffset += offset;
+            break;
+        default:
+            ERROR("Unsupported format %d",entry.format());
+            return 0;
+    }
+    return dataAddr;
+}
+
+/**
+ * Write the given entry to the buffer in big endian format
+ *      Each directory entry is composed of:
+ *          2 bytes: tag number (data field)
+ *          2 bytes: data format
+ *          4 bytes: number of components
+ *          4 bytes: data value or offset to data value
+ * @param buf           Starting address of the EXIF buffer
+ * @param entry_offset  Offset to write entry
+ * @param entry         Entry to write
+ * @param dataOffset    Offset for data buffer to write values
+ */
+void write_entry(unsigned char *buf, u_int32_t entry_offset, const exif::IFEntry &entry, u_int32_t *dataOffset) {
+    unsigned char *entryBuf = &buf[entry_offset];
+    write_buffer_2(entryBuf, entry.tag());
+    write_buffer_2(&entryBuf[2], entry.format());
+    write_buffer_4(&entryBuf[4], entry.length());
+    u_int32_t val = get_val(entry, buf, dataOffset);
+    write_buffer_4(&entryBuf[8], val);
+    //LOGD("Writing entry %x format %d length %d val %x",entry.tag(),entry.format(),entry.length(),val);
+}
+
+/**
+ * Check whether the out of line value of an entry is still stored unchanged at its original offset.  Only
+ * byte values are compared since they don't depend on the byte order, this covers MakerNote and other blobs.
+ * @param entry         Entry to check
+ * @param original      Original TIFF data
+ * @param original_len  Length of the original TIFF data
+ * @return True if the value can be left where it is
+ */
+bool isValueUnchanged(const exif::IFEntry &entry, const unsigned char *original, unsigned long original_len) {
+    unsigned long size = (unsigned long)exif::formatSize(entry.format()) * entry.length();
+    if (size <= 4 || entry.data() > original_len || size > original_len - entry.data()) return false;
+    const unsigned char *value = &original[entry.data()];
+    switch (entry.format()) {
+        case ENTRY_FORMAT_BYTE:
+        case ENTRY_FORMAT_UNDEFINED:
+            return entry.val_byte().size() == size && memcmp(entry.val_byte().data(), value, size) == 0;
+        case ENTRY_FORMAT_ASCII: {
+            const std::string &str = entry.val_string();
+            if (str.length() > size || memcmp(str.data(), value, str.length()) != 0) return false;
+            for (unsigned long i = str.length(); i < size; i++) {
+                if (value[i] != 0) return false;
+            }
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+/**
+ * Write given list of IFD entries to the buffer with any data values following the entry data.  Data is written in big endian format.
+ * @param entries   List of entries to write
+ * @param buf       Starting location of the EXIF buffer
+ * @param offset    Starting offset relative to buffer
+ * @param link_offset Offset to write link data.  Default is to not link another directory.
+ * @param original  Original TIFF data for values that haven't changed to stay in place, or NULL
+ * @param original_len Length of the original TIFF data
+ * @return  Ending offset of group of entries including the entry data
+ */
+unsigned long write_ifd_entries(std::vector<exif::IFEntry> *entries, unsigned char *buf, unsigned long offset, unsigned long *link_offset,
+                                const unsigned char *original = NULL, unsigned long original_len = 0) {
+    offset += write_buffer_2(&buf[offset], (uint16_t) entries->size());
+    u_int32_t dataOffset = (u_int32_t) (offset + entries->size() * ENTRY_SIZE + 4); // End of fixed section.  4 bytes for next IFD
+
+    for (unsigned long i = 0; i < entries->size(); i++) {
+        const exif::IFEntry &entry = entries->at(i);
+        if (original != NULL && isValueUnchanged(entry, original, original_len)) {
+            // Point at the original copy of the value instead of writing it again
+            write_buffer_2(&buf[offset], entry.tag());
+            write_buffer_2(&buf[offset + 2], entry.format());
+            write_buffer_4(&buf[offset + 4], entry.length());
+            write_buffer_4(&buf[offset + 8], entry.data());
+        } else {
+            write_entry(buf, (u_int32_t) offset, entry, &dataOffset);
+        }
+        offset += ENTRY_SIZE;
+    }
+    *link_offset = offset;
+    write_buffer_4(&buf[*link_offset],0); // Don't link the next IFD directory yet
+
+    return dataOffset;
+}
+
+/**
+ * Write the given App Marker to the buffer.  Data is written in big endian format.
+ * @param buff      Buffer location to write the AppMarker data
+ * @param marker    The AppMarker data
+ * @return The offset after writing the AppMarker
+ */
+unsigned long write_app_marker(unsigned char* buff,exif::AppMarker *marker) {
+    unsigned long offset = 0;
+    offset += write_buffer_2(buff,marker->type);
+    offset += write_buffer_2(&buff[offset],(uint16_t)marker->length);
+    unsigned long bufLen = (unsigned long)marker->length-2; // Remove bytes to store length
+    memcpy(&buff[offset],marker->buffer,bufLen);
+    LOGD("Wrote %x %x %x %x %x %x",buff[0],buff[1],buff[2],buff[3],buff[4],buff[5]);
+    offset += bufLen;
+    return offset;
+}
+
+/**
+ * Set a single LONG value entry in the list, replacing any existing entry with the same tag
+ * @param entries   List of entries to update
+ * @param tag       Tag of the entry
+ * @param val       Value to store
+ * @param dir       Directory of the tag
+ */
+void setLongEntry(std::vector<exif::IFEntry> *entries, uint16_t tag, uint32_t val, uint8_t dir = IFD0_DIRECTORY) {
+    exif::IFEntry entry(tag, dir, (int)val);
+    for (unsigned long i = 0; i < entries->size(); i++) {
+        if (entries->at(i).tag() == tag) {
+            entries->at(i) = entry;
+            return;
+        }
+    }
+    entries->push_back(entry);
+}
+
+/**
+ * Generate the EXIF header buffer starting from the "Exif" string. The data is written in big endian format.
+ * Note that we aren't putting the IFD's in the suggested order (IFD0, EXIF, GPS, INTEROP, IFD1) since it is
+ * easier to put them in order where we know the pointers (INTEROP, EXIF, GPS, 10, IFD0, IFD1)
+ * @param buf           Buffer to place header (starts at EXIF_START (6))
+ * @return The offset after the segment was written
+ */
+unsigned long exif::EXIFInfo::encodeEXIFsegment(unsigned char *buf) {
 
     //   2 bytes: 0xFFD8 (big-endian)
     // EXIF header
@@ -979,231 +3839,2701 @@ uint16_t exif::EXIFInfo::encodeEXIFsegment(unsigned char *buf) {
     //   4 bytes: Offset to first IFD
     //  16 bytes: TOTAL
 
-    unsigned long offset = 0;
-    buf[offset++] = (unsigned char) 'E';
-    buf[offset++] = (unsigned char) 'x';
-    buf[offset++] = (unsigned char) 'i';
-    buf[offset++] = (unsigned char) 'f';
-    offset += write_buffer_2(&buf[offset], 0);
-    buf[offset++] = (unsigned char) 'M';
-    buf[offset++] = (unsigned char) 'M';
-    offset += write_buffer_2(&buf[offset], 0x002A);
-    unsigned long first_ifd_offset = offset;
-    offset += write_buffer_4(&buf[offset], 0); // Leave space for first IFD offset
+    // Keep the original segment and only rebuild the directories which changed
+    if (exifMarker_ != NULL && exifMarker_->length >= 2 + EXIF_START + 8 &&
+        isTIFFHeader(exifMarker_->buffer + EXIF_START, exifMarker_->length - 2 - EXIF_START)) {
+        unsigned long end = encodeIncremental(buf);
+        if (end != 0) return end;
+        LOGD("Rebuilding the EXIF segment since it doesn't fit in one segment any more");
+    }
+    uint32_t dirty = dirty_; // The temporary offset entries below don't change anything
+
+    unsigned long offset = 0;
+    buf[offset++] = (unsigned char) 'E';
+    buf[offset++] = (unsigned char) 'x';
+    buf[offset++] = (unsigned char) 'i';
+    buf[offset++] = (unsigned char) 'f';
+    offset += write_buffer_2(&buf[offset], 0);
+    buf[offset++] = (unsigned char) 'M';
+    buf[offset++] = (unsigned char) 'M';
+    offset += write_buffer_2(&buf[offset], 0x002A);
+    unsigned long first_ifd_offset = offset;
+    offset += write_buffer_4(&buf[offset], 0); // Leave space for first IFD offset
+
+    // Sort entries in case new entries were added
+    for (unsigned long i=0; i<IFDirectories.size(); i++) {
+        std::sort(IFDirectories.at(i)->entries->begin(), IFDirectories.at(i)->entries->end(), tagComparator);
+    }
+
+    IFDirectory *IFD0 = getDirectory(IFD0_DIRECTORY);
+    if (IFD0 == NULL) return offset;
+
+    unsigned long end_ifd = offset;
+    unsigned long link_offset;
+
+    // Keep track of any offset entries we add for encoding purposes and then remove them.
+    std::vector<exif::TagId> tmpEntries;
+
+    // Put Interop IFD First
+    IFDirectory *InteropIFD = getDirectory(INTEROP_IFD_DIRECTORY);
+    if (InteropIFD ->entries->size() > 0){
+        unsigned long ifd_offset = end_ifd;
+        end_ifd = write_ifd_entries(InteropIFD->entries, buf, ifd_offset, &link_offset);
+
+        LOGD("Wrote %d Interop entries",(int)InteropIFD->entries->size());
+        // Add pointer to Interop IFD in Sub IFD directory
+        IFEntry ifd_entry(EXIF_TAG_INTEROP_OFFSET, EXIF_IFD_DIRECTORY,  (int)ifd_offset - EXIF_START);
+        updateEntry(&ifd_entry);
+        tmpEntries.push_back(TagId{EXIF_TAG_INTEROP_OFFSET, EXIF_IFD_DIRECTORY});
+    }
+
+    // Put EXIF IFD next
+    IFDirectory *ExifIFD = getDirectory(EXIF_IFD_DIRECTORY);
+    if (ExifIFD->entries->size() > 0) {
+        unsigned long exif_ifd_offset = end_ifd;
+        end_ifd = write_ifd_entries(ExifIFD->entries, buf, exif_ifd_offset, &link_offset);
+
+        LOGD("Wrote %d Exif entries",(int)ExifIFD->entries->size());
+        // Add pointer to EXIF IFD in main IFD0 entry
+        IFEntry exif_ifd_entry(EXIF_TAG_EXIF_IFD_OFFSET, IFD0_DIRECTORY, (int)exif_ifd_offset - EXIF_START);
+        updateEntry(&exif_ifd_entry);
+        tmpEntries.push_back(TagId{EXIF_TAG_EXIF_IFD_OFFSET, IFD0_DIRECTORY});
+    }
+
+    // Put GPS IFD next
+    IFDirectory *GPSIFD = getDirectory(GPS_IFD_DIRECTORY);
+    if (GPSIFD ->entries->size() > 0){
+        LOGD("Encoding %d GPS entries",(int)GPSIFD->entries->size());
+        unsigned long gps_ifd_offset = end_ifd;
+        end_ifd = write_ifd_entries(GPSIFD->entries, buf, gps_ifd_offset, &link_offset);
+
+        LOGD("Wrote %d GPS entries",(int)GPSIFD->entries->size());
+        // Add pointer to GPSIFD in main IFD entry
+        IFEntry gps_ifd_entry(EXIF_TAG_GPS_IFD_OFFSET, IFD0_DIRECTORY,  (int)gps_ifd_offset - EXIF_START);
+        updateEntry(&gps_ifd_entry);
+        tmpEntries.push_back(TagId{EXIF_TAG_GPS_IFD_OFFSET, IFD0_DIRECTORY});
+    }
+
+    // Put 10 IFD next
+    IFDirectory *IFD = getDirectory(EXIF_10_DIRECTORY);
+    if (IFD->entries->size() > 0) {
+        unsigned long ten_ifd_offset = end_ifd;
+
+        // Add 10 version to the 10 directory
+        IFEntry version_entry(EXIF_10_VERSION, EXIF_10_DIRECTORY, CURR_10_VERSION);
+        updateEntry(&version_entry);
+
+        end_ifd = write_ifd_entries(IFD->entries, buf, end_ifd, &link_offset);
+
+        LOGD("Wrote %d 10 entries",(int)IFD->entries->size());
+
+        // Add pointer to 10 IFD in main IFD entry
+        IFEntry ifd_entry(EXIF_TAG_10_IFD_OFFSET, IFD0_DIRECTORY,  (int)ten_ifd_offset - EXIF_START);
+        updateEntry(&ifd_entry);
+        tmpEntries.push_back(TagId{EXIF_TAG_10_IFD_OFFSET, IFD0_DIRECTORY});
+    }
+
+    // Put the thumbnail data next and point IFD1 at it
+    IFDirectory *IFD1 = getDirectory(IFD1_DIRECTORY);
+    if (IFD1->entries->size() > 0 && thumbnail_.size > 0) {
+        memcpy(&buf[end_ifd], thumbnail_.data, thumbnail_.size);
+        setLongEntry(IFD1->entries, EXIF_TAG_JPEG_SOI_OFFSET, (uint32_t)(end_ifd - EXIF_START));
+        setLongEntry(IFD1->entries, EXIF_TAG_JPEG_DATA_BYTES, (uint32_t)thumbnail_.size);
+        std::sort(IFD1->entries->begin(), IFD1->entries->end(), tagComparator);
+        end_ifd += thumbnail_.size;
+        LOGD("Wrote %lu bytes of thumbnail data",thumbnail_.size);
+    }
+
+    // Put IFD1 (Thumbnail) next
+    unsigned long ifd1_offset = end_ifd;
+    if (IFD1 ->entries->size() > 0){
+        end_ifd = write_ifd_entries(IFD1->entries, buf, ifd1_offset, &link_offset);
+        LOGD("Wrote %d IFD1 entries starting at %x ",(int)IFD1->entries->size(),(unsigned int)ifd1_offset);
+    }
+
+    // Place first ifd after the final ifd data
+    write_buffer_4(&buf[first_ifd_offset], (u_int32_t) end_ifd - EXIF_START);
+    unsigned long end_ifd0 = write_ifd_entries(IFD0->entries, buf, end_ifd, &link_offset);
+    if (IFD1 ->entries->size() > 0) {
+        write_buffer_4(&buf[link_offset],
+                       (u_int32_t) ifd1_offset - EXIF_START); // Link IFD1 if we have that directory
+        LOGD("Added link to IFD1 at %x", (unsigned int) ifd1_offset - EXIF_START);
+    }
+    // Now that we are done writing the encoded buffer, remove all of the temporary offset entries
+    for (unsigned long i=0; i<tmpEntries.size(); i++) {
+        removeEntry(tmpEntries.at(i).tag,tmpEntries.at(i).directory);
+    }
+    dirty_ = dirty;
+
+    return end_ifd0;
+}
+
+/**
+ * Compute an approximate size for the header buffer
+ * @param exifInfo EXIFInfo to compute size for
+ * @return approximate size of buffer
+ */
+unsigned long getApproxSize(exif::EXIFInfo *exifInfo) {
+    unsigned long size = 0xFF; // Add Some padding
+    for (unsigned long i = 0; i < exifInfo->IFDirectories.size(); i++) {
+        size += exifInfo->IFDirectories.at(i)->entries->size()*ENTRY_SIZE + 4;
+        for (unsigned long j=0; j<exifInfo->IFDirectories.at(i)->entries->size(); j++) {
+            exif::IFEntry &entry = exifInfo->IFDirectories.at(i)->entries->at(j);
+            size += (unsigned long)exif::formatSize(entry.format()) * entry.length();
+        }
+    }
+    for (unsigned long i = 0; i < exifInfo->AppMarkers.size(); i++) {
+        size += exifInfo->AppMarkers.at(i)->length+4;
+    }
+    size += exifInfo->thumbnail().size;
+    size += (size / (JPEG_SEGMENT_MAX - 2 - EXIF_START) + 1) * (4 + EXIF_START); // Extended EXIF segment headers
+    return size;
+}
+
+/**
+ * Write the JPEG SOI followed by the EXIF segment and the other App markers
+ * @param buf           Output buffer allocated with malloc, NULL on failure
+ * @param len           Output length of the buffer
+ * @param extendedExif  True to allow Extended EXIF segments
+ * @return False if the EXIF data doesn't fit in one segment and extendedExif is false
+ */
+bool exif::EXIFInfo::encodeJPEGHeader(unsigned char **buf, unsigned long *len, bool extendedExif) {
+
+    unsigned long init_size = getApproxSize(this);
+    if (exifMarker_ != NULL) {
+        // encodeIncremental keeps the unchanged data, and rebuilt directories may copy filtered tags from it
+        init_size += exifMarker_->length * (tagFilter_.empty() ? 1 : 2);
+    }
+    LOGD("Initial size is %lu",init_size);
+    unsigned char *tmp = (unsigned char *) malloc((size_t) init_size);
+
+    //   2 bytes: 0xFFD8 (big-endian)
+    // EXIF header
+    //   2 bytes: 0xFFE1 (big-endian)
+    //   2 bytes: section size
+
+    unsigned long offset = 0;
+    offset += write_buffer_2(&tmp[offset], JPEG_SOI);
+
+    // EXIF header (APP1 Marker)
+    offset += write_buffer_2(&tmp[offset], EXIF_MARKER);
+    unsigned long size_offset = offset;
+    offset +=2; // skip size
+    LOGD("Exif segment start %x",(int)offset);
+    unsigned long exif_size = encodeEXIFsegment(&tmp[offset]);
+    LOGD("Exif data length to write %lx",exif_size);
+    if (exif_size > JPEG_SEGMENT_MAX - 2 && !extendedExif) {
+        ERROR("EXIF data of %lu bytes doesn't fit in one segment", exif_size);
+        free(tmp);
+        *buf = NULL;
+        *len = 0;
+        return false;
+    }
+
+    // Extended EXIF: split data which doesn't fit in one segment over APP1 segments each starting with
+    // "Exif\0\0".  The continuations are moved into place starting from the last one so nothing is overwritten.
+    const unsigned long first_len = JPEG_SEGMENT_MAX - 2;
+    const unsigned long next_len = JPEG_SEGMENT_MAX - 2 - EXIF_START;
+    unsigned long segments = exif_size <= first_len ? 1 : 2 + (exif_size - first_len - 1) / next_len;
+    for (unsigned long i = segments - 1; i > 0; i--) {
+        unsigned long src = first_len + (i - 1) * next_len;
+        unsigned long seg_len = std::min(next_len, exif_size - src);
+        unsigned char *seg = &tmp[offset + src + (i - 1) * (4 + EXIF_START)];
+        memmove(&seg[4 + EXIF_START], &tmp[offset + src], seg_len);
+        write_buffer_2(seg, EXIF_MARKER);
+        write_buffer_2(&seg[2], (uint16_t)(seg_len + 2 + EXIF_START));
+        memcpy(&seg[4], "Exif\0\0", EXIF_START);
+    }
+    write_buffer_2(&tmp[size_offset], (uint16_t)(std::min(exif_size, first_len) + 2));
+    offset += exif_size + (segments - 1) * (4 + EXIF_START);
+    //Encode other segments
+    for (unsigned long i=0; i<AppMarkers.size(); i++) {
+        LOGD("Start marker 0x%x at 0x%x",AppMarkers.at(i)->type,(int)offset);
+        offset += write_app_marker(&tmp[offset],AppMarkers.at(i));
+    }
+    LOGD("Total header len %lu",offset);
+    *len = offset;
+    *buf = (unsigned char *)realloc(tmp, *len);
+    return true;
+}
+
+/**
+ * Find an entry in one IFD of encoded TIFF data
+ * @param tiff              TIFF data
+ * @param len               Length of the TIFF data
+ * @param ifd               Offset of the IFD
+ * @param isLittleEndian    Byte order of the TIFF data
+ * @param tag               Tag to find
+ * @param entry             Output offset of the 12 byte entry
+ * @return True if the tag was found
+ */
+bool findEncodedEntry(const unsigned char *tiff, unsigned long len, unsigned long ifd, bool isLittleEndian,
+                      uint16_t tag, unsigned long *entry) {
+    if (ifd == 0 || ifd + 2 > len) return false;
+    unsigned long num_entries = exif::parse_value<uint16_t>(&tiff[ifd], isLittleEndian);
+    if (ifd + 2 + num_entries * ENTRY_SIZE + 4 > len) return false;
+    for (unsigned long i = 0; i < num_entries; i++) {
+        unsigned long offset = ifd + 2 + i * ENTRY_SIZE;
+        if (exif::parse_value<uint16_t>(&tiff[offset], isLittleEndian) == tag) {
+            *entry = offset;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Find the offset of a directory in encoded TIFF data by following the links from IFD0
+ * @param tiff              TIFF data
+ * @param len               Length of the TIFF data
+ * @param isLittleEndian    Byte order of the TIFF data
+ * @param dir               Directory to find
+ * @return Offset of the IFD or 0 if it isn't linked
+ */
+unsigned long findEncodedIFD(const unsigned char *tiff, unsigned long len, bool isLittleEndian, uint8_t dir) {
+    unsigned long ifd0 = exif::parse_value<uint32_t>(&tiff[4], isLittleEndian);
+    unsigned long entry;
+    uint16_t tag;
+    switch (dir) {
+        case IFD0_DIRECTORY:
+            return ifd0;
+        case IFD1_DIRECTORY:
+            if (ifd0 + 2 > len) return 0;
+            entry = ifd0 + 2 + (unsigned long)exif::parse_value<uint16_t>(&tiff[ifd0], isLittleEndian) * ENTRY_SIZE;
+            return entry + 4 <= len ? exif::parse_value<uint32_t>(&tiff[entry], isLittleEndian) : 0;
+        case INTEROP_IFD_DIRECTORY:
+            if (!findEncodedEntry(tiff, len, findEncodedIFD(tiff, len, isLittleEndian, EXIF_IFD_DIRECTORY),
+                                  isLittleEndian, EXIF_TAG_INTEROP_OFFSET, &entry)) return 0;
+            return exif::parse_value<uint32_t>(&tiff[entry + 8], isLittleEndian);
+        case EXIF_IFD_DIRECTORY: tag = EXIF_TAG_EXIF_IFD_OFFSET; break;
+        case GPS_IFD_DIRECTORY: tag = EXIF_TAG_GPS_IFD_OFFSET; break;
+        case EXIF_10_DIRECTORY: tag = EXIF_TAG_10_IFD_OFFSET; break;
+        default: return 0;
+    }
+    if (!findEncodedEntry(tiff, len, ifd0, isLittleEndian, tag, &entry)) return 0;
+    return exif::parse_value<uint32_t>(&tiff[entry + 8], isLittleEndian);
+}
+
+/**
+ * Encode the header of an EXIFInfo and find where the values of the given tags are stored
+ * @param info      EXIF data to encode, every tag in fields must be set
+ * @param fields    Tags whose values will be changed per frame
+ * @return False if a tag is missing or the header needs Extended EXIF segments
+ */
+bool exif::EncodeTemplate::compile(EXIFInfo &info, const std::vector<TagId> &fields) {
+    fields_.clear();
+    buffer_.clear();
+    unsigned char *buf;
+    unsigned long len;
+    if (!info.encodeJPEGHeader(&buf, &len)) return false;
+    buffer_.assign(buf, buf + len);
+    free(buf);
+
+    // SOI, APP1 marker and length, "Exif\0\0"
+    const unsigned long tiff_start = 6 + EXIF_START;
+    unsigned long segment_len = parse_value<uint16_t>(&buffer_[4], false);
+    const unsigned char *tiff = &buffer_[tiff_start];
+    unsigned long tiff_len = segment_len - 2 - EXIF_START;
+    bool isLittleEndian = tiff[0] == 'I';
+
+    for (unsigned long i = 0; i < fields.size(); i++) {
+        Field field;
+        unsigned long entry;
+        field.tag = fields.at(i).tag;
+        field.directory = fields.at(i).directory;
+        if (!findEncodedEntry(tiff, tiff_len, findEncodedIFD(tiff, tiff_len, isLittleEndian, field.directory),
+                              isLittleEndian, field.tag, &entry)) {
+            ERROR("Template tag %x not found in directory %d", field.tag, field.directory);
+            fields_.clear();
+            buffer_.clear();
+            return false;
+        }
+        field.format = parse_value<uint16_t>(&tiff[entry + 2], isLittleEndian);
+        field.count = parse_value<uint32_t>(&tiff[entry + 4], isLittleEndian);
+        unsigned long size = (unsigned long)formatSize(field.format) * field.count;
+        unsigned long offset = size <= 4 ? entry + 8 : parse_value<uint32_t>(&tiff[entry + 8], isLittleEndian);
+        if (offset + size > tiff_len) {
+            ERROR("Template tag %x value out of range", field.tag);
+            fields_.clear();
+            buffer_.clear();
+            return false;
+        }
+        field.offset = tiff_start + offset;
+        fields_.push_back(field);
+    }
+    return true;
+}
+
+/**
+ * Get the index of a compiled field
+ * @param tag   Tag id
+ * @param dir   Directory of the tag
+ * @return Index for the set functions or -1 if the tag wasn't compiled
+ */
+int exif::EncodeTemplate::field(uint16_t tag, uint8_t dir) const {
+    for (unsigned long i = 0; i < fields_.size(); i++) {
+        if (fields_.at(i).tag == tag && fields_.at(i).directory == dir) return (int)i;
+    }
+    return -1;
+}
+
+/**
+ * Get the location of a value of a field
+ * @param field     Index of the field
+ * @param index     Index of the value within the field
+ * @param format    Expected format of the field
+ * @param size      Size of one value
+ * @return Location of the value in the header or NULL if the field doesn't match
+ */
+unsigned char *exif::EncodeTemplate::value(int field, unsigned index, uint16_t format, unsigned long size) {
+    if (field < 0 || (unsigned long)field >= fields_.size()) return NULL;
+    const Field &f = fields_[field];
+    if (f.format != format || index >= f.count) return NULL;
+    return &buffer_[f.offset + index * size];
+}
+
+bool exif::EncodeTemplate::setShort(int field, unsigned index, uint16_t value) {
+    unsigned char *buf = this->value(field, index, ENTRY_FORMAT_SHORT, 2);
+    if (buf == NULL) return false;
+    write_buffer_2(buf, value);
+    return true;
+}
+
+bool exif::EncodeTemplate::setLong(int field, unsigned index, uint32_t value) {
+    unsigned char *buf = this->value(field, index, ENTRY_FORMAT_LONG, 4);
+    if (buf == NULL) return false;
+    write_buffer_4(buf, value);
+    return true;
+}
+
+bool exif::EncodeTemplate::setRational(int field, unsigned index, Rational value) {
+    unsigned char *buf = this->value(field, index, ENTRY_FORMAT_RATIONAL, 8);
+    if (buf == NULL) return false;
+    write_buffer_4(buf, value.numerator);
+    write_buffer_4(&buf[4], value.denominator);
+    return true;
+}
+
+bool exif::EncodeTemplate::setSRational(int field, unsigned index, SRational value) {
+    unsigned char *buf = this->value(field, index, ENTRY_FORMAT_SRATIONAL, 8);
+    if (buf == NULL) return false;
+    write_buffer_4(buf, (uint32_t)value.numerator);
+    write_buffer_4(&buf[4], (uint32_t)value.denominator);
+    return true;
+}
+
+bool exif::EncodeTemplate::setString(int field, const char *value) {
+    unsigned char *buf = this->value(field, 0, ENTRY_FORMAT_ASCII, 1);
+    if (buf == NULL) return false;
+    // Keep the last byte as the terminating \0
+    unsigned long count = fields_[field].count;
+    unsigned long i = 0;
+    for (; i + 1 < count && value[i] != 0; i++) buf[i] = (unsigned char)value[i];
+    memset(&buf[i], 0, count - i);
+    return true;
+}
+
+/**
+ * Write 4 bytes in the given byte order
+ * @param buf               Buffer location to write data
+ * @param val               32 bit value to write
+ * @param isLittleEndian    Byte order to write
+ */
+void write_ordered_4(unsigned char *buf, uint32_t val, bool isLittleEndian) {
+    write_buffer_4(buf, val);
+    if (isLittleEndian) std::reverse(buf, buf + 4);
+}
+
+/**
+ * Convert an IFD written by write_ifd_entries from big endian to little endian, including its out of line values
+ * @param tiff  TIFF data
+ * @param len   Length of the TIFF data
+ * @param ifd   Offset of the IFD
+ */
+void swap_ifd_byte_order(unsigned char *tiff, unsigned long len, unsigned long ifd) {
+    unsigned long num_entries = exif::parse_value<uint16_t>(&tiff[ifd], false);
+    std::reverse(&tiff[ifd], &tiff[ifd + 2]);
+    for (unsigned long i = 0; i < num_entries; i++) {
+        unsigned char *entry = &tiff[ifd + 2 + i * ENTRY_SIZE];
+        uint16_t format = exif::parse_value<uint16_t>(entry + 2, false);
+        unsigned long size = (unsigned long)exif::formatSize(format) * exif::parse_value<uint32_t>(entry + 4, false);
+        unsigned char *value = entry + 8;
+        if (size > 4) {
+            unsigned long offset = exif::parse_value<uint32_t>(entry + 8, false);
+            if (offset > len || size > len - offset) size = 0;
+            value = &tiff[offset];
+            std::reverse(entry + 8, entry + 12);
+        } else {
+            size = 4; // Padding is 0 so swapping it is harmless
+        }
+        std::reverse(entry, entry + 2);
+        std::reverse(entry + 2, entry + 4);
+        std::reverse(entry + 4, entry + 8);
+
+        unsigned long unit = format == ENTRY_FORMAT_SHORT ? 2 :
+                             format == ENTRY_FORMAT_LONG || format == ENTRY_FORMAT_RATIONAL ||
+                             format == ENTRY_FORMAT_SRATIONAL ? 4 : 1;
+        for (unsigned long j = 0; unit > 1 && j + unit <= size; j += unit) {
+            std::reverse(&value[j], &value[j + unit]);
+        }
+    }
+    unsigned char *link = &tiff[ifd + 2 + num_entries * ENTRY_SIZE];
+    std::reverse(link, link + 4);
+}
+
+typedef std::vector<std::pair<unsigned long, unsigned long> > ByteRanges;  // [start, end) offsets
+
+/**
+ * Add the entry table and the out of line values of an encoded IFD to a list of byte ranges
+ * @param tiff              TIFF data
+ * @param len               Length of the TIFF data
+ * @param ifd               Offset of the IFD, 0 if there is none
+ * @param isLittleEndian    Byte order of the TIFF data
+ * @param ranges            List the ranges are added to
+ */
+void addEncodedIFDRanges(const unsigned char *tiff, unsigned long len, unsigned long ifd, bool isLittleEndian,
+                         ByteRanges *ranges) {
+    if (ifd == 0 || ifd + 2 > len) return;
+    unsigned long num_entries = exif::parse_value<uint16_t>(&tiff[ifd], isLittleEndian);
+    if (ifd + 2 + num_entries * ENTRY_SIZE + 4 > len) return;
+    ranges->push_back(std::make_pair(ifd, ifd + 2 + num_entries * ENTRY_SIZE + 4));
+    for (unsigned long i = 0; i < num_entries; i++) {
+        const unsigned char *entry = &tiff[ifd + 2 + i * ENTRY_SIZE];
+        unsigned long size = (unsigned long)exif::formatSize(exif::parse_value<uint16_t>(entry + 2, isLittleEndian)) *
+                             exif::parse_value<uint32_t>(entry + 4, isLittleEndian);
+        unsigned long offset = exif::parse_value<uint32_t>(entry + 8, isLittleEndian);
+        if (size > 4 && offset <= len && size <= len - offset) ranges->push_back(std::make_pair(offset, offset + size));
+    }
+}
+
+/**
+ * Sort byte ranges and merge the ones which overlap or touch
+ * @param ranges    Ranges to merge
+ */
+void mergeRanges(ByteRanges *ranges) {
+    std::sort(ranges->begin(), ranges->end());
+    unsigned long n = 0;
+    for (unsigned long i = 0; i < ranges->size(); i++) {
+        if (n > 0 && ranges->at(i).first <= ranges->at(n - 1).second) {
+            ranges->at(n - 1).second = std::max(ranges->at(n - 1).second, ranges->at(i).second);
+        } else {
+            ranges->at(n++) = ranges->at(i);
+        }
+    }
+    ranges->resize(n);
+}
+
+/**
+ * Remove the bytes of some ranges from a list of ranges
+ * @param ranges    Merged ranges to cut
+ * @param remove    Merged ranges to remove
+ */
+void subtractRanges(ByteRanges *ranges, const ByteRanges &remove) {
+    ByteRanges result;
+    for (unsigned long i = 0; i < ranges->size(); i++) {
+        unsigned long start = ranges->at(i).first, end = ranges->at(i).second;
+        for (unsigned long j = 0; j < remove.size() && start < end; j++) {
+            if (remove[j].second <= start || remove[j].first >= end) continue;
+            if (remove[j].first > start) result.push_back(std::make_pair(start, remove[j].first));
+            start = remove[j].second;
+        }
+        if (start < end) result.push_back(std::make_pair(start, end));
+    }
+    ranges->swap(result);
+}
+
+/**
+ * Take space for a directory out of a list of free ranges.  The space starts on a word boundary.
+ * @param free      Merged free ranges
+ * @param size      Bytes needed
+ * @param offset    Output start of the space
+ * @return False if no range is large enough
+ */
+bool allocateRange(ByteRanges *free, unsigned long size, unsigned long *offset) {
+    for (unsigned long i = 0; i < free->size(); i++) {
+        unsigned long start = (free->at(i).first + 1) & ~1UL;
+        if (start + size > free->at(i).second) continue;
+        *offset = start;
+        free->at(i).first = start + size;
+        if (free->at(i).first == free->at(i).second) free->erase(free->begin() + i);
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Drop the free ranges at the end of the data
+ * @param free  Merged free ranges
+ * @param end   End of the data, moved back over the dropped ranges
+ */
+void trimFreeRanges(ByteRanges *free, unsigned long *end) {
+    while (!free->empty() && free->back().second == *end) {
+        *end = free->back().first;
+        free->pop_back();
+    }
+}
+
+/**
+ * Encode the EXIF segment by copying the segment that was read and appending the directories which changed.
+ * Unchanged directories, MakerNote data and everything else the library doesn't understand keep their offsets.
+ * The links to rebuilt directories are patched in place, or the parent directory is rebuilt as well when it
+ * has no link to patch.  Rebuilt directories point at their original values where those haven't changed.
+ * The old table and replaced values of a rebuilt directory are reused for rebuilt directories before anything
+ * is appended, and dead space at the end is dropped, so editing and saving the same file over and over doesn't
+ * grow the segment.  Tags removed by the tag filter are copied from the original directory.
+ * @param buf   Buffer to place the segment (starts with "Exif\0\0")
+ * @return The offset after the segment was written, or 0 if it doesn't fit in one JPEG segment
+ */
+unsigned long exif::EXIFInfo::encodeIncremental(unsigned char *buf) {
+    unsigned long len = (unsigned long)exifMarker_->length - 2;
+    memcpy(buf, exifMarker_->buffer, len);
+    unsigned char *tiff = &buf[EXIF_START];
+    const unsigned long tiff_len = len - EXIF_START;
+    const unsigned char *original = exifMarker_->buffer + EXIF_START;
+    bool isLittleEndian = tiff[0] == 'I';
+    unsigned long end = len;
+
+    // Children come before their parents so the parents know where the children went
+    static const uint8_t order[] = {INTEROP_IFD_DIRECTORY, EXIF_IFD_DIRECTORY, GPS_IFD_DIRECTORY, EXIF_10_DIRECTORY,
+                                    IFD1_DIRECTORY, IFD0_DIRECTORY};
+    unsigned long offsets[EXIF_10_DIRECTORY + 1] = {0};
+    unsigned long newOffsets[EXIF_10_DIRECTORY + 1] = {0};
+    for (unsigned i = 0; i < sizeof(order); i++) {
+        offsets[order[i]] = findEncodedIFD(original, tiff_len, isLittleEndian, order[i]);
+    }
+
+    // Space of the old data of rebuilt directories, which nothing else uses
+    ByteRanges free;
+    ByteRanges used;
+    used.push_back(std::make_pair(0UL, 8UL));
+    if (thumbnail_.data >= original && thumbnail_.data + thumbnail_.size <= original + tiff_len) {
+        used.push_back(std::make_pair((unsigned long)(thumbnail_.data - original),
+                                      (unsigned long)(thumbnail_.data - original) + thumbnail_.size));
+    }
+
+    uint32_t dirty = dirty_;
+    if (offsets[IFD0_DIRECTORY] + 2 > tiff_len ||
+        offsets[IFD0_DIRECTORY] + 6 + parse_value<uint16_t>(&original[offsets[IFD0_DIRECTORY]], isLittleEndian) *
+        ENTRY_SIZE > tiff_len) {
+        dirty |= 1U << IFD0_DIRECTORY;
+    }
+    for (unsigned i = 0; i < sizeof(order); i++) {
+        uint8_t dir = order[i];
+        const IFDirectory *directory = findDirectory(dir);
+        static const std::vector<exif::IFEntry> none;
+        const std::vector<exif::IFEntry> *entries = directory != NULL ? directory->entries : &none;
+        // Tags removed by the filter were never decoded, take them from the original directory.  IFD1 uses the
+        // IFD0 tags like decodeTIFF does.
+        std::vector<exif::IFEntry> filtered;
+        if (!tagFilter_.empty() && offsets[dir] != 0) {
+            uint8_t filterDir = dir == IFD1_DIRECTORY ? (uint8_t)IFD0_DIRECTORY : dir;
+            std::vector<uint32_t> filter;
+            filter.swap(tagFilter_);
+            MemorySource src(original, tiff_len);
+            readIFD(src, offsets[dir], isLittleEndian, dir, &filtered, NULL);
+            filter.swap(tagFilter_);
+            unsigned long n = 0;
+            for (unsigned long j = 0; j < filtered.size(); j++) {
+                if (!keepTag(filtered[j].tag(), filterDir)) std::swap(filtered[n++], filtered[j]);
+            }
+            filtered.resize(n);
+        }
+
+        // Directories which were added or removed always need their parent to be rebuilt
+        if ((offsets[dir] != 0) != (!entries->empty() || !filtered.empty())) dirty |= 1U << dir;
+        if (!(dirty & (1U << dir))) {
+            newOffsets[dir] = offsets[dir];
+            continue;
+        }
+
+        std::vector<exif::IFEntry> copy(*entries);
+        copy.insert(copy.end(), filtered.begin(), filtered.end());
+
+        // The old table and the values which are not kept are free, unless another directory uses them
+        if (offsets[dir] != 0) {
+            ByteRanges old;
+            addEncodedIFDRanges(original, tiff_len, offsets[dir], isLittleEndian, &old);
+            ByteRanges kept(used);
+            for (unsigned j = 0; j < sizeof(order); j++) {
+                if (order[j] != dir) addEncodedIFDRanges(original, tiff_len, offsets[order[j]], isLittleEndian, &kept);
+            }
+            for (unsigned long j = 0; j < copy.size(); j++) {
+                if (isValueUnchanged(copy[j], original, tiff_len)) {
+                    unsigned long size = (unsigned long)formatSize(copy[j].format()) * copy[j].length();
+                    kept.push_back(std::make_pair((unsigned long)copy[j].data(), copy[j].data() + size));
+                }
+            }
+            mergeRanges(&old);
+            mergeRanges(&kept);
+            subtractRanges(&old, kept);
+            free.insert(free.end(), old.begin(), old.end());
+            mergeRanges(&free);
+        }
+
+        if (!copy.empty()) {
+            if (dir == EXIF_IFD_DIRECTORY && newOffsets[INTEROP_IFD_DIRECTORY] != 0) {
+                setLongEntry(&copy, EXIF_TAG_INTEROP_OFFSET, (uint32_t)newOffsets[INTEROP_IFD_DIRECTORY], dir);
+            }
+            if (dir == IFD0_DIRECTORY) {
+                if (newOffsets[EXIF_IFD_DIRECTORY] != 0) {
+                    setLongEntry(&copy, EXIF_TAG_EXIF_IFD_OFFSET, (uint32_t)newOffsets[EXIF_IFD_DIRECTORY], dir);
+                }
+                if (newOffsets[GPS_IFD_DIRECTORY] != 0) {
+                    setLongEntry(&copy, EXIF_TAG_GPS_IFD_OFFSET, (uint32_t)newOffsets[GPS_IFD_DIRECTORY], dir);
+                }
+                if (newOffsets[EXIF_10_DIRECTORY] != 0) {
+                    setLongEntry(&copy, EXIF_TAG_10_IFD_OFFSET, (uint32_t)newOffsets[EXIF_10_DIRECTORY], dir);
+                }
+            }
+            if (dir == EXIF_10_DIRECTORY && findTag(EXIF_10_VERSION, dir) == NULL) {
+                copy.push_back(exif::IFEntry(EXIF_10_VERSION, EXIF_10_DIRECTORY, CURR_10_VERSION));
+            }
+            if (dir == IFD1_DIRECTORY && thumbnail_.size > 0) {
+                // A thumbnail still in the original segment stays there, a new one is appended
+                unsigned long thumb_offset;
+                if (thumbnail_.data >= original && thumbnail_.data + thumbnail_.size <= original + tiff_len) {
+                    thumb_offset = (unsigned long)(thumbnail_.data - original);
+                } else {
+                    memcpy(&buf[end], thumbnail_.data, thumbnail_.size);
+                    thumb_offset = end - EXIF_START;
+                    end += thumbnail_.size;
+                }
+                setLongEntry(&copy, EXIF_TAG_JPEG_SOI_OFFSET, (uint32_t)thumb_offset);
+                setLongEntry(&copy, EXIF_TAG_JPEG_DATA_BYTES, (uint32_t)thumbnail_.size);
+            }
+            std::sort(copy.begin(), copy.end(), tagComparator);
+
+            // Write the directory after the end to find its size, then move it into free space if it fits.
+            // IFDs start on a word boundary.
+            unsigned long tiff_end = end - EXIF_START;
+            trimFreeRanges(&free, &tiff_end);
+            end = tiff_end + EXIF_START;
+            if ((end - EXIF_START) & 1) buf[end++] = 0;
+            unsigned long ifd_offset = end;
+            unsigned long link_offset;
+            unsigned long ifd_end = write_ifd_entries(&copy, buf, ifd_offset, &link_offset, tiff, tiff_len);
+            unsigned long space;
+            if (allocateRange(&free, ifd_end - ifd_offset, &space)) {
+                ifd_offset = space + EXIF_START;
+                ifd_end = write_ifd_entries(&copy, buf, ifd_offset, &link_offset, tiff, tiff_len);
+            } else {
+                end = ifd_end;
+            }
+            if (dir == IFD0_DIRECTORY) write_buffer_4(&buf[link_offset], (uint32_t)newOffsets[IFD1_DIRECTORY]);
+            if (isLittleEndian) swap_ifd_byte_order(tiff, ifd_end - EXIF_START, ifd_offset - EXIF_START);
+            newOffsets[dir] = ifd_offset - EXIF_START;
+            LOGD("Rebuilt directory %d at %lx", dir, newOffsets[dir]);
+        }
+
+        // Patch the link in the parent, or rebuild the parent if there is nothing to patch
+        unsigned long entry;
+        uint8_t parent = dir == INTEROP_IFD_DIRECTORY ? EXIF_IFD_DIRECTORY : IFD0_DIRECTORY;
+        uint16_t tag = dir == INTEROP_IFD_DIRECTORY ? EXIF_TAG_INTEROP_OFFSET :
+                       dir == EXIF_IFD_DIRECTORY ? EXIF_TAG_EXIF_IFD_OFFSET :
+                       dir == GPS_IFD_DIRECTORY ? EXIF_TAG_GPS_IFD_OFFSET : EXIF_TAG_10_IFD_OFFSET;
+        if (dir == IFD0_DIRECTORY) {
+            write_ordered_4(&tiff[4], (uint32_t)newOffsets[dir], isLittleEndian);
+        } else if (dirty & (1U << parent)) {
+            continue;
+        } else if (dir == IFD1_DIRECTORY) {
+            unsigned long num_entries = parse_value<uint16_t>(&original[offsets[IFD0_DIRECTORY]], isLittleEndian);
+            write_ordered_4(&tiff[offsets[IFD0_DIRECTORY] + 2 + num_entries * ENTRY_SIZE],
+                            (uint32_t)newOffsets[dir], isLittleEndian);
+        } else if (newOffsets[dir] != 0 &&
+                   findEncodedEntry(original, tiff_len, offsets[parent], isLittleEndian, tag, &entry) &&
+                   parse_value<uint16_t>(&original[entry + 2], isLittleEndian) == ENTRY_FORMAT_LONG) {
+            write_ordered_4(&tiff[entry + 8], (uint32_t)newOffsets[dir], isLittleEndian);
+        } else {
+            dirty |= 1U << parent;
+        }
+    }
+
+    // Free space at the end is dropped
+    unsigned long tiff_end = end - EXIF_START;
+    trimFreeRanges(&free, &tiff_end);
+    end = tiff_end + EXIF_START;
+    return end > JPEG_SEGMENT_MAX - 2 ? 0 : end;
+}
+
+/**
+ * Return a pointer to the IFEntry with given tag, otherwise NULL if entry not found
+ * @param tag   Input tag to get
+ * @param dir   Directory tag is in
+ * @return pointer to the IFEntry found or NULL
+ */
+exif::IFEntry* exif::EXIFInfo::getTagData(uint16_t tag, uint8_t dir) {
+    IFEntry *entry = const_cast<IFEntry *>(findTag(tag, dir));
+    if (entry != NULL) markDirty(dir); // The entry may be changed through the pointer
+    return entry;
+}
+
+/**
+ * Remove the IFEntry with given tag and return the index which was removed.  If entry didn't exist return -1.
+ * @param tag   Input entry tag to remove
+ * @param dir   Directory tag is in
+ * @return index removed or -1 if nothing to remove
+ */
+int exif::EXIFInfo::removeEntry(uint16_t tag, uint8_t dir) {
+    IFDirectory *directory = getDirectory(dir);
+    if (directory == NULL) return -1;
+    std::vector<exif::IFEntry> *entries = directory->entries;
+    for (unsigned long i = 0; i < entries->size(); i++) {
+        IFEntry *entry = &entries->at(i);
+        if (entry->tag() == tag) {
+            entries->erase(entries->begin() + i);
+            markDirty(dir);
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Update the directory for the given entry.  Removes the tag if it exists and then adds it back in.
+ * @param entry     New entry data to update
+ */
+void exif::EXIFInfo::updateEntry(exif::IFEntry *entry) {
+    removeEntry(entry->tag(),entry->directory());
+
+    std::vector<exif::IFEntry> *entries = getDirectory(entry->directory())->entries;
+    entries->push_back(*entry);
+    markDirty(entry->directory());
+}
+
+/**
+ * Add or replace a tag
+ * @param entry     New entry, its format must match the TagInfo format of the tag
+ * @param dir       Directory to store the tag in, replacing the directory of the entry
+ */
+void exif::EditSet::put(const IFEntry &entry, uint8_t dir) {
+    Edit edit = {dir, false, entry};
+    // Decoded IFD1 entries carry the IFD0 directory, as their tags are described with the IFD0 ones
+    edit.entry.directory(dir == IFD1_DIRECTORY ? IFD0_DIRECTORY : dir);
+    edits_.push_back(edit);
+}
+
+/**
+ * Remove a tag.  Removing a tag which doesn't exist isn't an error.
+ * @param tag   Tag to remove
+ * @param dir   Directory the tag is in
+ */
+void exif::EditSet::remove(uint16_t tag, uint8_t dir) {
+    Edit edit = {dir, true, IFEntry()};
+    edit.entry.tag(tag);
+    edits_.push_back(edit);
+}
+
+/**
+ * Get the number of values stored in an entry
+ * @param entry     Entry to check
+ * @return Number of values, or the string length for ASCII entries
+ */
+unsigned long getValueCount(const exif::IFEntry &entry) {
+    switch (entry.format()) {
+        case ENTRY_FORMAT_BYTE:
+        case ENTRY_FORMAT_UNDEFINED: return entry.val_byte().size();
+        case ENTRY_FORMAT_ASCII: return entry.val_string().size();
+        case ENTRY_FORMAT_SHORT: return entry.val_short().size();
+        case ENTRY_FORMAT_LONG: return entry.val_long().size();
+        case ENTRY_FORMAT_RATIONAL: return entry.val_rational().size();
+        case ENTRY_FORMAT_SRATIONAL: return entry.val_srational().size();
+        default: return 0;
+    }
+}
+
+/**
+ * Check if a tag links to another directory.  The links are written by the encoder, so they can't be edited.
+ * @param tag   Tag to check
+ * @return True for the EXIF, GPS, EXIF 1.0 and Interop IFD offsets
+ */
+bool isDirectoryLink(uint16_t tag) {
+    return tag == EXIF_TAG_EXIF_IFD_OFFSET || tag == EXIF_TAG_GPS_IFD_OFFSET || tag == EXIF_TAG_10_IFD_OFFSET ||
+           tag == EXIF_TAG_INTEROP_OFFSET;
+}
+
+/**
+ * Check if a tag gives the position of data in the file, which changes whenever the file is rewritten
+ * @param dir   Directory of the tag
+ * @param tag   Tag to check
+ * @return True for the directory links and the offsets of the strips and the thumbnail
+ */
+bool isLayoutTag(uint8_t dir, uint16_t tag) {
+    if (isDirectoryLink(tag)) return true;
+    return (dir == IFD0_DIRECTORY || dir == IFD1_DIRECTORY) &&
+           (tag == EXIF_TAG_STRIP_OFFSETS || tag == EXIF_TAG_JPEG_SOI_OFFSET);
+}
+
+/**
+ * Check the changes against the known tag formats
+ * @return True if every change is valid
+ */
+bool exif::EditSet::validate() const {
+    for (unsigned long i = 0; i < edits_.size(); i++) {
+        const Edit &edit = edits_.at(i);
+        uint16_t tag = edit.entry.tag();
+        if (edit.directory != IFD0_DIRECTORY && edit.directory != EXIF_IFD_DIRECTORY &&
+            edit.directory != GPS_IFD_DIRECTORY && edit.directory != INTEROP_IFD_DIRECTORY &&
+            edit.directory != IFD1_DIRECTORY && edit.directory != EXIF_10_DIRECTORY) {
+            ERROR("Edit of tag %x in unknown directory %d", tag, edit.directory);
+            return false;
+        }
+        if (isDirectoryLink(tag)) {
+            ERROR("Edit of directory link %x", tag);
+            return false;
+        }
+        if (edit.remove) continue;
+
+        const IFEntry &entry = edit.entry;
+        if (entry.format() != ENTRY_FORMAT_ASCII && getValueCount(entry) != entry.length()) {
+            ERROR("Tag %x has %lu values but length %u", tag, getValueCount(entry), entry.length());
+            return false;
+        }
+        // The length of a string counts its terminating NUL, which may be missing in decoded strings
+        if (entry.format() == ENTRY_FORMAT_ASCII && getValueCount(entry) != entry.length() &&
+            getValueCount(entry) + 1 != entry.length()) {
+            ERROR("Tag %x has %lu characters but length %u", tag, getValueCount(entry), entry.length());
+            return false;
+        }
+        // IFD1 tags are described with the IFD0 ones.  Unknown tags can have any format.
+        TagInfo *tagInfo = findTagInfo(tag, edit.directory == IFD1_DIRECTORY ? IFD0_DIRECTORY : edit.directory);
+        if (tagInfo == NULL) continue;
+        bool isInteger = entry.format() == ENTRY_FORMAT_SHORT || entry.format() == ENTRY_FORMAT_LONG;
+        bool wantsInteger = tagInfo->format == ENTRY_FORMAT_SHORT || tagInfo->format == ENTRY_FORMAT_LONG;
+        if (entry.format() != tagInfo->format && !(isInteger && wantsInteger)) {
+            ERROR("Tag %x has format %d instead of %d", tag, entry.format(), tagInfo->format);
+            return false;
+        }
+        if (tagInfo->length == 1 && entry.length() != 1) {
+            ERROR("Tag %x has %u values instead of 1", tag, entry.length());
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Order edits by directory and tag, keeping the order they were made in for the same tag
+ */
+struct EditOrder {
+    const std::vector<exif::TagId> *keys;
+    bool operator()(unsigned long a, unsigned long b) const {
+        const exif::TagId &ka = keys->at(a);
+        const exif::TagId &kb = keys->at(b);
+        if (ka.directory != kb.directory) return ka.directory < kb.directory;
+        if (ka.tag != kb.tag) return ka.tag < kb.tag;
+        return a < b;
+    }
+};
+
+/**
+ * Apply a set of changes in one merge pass per directory.  Nothing is changed if the set isn't valid.
+ * @param edits     Changes to apply
+ * @return True if the changes were applied
+ */
+bool exif::EXIFInfo::apply(const EditSet &edits) {
+    if (!edits.validate()) return false;
+
+    std::vector<TagId> keys(edits.edits_.size());
+    std::vector<const IFEntry *> values(edits.edits_.size());
+    for (unsigned long i = 0; i < keys.size(); i++) {
+        const EditSet::Edit &edit = edits.edits_.at(i);
+        keys[i].tag = edit.entry.tag();
+        keys[i].directory = edit.directory;
+        values[i] = edit.remove ? NULL : &edit.entry;
+    }
+    applyChanges(keys, values);
+    return true;
+}
+
+/**
+ * Put or remove tags in one merge pass per directory
+ * @param keys      Directory and tag of each change, in any order
+ * @param values    New entry of each change, NULL to remove the tag.  The last change of a tag counts.
+ */
+void exif::EXIFInfo::applyChanges(const std::vector<TagId> &keys, const std::vector<const IFEntry *> &values) {
+    std::vector<unsigned long> order(keys.size());
+    for (unsigned long i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    EditOrder compare = {&keys};
+    std::sort(order.begin(), order.end(), compare);
+
+    std::vector<exif::IFEntry> merged;
+    unsigned long i = 0;
+    while (i < order.size()) {
+        uint8_t dir = keys[order[i]].directory;
+        std::vector<exif::IFEntry> *entries = getDirectory(dir)->entries;
+        std::sort(entries->begin(), entries->end(), tagComparator);
+
+        merged.clear();
+        merged.reserve(entries->size() + order.size() - i);
+        unsigned long j = 0;
+        while (i < order.size() && keys[order[i]].directory == dir) {
+            // Only the last change of a tag counts
+            while (i + 1 < order.size() && keys[order[i + 1]].directory == dir &&
+                   keys[order[i + 1]].tag == keys[order[i]].tag) {
+                i++;
+            }
+            uint16_t tag = keys[order[i]].tag;
+            while (j < entries->size() && entries->at(j).tag() < tag) {
+                merged.push_back(std::move(entries->at(j++)));
+            }
+            if (j < entries->size() && entries->at(j).tag() == tag) j++;
+            if (values[order[i]] != NULL) merged.push_back(*values[order[i]]);
+            i++;
+        }
+        while (j < entries->size()) {
+            merged.push_back(std::move(entries->at(j++)));
+        }
+        entries->swap(merged);
+        markDirty(dir);
+    }
+}
+
+/**
+ * Get the values of an entry as bytes in host byte order
+ * @param entry     Entry to get the values of
+ * @return View of the values, empty for unknown formats
+ */
+exif::ByteView entryValueBytes(const exif::IFEntry &entry) {
+    exif::ByteView view = {NULL, 0};
+    switch (entry.format()) {
+        case ENTRY_FORMAT_BYTE:
+        case ENTRY_FORMAT_UNDEFINED:
+            view.data = entry.val_byte().data();
+            view.size = entry.val_byte().size();
+            break;
+        case ENTRY_FORMAT_ASCII:
+            view.data = (const unsigned char *)entry.val_string().data();
+            view.size = entry.val_string().size();
+            break;
+        case ENTRY_FORMAT_SHORT:
+            view.data = (const unsigned char *)entry.val_short().data();
+            view.size = entry.val_short().size() * sizeof(uint16_t);
+            break;
+        case ENTRY_FORMAT_LONG:
+            view.data = (const unsigned char *)entry.val_long().data();
+            view.size = entry.val_long().size() * sizeof(uint32_t);
+            break;
+        case ENTRY_FORMAT_RATIONAL:
+            view.data = (const unsigned char *)entry.val_rational().data();
+            view.size = entry.val_rational().size() * sizeof(exif::Rational);
+            break;
+        case ENTRY_FORMAT_SRATIONAL:
+            view.data = (const unsigned char *)entry.val_srational().data();
+            view.size = entry.val_srational().size() * sizeof(exif::SRational);
+            break;
+        default:
+            break;
+    }
+    return view;
+}
+
+/**
+ * Check if two entries have the same format and values
+ * @param a     First entry
+ * @param b     Second entry
+ * @return True if the values are equal byte for byte
+ */
+bool sameValue(const exif::IFEntry &a, const exif::IFEntry &b) {
+    if (a.format() != b.format() || a.length() != b.length()) return false;
+    exif::ByteView va = entryValueBytes(a);
+    exif::ByteView vb = entryValueBytes(b);
+    return va.size == vb.size && (va.size == 0 || memcmp(va.data, vb.data, (size_t)va.size) == 0);
+}
+
+/**
+ * Get the entries of a directory sorted by tag without changing the directory
+ * @param directory     Directory, may be NULL
+ * @param entries       Output pointers to the entries
+ */
+void sortedEntries(const exif::IFDirectory *directory, std::vector<const exif::IFEntry *> *entries) {
+    entries->clear();
+    if (directory == NULL) return;
+    entries->reserve(directory->entries->size());
+    for (unsigned long i = 0; i < directory->entries->size(); i++) {
+        entries->push_back(&directory->entries->at(i));
+    }
+    // Decoded and encoded directories are sorted already, only new entries are out of order
+    if (!std::is_sorted(entries->begin(), entries->end(), tagPtrComparator)) {
+        std::stable_sort(entries->begin(), entries->end(), tagPtrComparator);
+    }
+}
+
+/**
+ * Compare the tags with those of another EXIFInfo in one merge pass over the sorted entries of each
+ * directory.  Values are compared byte for byte.  The links between directories and the offsets of the strips and
+ * the thumbnail aren't compared, they change whenever the file is rewritten.
+ * @param other     EXIFInfo to compare with
+ * @param diffs     Output differences ordered by directory and tag.  TAG_ADDED tags are only in other.
+ */
+void exif::EXIFInfo::diff(const EXIFInfo &other, std::vector<TagDiff> *diffs) const {
+    diffs->clear();
+    std::vector<uint8_t> types;
+    for (unsigned long i = 0; i < IFDirectories.size(); i++) {
+        types.push_back(IFDirectories.at(i)->type);
+    }
+    for (unsigned long i = 0; i < other.IFDirectories.size(); i++) {
+        types.push_back(other.IFDirectories.at(i)->type);
+    }
+    std::sort(types.begin(), types.end());
+    types.erase(std::unique(types.begin(), types.end()), types.end());
+
+    std::vector<const IFEntry *> mine, theirs;
+    for (unsigned long t = 0; t < types.size(); t++) {
+        sortedEntries(findDirectory(types[t]), &mine);
+        sortedEntries(other.findDirectory(types[t]), &theirs);
+        unsigned long i = 0, j = 0;
+        while (i < mine.size() || j < theirs.size()) {
+            TagDiff diff = {0, types[t], 0};
+            if (j == theirs.size() || (i < mine.size() && mine[i]->tag() < theirs[j]->tag())) {
+                diff.tag = mine[i++]->tag();
+                diff.change = TAG_REMOVED;
+            } else if (i == mine.size() || theirs[j]->tag() < mine[i]->tag()) {
+                diff.tag = theirs[j++]->tag();
+                diff.change = TAG_ADDED;
+            } else {
+                diff.tag = mine[i]->tag();
+                if (!sameValue(*mine[i], *theirs[j])) diff.change = TAG_CHANGED;
+                i++;
+                j++;
+            }
+            if (diff.change != 0 && !isLayoutTag(diff.directory, diff.tag)) diffs->push_back(diff);
+        }
+    }
+}
+
+/**
+ * Apply differences found by diff, or a chosen subset of them, in one merge pass per directory.  Directory links
+ * and the offsets of the strips and the thumbnail are skipped, the encoder writes them for the new layout.
+ * @param source    EXIFInfo the differences were found against, added and changed values are copied from it
+ * @param diffs     Differences to apply
+ * @return False and nothing changed if source is this EXIFInfo or an added or changed tag isn't in source
+ */
+bool exif::EXIFInfo::merge(const EXIFInfo &source, const std::vector<TagDiff> &diffs) {
+    // The values are taken from the source while the entries are moved around
+    if (&source == this) {
+        ERROR("Merge from itself");
+        return false;
+    }
+    std::vector<const TagDiff *> picked;
+    std::vector<TagId> keys;
+    picked.reserve(diffs.size());
+    keys.reserve(diffs.size());
+    for (unsigned long i = 0; i < diffs.size(); i++) {
+        if (isLayoutTag(diffs.at(i).directory, diffs.at(i).tag)) continue;
+        TagId key = {diffs.at(i).tag, diffs.at(i).directory};
+        picked.push_back(&diffs.at(i));
+        keys.push_back(key);
+    }
+    std::vector<const IFEntry *> values(keys.size(), NULL);
+    std::vector<unsigned long> order(keys.size());
+    for (unsigned long i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    EditOrder compare = {&keys};
+    std::sort(order.begin(), order.end(), compare);
+
+    // Look up the source values in the same order, walking each source directory once
+    std::vector<const IFEntry *> entries;
+    int loaded = -1;
+    unsigned long j = 0;
+    for (unsigned long i = 0; i < order.size(); i++) {
+        const TagDiff &diff = *picked[order[i]];
+        if (diff.change == TAG_REMOVED) continue;
+        if (diff.directory != loaded) {
+            sortedEntries(source.findDirectory(diff.directory), &entries);
+            loaded = diff.directory;
+            j = 0;
+        }
+        while (j < entries.size() && entries[j]->tag() < diff.tag) j++;
+        if (j == entries.size() || entries[j]->tag() != diff.tag) {
+            ERROR("Tag %x of directory %d isn't in the source", diff.tag, diff.directory);
+            return false;
+        }
+        values[order[i]] = entries[j];
+    }
+    applyChanges(keys, values);
+    return true;
+}
+
+/**
+ * Copy the EXIF data of another EXIFInfo including the values, markers and thumbnail
+ * @param other     EXIFInfo to copy
+ */
+void exif::EXIFInfo::copyFrom(const EXIFInfo &other) {
+    for (unsigned long i = 0; i < other.IFDirectories.size(); i++) {
+        const std::vector<exif::IFEntry> *entries = other.IFDirectories.at(i)->entries;
+        addDirectory(other.IFDirectories.at(i)->type, new std::vector<exif::IFEntry>(*entries));
+    }
+    for (unsigned long i = 0; i < other.AppMarkers.size(); i++) {
+        AppMarker *marker = new AppMarker(*other.AppMarkers.at(i));
+        marker->buffer = (unsigned char *)malloc(marker->length - 2);
+        marker->capacity = marker->length - 2;
+        memcpy(marker->buffer, other.AppMarkers.at(i)->buffer, marker->length - 2);
+        AppMarkers.push_back(marker);
+    }
+    MPImages = other.MPImages;
+
+    if (other.exifMarker_ != NULL) {
+        exifMarker_ = new AppMarker(*other.exifMarker_);
+        exifMarker_->buffer = (unsigned char *)malloc(exifMarker_->length - 2);
+        exifMarker_->capacity = exifMarker_->length - 2;
+        memcpy(exifMarker_->buffer, other.exifMarker_->buffer, exifMarker_->length - 2);
+    }
+    // The thumbnail points into the EXIF segment, the thumbnail copy or memory retained by the caller
+    thumbnailData_ = other.thumbnailData_;
+    thumbnail_.size = other.thumbnail_.size;
+    const unsigned char *segment = other.exifMarker_ != NULL ? other.exifMarker_->buffer : NULL;
+    if (other.thumbnail_.data == NULL) {
+        thumbnail_.data = NULL;
+    } else if (other.thumbnail_.data == other.thumbnailData_.data()) {
+        thumbnail_.data = thumbnailData_.data();
+    } else if (segment != NULL && other.thumbnail_.data >= segment &&
+               other.thumbnail_.data + other.thumbnail_.size <= segment + other.exifMarker_->length - 2) {
+        thumbnail_.data = exifMarker_->buffer + (other.thumbnail_.data - segment);
+    } else {
+        thumbnailData_.assign(other.thumbnail_.data, other.thumbnail_.data + other.thumbnail_.size);
+        thumbnail_.data = thumbnailData_.data();
+    }
+
+    tagFilter_ = other.tagFilter_;
+    stringPool_ = other.stringPool_;
+    internTags_ = other.internTags_;
+    dirty_ = other.dirty_;
+}
+
+/**
+ * Copy the EXIF data into an immutable snapshot which can be shared by many threads.  Only the const
+ * functions of a snapshot can be used, so reading needs no locking.
+ * @return New snapshot
+ */
+std::shared_ptr<const exif::EXIFInfo> exif::EXIFInfo::snapshot() const {
+    std::shared_ptr<EXIFInfo> copy(new EXIFInfo);
+    copy->copyFrom(*this);
+    return copy;
+}
+
+/**
+ * Get a private copy of the base to change, made on the first call
+ * @return EXIFInfo to change
+ */
+exif::EXIFInfo &exif::SnapshotBuilder::edit() {
+    if (!copy_) {
+        copy_.reset(new EXIFInfo);
+        if (base_) copy_->copyFrom(*base_);
+    }
+    return *copy_;
+}
+
+/**
+ * Apply a set of changes to the private copy.  Nothing is copied if the set isn't valid.
+ * @param edits     Changes to apply
+ * @return True if the changes were applied
+ */
+bool exif::SnapshotBuilder::apply(const EditSet &edits) {
+    if (!edits.validate()) return false;
+    return edit().apply(edits);
+}
+
+/**
+ * Get the snapshot with the changes made so far.  Later changes go to a new copy.
+ * @return The base if nothing was changed, otherwise a new snapshot
+ */
+std::shared_ptr<const exif::EXIFInfo> exif::SnapshotBuilder::build() {
+    if (copy_) {
+        base_ = copy_;
+        copy_.reset();
+    }
+    return base_;
+}
+
+/**
+ * Clear the EXIFInfo data and free everything it allocated, including what reset() kept for reuse
+ */
+void exif::EXIFInfo::clear() {
+    // Release the entries first so reset() doesn't keep their values
+    for (unsigned long i=0; i<IFDirectories.size(); i++) {
+        IFDirectories.at(i)->entries->clear();
+    }
+    scratchEntries_.clear();
+    reset();
+    for (unsigned long i=0; i<spareDirectories_.size(); i++) {
+        delete spareDirectories_.at(i);
+    }
+    spareDirectories_.clear();
+    for (unsigned long i=0; i<spareEntries_.size(); i++) {
+        delete spareEntries_.at(i);
+    }
+    spareEntries_.clear();
+    for (unsigned long i=0; i<spareMarkers_.size(); i++) {
+        free(spareMarkers_.at(i)->buffer);
+        delete spareMarkers_.at(i);
+    }
+    spareMarkers_.clear();
+    std::vector<exif::IFEntry>().swap(scratchEntries_);
+    for (unsigned long i=0; i<=ENTRY_FORMAT_SRATIONAL; i++) {
+        std::vector<exif::IFEntry>().swap(spareValues_[i]);
+    }
+}
+
+/**
+ * Keep an entry whose values are no longer needed so readIFD can reuse its value storage
+ * @param entry     Entry to keep, moved from
+ */
+void exif::EXIFInfo::keepValue(IFEntry &entry) {
+    if (entry.format() >= ENTRY_FORMAT_BYTE && entry.format() <= ENTRY_FORMAT_SRATIONAL) {
+        spareValues_[entry.format()].push_back(std::move(entry));
+    }
+}
+
+/**
+ * Remove the EXIF data but keep the directories, entry lists, entry values and marker buffers for the next read,
+ * so decoding many files with the same layout into one EXIFInfo stops allocating once they have grown large
+ * enough.  readEXIF calls this first.  The tag filter and string pool settings are kept.
+ */
+void exif::EXIFInfo::reset() {
+    // Entries are kept in reverse so readIFD takes them back in the same order, which gives files with the
+    // same layout values of the same size
+    for (unsigned long i=IFDirectories.size(); i-- > 0; ) {
+        std::vector<IFEntry> *entries = IFDirectories.at(i)->entries;
+        for (unsigned long j=entries->size(); j-- > 0; ) {
+            keepValue(entries->at(j));
+        }
+    }
+    for (unsigned long i=scratchEntries_.size(); i-- > 0; ) {
+        keepValue(scratchEntries_.at(i));
+    }
+    scratchEntries_.clear();
+    for (unsigned long i=0; i<IFDirectories.size(); i++) {
+        IFDirectory *directory = IFDirectories.at(i);
+        directory->entries->clear();
+        spareEntries_.push_back(directory->entries);
+        directory->entries = NULL;
+        spareDirectories_.push_back(directory);
+    }
+    IFDirectories.clear();
+    for (unsigned long i=0; i<AppMarkers.size(); i++) {
+        releaseMarker(AppMarkers.at(i));
+    }
+    AppMarkers.clear();
+    MPImages.clear();
+    thumbnailData_.clear();
+    thumbnail_.data = NULL;
+    thumbnail_.size = 0;
+    releaseExifMarker();
+    dirty_ = 0;
+}
+
+/**
+ * Exchange the contents of two EXIFInfo objects without copying
+ * @param other     EXIFInfo to swap with
+ */
+void exif::EXIFInfo::swap(EXIFInfo &other) noexcept {
+    swapDecoded(other);
+    tagFilter_.swap(other.tagFilter_);
+    std::swap(stringPool_, other.stringPool_);
+    internTags_.swap(other.internTags_);
+}
+
+/**
+ * Exchange the decoded data of two EXIFInfo objects, keeping the tag filter and string pool settings
+ * @param other     EXIFInfo to swap with
+ */
+void exif::EXIFInfo::swapDecoded(EXIFInfo &other) noexcept {
+    // Swapping the vectors keeps their buffers, so the thumbnail views stay valid
+    IFDirectories.swap(other.IFDirectories);
+    AppMarkers.swap(other.AppMarkers);
+    MPImages.swap(other.MPImages);
+    spareDirectories_.swap(other.spareDirectories_);
+    spareEntries_.swap(other.spareEntries_);
+    spareMarkers_.swap(other.spareMarkers_);
+    scratchEntries_.swap(other.scratchEntries_);
+    for (unsigned long i = 0; i <= ENTRY_FORMAT_SRATIONAL; i++) {
+        spareValues_[i].swap(other.spareValues_[i]);
+    }
+    std::swap(exifMarker_, other.exifMarker_);
+    thumbnailData_.swap(other.thumbnailData_);
+    std::swap(thumbnail_, other.thumbnail_);
+    std::swap(dirty_, other.dirty_);
+}
+
+/**
+ * Replace the thumbnail written to IFD1 by encodeJPEGHeader.  The data is copied.
+ * @param buf   Thumbnail data, normally a JPEG stream
+ * @param len   Length of the thumbnail data, 0 to remove the thumbnail
+ */
+void exif::EXIFInfo::setThumbnail(const unsigned char *buf, unsigned long len) {
+    std::vector<exif::IFEntry> *entries = getDirectory(IFD1_DIRECTORY)->entries;
+    markDirty(IFD1_DIRECTORY);
+    if (buf == NULL || len == 0) {
+        thumbnailData_.clear();
+        thumbnail_.data = NULL;
+        thumbnail_.size = 0;
+        removeEntry(EXIF_TAG_JPEG_SOI_OFFSET, IFD1_DIRECTORY);
+        removeEntry(EXIF_TAG_JPEG_DATA_BYTES, IFD1_DIRECTORY);
+        return;
+    }
+    thumbnailData_.assign(buf, buf + len);
+    thumbnail_.data = thumbnailData_.data();
+    thumbnail_.size = len;
+
+    // The real offset is filled in by encodeEXIFsegment
+    setLongEntry(entries, EXIF_TAG_JPEG_SOI_OFFSET, 0);
+    setLongEntry(entries, EXIF_TAG_JPEG_DATA_BYTES, (uint32_t)len);
+    if (findTag(EXIF_TAG_COMPRESSION_SCHEME, IFD1_DIRECTORY) == NULL) {
+        entries->push_back(exif::IFEntry(EXIF_TAG_COMPRESSION_SCHEME, IFD0_DIRECTORY, 6)); // JPEG compression
+    }
+}
+
+/**
+ * Release the EXIF segment kept for the thumbnail, its buffer is kept for the next marker
+ */
+void exif::EXIFInfo::releaseExifMarker() {
+    if (exifMarker_ != NULL) {
+        releaseMarker(exifMarker_);
+        exifMarker_ = NULL;
+    }
+}
+
+/**
+ * Only keep the given tags when decoding.  The values of other tags aren't read from the source.
+ * The links between directories are always followed.
+ * @param tags  Tags to keep, an empty list keeps all tags
+ */
+void exif::EXIFInfo::setTagFilter(const std::vector<TagId> &tags) {
+    tagFilter_.clear();
+    for (unsigned long i = 0; i < tags.size(); i++) {
+        tagFilter_.push_back((uint32_t)tags.at(i).directory << 16 | tags.at(i).tag);
+    }
+    std::sort(tagFilter_.begin(), tagFilter_.end());
+}
+
+/**
+ * Intern the values of the given ASCII tags in a shared pool when decoding, so equal strings of many
+ * images are stored once.  The pool must outlive the entries decoded with it.
+ * @param pool  Pool to intern the strings in, NULL to stop interning
+ * @param tags  Tags to intern, normally internTags()
+ */
+void exif::EXIFInfo::setStringPool(StringPool *pool, const std::vector<TagId> &tags) {
+    stringPool_ = pool;
+    internTags_.clear();
+    for (unsigned long i = 0; i < tags.size(); i++) {
+        internTags_.push_back((uint32_t)tags.at(i).directory << 16 | tags.at(i).tag);
+    }
+    std::sort(internTags_.begin(), internTags_.end());
+}
+
+/**
+ * Check whether a tag passes the tag filter
+ * @param tag   Tag to check
+ * @param dir   Directory the tag was read with
+ * @return True if the tag should be kept
+ */
+bool exif::EXIFInfo::keepTag(uint16_t tag, uint8_t dir) const {
+    if (tagFilter_.empty()) return true;
+    // Keep the pointers to the other directories so decodeTIFF can follow them
+    if (dir == IFD0_DIRECTORY && (tag == EXIF_TAG_EXIF_IFD_OFFSET || tag == EXIF_TAG_GPS_IFD_OFFSET ||
+                                  tag == EXIF_TAG_10_IFD_OFFSET)) return true;
+    if (dir == EXIF_IFD_DIRECTORY && tag == EXIF_TAG_INTEROP_OFFSET) return true;
+    return std::binary_search(tagFilter_.begin(), tagFilter_.end(), (uint32_t)dir << 16 | tag);
+}
+
+/**
+ * Find the entry with the given tag without creating the directory if it doesn't exist
+ * @param tag   Input tag to find
+ * @param dir   Directory tag is in
+ * @return pointer to the IFEntry found or NULL
+ */
+const exif::IFEntry* exif::EXIFInfo::findTag(uint16_t tag, uint8_t dir) const {
+    for (unsigned long i = 0; i < IFDirectories.size(); i++) {
+        if (IFDirectories.at(i)->type != dir) continue;
+        const std::vector<exif::IFEntry> *entries = IFDirectories.at(i)->entries;
+        for (unsigned long j = 0; j < entries->size(); j++) {
+            if (entries->at(j).tag() == tag) return &entries->at(j);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the tags read by the typed accessors of EXIFInfo, to be used with EXIFInfo::setTagFilter
+ * @return List of tags
+ */
+const std::vector<exif::TagId> &exif::hotTags() {
+    static const TagId tags[] = {
+        {EXIF_TAG_ORIENTATION, IFD0_DIRECTORY},
+        {EXIF_TAG_MODIFY_DATE_TIME, IFD0_DIRECTORY},
+        {EXIF_TAG_ORIGINAL_DATE, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_DIGITIZATION_DATE, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_SUB_SEC_TIME, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_SUB_SEC_ORIG_TIME, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_DIGITIZED_TIME, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_OFFSET_TIME, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_OFFSET_TIME_ORIG, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_OFFSET_TIME_DIGITIZED, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_EXPOSURE_TIME, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_FNUMBER, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_EXPOSURE_BIAS, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_ISO_SPEED_RATING, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_GPS_LATITUDE_REF, GPS_IFD_DIRECTORY},
+        {EXIF_TAG_GPS_LATITUDE, GPS_IFD_DIRECTORY},
+        {EXIF_TAG_GPS_LONGITUDE_REF, GPS_IFD_DIRECTORY},
+        {EXIF_TAG_GPS_LONGITUDE, GPS_IFD_DIRECTORY},
+        {EXIF_TAG_GPS_ALTITUDE_REF, GPS_IFD_DIRECTORY},
+        {EXIF_TAG_GPS_ALTITUDE, GPS_IFD_DIRECTORY},
+    };
+    static const std::vector<TagId> hot(tags, tags + sizeof(tags) / sizeof(TagId));
+    return hot;
+}
+
+/**
+ * Get the ASCII tags with few distinct values across a corpus, to be used with EXIFInfo::setStringPool
+ * @return List of tags: Make, Model, Software, LensMake and LensModel
+ */
+const std::vector<exif::TagId> &exif::internTags() {
+    static const TagId tags[] = {
+        {EXIF_TAG_DIGICAM_MAKE, IFD0_DIRECTORY},
+        {EXIF_TAG_DIGICAM_MODEL, IFD0_DIRECTORY},
+        {EXIF_TAG_SOFTWARE, IFD0_DIRECTORY},
+        {EXIF_TAG_LENS_MAKE, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_LENS_MODEL, EXIF_IFD_DIRECTORY},
+    };
+    static const std::vector<TagId> intern(tags, tags + sizeof(tags) / sizeof(TagId));
+    return intern;
+}
+
+/**
+ * Parse an EXIF date/time string ("YYYY:MM:DD HH:MM:SS") without going through the C library.  All digits
+ * and separators are checked together so there is only one branch on the result.
+ * @param str       Date/time string
+ * @param len       Length of the string, at least 19
+ * @param epoch     Output seconds since 1970-01-01 00:00:00 for the given wall clock time
+ * @return True if the string is a valid date/time.  Blank dates such as "0000:00:00 00:00:00" are invalid.
+ */
+bool exif::parseDateTime(const char *str, unsigned long len, int64_t *epoch) {
+    static const unsigned char digitPos[14] = {0, 1, 2, 3, 5, 6, 8, 9, 11, 12, 14, 15, 17, 18};
+    if (str == NULL || len < 19) return false;
+
+    unsigned d[14];
+    unsigned bad = 0;
+    for (int i = 0; i < 14; i++) {
+        d[i] = (unsigned)(unsigned char)str[digitPos[i]] - '0';
+        bad |= d[i] > 9;
+    }
+    bad |= (str[4] != ':') | (str[7] != ':') | (str[10] != ' ') | (str[13] != ':') | (str[16] != ':');
+
+    unsigned year = d[0] * 1000 + d[1] * 100 + d[2] * 10 + d[3];
+    unsigned month = d[4] * 10 + d[5];
+    unsigned day = d[6] * 10 + d[7];
+    unsigned hour = d[8] * 10 + d[9];
+    unsigned minute = d[10] * 10 + d[11];
+    unsigned second = d[12] * 10 + d[13];
+    bad |= (year - 1 > 9998) | (month - 1 > 11) | (day - 1 > 30) | (hour > 23) | (minute > 59) | (second > 60);
+    if (bad) return false;
+    static const unsigned char monthDays[12] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+    if (day > monthDays[month - 1] || (month == 2 && day == 29 && !leap)) return false;
+
+    // Days since the epoch of the proleptic Gregorian date, counting years from March so leap days come last
+    unsigned y = year - (month <= 2);
+    unsigned era = y / 400;
+    unsigned yoe = y - era * 400;
+    unsigned doy = (153 * ((month + 9) % 12) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    int64_t days = (int64_t)era * 146097 + doe - 719468;
+    *epoch = days * 86400 + hour * 3600 + minute * 60 + second;
+    return true;
+}
+
+/**
+ * Get the first value of a rational entry
+ * @param entry     Entry to get the value from, may be NULL
+ * @param index     Index of the value
+ * @param value     Output value
+ * @return True if the entry is a RATIONAL or SRATIONAL with a value at index
+ */
+bool getRationalValue(const exif::IFEntry *entry, unsigned long index, double *value) {
+    if (entry == NULL) return false;
+    if (entry->format() == ENTRY_FORMAT_RATIONAL && entry->val_rational().size() > index) {
+        *value = entry->val_rational().at(index);
+    } else if (entry->format() == ENTRY_FORMAT_SRATIONAL && entry->val_srational().size() > index) {
+        *value = entry->val_srational().at(index);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Get the first value of an integer entry
+ * @param entry     Entry to get the value from, may be NULL
+ * @param value     Output value
+ * @return True if the entry is a BYTE, SHORT or LONG with at least one value
+ */
+bool getIntegerValue(const exif::IFEntry *entry, uint32_t *value) {
+    if (entry == NULL) return false;
+    switch (entry->format()) {
+        case ENTRY_FORMAT_BYTE:
+            if (entry->val_byte().empty()) return false;
+            *value = entry->val_byte().front();
+            return true;
+        case ENTRY_FORMAT_SHORT:
+            if (entry->val_short().empty()) return false;
+            *value = entry->val_short().front();
+            return true;
+        case ENTRY_FORMAT_LONG:
+            if (entry->val_long().empty()) return false;
+            *value = entry->val_long().front();
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Get the orientation of the main image
+ * @return Orientation 1-8, or 0 if unknown
+ */
+uint16_t exif::EXIFInfo::orientation() const {
+    uint32_t value;
+    if (!getIntegerValue(findTag(EXIF_TAG_ORIENTATION, IFD0_DIRECTORY), &value) || value < 1 || value > 8) return 0;
+    return (uint16_t)value;
+}
+
+/**
+ * Get the capture time from the original date/time tags, falling back to the digitized and modify date/time
+ * @param time  Output capture time
+ * @return True if a valid date/time was found
+ */
+bool exif::EXIFInfo::captureTime(CaptureTime *time) const {
+    // Date/time, sub second and offset tags in order of preference
+    static const TagId tags[3][3] = {
+        {{EXIF_TAG_ORIGINAL_DATE, EXIF_IFD_DIRECTORY}, {EXIF_TAG_SUB_SEC_ORIG_TIME, EXIF_IFD_DIRECTORY},
+         {EXIF_TAG_OFFSET_TIME_ORIG, EXIF_IFD_DIRECTORY}},
+        {{EXIF_TAG_DIGITIZATION_DATE, EXIF_IFD_DIRECTORY}, {EXIF_TAG_DIGITIZED_TIME, EXIF_IFD_DIRECTORY},
+         {EXIF_TAG_OFFSET_TIME_DIGITIZED, EXIF_IFD_DIRECTORY}},
+        {{EXIF_TAG_MODIFY_DATE_TIME, IFD0_DIRECTORY}, {EXIF_TAG_SUB_SEC_TIME, EXIF_IFD_DIRECTORY},
+         {EXIF_TAG_OFFSET_TIME, EXIF_IFD_DIRECTORY}},
+    };
+    for (int i = 0; i < 3; i++) {
+        const IFEntry *date = findTag(tags[i][0].tag, tags[i][0].directory);
+        if (date == NULL || date->format() != ENTRY_FORMAT_ASCII) continue;
+        const std::string &str = date->val_string();
+        if (!parseDateTime(str.data(), str.length(), &time->epoch)) continue;
+
+        // Sub second digits are a decimal fraction, "5" is 500ms
+        time->nanoseconds = 0;
+        const IFEntry *subsec = findTag(tags[i][1].tag, tags[i][1].directory);
+        if (subsec != NULL && subsec->format() == ENTRY_FORMAT_ASCII) {
+            uint32_t scale = 100000000;
+            for (unsigned long j = 0; j < subsec->val_string().length() && scale > 0; j++) {
+                unsigned digit = (unsigned)(unsigned char)subsec->val_string()[j] - '0';
+                if (digit > 9) break;
+                time->nanoseconds += digit * scale;
+                scale /= 10;
+            }
+        }
+
+        // Offset is "+HH:MM" or "-HH:MM"
+        time->offsetMinutes = 0;
+        time->hasOffset = false;
+        const IFEntry *offset = findTag(tags[i][2].tag, tags[i][2].directory);
+        if (offset != NULL && offset->format() == ENTRY_FORMAT_ASCII && offset->val_string().length() >= 6) {
+            const char *o = offset->val_string().data();
+            unsigned h1 = (unsigned)(unsigned char)o[1] - '0', h2 = (unsigned)(unsigned char)o[2] - '0';
+            unsigned m1 = (unsigned)(unsigned char)o[4] - '0', m2 = (unsigned)(unsigned char)o[5] - '0';
+            if ((o[0] == '+' || o[0] == '-') && o[3] == ':' && h1 <= 9 && h2 <= 9 && m1 <= 9 && m2 <= 9) {
+                int minutes = (int)((h1 * 10 + h2) * 60 + m1 * 10 + m2);
+                time->offsetMinutes = (int16_t)(o[0] == '-' ? -minutes : minutes);
+                time->hasOffset = true;
+                time->epoch -= time->offsetMinutes * 60;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Get the GPS position
+ * @param position  Output position
+ * @return True if latitude and longitude were found
+ */
+bool exif::EXIFInfo::gps(GPSPosition *position) const {
+    const IFEntry *lat = findTag(EXIF_TAG_GPS_LATITUDE, GPS_IFD_DIRECTORY);
+    const IFEntry *lon = findTag(EXIF_TAG_GPS_LONGITUDE, GPS_IFD_DIRECTORY);
+    double latDMS[3], lonDMS[3];
+    for (int i = 0; i < 3; i++) {
+        if (!getRationalValue(lat, i, &latDMS[i]) || !getRationalValue(lon, i, &lonDMS[i])) return false;
+    }
+    position->latitude = latDMS[0] + latDMS[1] / 60 + latDMS[2] / 3600;
+    position->longitude = lonDMS[0] + lonDMS[1] / 60 + lonDMS[2] / 3600;
+
+    const IFEntry *ref = findTag(EXIF_TAG_GPS_LATITUDE_REF, GPS_IFD_DIRECTORY);
+    if (ref != NULL && ref->format() == ENTRY_FORMAT_ASCII && !ref->val_string().empty() && ref->val_string()[0] == 'S') {
+        position->latitude = -position->latitude;
+    }
+    ref = findTag(EXIF_TAG_GPS_LONGITUDE_REF, GPS_IFD_DIRECTORY);
+    if (ref != NULL && ref->format() == ENTRY_FORMAT_ASCII && !ref->val_string().empty() && ref->val_string()[0] == 'W') {
+        position->longitude = -position->longitude;
+    }
+
+    position->altitude = 0;
+    position->hasAltitude = getRationalValue(findTag(EXIF_TAG_GPS_ALTITUDE, GPS_IFD_DIRECTORY), 0, &position->altitude);
+    uint32_t altitudeRef;
+    if (position->hasAltitude && getIntegerValue(findTag(EXIF_TAG_GPS_ALTITUDE_REF, GPS_IFD_DIRECTORY), &altitudeRef) &&
+        altitudeRef == 1) {
+        position->altitude = -position->altitude;
+    }
+    return true;
+}
+
+/**
+ * Get the exposure settings
+ * @param exposure  Output exposure settings
+ * @return True if any of the exposure tags was found
+ */
+bool exif::EXIFInfo::exposure(Exposure *exposure) const {
+    exposure->exposureTime = 0;
+    exposure->fNumber = 0;
+    exposure->bias = 0;
+    exposure->iso = 0;
+    bool found = getRationalValue(findTag(EXIF_TAG_EXPOSURE_TIME, EXIF_IFD_DIRECTORY), 0, &exposure->exposureTime);
+    found |= getRationalValue(findTag(EXIF_TAG_FNUMBER, EXIF_IFD_DIRECTORY), 0, &exposure->fNumber);
+    found |= getRationalValue(findTag(EXIF_TAG_EXPOSURE_BIAS, EXIF_IFD_DIRECTORY), 0, &exposure->bias);
+    found |= getIntegerValue(findTag(EXIF_TAG_ISO_SPEED_RATING, EXIF_IFD_DIRECTORY), &exposure->iso);
+    return found;
+}
+
+/**
+ * Get the XMP properties most catalogs want: rating, label, keywords, creation date and GPS position
+ * @return Properties to pass to EXIFInfo::readXMP
+ */
+std::vector<exif::XMPProperty> exif::commonXMPProperties() {
+    // Grouped by namespace so findXMPProperties looks up each namespace's prefixes once
+    static const char *const names[][2] = {
+        {XMP_NS_XMP, "Rating"},
+        {XMP_NS_XMP, "Label"},
+        {XMP_NS_XMP, "CreateDate"},
+        {XMP_NS_DC, "subject"},
+        {XMP_NS_EXIF, "GPSLatitude"},
+        {XMP_NS_EXIF, "GPSLongitude"},
+    };
+    std::vector<XMPProperty> properties(sizeof(names) / sizeof(names[0]));
+    for (unsigned long i = 0; i < properties.size(); i++) {
+        properties.at(i).ns = names[i][0];
+        properties.at(i).name = names[i][1];
+    }
+    return properties;
+}
+
+/**
+ * Find text in an XMP packet, comparing only where its first character is found
+ * @param p     Start of the text to search
+ * @param end   End of the text to search
+ * @param str   Text to find
+ * @param len   Length of the text to find
+ * @return Start of the text found, or NULL
+ */
+const char *findXMPText(const char *p, const char *end, const char *str, unsigned long len) {
+    while (p + len <= end && (p = (const char *)memchr(p, str[0], (size_t)(end - p))) != NULL) {
+        if (p + len > end) return NULL;
+        if (memcmp(p, str, len) == 0) return p;
+        p++;
+    }
+    return NULL;
+}
+
+/**
+ * Check whether a character is XML white space
+ */
+bool isXMLSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/**
+ * Parse the code point of an XML character reference such as "#233" or "#xE9"
+ * @param entity    Text between '&' and ';'
+ * @return Code point, or 0 if the reference is empty, malformed or not a valid character
+ */
+unsigned long parseXMLCharRef(const std::string &entity) {
+    bool hex = entity.size() > 1 && entity[1] == 'x';
+    const char *digits = entity.c_str() + (hex ? 2 : 1);
+    if (hex ? !isxdigit((unsigned char)digits[0]) : !isdigit((unsigned char)digits[0])) return 0;
+    char *stop;
+    unsigned long c = strtoul(digits, &stop, hex ? 16 : 10);
+    if (*stop != 0 || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) return 0;
+    return c;
+}
+
+/**
+ * Decode the standard XML entities and character references of an XMP value.  References which aren't valid
+ * characters, such as "&#x;" or "&#0;", are kept as they are.
+ * @param p     Start of the value
+ * @param end   End of the value
+ * @return Decoded value, UTF-8
+ */
+std::string decodeXMLText(const char *p, const char *end) {
+    std::string out;
+    out.reserve((size_t)(end - p));
+    while (p < end) {
+        const char *amp = (const char *)memchr(p, '&', (size_t)(end - p));
+        if (amp == NULL) amp = end;
+        out.append(p, amp);
+        if (amp == end) break;
+        const char *semi = (const char *)memchr(amp, ';', std::min((size_t)(end - amp), (size_t)12));
+        if (semi == NULL) {
+            out += '&';
+            p = amp + 1;
+            continue;
+        }
+        std::string entity(amp + 1, semi);
+        if (entity == "amp") out += '&';
+        else if (entity == "lt") out += '<';
+        else if (entity == "gt") out += '>';
+        else if (entity == "quot") out += '"';
+        else if (entity == "apos") out += '\'';
+        else if (entity.size() > 1 && entity[0] == '#' && parseXMLCharRef(entity) != 0) {
+            unsigned long c = parseXMLCharRef(entity);
+            if (c < 0x80) {
+                out += (char)c;
+            } else if (c < 0x800) {
+                out += (char)(0xC0 | (c >> 6));
+                out += (char)(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                out += (char)(0xE0 | (c >> 12));
+                out += (char)(0x80 | ((c >> 6) & 0x3F));
+                out += (char)(0x80 | (c & 0x3F));
+            } else {
+                out += (char)(0xF0 | ((c >> 18) & 0x07));
+                out += (char)(0x80 | ((c >> 12) & 0x3F));
+                out += (char)(0x80 | ((c >> 6) & 0x3F));
+                out += (char)(0x80 | (c & 0x3F));
+            }
+        } else {
+            out.append(amp, semi + 1);
+        }
+        p = semi + 1;
+    }
+    return out;
+}
+
+/**
+ * Find the prefixes bound to a namespace by the xmlns attributes of an XMP packet
+ * @param p         Start of the packet
+ * @param end       End of the packet
+ * @param ns        Namespace URI
+ * @param prefixes  Output prefixes, cleared first
+ */
+void findXMPPrefixes(const char *p, const char *end, const std::string &ns, std::vector<std::string> *prefixes) {
+    prefixes->clear();
+    while ((p = findXMPText(p, end, "xmlns:", 6)) != NULL) {
+        p += 6;
+        const char *prefix = p;
+        while (p < end && *p != '=' && !isXMLSpace(*p)) p++;
+        const char *prefixEnd = p;
+        while (p < end && (*p == '=' || isXMLSpace(*p))) p++;
+        if (p == end || (*p != '"' && *p != '\'')) continue;
+        const char *uri = p + 1;
+        const char *uriEnd = (const char *)memchr(uri, *p, (size_t)(end - uri));
+        if (uriEnd == NULL) return;
+        if ((unsigned long)(uriEnd - uri) == ns.size() && memcmp(uri, ns.data(), ns.size()) == 0) {
+            prefixes->push_back(std::string(prefix, prefixEnd));
+        }
+        p = uriEnd + 1;
+    }
+}
+
+/**
+ * Read the value of an XMP property: an attribute, a simple element or the rdf:li items of an array element
+ * @param start     Start of the packet
+ * @param end       End of the packet
+ * @param qname     Qualified name of the property, such as "xmp:Rating"
+ * @param rdf       Prefix bound to the RDF namespace, normally "rdf"
+ * @param values    Output values
+ * @return True if the property was found with a value
+ */
+bool readXMPValue(const char *start, const char *end, const std::string &qname, const std::string &rdf,
+                  std::vector<std::string> *values) {
+    const char *p = start;
+    while ((p = findXMPText(p, end, qname.data(), qname.size())) != NULL) {
+        const char *after = p + qname.size();
+        char before = p > start ? p[-1] : 0;
+        p = after;
+        // Closing tags and longer names such as xmp:RatingPercent don't count
+        if (after == end || (before != '<' && !isXMLSpace(before))) continue;
+        if (*after != '=' && *after != '>' && *after != '/' && !isXMLSpace(*after)) continue;
+
+        if (before != '<') {
+            // Attribute: name="value"
+            while (p < end && (*p == '=' || isXMLSpace(*p))) p++;
+            if (p == end || (*p != '"' && *p != '\'')) continue;
+            const char *valueEnd = (const char *)memchr(p + 1, *p, (size_t)(end - p - 1));
+            if (valueEnd == NULL) return false;
+            values->push_back(decodeXMLText(p + 1, valueEnd));
+            return true;
+        }
+
+        // Element: <name>value</name> or <name><rdf:Bag><rdf:li>value</rdf:li>...</rdf:Bag></name>
+        const char *gt = (const char *)memchr(after, '>', (size_t)(end - after));
+        if (gt == NULL || gt[-1] == '/') return false;
+        std::string closing = "</" + qname + ">";
+        const char *contentEnd = findXMPText(gt + 1, end, closing.data(), closing.size());
+        if (contentEnd == NULL) return false;
+        std::string itemStart = "<" + rdf + ":li";
+        std::string itemClosing = "</" + rdf + ":li>";
+        const char *item = findXMPText(gt + 1, contentEnd, itemStart.data(), itemStart.size());
+        if (item == NULL) {
+            values->push_back(decodeXMLText(gt + 1, contentEnd));
+            return true;
+        }
+        while (item != NULL) {
+            const char *itemGt = (const char *)memchr(item, '>', (size_t)(contentEnd - item));
+            if (itemGt == NULL) break;
+            const char *itemEnd = findXMPText(itemGt + 1, contentEnd, itemClosing.data(), itemClosing.size());
+            if (itemGt[-1] != '/' && itemEnd != NULL) values->push_back(decodeXMLText(itemGt + 1, itemEnd));
+            item = findXMPText(itemGt + 1, contentEnd, itemStart.data(), itemStart.size());
+        }
+        return !values->empty();
+    }
+    return false;
+}
+
+/**
+ * Find the values of XMP properties in a packet without building a DOM.  Values are attributes or simple
+ * elements, or the rdf:li items of an array element.  The standard XML entities are decoded.  Like the
+ * properties, the RDF namespace is matched by URI whatever prefix it is bound to.
+ * @param packet        XMP packet
+ * @param len           Length of the packet
+ * @param properties    Properties to find, the values of the ones found are set
+ * @return Number of properties found
+ */
+int exif::findXMPProperties(const char *packet, unsigned long len, std::vector<XMPProperty> *properties) {
+    const char *end = packet + len;
+    std::string ns;
+    std::vector<std::string> prefixes;
+    findXMPPrefixes(packet, end, XMP_NS_RDF, &prefixes);
+    std::string rdf = prefixes.empty() ? "rdf" : prefixes.at(0);
+    int found = 0;
+    for (unsigned long i = 0; i < properties->size(); i++) {
+        XMPProperty &property = properties->at(i);
+        property.values.clear();
+        if (i == 0 || property.ns != ns) {
+            ns = property.ns;
+            findXMPPrefixes(packet, end, ns, &prefixes);
+        }
+        for (unsigned long j = 0; j < prefixes.size() && property.values.empty(); j++) {
+            readXMPValue(packet, end, prefixes.at(j) + ":" + property.name, rdf, &property.values);
+        }
+        if (!property.values.empty()) found++;
+    }
+    return found;
+}
+
+/**
+ * Get the standard XMP packet of the JPEG read.  The view points into its APP1 marker.
+ * @return View of the packet, size is 0 if there is none
+ */
+exif::ByteView exif::EXIFInfo::xmpPacket() const {
+    ByteView view = {NULL, 0};
+    for (unsigned long i = 0; i < AppMarkers.size(); i++) {
+        const AppMarker *marker = AppMarkers.at(i);
+        if (marker->type == EXIF_MARKER && marker->length >= 2 + XMP_START &&
+            memcmp(marker->buffer, XMP_NS_XMP, XMP_START) == 0) {
+            view.data = marker->buffer + XMP_START;
+            view.size = marker->length - 2 - XMP_START;
+            break;
+        }
+    }
+    return view;
+}
+
+/**
+ * Reassemble the ExtendedXMP packet split over APP1 segments.  Only the chunks with the GUID given by
+ * xmpNote:HasExtendedXMP in the standard packet are used.  They may come in any order.
+ * @param packet    Output packet
+ * @return True if the chunks cover the whole packet
+ */
+bool exif::EXIFInfo::extendedXMP(std::string *packet) const {
+    packet->clear();
+    ByteView standard = xmpPacket();
+    std::vector<XMPProperty> note(1);
+    note[0].ns = XMP_NS_XMP_NOTE;
+    note[0].name = "HasExtendedXMP";
+    if (standard.size == 0 || findXMPProperties((const char *)standard.data, standard.size, &note) == 0 ||
+        note[0].values[0].size() != XMP_GUID_LEN) return false;
+    const std::string &guid = note[0].values[0];
+
+    std::vector<std::pair<unsigned long, unsigned long> > chunks;
+    unsigned long total = 0;
+    for (unsigned long i = 0; i < AppMarkers.size(); i++) {
+        const AppMarker *marker = AppMarkers.at(i);
+        if (marker->type != EXIF_MARKER || marker->length < 2 + XMP_EXT_START ||
+            memcmp(marker->buffer, XMP_NS_EXTENSION, XMP_EXT_ID_LEN) != 0 ||
+            memcmp(marker->buffer + XMP_EXT_ID_LEN, guid.data(), XMP_GUID_LEN) != 0) continue;
+        unsigned long full = parse_value<uint32_t>(marker->buffer + XMP_EXT_ID_LEN + XMP_GUID_LEN, false);
+        unsigned long offset = parse_value<uint32_t>(marker->buffer + XMP_EXT_ID_LEN + XMP_GUID_LEN + 4, false);
+        unsigned long len = marker->length - 2 - XMP_EXT_START;
+        if (chunks.empty()) {
+            // The chunks can't hold more than the segments they came in, don't trust a larger length
+            if (full > AppMarkers.size() * (unsigned long)JPEG_SEGMENT_MAX) return false;
+            total = full;
+            packet->assign(total, '\0');
+        }
+        if (full != total || offset > total || len > total - offset) continue;
+        memcpy(&(*packet)[offset], marker->buffer + XMP_EXT_START, len);
+        chunks.push_back(std::make_pair(offset, len));
+    }
+
+    std::sort(chunks.begin(), chunks.end());
+    unsigned long covered = 0;
+    for (unsigned long i = 0; i < chunks.size() && chunks.at(i).first <= covered; i++) {
+        covered = std::max(covered, chunks.at(i).first + chunks.at(i).second);
+    }
+    if (chunks.empty() || covered != total) {
+        packet->clear();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Extract XMP properties from the standard packet, and from the ExtendedXMP packet for the properties
+ * which aren't in the standard one
+ * @param properties    Properties to find, normally commonXMPProperties().  The values are set.
+ * @return True if any of the properties was found
+ */
+bool exif::EXIFInfo::readXMP(std::vector<XMPProperty> *properties) const {
+    ByteView standard = xmpPacket();
+    int found = 0;
+    for (unsigned long i = 0; i < properties->size(); i++) {
+        properties->at(i).values.clear();
+    }
+    if (standard.size != 0) found = findXMPProperties((const char *)standard.data, standard.size, properties);
+    if (found == (int)properties->size()) return true;
 
-    // Sort entries in case new entries were added
-    for (unsigned long i=0; i<IFDirectories.size(); i++) {
-        std::sort(IFDirectories.at(i)->entries->begin(), IFDirectories.at(i)->entries->end(), tagComparator);
+    std::string extended;
+    if (!extendedXMP(&extended)) return found > 0;
+    std::vector<XMPProperty> missing;
+    for (unsigned long i = 0; i < properties->size(); i++) {
+        if (properties->at(i).values.empty()) missing.push_back(properties->at(i));
+    }
+    found += findXMPProperties(extended.data(), extended.size(), &missing);
+    for (unsigned long i = 0, j = 0; i < properties->size(); i++) {
+        if (properties->at(i).values.empty()) properties->at(i).values.swap(missing.at(j++).values);
     }
+    return found > 0;
+}
 
-    IFDirectory *IFD0 = getDirectory(IFD0_DIRECTORY);
-    if (IFD0 == NULL) return (uint16_t)offset;
+exif::MD5::MD5() {
+    reset();
+}
 
-    unsigned long end_ifd = offset;
-    unsigned long link_offset;
+/**
+ * Start a new hash
+ */
+void exif::MD5::reset() {
+    state_[0] = 0x67452301;
+    state_[1] = 0xefcdab89;
+    state_[2] = 0x98badcfe;
+    state_[3] = 0x10325476;
+    length_ = 0;
+}
 
-    // Keep track of any offset entries we add for encoding purposes and then remove them.
-    std::vector<exif::IFEntry> *tmpEntries = new std::vector<exif::IFEntry>;
+/**
+ * Hash one 64 byte block
+ * @param block     Block to hash
+ */
+void exif::MD5::transform(const unsigned char *block) {
+    static const uint32_t k[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const int r[16] = {7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21};
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++) m[i] = parse_value<uint32_t>(block + 4 * i, true);
 
-    // Put Interop IFD First
-    IFDirectory *InteropIFD = getDirectory(INTEROP_IFD_DIRECTORY);
-    if (InteropIFD ->entries->size() > 0){
-        unsigned long ifd_offset = end_ifd;
-        end_ifd = write_ifd_entries(InteropIFD->entries, buf, ifd_offset, &link_offset);
+    uint32_t a = state_[0], b = state_[1], c = state_[2], d = state_[3];
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        switch (i / 16) {
+            case 0: f = (b & c) | (~b & d); g = i; break;
+            case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+            case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+            default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+        }
+        int s = r[(i / 16) * 4 + i % 4];
+        f += a + k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += (f << s) | (f >> (32 - s));
+    }
+    state_[0] += a;
+    state_[1] += b;
+    state_[2] += c;
+    state_[3] += d;
+}
 
-        LOGD("Wrote %d Interop entries",(int)InteropIFD->entries->size());
-        // Add pointer to Interop IFD in Sub IFD directory
-        IFEntry *ifd_entry = new exif::IFEntry(EXIF_TAG_INTEROP_OFFSET, EXIF_IFD_DIRECTORY,  (int)ifd_offset - EXIF_START);
-        updateEntry(ifd_entry);
-        tmpEntries->push_back(*ifd_entry);
+/**
+ * Add data to the hash
+ * @param data  Data to add
+ * @param len   Length of the data
+ */
+void exif::MD5::update(const unsigned char *data, unsigned long len) {
+    unsigned long used = (unsigned long)(length_ % 64);
+    length_ += len;
+    if (used != 0) {
+        unsigned long take = std::min(len, 64 - used);
+        memcpy(block_ + used, data, take);
+        data += take;
+        len -= take;
+        if (used + take < 64) return;
+        transform(block_);
     }
+    for (; len >= 64; data += 64, len -= 64) transform(data);
+    memcpy(block_, data, len);
+}
 
-    // Put EXIF IFD next
-    IFDirectory *ExifIFD = getDirectory(EXIF_IFD_DIRECTORY);
-    if (ExifIFD->entries->size() > 0) {
-        unsigned long exif_ifd_offset = end_ifd;
-        end_ifd = write_ifd_entries(ExifIFD->entries, buf, exif_ifd_offset, &link_offset);
+/**
+ * Finish the hash.  The object has to be reset before it can be used again.
+ * @param digest    Output 16 byte digest
+ */
+void exif::MD5::finish(unsigned char digest[16]) {
+    uint64_t bits = length_ * 8;
+    unsigned char pad[72] = {0x80};
+    unsigned long used = (unsigned long)(length_ % 64);
+    unsigned long padLen = (used < 56 ? 56 : 120) - used;
+    for (int i = 0; i < 8; i++) pad[padLen + i] = (unsigned char)(bits >> (8 * i));
+    update(pad, padLen + 8);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) digest[4 * i + j] = (unsigned char)(state_[i] >> (8 * j));
+    }
+}
 
-        LOGD("Wrote %d Exif entries",(int)ExifIFD->entries->size());
-        // Add pointer to EXIF IFD in main IFD0 entry
-        IFEntry *exif_ifd_entry = new exif::IFEntry(EXIF_TAG_EXIF_IFD_OFFSET, IFD0_DIRECTORY, (int)exif_ifd_offset - EXIF_START);
-        updateEntry(exif_ifd_entry);
-        tmpEntries->push_back(*exif_ifd_entry);
+/**
+ * Get the embedded ICC profile as a scatter list over the APP2 marker buffers, nothing is copied.
+ * The views stay valid until the EXIFInfo is cleared, destroyed or read into again.
+ * @param chunks    Output parts of the profile in sequence order
+ * @return True if every chunk of the profile was found exactly once
+ */
+bool exif::EXIFInfo::iccChunks(std::vector<ByteView> *chunks) const {
+    chunks->clear();
+    unsigned count = 0;
+    for (unsigned long i = 0; i < AppMarkers.size(); i++) {
+        const AppMarker *marker = AppMarkers.at(i);
+        if (marker->type != ICC_MARKER || marker->length < 2 + ICC_START ||
+            memcmp(marker->buffer, "ICC_PROFILE\0", 12) != 0) continue;
+        unsigned seq = marker->buffer[12];
+        if (count == 0) {
+            count = marker->buffer[13];
+            ByteView none = {NULL, 0};
+            chunks->assign(count, none);
+        }
+        if (marker->buffer[13] != count || seq == 0 || seq > count || chunks->at(seq - 1).data != NULL) {
+            ERROR("Bad ICC profile chunk %u of %u", seq, (unsigned)marker->buffer[13]);
+            chunks->clear();
+            return false;
+        }
+        chunks->at(seq - 1).data = marker->buffer + ICC_START;
+        chunks->at(seq - 1).size = marker->length - 2 - ICC_START;
+    }
+    for (unsigned long i = 0; i < chunks->size(); i++) {
+        if (chunks->at(i).data == NULL) {
+            ERROR("ICC profile chunk %lu missing", i + 1);
+            chunks->clear();
+            return false;
+        }
     }
+    return count > 0;
+}
 
-    // Put GPS IFD next
-    IFDirectory *GPSIFD = getDirectory(GPS_IFD_DIRECTORY);
-    if (GPSIFD ->entries->size() > 0){
-        LOGD("Encoding %d GPS entries",(int)GPSIFD->entries->size());
-        unsigned long gps_ifd_offset = end_ifd;
-        end_ifd = write_ifd_entries(GPSIFD->entries, buf, gps_ifd_offset, &link_offset);
+/**
+ * Copy the embedded ICC profile into one buffer
+ * @param profile   Output profile
+ * @return True if every chunk of the profile was found exactly once
+ */
+bool exif::EXIFInfo::iccProfile(std::vector<unsigned char> *profile) const {
+    std::vector<ByteView> chunks;
+    profile->clear();
+    if (!iccChunks(&chunks)) return false;
+    unsigned long size = 0;
+    for (unsigned long i = 0; i < chunks.size(); i++) size += chunks.at(i).size;
+    profile->reserve(size);
+    for (unsigned long i = 0; i < chunks.size(); i++) {
+        profile->insert(profile->end(), chunks.at(i).data, chunks.at(i).data + chunks.at(i).size);
+    }
+    return true;
+}
 
-        LOGD("Wrote %d GPS entries",(int)GPSIFD->entries->size());
-        // Add pointer to GPSIFD in main IFD entry
-        IFEntry *gps_ifd_entry = new exif::IFEntry(EXIF_TAG_GPS_IFD_OFFSET, IFD0_DIRECTORY,  (int)gps_ifd_offset - EXIF_START);
-        updateEntry(gps_ifd_entry);
-        tmpEntries->push_back(*gps_ifd_entry);
+/**
+ * Get the ID of the embedded ICC profile, to cache colour transforms per profile.  This is the Profile ID
+ * of the header when it was set (ICC v4), otherwise it is computed the same way: the MD5 of the profile
+ * with the flags, rendering intent and profile ID fields zeroed.  So equal profiles get the same ID.
+ * @param id    Output 16 byte ID
+ * @return True if the image has a complete profile
+ */
+bool exif::EXIFInfo::iccProfileID(unsigned char id[16]) const {
+    std::vector<ByteView> chunks;
+    if (!iccChunks(&chunks)) return false;
+
+    // The header may be split over chunks, gather it first
+    unsigned char header[ICC_HEADER_SIZE];
+    unsigned long got = 0;
+    for (unsigned long i = 0; i < chunks.size() && got < ICC_HEADER_SIZE; i++) {
+        unsigned long take = std::min(chunks.at(i).size, ICC_HEADER_SIZE - got);
+        memcpy(header + got, chunks.at(i).data, take);
+        got += take;
+    }
+    if (got < ICC_HEADER_SIZE) {
+        ERROR("ICC profile shorter than its header");
+        return false;
+    }
+    static const unsigned char zero[16] = {0};
+    if (memcmp(header + ICC_PROFILE_ID_OFFSET, zero, 16) != 0) {
+        memcpy(id, header + ICC_PROFILE_ID_OFFSET, 16);
+        return true;
     }
 
-    // Put 10 IFD next
-    IFDirectory *IFD = getDirectory(EXIF_10_DIRECTORY);
-    if (IFD->entries->size() > 0) {
-        unsigned long ten_ifd_offset = end_ifd;
+    memset(header + 44, 0, 4);  // Profile flags
+    memset(header + 64, 0, 4);  // Rendering intent
+    MD5 md5;
+    md5.update(header, ICC_HEADER_SIZE);
+    unsigned long skip = ICC_HEADER_SIZE;
+    for (unsigned long i = 0; i < chunks.size(); i++) {
+        unsigned long from = std::min(skip, chunks.at(i).size);
+        md5.update(chunks.at(i).data + from, chunks.at(i).size - from);
+        skip -= from;
+    }
+    md5.finish(id);
+    return true;
+}
 
-        // Add 10 version to the 10 directory
-        IFEntry *ifd_entry = new exif::IFEntry(EXIF_10_VERSION, EXIF_10_DIRECTORY, CURR_10_VERSION);
-        updateEntry(ifd_entry);
+/**
+ * Get the policy for publishing images: the GPS directory, MakerNote, artist, owner name, body and lens serial
+ * numbers, unique image ID and the XMP packets are removed
+ * @return Policy for stripTIFF and stripJPEGFile
+ */
+exif::StripPolicy exif::privacyPolicy() {
+    static const TagId tags[] = {
+        {EXIF_TAG_ARTIST, IFD0_DIRECTORY},
+        {EXIF_TAG_MAKER_NOTE, EXIF_IFD_DIRECTORY},
+        {EXIF_CAMERA_OWNER_NAME, EXIF_IFD_DIRECTORY},
+        {EXIF_BODY_SERIAL_NUMBER, EXIF_IFD_DIRECTORY},
+        {EXIF_TAG_LENS_SERIAL_NUMBER, EXIF_IFD_DIRECTORY},
+        {EXIF_UNIQUE_IMAGE_ID, EXIF_IFD_DIRECTORY},
+    };
+    StripPolicy policy;
+    policy.tags.assign(tags, tags + sizeof(tags) / sizeof(TagId));
+    policy.directories.push_back(GPS_IFD_DIRECTORY);
+    policy.xmp = true;
+    return policy;
+}
 
-        end_ifd = write_ifd_entries(IFD->entries, buf, end_ifd, &link_offset);
+/**
+ * Write 2 bytes in the byte order of TIFF data
+ * @param buf               Buffer location to write data
+ * @param val               16 bit value to write
+ * @param isLittleEndian    Byte order of the TIFF data
+ */
+void write_tiff_2(unsigned char *buf, uint16_t val, bool isLittleEndian) {
+    buf[isLittleEndian ? 0 : 1] = (unsigned char)(val & 0xFF);
+    buf[isLittleEndian ? 1 : 0] = (unsigned char)(val >> 8);
+}
 
-        LOGD("Wrote %d 10 entries",(int)IFD->entries->size());
+/**
+ * Zero the value of an encoded entry if it is stored outside of the entry
+ * @param tiff              TIFF data
+ * @param len               Length of the TIFF data
+ * @param entry             Offset of the 12 byte entry
+ * @param isLittleEndian    Byte order of the TIFF data
+ */
+void blankEncodedValue(unsigned char *tiff, unsigned long len, unsigned long entry, bool isLittleEndian) {
+    uint64_t size = (uint64_t)exif::formatSize(exif::parse_value<uint16_t>(&tiff[entry + 2], isLittleEndian)) *
+                    exif::parse_value<uint32_t>(&tiff[entry + 4], isLittleEndian);
+    if (size <= 4) return;
+    unsigned long offset = exif::parse_value<uint32_t>(&tiff[entry + 8], isLittleEndian);
+    if (offset <= len && size <= len - offset) memset(&tiff[offset], 0, (size_t)size);
+}
 
-        // Add pointer to 10 IFD in main IFD entry
-        ifd_entry = new exif::IFEntry(EXIF_TAG_10_IFD_OFFSET, IFD0_DIRECTORY,  (int)ten_ifd_offset - EXIF_START);
-        updateEntry(ifd_entry);
-        tmpEntries->push_back(*ifd_entry);
+/**
+ * Remove an entry from an IFD of encoded TIFF data.  Its value is zeroed and the later entries and the link to
+ * the next IFD move up, so the IFD gets shorter but nothing else moves.
+ * @param tiff              TIFF data
+ * @param len               Length of the TIFF data
+ * @param ifd               Offset of the IFD, already checked by findEncodedEntry
+ * @param entry             Offset of the 12 byte entry
+ * @param isLittleEndian    Byte order of the TIFF data
+ */
+void removeEncodedEntry(unsigned char *tiff, unsigned long len, unsigned long ifd, unsigned long entry,
+                        bool isLittleEndian) {
+    blankEncodedValue(tiff, len, entry, isLittleEndian);
+    uint16_t num_entries = exif::parse_value<uint16_t>(&tiff[ifd], isLittleEndian);
+    unsigned long end = ifd + 2 + (unsigned long)num_entries * ENTRY_SIZE + 4;
+    memmove(&tiff[entry], &tiff[entry + ENTRY_SIZE], end - entry - ENTRY_SIZE);
+    memset(&tiff[end - ENTRY_SIZE], 0, ENTRY_SIZE);
+    write_tiff_2(&tiff[ifd], (uint16_t)(num_entries - 1), isLittleEndian);
+}
+
+/**
+ * Remove the tags of a policy from encoded TIFF data in place.  Nothing is moved so the length stays the same:
+ * the values are zeroed and the entries are taken out of their IFDs, whose later entries move up.
+ * @param tiff      TIFF data starting with the TIFF header
+ * @param len       Length of the TIFF data
+ * @param policy    Tags and directories to remove
+ * @return Number of tags removed, or -1 if the data doesn't start with a TIFF header
+ */
+int exif::stripTIFF(unsigned char *tiff, unsigned long len, const StripPolicy &policy) {
+    if (len < 8 || !isTIFFHeader(tiff, len)) return -1;
+    bool isLittleEndian = tiff[0] == 'I';
+    int removed = 0;
+    unsigned long entry;
+
+    for (unsigned long i = 0; i < policy.tags.size(); i++) {
+        const TagId &id = policy.tags.at(i);
+        unsigned long ifd = findEncodedIFD(tiff, len, isLittleEndian, id.directory);
+        while (findEncodedEntry(tiff, len, ifd, isLittleEndian, id.tag, &entry)) {
+            removeEncodedEntry(tiff, len, ifd, entry, isLittleEndian);
+            removed++;
+        }
     }
 
-    // Put IFD0 (Thumbnail) next
-    IFDirectory *IFD1 = getDirectory(IFD1_DIRECTORY);
-    unsigned long ifd1_offset = end_ifd;
-    if (IFD1 ->entries->size() > 0){
-        end_ifd = write_ifd_entries(IFD1->entries, buf, ifd1_offset, &link_offset);
-        LOGD("Wrote %d IFD1 entries starting at %x ",(int)IFD1->entries->size(),(unsigned int)ifd1_offset);
+    for (unsigned long i = 0; i < policy.directories.size(); i++) {
+        uint8_t dir = policy.directories.at(i);
+        unsigned long ifd = findEncodedIFD(tiff, len, isLittleEndian, dir);
+        if (ifd == 0 || ifd + 2 > len) continue;
+        unsigned long num_entries = parse_value<uint16_t>(&tiff[ifd], isLittleEndian);
+        if (ifd + 2 + num_entries * ENTRY_SIZE + 4 > len) continue;
+
+        // Unlink the directory first, its IFD may be needed to find it
+        uint16_t link = 0;
+        unsigned long parent = findEncodedIFD(tiff, len, isLittleEndian, IFD0_DIRECTORY);
+        switch (dir) {
+            case IFD1_DIRECTORY:
+                memset(&tiff[parent + 2 + parse_value<uint16_t>(&tiff[parent], isLittleEndian) * ENTRY_SIZE], 0, 4);
+                break;
+            case EXIF_IFD_DIRECTORY: link = EXIF_TAG_EXIF_IFD_OFFSET; break;
+            case GPS_IFD_DIRECTORY: link = EXIF_TAG_GPS_IFD_OFFSET; break;
+            case EXIF_10_DIRECTORY: link = EXIF_TAG_10_IFD_OFFSET; break;
+            case INTEROP_IFD_DIRECTORY:
+                link = EXIF_TAG_INTEROP_OFFSET;
+                parent = findEncodedIFD(tiff, len, isLittleEndian, EXIF_IFD_DIRECTORY);
+                break;
+            default: continue;
+        }
+        if (link != 0 && findEncodedEntry(tiff, len, parent, isLittleEndian, link, &entry)) {
+            // The link's value is the IFD offset, not a value to blank
+            memset(&tiff[entry + 8], 0, 4);
+            removeEncodedEntry(tiff, len, parent, entry, isLittleEndian);
+        }
+
+        for (unsigned long j = 0; j < num_entries; j++) {
+            blankEncodedValue(tiff, len, ifd + 2 + j * ENTRY_SIZE, isLittleEndian);
+        }
+        memset(&tiff[ifd], 0, 2 + num_entries * ENTRY_SIZE + 4);
+        removed += (int)num_entries;
     }
+    return removed;
+}
 
-    // Place first ifd after the final ifd data
-    write_buffer_4(&buf[first_ifd_offset], (u_int32_t) end_ifd - EXIF_START);
-    unsigned long end_ifd0 = write_ifd_entries(IFD0->entries, buf, end_ifd, &link_offset);
-    if (IFD1 ->entries->size() > 0) {
-        write_buffer_4(&buf[link_offset],
-                       (u_int32_t) ifd1_offset - EXIF_START); // Link IFD1 if we have that directory
-        LOGD("Added link to IFD1 at %x", (unsigned int) ifd1_offset - EXIF_START);
+/**
+ * Copy a range of one file to the end of another.  On Linux the kernel copies it with copy_file_range, or
+ * sendfile where that isn't supported, so the data doesn't pass through user space.
+ * @param in        File to copy from
+ * @param out       File to append to
+ * @param offset    Offset of the range in the input file
+ * @param len       Length of the range
+ * @return True if the whole range was copied
+ */
+bool copyFileRange(FILE *in, FILE *out, unsigned long offset, unsigned long len) {
+    if (fflush(out) != 0) return false;
+#ifdef __linux__
+    loff_t inOffset = (loff_t)offset;
+#ifdef SYS_copy_file_range
+    while (len > 0) {
+        long n = syscall(SYS_copy_file_range, fileno(in), &inOffset, fileno(out), NULL, (size_t)len, 0);
+        if (n <= 0) break;
+        len -= (unsigned long)n;
     }
-    // Now that we are done writing the encoded buffer, remove all of the temporary offset entries
-    for (unsigned long i=0; i<tmpEntries->size(); i++) {
-        removeEntry(tmpEntries->at(i).tag(),tmpEntries->at(i).directory());
+#endif
+    while (len > 0) {
+        off_t sendOffset = (off_t)inOffset;
+        ssize_t n = sendfile(fileno(out), fileno(in), &sendOffset, (size_t)len);
+        if (n <= 0) break;
+        inOffset = sendOffset;
+        len -= (unsigned long)n;
     }
-    tmpEntries->clear();
-
-    return (uint16_t) (end_ifd0 + 4);
+    offset = (unsigned long)inOffset;
+    if (len == 0) return true;
+    // Carry on with stdio from where the kernel stopped
+    if (fseek(out, 0, SEEK_END) != 0) return false;
+#endif
+    std::vector<unsigned char> buf(PREFETCH_WINDOW);
+    if (fseek(in, (long)offset, SEEK_SET) != 0) return false;
+    while (len > 0) {
+        size_t n = fread(buf.data(), 1, (size_t)std::min(len, (unsigned long)buf.size()), in);
+        if (n == 0 || fwrite(buf.data(), 1, n, out) != n) return false;
+        len -= n;
+    }
+    return true;
 }
 
 /**
- * Compute an approximate size for the header buffer
- * @param exifInfo EXIFInfo to compute size for
- * @return approximate size of buffer
+ * Strip a JPEG file with stripTIFF.  Only the metadata segments before the image data are read and rewritten,
+ * all of them keep their length.  The image data is copied by the kernel (copy_file_range or sendfile on
+ * Linux), or not at all when the file is stripped in place.
+ * @param inputFile     JPEG file to strip
+ * @param outputFile    File to write, or empty to change the input file in place
+ * @param policy        Tags and directories to remove
+ * @param removed       Output number of tags removed, may be NULL
+ * @return False if the file isn't a JPEG or can't be read or written
  */
-unsigned long getApproxSize(exif::EXIFInfo *exifInfo) {
-    unsigned long size = 0xFF; // Add Some padding
-    for (unsigned long i = 0; i < exifInfo->IFDirectories.size(); i++) {
-        size += exifInfo->IFDirectories.at(i)->entries->size()*ENTRY_SIZE + 4;
-        for (unsigned long j=0; j<exifInfo->IFDirectories.at(i)->entries->size(); j++) {
-            size += exifInfo->IFDirectories.at(i)->entries->at(j).length();
+bool exif::stripJPEGFile(const std::string &inputFile, const std::string &outputFile, const StripPolicy &policy,
+                         int *removed) {
+    if (removed != NULL) *removed = 0;
+    std::vector<unsigned char> header;
+    unsigned long size;
+    {
+        FileSource file(inputFile);
+        if (!file.isOpen()) {
+            ERROR("File not found %s", inputFile.c_str());
+            return false;
         }
+        PrefetchSource src(file);
+        size = src.size();
+        const unsigned char *buf = src.readAt(0, 2);
+        if (buf == NULL || parse_value<uint16_t>(buf, false) != JPEG_SOI) {
+            ERROR("Not a JPEG file %s", inputFile.c_str());
+            return false;
+        }
+        // Read up to the end of the last App marker, like getDataStart
+        unsigned long offs = 2, end = 2;
+        JPEGMarker marker;
+        while (nextJPEGMarker(src, offs, &marker) && marker.type != JPEG_SOS && marker.type != JPEG_EOI) {
+            offs = marker.offset + 2 + marker.length;
+            if (isHeaderMarker(marker.type)) end = std::min(offs, size);
+        }
+        buf = src.readAt(0, end);
+        if (buf == NULL) return false;
+        header.assign(buf, buf + end);
     }
-    for (unsigned long i = 0; i < exifInfo->AppMarkers.size(); i++) {
-        size += exifInfo->AppMarkers.at(i)->length+4;
+
+    MemorySource src(header.data(), header.size());
+    unsigned long offs = 2;
+    int count = 0;
+    JPEGMarker marker;
+    std::vector<std::pair<unsigned long, unsigned long> > pieces;
+    std::vector<unsigned char> gathered;
+    while (nextJPEGMarker(src, offs, &marker) && marker.length >= 2 &&
+           marker.offset + 2 + marker.length <= header.size()) {
+        unsigned char *data = &header[marker.offset + 4];
+        unsigned long len = marker.length - 2;
+        offs = marker.offset + 2 + marker.length;
+        if (marker.type != EXIF_MARKER) continue;
+        if (len >= EXIF_START && memcmp(data, "Exif\0\0", EXIF_START) == 0) {
+            pieces.clear();
+            if (marker.length == JPEG_SEGMENT_MAX) offs = findExifContinuations(src, offs, &pieces);
+            if (pieces.empty()) {
+                count += std::max(0, stripTIFF(data + EXIF_START, len - EXIF_START, policy));
+                continue;
+            }
+            // Extended EXIF: strip a gathered copy and put the pieces back where they came from
+            gathered.assign(data + EXIF_START, data + len);
+            for (unsigned long i = 0; i < pieces.size(); i++) {
+                gathered.insert(gathered.end(), &header[pieces.at(i).first],
+                                &header[pieces.at(i).first] + pieces.at(i).second);
+            }
+            count += std::max(0, stripTIFF(gathered.data(), gathered.size(), policy));
+            unsigned long from = len - EXIF_START;
+            memcpy(data + EXIF_START, gathered.data(), from);
+            for (unsigned long i = 0; i < pieces.size(); i++) {
+                memcpy(&header[pieces.at(i).first], &gathered[from], pieces.at(i).second);
+                from += pieces.at(i).second;
+            }
+        } else if (policy.xmp && ((len >= XMP_START && memcmp(data, XMP_NS_XMP, XMP_START) == 0) ||
+                                  (len >= XMP_EXT_ID_LEN && memcmp(data, XMP_NS_EXTENSION, XMP_EXT_ID_LEN) == 0))) {
+            // Keep the length, the segment becomes an empty comment
+            header[marker.offset + 1] = 0xFE;
+            memset(data, 0, len);
+            count++;
+        }
     }
-    return size;
+    if (removed != NULL) *removed = count;
+
+    if (outputFile.empty() || outputFile == inputFile) {
+        if (count == 0) return true;
+        FILE *fp = fopen(inputFile.c_str(), "r+b");
+        if (fp == NULL) {
+            ERROR("Can't open %s for writing", inputFile.c_str());
+            return false;
+        }
+        bool ok = fwrite(header.data(), 1, header.size(), fp) == header.size();
+        return fclose(fp) == 0 && ok;
+    }
+    FILE *in = fopen(inputFile.c_str(), "rb");
+    FILE *out = fopen(outputFile.c_str(), "wb");
+    bool ok = in != NULL && out != NULL && fwrite(header.data(), 1, header.size(), out) == header.size() &&
+              copyFileRange(in, out, header.size(), size - header.size());
+    if (in != NULL) fclose(in);
+    if (out != NULL && fclose(out) != 0) ok = false;
+    if (!ok) ERROR("Can't write %s", outputFile.c_str());
+    return ok;
 }
 
 /**
- * Write the JPEG EXIF data in a buffer starting with the JPEG_SOI
- * @param buf   Newly created buffer containing the data
- * @param len   Output the length of the generated buffer
+ * Get the policy for detecting metadata changes: the software, the modify date/time and the thumbnail
+ * directory are left out since editors rewrite them on every save
+ * @return Policy for fingerprint
  */
-void exif::EXIFInfo::encodeJPEGHeader(unsigned char **buf,
-                                      unsigned long *len) {
+exif::FingerprintPolicy exif::fingerprintPolicy() {
+    static const TagId tags[] = {
+        {EXIF_TAG_SOFTWARE, IFD0_DIRECTORY},
+        {EXIF_TAG_MODIFY_DATE_TIME, IFD0_DIRECTORY},
+    };
+    FingerprintPolicy policy;
+    policy.ignore.assign(tags, tags + sizeof(tags) / sizeof(TagId));
+    policy.directories.push_back(IFD1_DIRECTORY);
+    return policy;
+}
 
-    unsigned long init_size = getApproxSize(this);
-    LOGD("Initial size is %lu",init_size);
-    unsigned char *tmp = (unsigned char *) malloc((size_t) init_size);
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
 
-    //   2 bytes: 0xFFD8 (big-endian)
-    // EXIF header
-    //   2 bytes: 0xFFE1 (big-endian)
-    //   2 bytes: section size
+/**
+ * Final avalanche of MurmurHash3
+ * @param k     Value to mix
+ * @return Mixed value
+ */
+uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
 
-    unsigned long offset = 0;
-    offset += write_buffer_2(&tmp[offset], JPEG_SOI);
+/**
+ * MurmurHash3 x64 128, with a 64 bit seed for both halves.  The blocks are read in host byte order, which is
+ * little endian as exif.h requires.
+ * @param data  Data to hash
+ * @param len   Length of the data
+ * @param seed  Seed
+ * @param out   Output 128 bit hash
+ */
+void murmur3_128(const unsigned char *data, unsigned long len, uint64_t seed, uint64_t out[2]) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = seed, h2 = seed, k1, k2;
 
-    // EXIF header (APP1 Marker)
-    offset += write_buffer_2(&tmp[offset], EXIF_MARKER);
-    unsigned long size_offset = offset;
-    offset +=2; // skip size
-    LOGD("Exif segment start %x",(int)offset);
-    uint16_t exif_size = encodeEXIFsegment(&tmp[offset]);
-    LOGD("Exif segment length to write %x",exif_size);
-    write_buffer_2(&tmp[size_offset], exif_size);
+    unsigned long nblocks = len / 16;
+    for (unsigned long i = 0; i < nblocks; i++) {
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
 
-    offset += exif_size-2; // Includes 2 bytes for size
-    //Encode other segments
-    for (unsigned long i=0; i<AppMarkers.size(); i++) {
-        LOGD("Start marker 0x%x at 0x%x",AppMarkers.at(i)->type,(int)offset);
-        offset += write_app_marker(&tmp[offset],AppMarkers.at(i));
+    const unsigned char *tail = data + nblocks * 16;
+    unsigned long rem = len & 15;
+    k1 = k2 = 0;
+    for (unsigned long i = 8; i < rem; i++) {
+        k2 ^= (uint64_t)tail[i] << ((i - 8) * 8);
     }
-    LOGD("Total header len %lu",offset);
-    *len = offset;
-    *buf = (unsigned char *)realloc(tmp, *len);
+    if (rem > 8) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (unsigned long i = 0; i < rem && i < 8; i++) {
+        k1 ^= (uint64_t)tail[i] << (i * 8);
+    }
+    if (rem > 0) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
 }
 
 /**
- * Return a pointer to the IFEntry with given tag, otherwise NULL if entry not found
- * @param tag   Input tag to get
- * @param dir   Directory tag is in
- * @return pointer to the IFEntry found or NULL
+ * Get the size of the units swapped to normalise the byte order of a format
+ * @param format    Entry format
+ * @return 1 for bytes and strings, 2 or 4, or 0 for formats whose values aren't decoded
  */
-exif::IFEntry* exif::EXIFInfo::getTagData(uint16_t tag, uint8_t dir) {
-    IFDirectory *directory = getDirectory(dir);
-    if (directory == NULL) return NULL;
-
-    std::vector<exif::IFEntry> *entries = directory->entries;
-    for (unsigned long i = 0; i < entries->size(); i++) {
-        IFEntry *entry = &entries->at(i);
-        if (entry->tag() == tag) return entry;
+unsigned fingerprintUnit(uint16_t format) {
+    switch (format) {
+        case ENTRY_FORMAT_BYTE:
+        case ENTRY_FORMAT_ASCII:
+        case ENTRY_FORMAT_UNDEFINED: return 1;
+        case ENTRY_FORMAT_SHORT: return 2;
+        case ENTRY_FORMAT_LONG:
+        case ENTRY_FORMAT_RATIONAL:
+        case ENTRY_FORMAT_SRATIONAL: return 4;
+        default: return 0;
     }
-
-    return NULL;
 }
 
 /**
- * Remove the IFEntry with given tag and return the index which was removed.  If entry didn't exist return -1.
- * @param tag   Input entry tag to remove
- * @param dir   Directory tag is in
- * @return index removed or -1 if nothing to remove
+ * Visitor hashing the canonical form of the entries.  Each entry is hashed on its own, seeded with its
+ * directory, tag, format and count, and the entry hashes are added up so the order of the entries doesn't matter.
  */
-int exif::EXIFInfo::removeEntry(uint16_t tag, uint8_t dir) {
-    IFDirectory *directory = getDirectory(dir);
-    if (directory == NULL) return -1;
-    std::vector<exif::IFEntry> *entries = directory->entries;
-    for (unsigned long i = 0; i < entries->size(); i++) {
-        IFEntry *entry = &entries->at(i);
-        if (entry->tag() == tag) {
-            entries->erase(entries->begin() + i);
-            return (int)i;
+class FingerprintVisitor : public exif::TagVisitor {
+public:
+    explicit FingerprintVisitor(const exif::FingerprintPolicy &policy) : policy_(policy), hi_(0), lo_(0), count_(0) {}
+
+    bool wants(uint8_t dir, uint16_t tag) {
+        if (isLayoutTag(dir, tag)) return false;
+        for (unsigned long i = 0; i < policy_.directories.size(); i++) {
+            if (policy_.directories[i] == dir) return false;
         }
+        for (unsigned long i = 0; i < policy_.ignore.size(); i++) {
+            if (policy_.ignore[i].tag == tag && policy_.ignore[i].directory == dir) return false;
+        }
+        return true;
     }
-    return -1;
-}
+
+    void visit(uint8_t dir, uint16_t tag, uint16_t format, uint32_t count, const unsigned char *value,
+               bool isLittleEndian) {
+        unsigned unit = fingerprintUnit(format);
+        if (unit == 0) {
+            add(dir, tag, format, count, NULL, 0, isLittleEndian);
+        } else if (value != NULL) {
+            add(dir, tag, format, count, value, (unsigned long)exif::formatSize(format) * count, isLittleEndian);
+        }
+    }
+
+    /**
+     * Hash an entry
+     * @param dir               Directory of the entry
+     * @param tag               Tag id
+     * @param format            Entry format
+     * @param count             Number of values, not hashed for ASCII values
+     * @param value             Values, NULL for formats whose values aren't hashed
+     * @param len               Length of the values in bytes
+     * @param isLittleEndian    Byte order of the values
+     */
+    void add(uint8_t dir, uint16_t tag, uint16_t format, uint32_t count, const unsigned char *value,
+             unsigned long len, bool isLittleEndian) {
+        unsigned unit = fingerprintUnit(format);
+        if (format == ENTRY_FORMAT_ASCII) {
+            while (len > 0 && value[len - 1] == 0) len--;
+            count = 0;
+        } else if (unit > 1 && isLittleEndian) {
+            scratch_.resize(len);
+            for (unsigned long i = 0; i + unit <= len; i += unit) {
+                for (unsigned j = 0; j < unit; j++) scratch_[i + j] = value[i + unit - 1 - j];
+            }
+            value = scratch_.data();
+        }
+        uint64_t seed = (uint64_t)dir << 56 | (uint64_t)tag << 40 | (uint64_t)format << 32 | count;
+        uint64_t hash[2];
+        murmur3_128(value, len, seed, hash);
+        hi_ += hash[0];
+        lo_ += hash[1];
+        count_++;
+    }
+
+    /**
+     * Mix the entry hashes and their number into the fingerprint
+     * @param fp    Output fingerprint
+     */
+    void finish(exif::Fingerprint *fp) const {
+        uint64_t h1 = fmix64(hi_ ^ count_);
+        uint64_t h2 = fmix64(lo_ + count_);
+        h1 += h2;
+        h2 += h1;
+        fp->hi = h1;
+        fp->lo = h2;
+    }
+
+private:
+    const exif::FingerprintPolicy &policy_;
+    uint64_t hi_;
+    uint64_t lo_;
+    uint64_t count_;
+    std::vector<unsigned char> scratch_;    // Values swapped to big endian
+};
 
 /**
- * Update the directory for the given entry.  Removes the tag if it exists and then adds it back in.
- * @param entry     New entry data to update
+ * Hash the EXIF data of a JPEG, TIFF, HEIF, PNG or WebP file in one walkTIFF pass, without building an EXIFInfo.
+ * @param src       Source of the file
+ * @param policy    Tags to leave out, normally fingerprintPolicy()
+ * @param fp        Output fingerprint
+ * @return False if no EXIF data was found
  */
-void exif::EXIFInfo::updateEntry(exif::IFEntry *entry) {
-    removeEntry(entry->tag(),entry->directory());
+bool exif::fingerprint(ByteSource &src, const FingerprintPolicy &policy, Fingerprint *fp) {
+    unsigned long offset, len;
+    if (!locateTIFF(src, &offset, &len)) return false;
 
-    std::vector<exif::IFEntry> *entries = getDirectory(entry->directory())->entries;
-    entries->push_back(*entry);
+    // Extended EXIF continues in the following APP1 segments
+    std::vector<std::pair<unsigned long, unsigned long> > pieces;
+    const unsigned char *buf = src.readAt(0, 2);
+    if (len == JPEG_SEGMENT_MAX - 2 - EXIF_START && buf != NULL && parse_value<uint16_t>(buf, false) == JPEG_SOI) {
+        findExifContinuations(src, offset + len, &pieces);
+    }
+    FingerprintVisitor visitor(policy);
+    bool found;
+    if (pieces.empty()) {
+        SubSource tiff(src, offset, len);
+        found = walkTIFF(tiff, visitor);
+    } else {
+        std::vector<unsigned char> gathered;
+        pieces.insert(pieces.begin(), std::make_pair(offset, len));
+        for (unsigned long i = 0; i < pieces.size(); i++) {
+            buf = src.readAt(pieces.at(i).first, pieces.at(i).second);
+            if (buf == NULL) return false;
+            gathered.insert(gathered.end(), buf, buf + pieces.at(i).second);
+        }
+        MemorySource tiff(gathered.data(), gathered.size());
+        found = walkTIFF(tiff, visitor);
+    }
+    visitor.finish(fp);
+    return found;
 }
 
 /**
- * Clear the EXIFInfo data
+ * Hash the decoded tags the same way as exif::fingerprint, which gives the same result for the entries
+ * whose values could be read.  Edited tags are included.
+ * @param policy    Tags to leave out, normally fingerprintPolicy()
+ * @param fp        Output fingerprint
  */
-void exif::EXIFInfo::clear() {
-    for (unsigned long i=0; i<IFDirectories.size(); i++) {
-        IFDirectories.at(i)->entries->clear();
+void exif::EXIFInfo::fingerprint(const FingerprintPolicy &policy, Fingerprint *fp) const {
+    FingerprintVisitor visitor(policy);
+    for (unsigned long i = 0; i < IFDirectories.size(); i++) {
+        const IFDirectory *dir = IFDirectories.at(i);
+        for (unsigned long j = 0; j < dir->entries->size(); j++) {
+            const IFEntry &entry = dir->entries->at(j);
+            if (!visitor.wants(dir->type, entry.tag())) continue;
+            unsigned unit = fingerprintUnit(entry.format());
+            ByteView value = entryValueBytes(entry);
+            if (unit == 0) {
+                value.data = NULL;
+                value.size = 0;
+            } else if (entry.format() != ENTRY_FORMAT_ASCII &&
+                       value.size != (unsigned long)formatSize(entry.format()) * entry.length()) {
+                continue;   // The value couldn't be read
+            }
+            // The values are in host byte order, and exif.h only builds on little endian hosts
+            visitor.add(dir->type, entry.tag(), entry.format(), entry.length(), value.data, value.size, true);
+        }
     }
-    IFDirectories.clear();
+    visitor.finish(fp);
 }
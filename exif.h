@@ -34,6 +34,9 @@
 #include <cstring>
 #include <vector>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 
 //#define DEBUG
 #define LOG_TAG "Exif"
@@ -72,10 +75,112 @@
 #define ENTRY_SIZE  12
 #define EXIF_START  6
 #define JPEG_SOI    0xFFD8
+#define JPEG_EOI    0xFFD9
+#define JPEG_SOS    0xFFDA  // Start of scan, the entropy coded image data follows its segment
 #define EXIF_MARKER 0xFFE1
+#define JPEG_SEGMENT_MAX 0xFFFF // Largest JPEG segment length, including the 2 length bytes
 #define MAX_TO_PRINT 10
+#define JPEG_RECOVERY_WINDOW 0x10000 // Bytes searched for the next marker after garbage between JPEG segments
+#define RECOVER_WINDOW  0x1000000 // Default number of bytes recoverEXIF searches
+#define RECOVER_MAX_CANDIDATES 16 // Most "Exif\0\0" blocks recoverEXIF decodes
+#define PREFETCH_WINDOW 65536   // Default size of the speculative first read of a PrefetchSource
+#define PREFETCH_GAP    4096    // Reads this close together are coalesced into one request
+#define SCAN_QUEUE_DEPTH 256    // Default number of reads scanFiles keeps in flight
+#define STREAM_MAX_EXIF 0x100000 // Default limit of Extended EXIF data gathered by a StreamDecoder
+
+// Status of StreamDecoder
+#define STREAM_NEED_MORE    0   // The metadata isn't complete yet
+#define STREAM_DONE         1   // All of the metadata was decoded, the rest of the stream is image data
+#define STREAM_ERROR        -1  // Not a JPEG stream or the EXIF data couldn't be decoded
 #define CURR_10_VERSION  1
 
+// ISOBMFF box and item types used to find the Exif item in HEIF files
+#define BOX_FTYP        0x66747970  // "ftyp"
+#define BOX_META        0x6D657461  // "meta"
+#define BOX_IINF        0x69696E66  // "iinf"
+#define BOX_INFE        0x696E6665  // "infe"
+#define BOX_ILOC        0x696C6F63  // "iloc"
+#define BOX_IDAT        0x69646174  // "idat"
+#define ITEM_TYPE_EXIF  0x45786966  // "Exif"
+
+// PNG and WebP (RIFF) chunk types holding EXIF data
+#define PNG_CHUNK_EXIF  0x65584966  // "eXIf"
+#define PNG_CHUNK_IEND  0x49454E44  // "IEND"
+#define RIFF_CHUNK_EXIF 0x45584946  // "EXIF"
+
+// Container formats recognised by detectContainer
+#define CONTAINER_UNKNOWN   0
+#define CONTAINER_JPEG      1
+#define CONTAINER_TIFF      2
+#define CONTAINER_HEIF      3
+#define CONTAINER_PNG       4
+#define CONTAINER_WEBP      5
+
+// Multi-Picture Format (CIPA DC-007) APP2 segment
+#define MPF_MARKER              0xFFE2
+#define MPF_START               4       // "MPF\0"
+#define MPF_TAG_VERSION         0xB000
+#define MPF_TAG_NUMBER_OF_IMAGES 0xB001
+#define MPF_TAG_MP_ENTRY        0xB002
+#define MP_ENTRY_SIZE           16
+#define MP_TYPE_MASK            0x00FFFFFF
+#define MP_TYPE_PRIMARY         0x030000
+#define MP_TYPE_LARGE_THUMBNAIL_VGA     0x010001
+#define MP_TYPE_LARGE_THUMBNAIL_FULLHD  0x010002
+#define MP_TYPE_PANORAMA        0x020001
+#define MP_TYPE_DISPARITY       0x020002
+#define MP_TYPE_MULTI_ANGLE     0x020003
+
+// ICC profile APP2 segments: "ICC_PROFILE\0", the 1 based sequence number and the number of segments
+#define ICC_MARKER              0xFFE2
+#define ICC_START               14
+#define ICC_HEADER_SIZE         128
+#define ICC_PROFILE_ID_OFFSET   84      // MD5 of the profile in the header, all zero if not computed
+
+// XMP APP1 segments and the namespaces of the common properties
+#define XMP_NS_XMP      "http://ns.adobe.com/xap/1.0/"          // Also the id of the standard packet segment
+#define XMP_NS_XMP_NOTE "http://ns.adobe.com/xmp/note/"
+#define XMP_NS_EXTENSION "http://ns.adobe.com/xmp/extension/"   // Id of the ExtendedXMP segments
+#define XMP_NS_DC       "http://purl.org/dc/elements/1.1/"
+#define XMP_NS_EXIF     "http://ns.adobe.com/exif/1.0/"
+#define XMP_NS_RDF      "http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+#define XMP_START       29      // XMP_NS_XMP and a 0 byte
+#define XMP_EXT_ID_LEN  35      // XMP_NS_EXTENSION and a 0 byte
+#define XMP_GUID_LEN    32      // Hex MD5 of the extended packet
+#define XMP_EXT_START   75      // Id, GUID, 4 byte full length and 4 byte offset of the chunk
+
+// Fields extracted by decodeBatch
+#define BATCH_FIELD_MAKE            0   // String, IFD0 camera make
+#define BATCH_FIELD_MODEL           1   // String, IFD0 camera model
+#define BATCH_FIELD_LENS_MODEL      2   // String
+#define BATCH_FIELD_ORIENTATION     3   // Int64, 1-8
+#define BATCH_FIELD_IMAGE_WIDTH     4   // Int64, EXIF image width or IFD0 image width
+#define BATCH_FIELD_IMAGE_HEIGHT    5   // Int64, EXIF image height or IFD0 image height
+#define BATCH_FIELD_CAPTURE_TIME    6   // Int64, original date/time as seconds since 1970 of the wall clock time
+#define BATCH_FIELD_EXPOSURE_TIME   7   // Double, seconds
+#define BATCH_FIELD_FNUMBER         8   // Double
+#define BATCH_FIELD_ISO             9   // Int64
+#define BATCH_FIELD_FOCAL_LENGTH    10  // Double, mm
+#define BATCH_FIELD_GPS_LATITUDE    11  // Double, decimal degrees
+#define BATCH_FIELD_GPS_LONGITUDE   12  // Double, decimal degrees
+#define BATCH_FIELD_GPS_ALTITUDE    13  // Double, meters
+#define BATCH_NUM_FIELDS            14
+
+// Column types of BatchColumn
+#define COLUMN_INT64    0
+#define COLUMN_DOUBLE   1
+#define COLUMN_STRING   2
+
+// Flags of ExifSummary
+#define SUMMARY_HAS_SIZE            0x01
+#define SUMMARY_HAS_CAPTURE_TIME    0x02
+#define SUMMARY_HAS_GPS             0x04
+#define SUMMARY_HAS_ALTITUDE        0x08
+#define SUMMARY_HAS_EXPOSURE_TIME   0x10
+#define SUMMARY_HAS_FNUMBER         0x20
+#define SUMMARY_HAS_ISO             0x40
+#define SUMMARY_HAS_FOCAL_LENGTH    0x80
+
 // Exif defined format types
 #define ENTRY_FORMAT_BYTE       1
 #define ENTRY_FORMAT_ASCII      2
@@ -96,6 +201,11 @@
 #define IFD1_DIRECTORY          5
 #define EXIF_10_DIRECTORY      10
 
+// Changes reported by EXIFInfo::diff
+#define TAG_ADDED               1
+#define TAG_REMOVED             2
+#define TAG_CHANGED             3
+
 // See http://www.cipa.jp/std/documents/e/DC-008-Translation-2016-E.pdf for definitions
 // Tags used in IFD0 (Primary Image) and IFD1 (Thumbnail) directory
 #define EXIF_TAG_IFD_IMAGE_WIDTH    0x0100
@@ -142,6 +252,9 @@
 #define EXIF_TAG_EXIF_VERSION       0x9000
 #define EXIF_TAG_ORIGINAL_DATE      0x9003
 #define EXIF_TAG_DIGITIZATION_DATE  0x9004
+#define EXIF_TAG_OFFSET_TIME        0x9010
+#define EXIF_TAG_OFFSET_TIME_ORIG   0x9011
+#define EXIF_TAG_OFFSET_TIME_DIGITIZED 0x9012
 #define EXIF_TAG_COMPONENTS_CONFIG  0x9101
 #define EXIF_TAG_COMPRESSED_BPP     0x9102
 #define EXIF_TAG_SHUTTER_SPEED      0x9201
@@ -308,7 +421,7 @@ namespace exif {
          * Output Rational number as a string in simplified format
          * @return
          */
-        std::string toString() {
+        std::string toString() const {
             char tmp[50];
 
             if (denominator == 1)
@@ -341,7 +454,7 @@ namespace exif {
          * Output Signed Rational number as a string in simplified format
          * @return
          */
-        std::string toString() {
+        std::string toString() const {
             char tmp[50];
 
             if (denominator == 1)
@@ -357,6 +470,86 @@ namespace exif {
         }
     };
 
+    /**
+     * Streaming MD5 (RFC 1321).  Used for ICC profile IDs, which are defined as the MD5 of the profile.
+     */
+    class MD5 {
+    public:
+        MD5();
+
+        /**
+         * Add data to the hash
+         * @param data  Data to add
+         * @param len   Length of the data
+         */
+        void update(const unsigned char *data, unsigned long len);
+
+        /**
+         * Finish the hash.  The object has to be reset before it can be used again.
+         * @param digest    Output 16 byte digest
+         */
+        void finish(unsigned char digest[16]);
+
+        void reset();
+
+    private:
+        uint32_t state_[4];
+        uint64_t length_;           // Bytes added so far
+        unsigned char block_[64];   // Partial block
+
+        void transform(const unsigned char *block);
+    };
+
+    /**
+     * Thread-safe pool of interned strings.  Equal strings decoded from many images are only stored once, which
+     * saves memory for tags like Make and Model that have few distinct values across a corpus.  The pool can be
+     * shared between threads and EXIFInfo objects and must outlive every entry pointing into it.
+     */
+    class StringPool {
+    public:
+        StringPool() : bytes_(0) {}
+
+        /**
+         * Intern a string
+         * @param str   String data, doesn't need to be \0 terminated
+         * @param len   Length of the string
+         * @return Pooled copy of the string, the same pointer for equal strings and valid for the life of the pool
+         */
+        const std::string *intern(const char *str, size_t len) {
+            std::string key(str, len);
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::pair<std::unordered_set<std::string>::iterator, bool> result = strings_.insert(std::move(key));
+            if (result.second) bytes_ += len;
+            return &*result.first;
+        }
+
+        /**
+         * Get the number of distinct strings in the pool
+         * @return Number of strings
+         */
+        size_t size() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return strings_.size();
+        }
+
+        /**
+         * Get the total length of the distinct strings in the pool
+         * @return Number of characters
+         */
+        size_t bytes() const {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return bytes_;
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::unordered_set<std::string> strings_;   // Elements never move so pointers to them stay valid
+        size_t bytes_;
+
+        StringPool(const StringPool &);
+        StringPool &operator=(const StringPool &);
+    };
+
     /**
      * IFEntry describes the entry data stored in the EXIFInfo
      */
@@ -375,6 +568,45 @@ namespace exif {
          */
         IFEntry() : tag_(0xFF), directory_(IFD0_DIRECTORY), format_(0xFF), data_(0), length_(0), val_byte_(nullptr) {}
 
+        /**
+         * Copy constructor, the values are copied.  Interned strings stay shared since they never change.
+         * @param other     Entry to copy
+         */
+        IFEntry(const IFEntry &other) : tag_(other.tag_), directory_(other.directory_), format_(other.format_),
+                                        data_(other.data_), length_(other.length_), val_byte_(nullptr) {
+            copy_union(other);
+        }
+
+        /**
+         * Move constructor, the values are taken over without copying
+         * @param other     Entry to move, left without values
+         */
+        IFEntry(IFEntry &&other) noexcept : tag_(other.tag_), directory_(other.directory_), format_(other.format_),
+                                            data_(other.data_), length_(other.length_), val_byte_(other.val_byte_),
+                                            interned_(other.interned_) {
+            other.format_ = 0xFF;
+            other.val_byte_ = nullptr;
+            other.interned_ = false;
+        }
+
+        /**
+         * Assignment, copies or moves depending on the argument
+         * @param other     Entry to assign
+         * @return This entry
+         */
+        IFEntry &operator=(IFEntry other) noexcept {
+            std::swap(tag_, other.tag_);
+            std::swap(directory_, other.directory_);
+            std::swap(format_, other.format_);
+            std::swap(data_, other.data_);
+            std::swap(length_, other.length_);
+            std::swap(val_byte_, other.val_byte_);
+            std::swap(interned_, other.interned_);
+            return *this;
+        }
+
+        ~IFEntry() { delete_union(); }
+
         /**
          * Constructor for IFEntry for a string type
          * @param tagIn     Tag ID
@@ -643,6 +875,13 @@ namespace exif {
                 default:
                     return false;
             }
+            if (storage_kind(format) != 0 && storage_kind(format) == storage_kind(format_) &&
+                val_byte_ != nullptr && !interned_) {
+                // Same kind of values, so keep the storage and its capacity for the new values
+                clear_union();
+                format_ = format;
+                return true;
+            }
             delete_union();
             format_ = format;
             new_union();
@@ -679,7 +918,19 @@ namespace exif {
         // !! is correct before accessing it's field          !!
         byte_vector &val_byte() { return *val_byte_; }
 
-        ascii_vector &val_string() { return *val_string_; }
+        /**
+         * Get the ASCII value for modification.  An interned value is shared with other entries through the
+         * StringPool, so this first replaces it with a private copy and interned() becomes false.  Read through
+         * a const IFEntry to keep the value interned.
+         * @return Value owned by the entry
+         */
+        ascii_vector &val_string() {
+            if (interned_) {
+                val_string_ = new ascii_vector(*val_string_);
+                interned_ = false;
+            }
+            return *val_string_;
+        }
 
         short_vector &val_short() { return *val_short_; }
 
@@ -689,12 +940,48 @@ namespace exif {
 
         srational_vector &val_srational() { return *val_srational_; }
 
+        const byte_vector &val_byte() const { return *val_byte_; }
+
+        const ascii_vector &val_string() const { return *val_string_; }
+
+        const short_vector &val_short() const { return *val_short_; }
+
+        const long_vector &val_long() const { return *val_long_; }
+
+        const rational_vector &val_rational() const { return *val_rational_; }
+
+        const srational_vector &val_srational() const { return *val_srational_; }
+
+        /**
+         * Copy the entry including its values, the same as the copy constructor
+         * @return Independent copy of the entry
+         */
+        IFEntry clone() const { return IFEntry(*this); }
+
+        /**
+         * Replace the value of an ASCII entry with the equal string from the pool
+         * @param pool  Pool to intern the string in
+         */
+        void intern(StringPool &pool) {
+            if (format_ != ENTRY_FORMAT_ASCII || val_string_ == nullptr || interned_) return;
+            const std::string *pooled = pool.intern(val_string_->data(), val_string_->size());
+            delete val_string_;
+            val_string_ = const_cast<ascii_vector *>(pooled);
+            interned_ = true;
+        }
+
+        /**
+         * Check whether the value of the entry is an interned string
+         * @return True if the value points into a StringPool
+         */
+        bool interned() const { return interned_; }
+
     private:
         // Raw fields
         unsigned short tag_;
         uint8_t directory_;
         unsigned short format_;
-        unsigned data_;
+        unsigned data_ = 0;
         unsigned length_;
 
         // Parsed fields
@@ -706,6 +993,37 @@ namespace exif {
             rational_vector *val_rational_;
             srational_vector *val_srational_;
         };
+        bool interned_ = false;     // val_string_ points into a StringPool and isn't owned
+
+        /**
+         * Get the kind of storage used for the values of a format, formats with the same kind share a vector type
+         * @param format    Entry format
+         * @return Storage kind, 0 for formats without values
+         */
+        static int storage_kind(unsigned short format) {
+            switch (format) {
+                case ENTRY_FORMAT_BYTE:
+                case ENTRY_FORMAT_UNDEFINED: return 1;
+                case ENTRY_FORMAT_ASCII: return 2;
+                case ENTRY_FORMAT_SHORT: return 3;
+                case ENTRY_FORMAT_LONG: return 4;
+                case ENTRY_FORMAT_RATIONAL: return 5;
+                case ENTRY_FORMAT_SRATIONAL: return 6;
+                default: return 0;
+            }
+        }
+
+        void clear_union() {
+            switch (storage_kind(format_)) {
+                case 1: val_byte_->clear(); break;
+                case 2: val_string_->clear(); break;
+                case 3: val_short_->clear(); break;
+                case 4: val_long_->clear(); break;
+                case 5: val_rational_->clear(); break;
+                case 6: val_srational_->clear(); break;
+                default: break;
+            }
+        }
 
         void delete_union() {
             switch (format_) {
@@ -714,8 +1032,9 @@ namespace exif {
                     val_byte_ = nullptr;
                     break;
                 case ENTRY_FORMAT_ASCII:
-                    if (val_string_) delete val_string_;
+                    if (val_string_ && !interned_) delete val_string_;
                     val_string_ = nullptr;
+                    interned_ = false;
                     break;
                 case ENTRY_FORMAT_SHORT:
                     if (val_short_) delete val_short_;
@@ -737,11 +1056,41 @@ namespace exif {
                     if (val_srational_) delete val_srational_;
                     val_srational_ = nullptr;
                     break;
-                case 0xff:
+                default:
+                    // Formats without storage such as SBYTE
+                    val_byte_ = nullptr;
+                    break;
+            }
+        }
+
+        void copy_union(const IFEntry &other) {
+            interned_ = other.interned_;
+            if (other.val_byte_ == nullptr || other.interned_) {
+                val_byte_ = other.val_byte_;
+                return;
+            }
+            switch (format_) {
+                case ENTRY_FORMAT_BYTE:
+                case ENTRY_FORMAT_UNDEFINED:
+                    val_byte_ = new byte_vector(*other.val_byte_);
+                    break;
+                case ENTRY_FORMAT_ASCII:
+                    val_string_ = new ascii_vector(*other.val_string_);
+                    break;
+                case ENTRY_FORMAT_SHORT:
+                    val_short_ = new short_vector(*other.val_short_);
+                    break;
+                case ENTRY_FORMAT_LONG:
+                    val_long_ = new long_vector(*other.val_long_);
+                    break;
+                case ENTRY_FORMAT_RATIONAL:
+                    val_rational_ = new rational_vector(*other.val_rational_);
+                    break;
+                case ENTRY_FORMAT_SRATIONAL:
+                    val_srational_ = new srational_vector(*other.val_srational_);
                     break;
                 default:
-                    // TODO should not get here
-                    ERROR("delete_union ERROR");
+                    val_byte_ = nullptr;
                     break;
             }
         }
@@ -754,6 +1103,7 @@ namespace exif {
                     break;
                 case ENTRY_FORMAT_ASCII:
                     val_string_ = new ascii_vector();
+                    interned_ = false;
                     break;
                 case ENTRY_FORMAT_SHORT:
                     val_short_ = new short_vector();
@@ -767,11 +1117,14 @@ namespace exif {
                 case ENTRY_FORMAT_SRATIONAL:
                     val_srational_ = new srational_vector();
                     break;
+                case ENTRY_FORMAT_SBYTE:
                 case 0xff:
+                    val_byte_ = nullptr;
                     break;
                 default:
                     // TODO should not get here
                     ERROR("new_union ERROR");
+                    val_byte_ = nullptr;
                     break;
             }
         }
@@ -812,8 +1165,11 @@ namespace exif {
         }
         ~IFDirectory() {
             LOGD("~IFDirectory");
-            free(entries);
+            delete entries;
         }
+    private:
+        IFDirectory(const IFDirectory &);
+        IFDirectory &operator=(const IFDirectory &);
     };
 
 // Helper functions
@@ -882,6 +1238,18 @@ namespace exif {
         return r;
     }
 
+    /**
+     * Parse entry.length() values from a buffer which is known to hold all of them
+     */
+    template<typename T, typename C>
+    void inline parse_values(C &container, const unsigned char *data,
+                             const bool isLittleEndian, const IFEntry &entry) {
+        container.resize(entry.length());
+        for (size_t i = 0; i < entry.length(); ++i) {
+            container[i] = parse<T>(data + sizeof(T) * i, isLittleEndian);
+        }
+    }
+
     /**
      * Try to read entry.length() values for this entry.
      *
@@ -920,10 +1288,7 @@ namespace exif {
                 return false;
             }
         }
-        container.resize(entry.length());
-        for (size_t i = 0; i < entry.length(); ++i) {
-            container[i] = parse<T>(data + sizeof(T) * i, isLittleEndian);
-        }
+        parse_values<T>(container, data, isLittleEndian, entry);
         return true;
     }
 
@@ -1039,60 +1404,1169 @@ namespace exif {
     }
 
     /**
-     * Structure to store non EXIF (0xFFE1) Application Markers
+     * Get the size in bytes of a single value of the given format
+     * @param format    Entry format type
+     * @return Size of one value or 0 if the format is unknown
      */
-    struct AppMarker {
-        uint16_t type;
-        uint16_t length;
-        unsigned char* buffer;
+    unsigned inline formatSize(unsigned short format) {
+        switch (format) {
+            case ENTRY_FORMAT_BYTE:
+            case ENTRY_FORMAT_ASCII:
+            case ENTRY_FORMAT_SBYTE:
+            case ENTRY_FORMAT_UNDEFINED:
+                return 1;
+            case ENTRY_FORMAT_SHORT:
+                return 2;
+            case ENTRY_FORMAT_LONG:
+                return 4;
+            case ENTRY_FORMAT_RATIONAL:
+            case ENTRY_FORMAT_SRATIONAL:
+                return 8;
+            default:
+                return 0;
+        }
+    }
+
+    /**
+     * Parse the value of an entry whose header has already been parsed
+     * @param result            Entry to store the value in
+     * @param data              Start of the value data, either the entry's own data field or the out of line data
+     * @param isLittleEndian    Byte order of the data
+     * @return True if the format is supported and the value was parsed
+     */
+    bool inline parseIFEntryValue(IFEntry &result, const unsigned char *data, bool isLittleEndian) {
+        switch (result.format()) {
+            case ENTRY_FORMAT_BYTE:
+            case ENTRY_FORMAT_UNDEFINED:
+                parse_values<uint8_t>(result.val_byte(), data, isLittleEndian, result);
+                break;
+            case ENTRY_FORMAT_ASCII:
+                parse_values<uint8_t>(result.val_string(), data, isLittleEndian, result);
+                // cut zero byte at the end, since we don't want that in the std::string
+                if (result.val_string().length() > 0 &&
+                    result.val_string()[result.val_string().length() - 1] == '\0') {
+                    result.val_string().resize(result.val_string().length() - 1);
+                }
+                break;
+            case ENTRY_FORMAT_SHORT:
+                parse_values<uint16_t>(result.val_short(), data, isLittleEndian, result);
+                break;
+            case ENTRY_FORMAT_LONG:
+                parse_values<uint32_t>(result.val_long(), data, isLittleEndian, result);
+                break;
+            case ENTRY_FORMAT_RATIONAL:
+                parse_values<Rational>(result.val_rational(), data, isLittleEndian, result);
+                break;
+            case ENTRY_FORMAT_SRATIONAL:
+                parse_values<SRational>(result.val_srational(), data, isLittleEndian, result);
+                break;
+            default:
+                ERROR("Unsupported format %d",result.format());
+                return false;
+        }
+        return true;
+    }
+
+    /**
+     * Read only view of a range of bytes owned by someone else
+     */
+    struct ByteView {
+        const unsigned char *data;
+        unsigned long size;
     };
-    bool isAppMarker(const unsigned char *buf, uint16_t *type, uint16_t *length);
 
-    unsigned long getDataStart(const unsigned char *buf, unsigned long len);
+    /**
+     * Random access source of bytes for the decoders.  Only positioned reads are needed so large files such as
+     * RAW images don't have to be loaded into memory to find their metadata.
+     */
+    class ByteSource {
+    public:
+        virtual ~ByteSource() {}
+
+        /**
+         * Read bytes from the source
+         * @param offset    Offset of the first byte to read
+         * @param len       Number of bytes to read
+         * @return Pointer to the data which stays valid until the next read, or NULL if the range can't be read
+         */
+        virtual const unsigned char* readAt(unsigned long offset, unsigned long len) = 0;
+
+        /**
+         * Get the size of the source
+         * @return Size in bytes
+         */
+        virtual unsigned long size() const = 0;
+    };
 
     /**
-     * Class responsible for storing and parsing EXIF information from a JPEG blob
+     * ByteSource over a buffer that is already in memory.  Reads return pointers into the buffer.
      */
-    class EXIFInfo {
+    class MemorySource : public ByteSource {
     public:
-        bool readEXIF(std::string inputFile);
+        MemorySource(const unsigned char *buf, unsigned long len) : buf_(buf), len_(len) {}
 
-        bool readEXIF(unsigned char *buf, unsigned long bufLen);
+        const unsigned char* readAt(unsigned long offset, unsigned long len) {
+            if (!buf_ || offset > len_ || len > len_ - offset) return NULL;
+            return buf_ + offset;
+        }
 
-        void encodeJPEGHeader(unsigned char **buf, unsigned long *len);
+        unsigned long size() const { return len_; }
 
-        std::string toString();
-        std::string toString(int directory);
+    private:
+        const unsigned char *buf_;
+        unsigned long len_;
+    };
 
-        IFEntry* getTagData(uint16_t tag, uint8_t dir);
+    /**
+     * ByteSource reading from a file on demand with fseek/fread
+     */
+    class FileSource : public ByteSource {
+    public:
+        FileSource(const std::string &inputFile);
+        ~FileSource();
 
-        int removeEntry(uint16_t tag, uint8_t dir);
-        void updateEntry(IFEntry *entry);
+        /**
+         * Check whether the file was opened
+         * @return True if the file is open
+         */
+        bool isOpen() const { return fp_ != NULL; }
 
-        void clear();
+        const unsigned char* readAt(unsigned long offset, unsigned long len);
 
-        std::vector<IFDirectory*> IFDirectories;
-        std::vector<AppMarker*> AppMarkers;
+        unsigned long size() const { return size_; }
 
-        EXIFInfo() {
-        }
+    private:
+        FILE *fp_;
+        unsigned long size_;
+        std::vector<unsigned char> data_;
 
-        ~EXIFInfo() {
-            LOGD("~EXIFInfo");
-            for (unsigned long i=0; i<IFDirectories.size(); i++) {
-                free(IFDirectories.at(i));
-            }
-            IFDirectories.clear();
+        FileSource(const FileSource &);
+        FileSource &operator=(const FileSource &);
+    };
+
+    /**
+     * ByteSource for a range of another source, such as EXIF data embedded in a larger file
+     */
+    class SubSource : public ByteSource {
+    public:
+        SubSource(ByteSource &src, unsigned long offset, unsigned long len) : src_(src), offset_(offset), len_(len) {}
+
+        const unsigned char* readAt(unsigned long offset, unsigned long len) {
+            if (offset > len_ || len > len_ - offset) return NULL;
+            return src_.readAt(offset_ + offset, len);
         }
+
+        unsigned long size() const { return len_; }
+
     private:
-        IFDirectory* getDirectory(int type);
-        IFDirectory* addDirectory(int type, std::vector<exif::IFEntry> *entries);
-        bool isInDirectory(uint16_t tag, uint8_t dir);
-        uint16_t encodeEXIFsegment(unsigned char *buf);
-        AppMarker* getAppMarker(const unsigned char *buf);
-        bool decodeJPEGFile(const unsigned char *buf, unsigned long len);
-        bool decodeEXIFsegment(AppMarker *marker);
-       };
+        ByteSource &src_;
+        unsigned long offset_;
+        unsigned long len_;
+    };
+
+    /**
+     * ByteSource in front of a source where every read is a round trip, such as range requests to an object
+     * store.  The first read fetches a whole window so the headers of most files arrive in one request.  Later
+     * misses also fetch at least a window and are merged with fetched data close to them.  Reads larger than the
+     * window which aren't cached, such as a preview image, are passed straight to the source.
+     */
+    class PrefetchSource : public ByteSource {
+    public:
+        /**
+         * Create a source reading through to another one
+         * @param src       Source to read from, every read from it counts as a request
+         * @param window    Size of the speculative first read and the minimum size of later requests
+         * @param gap       Misses within this distance of fetched data are merged with it
+         */
+        explicit PrefetchSource(ByteSource &src, unsigned long window = PREFETCH_WINDOW,
+                                unsigned long gap = PREFETCH_GAP)
+                : src_(src), window_(window), gap_(gap), requests_(0), fetched_(0) {}
+
+        const unsigned char* readAt(unsigned long offset, unsigned long len);
+
+        unsigned long size() const { return src_.size(); }
+
+        /**
+         * Get the number of reads made from the underlying source
+         * @return Number of requests
+         */
+        unsigned long requests() const { return requests_; }
+
+        /**
+         * Get the number of bytes read from the underlying source
+         * @return Number of bytes
+         */
+        unsigned long fetched() const { return fetched_; }
+
+    private:
+        struct Range {
+            unsigned long offset;
+            std::vector<unsigned char> data;
+        };
+
+        ByteSource &src_;
+        unsigned long window_;
+        unsigned long gap_;
+        unsigned long requests_;
+        unsigned long fetched_;
+        std::vector<Range> ranges_;     // Fetched data sorted by offset, never closer together than gap_
+
+        PrefetchSource(const PrefetchSource &);
+        PrefetchSource &operator=(const PrefetchSource &);
+    };
+
+    /**
+     * Check whether the buffer starts with a TIFF header ("II*\0" or "MM\0*")
+     * @param buf   Buffer to check
+     * @param len   Length of the buffer
+     * @return True if buf starts with a TIFF header
+     */
+    bool isTIFFHeader(const unsigned char *buf, unsigned long len);
+
+    /**
+     * Check whether the buffer starts with an ISOBMFF "ftyp" box as used by HEIF/HEIC files
+     * @param buf   Buffer to check
+     * @param len   Length of the buffer
+     * @return True if buf starts with an ftyp box
+     */
+    bool isHEIFHeader(const unsigned char *buf, unsigned long len);
+
+    /**
+     * Detect the container format of a file from its first bytes
+     * @param buf   Start of the file, at least 12 bytes are needed to detect all formats
+     * @param len   Length of the buffer
+     * @return One of the CONTAINER_ types
+     */
+    int detectContainer(const unsigned char *buf, unsigned long len);
+
+    /**
+     * Locate the embedded IFD1 thumbnail of a JPEG, TIFF, HEIF, PNG or WebP file without decoding the rest of the
+     * EXIF data.  Only the container structure, the TIFF header, the entry count and next link of IFD0 and the
+     * IFD1 entry table are read from the source.
+     * @param src       Source to search
+     * @param offset    Output offset of the thumbnail within the source
+     * @param length    Output length of the thumbnail
+     * @return True if a thumbnail was found
+     */
+    bool findThumbnail(ByteSource &src, unsigned long *offset, unsigned long *length);
+
+    /**
+     * Read the embedded IFD1 thumbnail of a JPEG, TIFF, HEIF, PNG or WebP file using findThumbnail
+     * @param inputFile     Full path of file to read
+     * @param thumbnail     Output thumbnail data, normally a JPEG stream
+     * @return True if a thumbnail was found and read
+     */
+    bool readThumbnail(const std::string &inputFile, std::vector<unsigned char> *thumbnail);
+
+    /**
+     * Image listed in the MP Index IFD of a Multi-Picture Format segment
+     */
+    struct MPImage {
+        uint32_t attribute;     // Individual image attribute, the image type is in the lower 24 bits
+        unsigned long offset;   // Offset of the image from the start of the file
+        unsigned long size;     // Size of the image in bytes
+
+        /**
+         * Get the MP type code of the image
+         * @return One of the MP_TYPE_ values
+         */
+        uint32_t type() const { return attribute & MP_TYPE_MASK; }
+    };
+
+    /**
+     * Parse the MP Index IFD of a Multi-Picture Format segment
+     * @param buf           MP header data following "MPF\0", starting with the byte order mark
+     * @param len           Length of the MP header data
+     * @param headerOffset  Offset of the MP header in the file, image offsets are relative to it
+     * @param images        List the images are added to
+     * @return True if the MP Index IFD was parsed
+     */
+    bool parseMPIndex(const unsigned char *buf, unsigned long len, unsigned long headerOffset,
+                      std::vector<MPImage> *images);
+
+    /**
+     * List the images of a Multi-Picture Format JPEG.  Only the APP marker headers and the MPF segment are read.
+     * @param src       Source of the JPEG file
+     * @param images    List the images are added to
+     * @return True if an MPF segment was found
+     */
+    bool findMPImages(ByteSource &src, std::vector<MPImage> *images);
+
+    /**
+     * Read the largest preview image of a Multi-Picture Format JPEG.  Only the MPF segment and the byte range
+     * of the chosen preview are read from the file.
+     * @param inputFile     Full path of file to read
+     * @param preview       Output preview data, a complete JPEG stream
+     * @return True if the file has a large thumbnail image and it was read
+     */
+    bool readMPPreview(const std::string &inputFile, std::vector<unsigned char> *preview);
+
+    /**
+     * Structure to store non EXIF (0xFFE1) Application Markers.  COM and image data segments such as DQT
+     * which come before an Application Marker are stored too, so the header can be written back in order.
+     */
+    struct AppMarker {
+        uint16_t type;
+        uint32_t length;        // Includes the 2 length bytes.  May exceed a segment for Extended EXIF.
+        unsigned char* buffer;
+        uint32_t capacity;      // Allocated size of buffer, at least length - 2
+    };
+    bool isAppMarker(const unsigned char *buf, uint16_t *type, uint16_t *length);
+
+    /**
+     * JPEG marker found by nextJPEGMarker
+     */
+    struct JPEGMarker {
+        uint16_t type;
+        unsigned long offset;   // Offset of the marker in the file
+        unsigned long length;   // Includes the 2 length bytes.  0 for markers without a segment such as RSTn.
+    };
+    bool nextJPEGMarker(ByteSource &src, unsigned long offs, JPEGMarker *marker);
+
+    unsigned long getDataStart(const unsigned char *buf, unsigned long len);
+
+    /**
+     * Identifies a tag within a directory.  IFD1 entries use the IFD0_DIRECTORY tag ids.
+     */
+    struct TagId {
+        uint16_t tag;
+        uint8_t directory;
+    };
+
+    /**
+     * Difference of one tag between two EXIFInfo objects found by EXIFInfo::diff
+     */
+    struct TagDiff {
+        uint16_t tag;
+        uint8_t directory;
+        uint8_t change;         // TAG_ADDED, TAG_REMOVED or TAG_CHANGED
+    };
+
+    /**
+     * Capture time of an image from the date/time, sub second and offset tags
+     */
+    struct CaptureTime {
+        int64_t epoch;          // Seconds since 1970-01-01 00:00:00 UTC, or since that wall clock time if !hasOffset
+        uint32_t nanoseconds;   // Sub second part of the time
+        int16_t offsetMinutes;  // Offset of the local time from UTC
+        bool hasOffset;         // True if the offset is known and epoch is in UTC
+    };
+
+    /**
+     * GPS position in decimal degrees, negative for south and west
+     */
+    struct GPSPosition {
+        double latitude;
+        double longitude;
+        double altitude;        // Meters above sea level, negative below sea level
+        bool hasAltitude;
+    };
+
+    /**
+     * Exposure settings, each value is 0 if the tag is missing
+     */
+    struct Exposure {
+        double exposureTime;    // Seconds
+        double fNumber;
+        double bias;            // EV
+        uint32_t iso;
+    };
+
+    /**
+     * XMP property to extract with EXIFInfo::readXMP.  The namespace is matched by URI so any prefix bound
+     * to it is found, such as the old "xap" for XMP_NS_XMP.
+     */
+    struct XMPProperty {
+        std::string ns;                     // Namespace URI, such as XMP_NS_XMP
+        std::string name;                   // Local name, such as "Rating"
+        std::vector<std::string> values;    // The value, or the items of an rdf:Bag, rdf:Seq or rdf:Alt
+    };
+
+    /**
+     * Get the XMP properties most catalogs want: rating, label, keywords, creation date and GPS position
+     * @return Properties to pass to EXIFInfo::readXMP
+     */
+    std::vector<XMPProperty> commonXMPProperties();
+
+    /**
+     * Find the values of XMP properties in a packet without building a DOM.  Values are attributes or simple
+     * elements, or the rdf:li items of an array element.  The standard XML entities are decoded.  Like the
+     * properties, the RDF namespace is matched by URI whatever prefix it is bound to.
+     * @param packet        XMP packet
+     * @param len           Length of the packet
+     * @param properties    Properties to find, the values of the ones found are set
+     * @return Number of properties found
+     */
+    int findXMPProperties(const char *packet, unsigned long len, std::vector<XMPProperty> *properties);
+
+    /**
+     * Parse an EXIF date/time string ("YYYY:MM:DD HH:MM:SS") without going through the C library
+     * @param str       Date/time string
+     * @param len       Length of the string, at least 19
+     * @param epoch     Output seconds since 1970-01-01 00:00:00 for the given wall clock time
+     * @return True if the string is a valid date/time.  Blank dates such as "0000:00:00 00:00:00" are invalid.
+     */
+    bool parseDateTime(const char *str, unsigned long len, int64_t *epoch);
+
+    /**
+     * Get the tags read by the typed accessors of EXIFInfo, to be used with EXIFInfo::setTagFilter
+     * @return List of tags
+     */
+    const std::vector<TagId> &hotTags();
+
+    /**
+     * Get the ASCII tags with few distinct values across a corpus, to be used with EXIFInfo::setStringPool
+     * @return List of tags: Make, Model, Software, LensMake and LensModel
+     */
+    const std::vector<TagId> &internTags();
+
+    /**
+     * Tags removed by stripTIFF and stripJPEGFile
+     */
+    struct StripPolicy {
+        std::vector<TagId> tags;            // Tags to remove
+        std::vector<uint8_t> directories;   // Directories removed with all of their tags, such as GPS_IFD_DIRECTORY
+        bool xmp;                           // Also blank the XMP packets, which repeat the location and serials
+    };
+
+    /**
+     * Get the policy for publishing images: the GPS directory, MakerNote, artist, owner name, body and lens serial
+     * numbers, unique image ID and the XMP packets are removed
+     * @return Policy for stripTIFF and stripJPEGFile
+     */
+    StripPolicy privacyPolicy();
+
+    /**
+     * Remove the tags of a policy from encoded TIFF data in place.  Nothing is moved so the length stays the same:
+     * the values are zeroed and the entries are taken out of their IFDs, whose later entries move up.
+     * @param tiff      TIFF data starting with the TIFF header
+     * @param len       Length of the TIFF data
+     * @param policy    Tags and directories to remove
+     * @return Number of tags removed, or -1 if the data doesn't start with a TIFF header
+     */
+    int stripTIFF(unsigned char *tiff, unsigned long len, const StripPolicy &policy);
+
+    /**
+     * Strip a JPEG file with stripTIFF.  Only the metadata segments before the image data are read and rewritten,
+     * all of them keep their length.  The image data is copied by the kernel (copy_file_range or sendfile on
+     * Linux), or not at all when the file is stripped in place.
+     * @param inputFile     JPEG file to strip
+     * @param outputFile    File to write, or empty to change the input file in place
+     * @param policy        Tags and directories to remove
+     * @param removed       Output number of tags removed, may be NULL
+     * @return False if the file isn't a JPEG or can't be read or written
+     */
+    bool stripJPEGFile(const std::string &inputFile, const std::string &outputFile, const StripPolicy &policy,
+                       int *removed = NULL);
+
+    /**
+     * Locate the TIFF data holding the EXIF data of a JPEG, TIFF, HEIF, PNG or WebP file.  Only the container
+     * structure is read.  Any "Exif\0\0" prefix is skipped.  A HEIF Exif item split over several extents isn't
+     * contiguous in the file, so it can only be decoded by readEXIF.
+     * @param src       Source of the file
+     * @param offset    Output offset of the TIFF header within the source
+     * @param len       Output length of the TIFF data
+     * @return True if EXIF data was found
+     */
+    bool locateTIFF(ByteSource &src, unsigned long *offset, unsigned long *len);
+
+    /**
+     * Receives the raw entries found by walkTIFF
+     */
+    class TagVisitor {
+    public:
+        virtual ~TagVisitor() {}
+
+        /**
+         * Check whether the value of a tag is needed.  Values of other tags aren't read from the source.
+         * @param dir   Directory of the tag, IFD1 entries use IFD1_DIRECTORY
+         * @param tag   Tag id
+         * @return True to have visit called for the tag
+         */
+        virtual bool wants(uint8_t dir, uint16_t tag) { return true; }
+
+        /**
+         * Called for each entry
+         * @param dir               Directory of the tag, IFD1 entries use IFD1_DIRECTORY
+         * @param tag               Tag id
+         * @param format            Entry format
+         * @param count             Number of values
+         * @param value             Raw value data, only valid during the call.  NULL if it can't be read.
+         * @param isLittleEndian    Byte order of the value data
+         */
+        virtual void visit(uint8_t dir, uint16_t tag, uint16_t format, uint32_t count, const unsigned char *value,
+                           bool isLittleEndian) = 0;
+    };
+
+    /**
+     * Walk the IFD0, EXIF, GPS, Interop, 10 and IFD1 directories of TIFF data without building IFEntries
+     * @param src       Source starting with the TIFF header
+     * @param visitor   Visitor receiving the entries
+     * @return False if the TIFF header or IFD0 can't be read
+     */
+    bool walkTIFF(ByteSource &src, TagVisitor &visitor);
+
+    /**
+     * 128 bit hash of the canonical form of EXIF data, for finding duplicates and metadata changes.  Any 64 bits
+     * of it can be used as a shorter hash.
+     */
+    struct Fingerprint {
+        uint64_t hi;
+        uint64_t lo;
+    };
+
+    /**
+     * Tags left out of a fingerprint
+     */
+    struct FingerprintPolicy {
+        std::vector<TagId> ignore;          // Tags to leave out
+        std::vector<uint8_t> directories;   // Directories to leave out, such as IFD1_DIRECTORY for the thumbnail
+    };
+
+    /**
+     * Get the policy for detecting metadata changes: the software, the modify date/time and the thumbnail
+     * directory are left out since editors rewrite them on every save
+     * @return Policy for fingerprint
+     */
+    FingerprintPolicy fingerprintPolicy();
+
+    /**
+     * Hash the EXIF data of a JPEG, TIFF, HEIF, PNG or WebP file in one walkTIFF pass, without building an EXIFInfo.
+     * The canonical form doesn't depend on the byte order or the order and layout of the entries: each entry is
+     * hashed with its values in big endian order and the entry hashes are combined so their order doesn't
+     * matter.  ASCII values are hashed without trailing NULs.  Directory links and the thumbnail and strip
+     * offsets only describe the layout, so they are always left out.  The values of left out tags aren't read.
+     * @param src       Source of the file
+     * @param policy    Tags to leave out, normally fingerprintPolicy()
+     * @param fp        Output fingerprint
+     * @return False if no EXIF data was found
+     */
+    bool fingerprint(ByteSource &src, const FingerprintPolicy &policy, Fingerprint *fp);
+
+    /**
+     * Column of decodeBatch output in the Apache Arrow memory layout.  Rows without a value have their bit in
+     * validity cleared and a 0 or empty value.
+     */
+    struct BatchColumn {
+        int field;                      // One of the BATCH_FIELD_ values
+        int type;                       // One of the COLUMN_ types
+        std::vector<uint8_t> validity;  // Bit i (least significant bit first) is set if row i has a value
+        std::vector<int64_t> int64Values;
+        std::vector<double> doubleValues;
+        std::vector<int32_t> offsets;   // String column: rows + 1 offsets into data
+        std::vector<char> data;         // String column: concatenated string values
+    };
+
+    /**
+     * Decode a set of fields from many images straight into columns, without building an EXIFInfo per image
+     * @param spans     Images to decode, each a complete JPEG, TIFF, HEIF, PNG or WebP file in memory
+     * @param n         Number of images
+     * @param fields    BATCH_FIELD_ values to extract, one column is output per field
+     * @param columns   Output columns in the order of fields, each with n rows
+     * @param threads   Number of threads to use, 0 for the number of cores
+     * @return False if a field is unknown
+     */
+    bool decodeBatch(const ByteView spans[], unsigned long n, const std::vector<int> &fields,
+                     std::vector<BatchColumn> *columns, unsigned threads);
+
+    /**
+     * Statistics of scanFiles
+     */
+    struct ScanStats {
+        unsigned long files;        // Files read and decoded
+        unsigned long failed;       // Files which couldn't be opened or read
+        unsigned long reads;        // Reads made, including the follow up reads
+        unsigned long followUps;    // Extra reads for data extending past the prefix
+        unsigned long bytesRead;
+        bool ioUring;               // True if the reads went through io_uring, false for the reader threads
+    };
+
+    /**
+     * Decode a set of fields from many files straight into columns like decodeBatch, keeping many header reads in
+     * flight.  Only a prefix of each file is read and the completed prefixes are decoded by worker threads while
+     * the next reads are under way.  A file whose APPn markers, container structure or wanted EXIF values extend
+     * past the prefix gets follow up reads for the rest of them.  When built with EXIF_IO_URING the reads
+     * go through io_uring on Linux 5.6 or newer.  Without it, or where io_uring can't be set up, a pool of reader
+     * threads with one blocking read each is used, at most one thread per core.
+     * @param paths         Files to read
+     * @param fields        BATCH_FIELD_ values to extract, one column is output per field
+     * @param columns       Output columns in the order of fields, one row per path
+     * @param threads       Number of decode threads, 0 for the number of cores
+     * @param queueDepth    Number of reads to keep in flight, normally SCAN_QUEUE_DEPTH
+     * @param prefix        Bytes to read from the start of each file, normally PREFETCH_WINDOW
+     * @param stats         Output statistics, may be NULL
+     * @return False if a field is unknown or the reads failed
+     */
+    bool scanFiles(const std::vector<std::string> &paths, const std::vector<int> &fields,
+                   std::vector<BatchColumn> *columns, unsigned threads, unsigned queueDepth, unsigned long prefix,
+                   ScanStats *stats);
+
+    /**
+     * Compact fixed size record of the most used metadata of an image, for catalogs of many images kept in memory.
+     * The strings are interned so equal camera and lens names are shared between records.
+     */
+    struct ExifSummary {
+        int64_t captureTime;        // Original date/time as seconds since 1970 of the wall clock time
+        double latitude;            // Decimal degrees, negative for south
+        double longitude;           // Decimal degrees, negative for west
+        float altitude;             // Meters above sea level
+        float exposureTime;         // Seconds
+        float fNumber;
+        float focalLength;          // mm
+        uint32_t width;
+        uint32_t height;
+        uint32_t iso;
+        const std::string *make;    // Interned camera make, NULL if missing
+        const std::string *model;   // Interned camera model, NULL if missing
+        const std::string *lens;    // Interned lens model, NULL if missing
+        uint8_t orientation;        // 1-8, or 0 if unknown
+        uint8_t flags;              // SUMMARY_HAS_ flags of the values present
+    };
+
+    /**
+     * Decode the summary of an image in a single pass over its EXIF data, without building an EXIFInfo
+     * @param image     Complete JPEG, TIFF, HEIF, PNG or WebP file in memory
+     * @param pool      Pool to intern the make, model and lens in, NULL to skip them
+     * @param summary   Output summary, missing values are 0 or NULL
+     * @return True if EXIF data was found
+     */
+    bool summarize(const ByteView &image, StringPool *pool, ExifSummary *summary);
+
+    /**
+     * Set of tag changes applied to an EXIFInfo at once with EXIFInfo::apply.  Later changes to the same tag replace
+     * earlier ones.  The set is validated as a whole, so either every change is applied or none is.
+     */
+    class EditSet {
+    public:
+        /**
+         * Add or replace a tag
+         * @param entry     New entry, its format must match the TagInfo format of the tag
+         * @param dir       Directory to store the tag in, replacing the directory of the entry
+         */
+        void put(const IFEntry &entry, uint8_t dir);
+
+        /**
+         * Remove a tag.  Removing a tag which doesn't exist isn't an error.
+         * @param tag   Tag to remove
+         * @param dir   Directory the tag is in
+         */
+        void remove(uint16_t tag, uint8_t dir);
+
+        /**
+         * Check the changes against the known tag formats
+         * @return True if every change is valid
+         */
+        bool validate() const;
+
+        /**
+         * Get the number of changes
+         * @return Number of puts and removes
+         */
+        unsigned long size() const { return edits_.size(); }
+
+        void clear() { edits_.clear(); }
+
+    private:
+        friend class EXIFInfo;
+        struct Edit {
+            uint8_t directory;
+            bool remove;
+            IFEntry entry;
+        };
+        std::vector<Edit> edits_;
+    };
+
+    /**
+     * Class responsible for storing and parsing EXIF information from a JPEG blob
+     */
+    class EXIFInfo {
+    public:
+        bool readEXIF(std::string inputFile);
+
+        bool readEXIF(unsigned char *buf, unsigned long bufLen);
+
+        bool readEXIF(ByteSource &src);
+
+        /**
+         * Salvage EXIF data from a damaged or truncated file which readEXIF rejects.  The start of the source is
+         * searched for "Exif\0\0" followed by a TIFF header, wherever it is, and every candidate is decoded and
+         * scored.  The EXIF data of the most plausible one is kept.
+         * @param src           Source to search
+         * @param window        Number of bytes at the start of the source to search
+         * @param confidence    Output score of the kept candidate from 1 to 100, may be NULL
+         * @return True if a candidate with at least some IFD0 entries was found
+         */
+        bool recoverEXIF(ByteSource &src, unsigned long window = RECOVER_WINDOW, int *confidence = NULL);
+
+        /**
+         * Write the JPEG SOI followed by the EXIF segment and the other App markers.  EXIF data larger than one
+         * segment can only be written as Extended EXIF, split over several APP1 segments, which most readers
+         * don't understand, so it has to be asked for.
+         * @param buf           Output buffer allocated with malloc, NULL on failure
+         * @param len           Output length of the buffer
+         * @param extendedExif  True to allow Extended EXIF segments
+         * @return False if the EXIF data doesn't fit in one segment and extendedExif is false
+         */
+        bool encodeJPEGHeader(unsigned char **buf, unsigned long *len, bool extendedExif = false);
+
+        std::string toString() const;
+        std::string toString(int directory) const;
+
+        /**
+         * Get the entry with the given tag for changing.  The directory is marked as changed when the tag is found
+         * since the entry may be modified through the pointer.
+         * @param tag   Tag to get
+         * @param dir   Directory the tag is in
+         * @return Entry or NULL if not found
+         */
+        IFEntry* getTagData(uint16_t tag, uint8_t dir);
+
+        /**
+         * Get the entry with the given tag for reading.  Unlike the non-const version nothing is marked as changed,
+         * so this can be called from many threads at once.
+         * @param tag   Tag to get
+         * @param dir   Directory the tag is in
+         * @return Entry or NULL if not found
+         */
+        const IFEntry* getTagData(uint16_t tag, uint8_t dir) const { return findTag(tag, dir); }
+
+        /**
+         * Find a directory without creating it
+         * @param type  Directory type to find
+         * @return Directory or NULL if there is none
+         */
+        const IFDirectory* findDirectory(uint8_t type) const;
+
+        int removeEntry(uint16_t tag, uint8_t dir);
+        void updateEntry(IFEntry *entry);
+
+        /**
+         * Apply a set of changes in one merge pass per directory.  Nothing is changed if the set isn't valid.
+         * @param edits     Changes to apply
+         * @return True if the changes were applied
+         */
+        bool apply(const EditSet &edits);
+
+        /**
+         * Compare the tags with those of another EXIFInfo in one merge pass over the sorted entries of each
+         * directory.  Values are compared byte for byte.  The links between directories and the offsets of the strips
+         * and the thumbnail aren't compared, they change whenever the file is rewritten.
+         * @param other     EXIFInfo to compare with
+         * @param diffs     Output differences ordered by directory and tag.  TAG_ADDED tags are only in other.
+         */
+        void diff(const EXIFInfo &other, std::vector<TagDiff> *diffs) const;
+
+        /**
+         * Apply differences found by diff, or a chosen subset of them, in one merge pass per directory.  Directory
+         * links and the offsets of the strips and the thumbnail are skipped, the encoder writes them for the new layout.
+         * @param source    EXIFInfo the differences were found against, added and changed values are copied from it
+         * @param diffs     Differences to apply
+         * @return False and nothing changed if source is this EXIFInfo or an added or changed tag isn't in source
+         */
+        bool merge(const EXIFInfo &source, const std::vector<TagDiff> &diffs);
+
+        /**
+         * Hash the decoded tags the same way as exif::fingerprint, which gives the same result for the entries
+         * whose values could be read.  Edited tags are included.
+         * @param policy    Tags to leave out, normally fingerprintPolicy()
+         * @param fp        Output fingerprint
+         */
+        void fingerprint(const FingerprintPolicy &policy, Fingerprint *fp) const;
+
+        /**
+         * Copy the EXIF data into an immutable snapshot which can be shared by many threads.  Only the const
+         * functions of a snapshot can be used, so reading needs no locking.
+         * @return New snapshot
+         */
+        std::shared_ptr<const EXIFInfo> snapshot() const;
+
+        void clear();
+
+        /**
+         * Remove the EXIF data but keep the directories, entry lists, entry values and marker buffers for the next
+         * read, so decoding many files with the same layout into one EXIFInfo stops allocating them once they have
+         * grown large enough.  readEXIF calls this first.  The tag filter and string pool settings are kept.
+         */
+        void reset();
+
+        /**
+         * Exchange the contents of two EXIFInfo objects without copying
+         * @param other     EXIFInfo to swap with
+         */
+        void swap(EXIFInfo &other) noexcept;
+
+        /**
+         * Get the thumbnail stored in IFD1.  For JPEG files the view points into the retained EXIF segment so
+         * no copy is made.  The view stays valid until the EXIFInfo is cleared, destroyed or read into again.
+         * @return View of the thumbnail data, size is 0 if there is no thumbnail
+         */
+        ByteView thumbnail() const { return thumbnail_; }
+
+        /**
+         * Replace the thumbnail written to IFD1 by encodeJPEGHeader.  The data is copied.
+         * @param buf   Thumbnail data, normally a JPEG stream
+         * @param len   Length of the thumbnail data, 0 to remove the thumbnail
+         */
+        void setThumbnail(const unsigned char *buf, unsigned long len);
+
+        /**
+         * Mark a directory as changed so encodeJPEGHeader rebuilds it.  getTagData when it finds the tag,
+         * updateEntry, removeEntry, EditSet::apply and setThumbnail do this already, it is only needed after editing
+         * IFDirectories directly.
+         * @param dir   Directory that was changed
+         */
+        void markDirty(uint8_t dir) { dirty_ |= 1U << dir; }
+
+        /**
+         * Only keep the given tags when decoding.  The values of other tags aren't read from the source.
+         * The links between directories are always followed.  encodeJPEGHeader copies the other tags from the
+         * EXIF segment that was read, other sources and Extended EXIF are encoded with the kept tags only.
+         * @param tags  Tags to keep, an empty list keeps all tags
+         */
+        void setTagFilter(const std::vector<TagId> &tags);
+
+        /**
+         * Intern the values of the given ASCII tags in a shared pool when decoding, so equal strings of many
+         * images are stored once.  The pool must outlive the entries decoded with it.
+         * @param pool  Pool to intern the strings in, NULL to stop interning
+         * @param tags  Tags to intern, normally internTags()
+         */
+        void setStringPool(StringPool *pool, const std::vector<TagId> &tags);
+
+        /**
+         * Get the orientation of the main image
+         * @return Orientation 1-8, or 0 if unknown
+         */
+        uint16_t orientation() const;
+
+        /**
+         * Get the capture time from the original date/time tags, falling back to the digitized and modify date/time
+         * @param time  Output capture time
+         * @return True if a valid date/time was found
+         */
+        bool captureTime(CaptureTime *time) const;
+
+        /**
+         * Get the GPS position
+         * @param position  Output position
+         * @return True if latitude and longitude were found
+         */
+        bool gps(GPSPosition *position) const;
+
+        /**
+         * Get the exposure settings
+         * @param exposure  Output exposure settings
+         * @return True if any of the exposure tags was found
+         */
+        bool exposure(Exposure *exposure) const;
+
+        /**
+         * Get the embedded ICC profile as a scatter list over the APP2 marker buffers, nothing is copied.
+         * The views stay valid until the EXIFInfo is cleared, destroyed or read into again.
+         * @param chunks    Output parts of the profile in sequence order
+         * @return True if every chunk of the profile was found exactly once
+         */
+        bool iccChunks(std::vector<ByteView> *chunks) const;
+
+        /**
+         * Copy the embedded ICC profile into one buffer
+         * @param profile   Output profile
+         * @return True if every chunk of the profile was found exactly once
+         */
+        bool iccProfile(std::vector<unsigned char> *profile) const;
+
+        /**
+         * Get the ID of the embedded ICC profile, to cache colour transforms per profile.  This is the Profile ID
+         * of the header when it was set (ICC v4), otherwise it is computed the same way: the MD5 of the profile
+         * with the flags, rendering intent and profile ID fields zeroed.  So equal profiles get the same ID.
+         * @param id    Output 16 byte ID
+         * @return True if the image has a complete profile
+         */
+        bool iccProfileID(unsigned char id[16]) const;
+
+        /**
+         * Get the standard XMP packet of the JPEG read.  The view points into its APP1 marker.
+         * @return View of the packet, size is 0 if there is none
+         */
+        ByteView xmpPacket() const;
+
+        /**
+         * Reassemble the ExtendedXMP packet split over APP1 segments.  Only the chunks with the GUID given by
+         * xmpNote:HasExtendedXMP in the standard packet are used.  They may come in any order.
+         * @param packet    Output packet
+         * @return True if the chunks cover the whole packet
+         */
+        bool extendedXMP(std::string *packet) const;
+
+        /**
+         * Extract XMP properties from the standard packet, and from the ExtendedXMP packet for the properties
+         * which aren't in the standard one
+         * @param properties    Properties to find, normally commonXMPProperties().  The values are set.
+         * @return True if any of the properties was found
+         */
+        bool readXMP(std::vector<XMPProperty> *properties) const;
+
+        std::vector<IFDirectory*> IFDirectories;
+        std::vector<AppMarker*> AppMarkers;
+        std::vector<MPImage> MPImages;
+
+        EXIFInfo() : exifMarker_(NULL), stringPool_(NULL), dirty_(0) {
+            thumbnail_.data = NULL;
+            thumbnail_.size = 0;
+        }
+
+        /**
+         * Move constructor, the directories, markers and thumbnail are taken over without copying
+         * @param other     EXIFInfo to move, left empty
+         */
+        EXIFInfo(EXIFInfo &&other) noexcept : EXIFInfo() { swap(other); }
+
+        /**
+         * Move assignment, the decoded data of other replaces this one's.  The tag filter and string pool settings
+         * of both stay as they are.
+         * @param other     EXIFInfo to move, left empty
+         * @return This EXIFInfo
+         */
+        EXIFInfo &operator=(EXIFInfo &&other) noexcept {
+            if (this != &other) {
+                swapDecoded(other);
+                other.clear();
+            }
+            return *this;
+        }
+
+        ~EXIFInfo() {
+            LOGD("~EXIFInfo");
+            clear();
+        }
+    private:
+        friend class SnapshotBuilder;
+        friend class StreamDecoder;
+        void copyFrom(const EXIFInfo &other);
+        void applyChanges(const std::vector<TagId> &keys, const std::vector<const IFEntry*> &values);
+        EXIFInfo(const EXIFInfo &);
+        EXIFInfo &operator=(const EXIFInfo &);
+
+        std::vector<IFDirectory*> spareDirectories_;            // Directories kept by reset() for reuse
+        std::vector<std::vector<IFEntry>*> spareEntries_;       // Empty entry lists kept by reset() for reuse
+        std::vector<AppMarker*> spareMarkers_;                  // Markers kept by reset(), buffers are reused
+        std::vector<IFEntry> scratchEntries_;                   // Entries read before the directory links are removed
+        std::vector<IFEntry> spareValues_[ENTRY_FORMAT_SRATIONAL + 1]; // Entries kept by reset() by format for
+                                                                       // their value storage
+        void keepValue(IFEntry &entry);
+        void swapDecoded(EXIFInfo &other) noexcept;
+        std::vector<exif::IFEntry> *newEntries();
+        void releaseMarker(AppMarker *marker);
+
+        AppMarker *exifMarker_;                     // EXIF segment of the last JPEG read, kept for thumbnail_
+        std::vector<unsigned char> thumbnailData_;  // Thumbnail copy when it can't point into exifMarker_
+        ByteView thumbnail_;
+
+        void releaseExifMarker();
+        std::vector<uint32_t> tagFilter_;          // Sorted directory << 16 | tag keys, empty to keep all tags
+        bool keepTag(uint16_t tag, uint8_t dir) const;
+        StringPool *stringPool_;                    // Pool for interned strings, not owned
+        std::vector<uint32_t> internTags_;          // Sorted directory << 16 | tag keys of the tags to intern
+        const IFEntry* findTag(uint16_t tag, uint8_t dir) const;
+        IFDirectory* getDirectory(int type);
+        IFDirectory* addDirectory(int type, std::vector<exif::IFEntry> *entries);
+        uint32_t dirty_;                            // Bit per directory changed since the EXIF segment was read
+        unsigned long encodeEXIFsegment(unsigned char *buf);
+        unsigned long encodeIncremental(unsigned char *buf);
+        AppMarker* getAppMarker(const unsigned char *buf);
+        bool decodeJPEG(ByteSource &src);
+        int recoverCandidate(ByteSource &src, unsigned long pos, std::vector<unsigned char> *segment);
+        bool addJPEGMarker(AppMarker *marker, unsigned long offset);
+        bool decodeEXIFsegment(AppMarker *marker);
+        unsigned long gatherExtendedExif(ByteSource &src, unsigned long offs, AppMarker *marker);
+        bool decodeTIFF(ByteSource &src, const unsigned char *retained);
+        bool decodeHEIF(ByteSource &src);
+        bool decodePNG(ByteSource &src);
+        bool decodeWebP(ByteSource &src);
+        bool decodeEmbeddedTIFF(ByteSource &src, unsigned long offset, unsigned long len);
+        bool readIFD(ByteSource &src, unsigned long offset, bool isLittleEndian, uint8_t dir,
+                     std::vector<exif::IFEntry> *entries, unsigned long *next_ifd);
+       };
+
+    /**
+     * Copy-on-write builder for snapshots.  The base snapshot is only copied when the first change is made, so
+     * readers of the base are never affected and a builder without changes costs nothing.
+     */
+    class SnapshotBuilder {
+    public:
+        /**
+         * Start building from a snapshot
+         * @param base  Snapshot to start from
+         */
+        explicit SnapshotBuilder(const std::shared_ptr<const EXIFInfo> &base) : base_(base) {}
+
+        /**
+         * Get a private copy of the base to change, made on the first call
+         * @return EXIFInfo to change
+         */
+        EXIFInfo &edit();
+
+        /**
+         * Apply a set of changes to the private copy.  Nothing is copied if the set isn't valid.
+         * @param edits     Changes to apply
+         * @return True if the changes were applied
+         */
+        bool apply(const EditSet &edits);
+
+        /**
+         * Get the snapshot with the changes made so far.  Later changes go to a new copy.
+         * @return The base if nothing was changed, otherwise a new snapshot
+         */
+        std::shared_ptr<const EXIFInfo> build();
+
+    private:
+        std::shared_ptr<const EXIFInfo> base_;
+        std::shared_ptr<EXIFInfo> copy_;
+    };
+
+    /**
+     * Push style decoder for JPEG streams which can't be seeked, such as pipes, sockets or an HTTP body.  Chunks
+     * are pushed as they arrive and every App marker is decoded as soon as all of its bytes are in.  Only the
+     * marker being received is buffered, plus Extended EXIF up to a limit and up to one segment of image data
+     * segments such as DQT which may come before an App marker.  Once the start of scan arrives, or the image data
+     * segments would need more, the metadata is done, so the caller can stop buffering and pass the rest on
+     * untouched.
+     */
+    class StreamDecoder {
+    public:
+        /**
+         * Start decoding a stream.  The EXIFInfo is reset and filled in as the markers arrive.
+         * @param info      EXIFInfo to decode into, must outlive the decoder
+         * @param maxExif   Largest Extended EXIF data to gather, larger data is an error
+         */
+        explicit StreamDecoder(EXIFInfo *info, unsigned long maxExif = STREAM_MAX_EXIF);
+        ~StreamDecoder();
+
+        /**
+         * Decode the next chunk of the stream
+         * @param data  Chunk data
+         * @param len   Length of the chunk
+         * @param used  Output number of bytes of the chunk belonging to the metadata, may be NULL.  Once done, the
+         *              rest of the stream is carry() followed by the chunk from this offset.
+         * @return STREAM_NEED_MORE, STREAM_DONE or STREAM_ERROR
+         */
+        int push(const unsigned char *data, unsigned long len, unsigned long *used = NULL);
+
+        /**
+         * End the stream, decoding what has arrived if the metadata wasn't done yet
+         * @return STREAM_DONE or STREAM_ERROR
+         */
+        int finish();
+
+        /**
+         * Get the status of the last push or finish
+         * @return STREAM_NEED_MORE, STREAM_DONE or STREAM_ERROR
+         */
+        int status() const { return status_; }
+
+        /**
+         * Get the bytes following the metadata which arrived in chunks before the last one
+         * @return Bytes to pass on before the rest of the last chunk
+         */
+        ByteView carry() const;
+
+        /**
+         * Get the length of the metadata at the start of the stream, the offset of the image data, once done
+         * @return Number of bytes
+         */
+        unsigned long metadataLength() const { return metadataLength_; }
+
+    private:
+        enum State { STATE_SOI, STATE_MARKER, STATE_SEGMENT, STATE_DONE };
+
+        EXIFInfo *info_;
+        unsigned long maxExif_;
+        State state_;
+        int status_;
+        bool ok_;
+        unsigned long offset_;                  // Bytes of the stream received
+        unsigned long need_;                    // Bytes pending_ needs for the current state
+        std::vector<unsigned char> pending_;    // Stream since the last App marker, up to the marker being received
+        unsigned long scan_;                    // Offset in pending_ of the next marker
+        JPEGMarker marker_;                     // Marker being received
+        std::vector<unsigned long> skipped_;    // Offsets in pending_ of image data segments such as DQT
+        unsigned long carry_;                   // Bytes of pending_ after the metadata from earlier chunks once done
+        unsigned long metadataLength_;
+        AppMarker *exif_;                       // Extended EXIF being gathered, or NULL
+        unsigned long exifOffset_;
+        bool exifContinues_;                    // The last EXIF segment was full so another may follow
+
+        void step();
+        void finishExif();
+        void done(unsigned long length);
+
+        StreamDecoder(const StreamDecoder &);
+        StreamDecoder &operator=(const StreamDecoder &);
+    };
+
+    /**
+     * Precompiled JPEG EXIF header for writing the same tag set many times with a few changing values, such as
+     * the timestamp and exposure of every frame of a capture pipeline.  The header is encoded once and the
+     * changing values are patched in place at fixed offsets.  A value keeps the format and count it had when
+     * compiled, so give strings their full length (e.g. a complete date/time) before compiling.
+     */
+    class EncodeTemplate {
+    public:
+        /**
+         * Encode the header of an EXIFInfo and find where the values of the given tags are stored
+         * @param info      EXIF data to encode, every tag in fields must be set
+         * @param fields    Tags whose values will be changed per frame
+         * @return False if a tag is missing or the header needs Extended EXIF segments
+         */
+        bool compile(EXIFInfo &info, const std::vector<TagId> &fields);
+
+        /**
+         * Get the index of a compiled field
+         * @param tag   Tag id
+         * @param dir   Directory of the tag
+         * @return Index for the set functions or -1 if the tag wasn't compiled
+         */
+        int field(uint16_t tag, uint8_t dir) const;
+
+        /**
+         * Set one value of a SHORT, LONG, RATIONAL or SRATIONAL field, or the whole value of an ASCII field.
+         * Strings longer than the compiled length are truncated, shorter ones padded with \0.
+         * @param field     Index returned by field()
+         * @param index     Index of the value within the field
+         * @param value     New value
+         * @return False if the field, index or format doesn't match
+         */
+        bool setShort(int field, unsigned index, uint16_t value);
+        bool setLong(int field, unsigned index, uint32_t value);
+        bool setRational(int field, unsigned index, Rational value);
+        bool setSRational(int field, unsigned index, SRational value);
+        bool setString(int field, const char *value);
+
+        /**
+         * Get the header with the current values, starting with the JPEG SOI
+         * @return Header data, valid until the template is compiled again
+         */
+        const unsigned char *data() const { return buffer_.data(); }
+
+        /**
+         * Get the length of the header
+         * @return Length in bytes
+         */
+        unsigned long size() const { return buffer_.size(); }
+
+    private:
+        struct Field {
+            uint16_t tag;
+            uint8_t directory;
+            uint16_t format;
+            uint32_t count;
+            unsigned long offset;   // Offset of the value in buffer_
+        };
+        std::vector<Field> fields_;
+        std::vector<unsigned char> buffer_;
+
+        unsigned char *value(int field, unsigned index, uint16_t format, unsigned long size);
+    };
 
 }  // namespace exif
 
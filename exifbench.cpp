@@ -0,0 +1,376 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include "exif.h"
+
+// Compare the memory used by ExifSummary records and full EXIFInfo objects for a catalog of many images.
+// The given files are decoded over and over until the requested number of records is reached.
+// The reuse mode decodes every record into the same EXIFInfo and checks that memory stays flat after warm-up.
+// The requests mode reads each file once through a PrefetchSource with the given window and counts the reads.
+// The scan mode runs scanFiles over the files at queue depths from 1 up to the given depth.
+// The fingerprint mode compares the rate of fingerprint with readEXIF over the same records, and checks that
+// fingerprint gives the same result as hashing the decoded tags.
+// The roundtrip mode edits, encodes and reads back each file over and over, and checks that the tags read
+// back are the ones written and that the header doesn't grow once the edits have the same size.
+// The mergecheck mode merges the differences of every pair of files and checks that nothing differs afterwards.
+// The template mode compares patching the exposure time and ISO of each frame through an EncodeTemplate with
+// encodeJPEGHeader, using the first file which has both tags.
+
+static long residentKB() {
+  // Linux only, reports 0 elsewhere
+  FILE *fp = fopen("/proc/self/statm", "r");
+  long pages = 0, resident = 0;
+  if (fp == NULL) return 0;
+  if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  fclose(fp);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double now() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *name, unsigned long n, long kb, double seconds) {
+  double perRecord = kb * 1024.0 / n;
+  printf("%-12s %10lu records %10ld KB %8.1f bytes/record %8.1f GB at 10M %10.0f records/s\n", name, n, kb,
+         perRecord, perRecord * 10e6 / (1 << 30), n / seconds);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 4) {
+    printf("Usage: exifbench summary|full|reuse <records> <JPEG files...>\n");
+    printf("       exifbench requests <window> <files...>\n");
+    printf("       exifbench scan <max queue depth> <files...>\n");
+    printf("       exifbench scancheck <prefix> <files...>\n");
+    printf("       exifbench fingerprint <records> <files...>\n");
+    printf("       exifbench template <frames> <JPEG files...>\n");
+    printf("       exifbench roundtrip <cycles> <JPEG files...>\n");
+    printf("       exifbench mergecheck <file> <files...>\n");
+    return -1;
+  }
+  if (strcmp(argv[1], "requests") == 0) {
+    unsigned long window = strtoul(argv[2], NULL, 10);
+    unsigned long requests = 0, fetched = 0, single = 0;
+    exif::EXIFInfo info;
+    for (int i = 3; i < argc; i++) {
+      exif::FileSource file(argv[i]);
+      exif::PrefetchSource src(file, window);
+      if (!info.readEXIF(src)) printf("Error reading %s\n", argv[i]);
+      printf("%-40s %3lu requests %8lu bytes\n", argv[i], src.requests(), src.fetched());
+      requests += src.requests();
+      fetched += src.fetched();
+      if (src.requests() == 1) single++;
+    }
+    int files = argc - 3;
+    printf("%d files, %.2f requests and %.0f bytes per file, %lu files in one request\n", files,
+           (double)requests / files, (double)fetched / files, single);
+    return 0;
+  }
+  if (strcmp(argv[1], "scan") == 0) {
+    unsigned maxDepth = (unsigned)strtoul(argv[2], NULL, 10);
+    std::vector<std::string> paths(argv + 3, argv + argc);
+    std::vector<int> fields;
+    for (int i = 0; i < BATCH_NUM_FIELDS; i++) fields.push_back(i);
+    for (unsigned depth = 1; depth <= maxDepth; depth *= 2) {
+      std::vector<exif::BatchColumn> columns;
+      exif::ScanStats stats;
+      double start = now();
+      if (!exif::scanFiles(paths, fields, &columns, 0, depth, PREFETCH_WINDOW, &stats)) {
+        printf("Scan failed\n");
+        return 1;
+      }
+      double seconds = now() - start;
+      printf("%-9s depth %4u %10.0f files/s %8lu files %4lu failed %6lu follow up reads %8.1f MB read\n",
+             stats.ioUring ? "io_uring" : "threads", depth, stats.files / seconds, stats.files, stats.failed,
+             stats.followUps, stats.bytesRead / 1e6);
+    }
+    return 0;
+  }
+  if (strcmp(argv[1], "scancheck") == 0) {
+    // Read only a small prefix of each file, the follow up reads must fetch the rest of the EXIF data
+    unsigned long prefix = strtoul(argv[2], NULL, 10);
+    std::vector<std::string> paths(argv + 3, argv + argc);
+    std::vector<int> fields;
+    for (int i = 0; i < BATCH_NUM_FIELDS; i++) fields.push_back(i);
+    std::vector<exif::BatchColumn> scanned;
+    exif::ScanStats stats;
+    if (!exif::scanFiles(paths, fields, &scanned, 2, 4, prefix, &stats) || stats.failed > 0) {
+      printf("Scan failed\n");
+      return 1;
+    }
+
+    std::vector<std::vector<unsigned char> > files;
+    std::vector<exif::ByteView> spans;
+    for (unsigned long i = 0; i < paths.size(); i++) {
+      exif::FileSource file(paths[i]);
+      const unsigned char *buf = file.readAt(0, file.size());
+      files.push_back(buf != NULL ? std::vector<unsigned char>(buf, buf + file.size()) : std::vector<unsigned char>());
+    }
+    for (unsigned long i = 0; i < files.size(); i++) {
+      exif::ByteView span = {files[i].data(), files[i].size()};
+      spans.push_back(span);
+    }
+    std::vector<exif::BatchColumn> decoded;
+    exif::decodeBatch(spans.data(), spans.size(), fields, &decoded, 2);
+
+    int failed = 0;
+    for (unsigned long c = 0; c < fields.size(); c++) {
+      const exif::BatchColumn &a = scanned[c], &b = decoded[c];
+      for (unsigned long row = 0; row < paths.size(); row++) {
+        bool valid = (a.validity[row / 8] >> (row % 8)) & 1;
+        bool same = valid == (bool)((b.validity[row / 8] >> (row % 8)) & 1);
+        if (same && valid && a.type == COLUMN_INT64) same = a.int64Values[row] == b.int64Values[row];
+        if (same && valid && a.type == COLUMN_DOUBLE) same = a.doubleValues[row] == b.doubleValues[row];
+        if (same && valid && a.type == COLUMN_STRING) {
+          same = std::string(&a.data[a.offsets[row]], a.offsets[row + 1] - a.offsets[row]) ==
+                 std::string(&b.data[b.offsets[row]], b.offsets[row + 1] - b.offsets[row]);
+        }
+        if (!same) {
+          printf("%s: field %d differs from the full file\n", paths[row].c_str(), fields[c]);
+          failed++;
+        }
+      }
+    }
+    printf("%lu files %lu reads %lu follow up reads %lu bytes read\n", stats.files, stats.reads, stats.followUps,
+           stats.bytesRead);
+    return failed > 0 ? 1 : 0;
+  }
+  if (strcmp(argv[1], "mergecheck") == 0) {
+    // Layout tags are never reported or merged, and merging from the target itself is refused
+    int failed = 0;
+    for (int a = 2; a < argc; a++) {
+      for (int b = 2; b < argc; b++) {
+        exif::EXIFInfo target, source;
+        std::vector<exif::TagDiff> diffs;
+        if (!target.readEXIF(argv[a]) || !source.readEXIF(argv[b])) continue;
+        target.diff(source, &diffs);
+        for (unsigned long i = 0; i < diffs.size(); i++) {
+          uint16_t tag = diffs.at(i).tag;
+          if (tag == EXIF_TAG_STRIP_OFFSETS || tag == EXIF_TAG_JPEG_SOI_OFFSET || tag == EXIF_TAG_EXIF_IFD_OFFSET ||
+              tag == EXIF_TAG_GPS_IFD_OFFSET || tag == EXIF_TAG_INTEROP_OFFSET) {
+            printf("%s %s: layout tag 0x%04x reported\n", argv[a], argv[b], tag);
+            failed++;
+          }
+        }
+        std::string before = target.toString(IFD0_DIRECTORY) + target.toString(EXIF_IFD_DIRECTORY);
+        if (!diffs.empty() && (target.merge(target, diffs) ||
+                               before != target.toString(IFD0_DIRECTORY) + target.toString(EXIF_IFD_DIRECTORY))) {
+          printf("%s: merge from itself wasn't refused\n", argv[a]);
+          failed++;
+        }
+        if (!target.merge(source, diffs)) {
+          printf("%s %s: merge failed\n", argv[a], argv[b]);
+          failed++;
+          continue;
+        }
+        target.diff(source, &diffs);
+        if (!diffs.empty()) {
+          printf("%s %s: %lu tags differ after the merge\n", argv[a], argv[b], (unsigned long)diffs.size());
+          failed++;
+        }
+      }
+    }
+    printf("%d files merged pairwise, %d failures\n", argc - 2, failed);
+    return failed > 0 ? 1 : 0;
+  }
+  bool full = strcmp(argv[1], "full") == 0;
+  bool reuse = strcmp(argv[1], "reuse") == 0;
+  bool fingerprint = strcmp(argv[1], "fingerprint") == 0;
+  bool encodeTemplate = strcmp(argv[1], "template") == 0;
+  bool roundtrip = strcmp(argv[1], "roundtrip") == 0;
+  unsigned long n = strtoul(argv[2], NULL, 10);
+  if (n == 0) {
+    printf("The number of records must be at least 1\n");
+    return -1;
+  }
+
+  std::vector<std::vector<unsigned char> > files;
+  for (int i = 3; i < argc; i++) {
+    FILE *fp = fopen(argv[i], "rb");
+    if (fp == NULL) {
+      printf("Can't open %s\n", argv[i]);
+      return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    files.push_back(std::vector<unsigned char>((size_t)ftell(fp)));
+    fseek(fp, 0, SEEK_SET);
+    if (fread(files.back().data(), 1, files.back().size(), fp) != files.back().size()) files.back().clear();
+    fclose(fp);
+  }
+
+  // Run each kind in its own process so the measurements don't share the heap
+  long before = residentKB();
+  double start = now();
+  if (reuse) {
+    // Warm up with a few passes over the files so the directories and marker buffers have grown to size
+    exif::EXIFInfo info;
+    for (unsigned long i = 0; i < 4 * files.size(); i++) {
+      info.readEXIF(files[i % files.size()].data(), files[i % files.size()].size());
+    }
+    long warm = residentKB();
+    for (unsigned long i = 0; i < n; i++) {
+      std::vector<unsigned char> &file = files.at(i % files.size());
+      info.readEXIF(file.data(), file.size());
+    }
+    long growth = residentKB() - warm;
+    printf("%-12s %10lu records %10ld KB after warm-up %10ld KB growth %10.0f records/s\n", "reuse", n,
+           warm - before, growth, n / (now() - start));
+    // Allow some slack for the allocator, a leak of even a few bytes per record grows far more than this
+    if (growth > 256) {
+      printf("Memory grew by %ld KB\n", growth);
+      return 1;
+    }
+  } else if (fingerprint) {
+    exif::EXIFInfo info;
+    for (unsigned long i = 0; i < n; i++) {
+      std::vector<unsigned char> &file = files.at(i % files.size());
+      info.readEXIF(file.data(), file.size());
+    }
+    double decodeSeconds = now() - start;
+    exif::FingerprintPolicy policy = exif::fingerprintPolicy();
+    exif::Fingerprint fp;
+    uint64_t check = 0;
+    start = now();
+    for (unsigned long i = 0; i < n; i++) {
+      std::vector<unsigned char> &file = files.at(i % files.size());
+      exif::MemorySource src(file.data(), file.size());
+      if (exif::fingerprint(src, policy, &fp)) check ^= fp.lo;
+    }
+    double fingerprintSeconds = now() - start;
+    // Both ways of hashing must agree for every file with EXIF data, whatever its container
+    int failed = 0;
+    for (unsigned long i = 0; i < files.size(); i++) {
+      exif::Fingerprint decoded;
+      exif::MemorySource src(files[i].data(), files[i].size());
+      bool found = exif::fingerprint(src, policy, &fp);
+      if (!info.readEXIF(files[i].data(), files[i].size())) continue;
+      info.fingerprint(policy, &decoded);
+      if (!found || fp.hi != decoded.hi || fp.lo != decoded.lo) {
+        printf("%s: fingerprint differs from the decoded tags\n", argv[3 + i]);
+        failed++;
+      }
+    }
+    printf("%-12s %10lu records %10.0f records/s\n", "readEXIF", n, n / decodeSeconds);
+    printf("%-12s %10lu records %10.0f records/s %6.2f of the decode time (%016llx)\n", "fingerprint", n,
+           n / fingerprintSeconds, fingerprintSeconds / decodeSeconds, (unsigned long long)check);
+    if (failed > 0) return 1;
+  } else if (roundtrip) {
+    int failed = 0;
+    for (unsigned long f = 0; f < files.size(); f++) {
+      std::vector<unsigned char> file = files[f];
+      unsigned long stableSize = 0;
+      for (unsigned long cycle = 0; cycle < n; cycle++) {
+        exif::EXIFInfo info;
+        if (!info.readEXIF(file.data(), file.size())) {
+          if (cycle > 0) {
+            printf("%s: can't read the EXIF data written in cycle %lu\n", argv[3 + f], cycle - 1);
+            failed++;
+          }
+          break;
+        }
+        // Same sized values every cycle: inline, out of line and string values in three directories
+        char text[32];
+        snprintf(text, sizeof(text), "Roundtrip %06lu", cycle);
+        exif::IFEntry iso(EXIF_TAG_ISO_SPEED_RATING, EXIF_IFD_DIRECTORY, (int)(100 + cycle % 1000));
+        exif::IFEntry artist(EXIF_TAG_ARTIST, IFD0_DIRECTORY, std::string(text));
+        exif::IFEntry exposure(EXIF_TAG_EXPOSURE_TIME, EXIF_IFD_DIRECTORY, 1, (int)(30 + cycle % 1000));
+        exif::IFEntry datum(EXIF_TAG_GPS_MAP_DATUM, GPS_IFD_DIRECTORY, std::string(text));
+        info.updateEntry(&iso);
+        info.updateEntry(&artist);
+        info.updateEntry(&exposure);
+        info.updateEntry(&datum);
+
+        unsigned char *buf = NULL;
+        unsigned long len = 0;
+        if (!info.encodeJPEGHeader(&buf, &len)) break; // Only Extended EXIF would fit
+        std::vector<unsigned char> out(buf, buf + len);
+        free(buf);
+        out.insert(out.end(), file.begin() + exif::getDataStart(file.data(), file.size()), file.end());
+
+        exif::EXIFInfo check;
+        check.readEXIF(out.data(), out.size());
+        if (check.toString(IFD0_DIRECTORY) != info.toString(IFD0_DIRECTORY) ||
+            check.toString(EXIF_IFD_DIRECTORY) != info.toString(EXIF_IFD_DIRECTORY) ||
+            check.toString(GPS_IFD_DIRECTORY) != info.toString(GPS_IFD_DIRECTORY)) {
+          printf("%s: tags read back differ in cycle %lu\n", argv[3 + f], cycle);
+          failed++;
+          break;
+        }
+        // The first cycle adds tags and the second may move directories into the space freed by the first
+        if (cycle == 2) stableSize = len;
+        if (cycle > 2 && len > stableSize) {
+          printf("%s: header grew from %lu to %lu bytes in cycle %lu\n", argv[3 + f], stableSize, len, cycle);
+          failed++;
+          break;
+        }
+        file.swap(out);
+      }
+      printf("%-40s %8lu byte header\n", argv[3 + f], stableSize);
+    }
+    if (failed > 0) return 1;
+  } else if (encodeTemplate) {
+    exif::EXIFInfo info;
+    exif::EncodeTemplate tmpl;
+    std::vector<exif::TagId> fields(2);
+    fields[0].tag = EXIF_TAG_EXPOSURE_TIME;
+    fields[0].directory = EXIF_IFD_DIRECTORY;
+    fields[1].tag = EXIF_TAG_ISO_SPEED_RATING;
+    fields[1].directory = EXIF_IFD_DIRECTORY;
+    unsigned long i = 0;
+    while (i < files.size() && !(info.readEXIF(files[i].data(), files[i].size()) &&
+                                 tmpl.compile(info, fields))) {
+      i++;
+    }
+    if (i == files.size()) {
+      printf("No file with an exposure time and ISO\n");
+      return 1;
+    }
+    int exposure = tmpl.field(EXIF_TAG_EXPOSURE_TIME, EXIF_IFD_DIRECTORY);
+    int iso = tmpl.field(EXIF_TAG_ISO_SPEED_RATING, EXIF_IFD_DIRECTORY);
+    unsigned long patched = 0;
+    start = now();
+    for (unsigned long frame = 0; frame < n; frame++) {
+      exif::Rational time;
+      time.numerator = 1;
+      time.denominator = 30 + (uint32_t)(frame % 1000);
+      // Only count frames which were patched so the stores can't be optimized away
+      if (tmpl.setRational(exposure, 0, time) && tmpl.setShort(iso, 0, (uint16_t)(100 + frame % 3200))) patched++;
+    }
+    double templateSeconds = now() - start;
+    unsigned long encodes = std::max(1UL, n / 1000);
+    start = now();
+    for (unsigned long frame = 0; frame < encodes; frame++) {
+      unsigned char *buf = NULL;
+      unsigned long len = 0;
+      info.encodeJPEGHeader(&buf, &len);
+      free(buf);
+    }
+    double encodeSeconds = now() - start;
+    printf("%-40s %lu of %lu frames patched, %8.1f ns/frame (%02x)\n", argv[3 + i], patched, n,
+           templateSeconds * 1e9 / n, tmpl.data()[tmpl.size() - 1]);
+    printf("%-40s %lu headers encoded, %8.1f ns/frame\n", "encodeJPEGHeader", encodes, encodeSeconds * 1e9 / encodes);
+  } else if (full) {
+    std::vector<exif::EXIFInfo *> records(n);
+    for (unsigned long i = 0; i < n; i++) {
+      std::vector<unsigned char> &file = files.at(i % files.size());
+      records[i] = new exif::EXIFInfo;
+      records[i]->readEXIF(file.data(), file.size());
+    }
+    report("EXIFInfo", n, residentKB() - before, now() - start);
+  } else {
+    exif::StringPool pool;
+    std::vector<exif::ExifSummary> records(n);
+    for (unsigned long i = 0; i < n; i++) {
+      std::vector<unsigned char> &file = files.at(i % files.size());
+      exif::ByteView image = {file.data(), file.size()};
+      exif::summarize(image, &pool, &records[i]);
+    }
+    report("ExifSummary", n, residentKB() - before, now() - start);
+    printf("sizeof(ExifSummary) %lu, %lu pooled strings\n", (unsigned long)sizeof(exif::ExifSummary),
+           (unsigned long)pool.size());
+  }
+  return 0;
+}
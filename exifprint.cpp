@@ -1,20 +1,104 @@
 #include <stdio.h>
+#include <string.h>
 #include "exif.h"
 
 
 int main(int argc, char *argv[]) {
   if (argc < 2) {
-    printf("Usage: demo <JPEG file>\n");
+    printf("Usage: demo <JPEG file or - for stdin>\n");
+    printf("       demo -r <damaged file>\n");
+    printf("       demo -x <JPEG file>\n");
+    printf("       demo -i <JPEG file>\n");
+    printf("       demo -d <JPEG file> <JPEG file>\n");
+    printf("       demo -f <JPEG file>\n");
     return -1;
   }
   exif::EXIFInfo *exifInfo = new exif::EXIFInfo; 
-  if (!exifInfo->readEXIF(argv[1]))
+  if (strcmp(argv[1], "-r") == 0 && argc > 2) {
+    // Salvage the EXIF data of a file the normal decode rejects
+    exif::FileSource file(argv[2]);
+    exif::PrefetchSource src(file);
+    int confidence = 0;
+    if (file.isOpen() && exifInfo->recoverEXIF(src, RECOVER_WINDOW, &confidence))
+      printf("Recovered with confidence %d\n", confidence);
+    else
+      printf("Nothing recovered from %s\n", argv[2]);
+  } else if (strcmp(argv[1], "-x") == 0 && argc > 2) {
+    // Only the common XMP properties
+    std::vector<exif::XMPProperty> properties = exif::commonXMPProperties();
+    if (!exifInfo->readEXIF(argv[2]) && exifInfo->AppMarkers.empty())
+      printf("Error reading file %s\n", argv[2]);
+    exifInfo->readXMP(&properties);
+    for (unsigned long i = 0; i < properties.size(); i++) {
+      for (unsigned long j = 0; j < properties.at(i).values.size(); j++) {
+        printf("XMP: %s: %s\n", properties.at(i).name.c_str(), properties.at(i).values.at(j).c_str());
+      }
+    }
+    delete exifInfo;
+    return 0;
+  } else if (strcmp(argv[1], "-i") == 0 && argc > 2) {
+    // Only the ICC profile
+    std::vector<exif::ByteView> chunks;
+    unsigned char id[16];
+    exifInfo->readEXIF(argv[2]);
+    if (exifInfo->iccChunks(&chunks) && exifInfo->iccProfileID(id)) {
+      unsigned long size = 0;
+      for (unsigned long i = 0; i < chunks.size(); i++) size += chunks.at(i).size;
+      printf("ICC: %lu bytes in %lu chunks, ID ", size, (unsigned long)chunks.size());
+      for (int i = 0; i < 16; i++) printf("%02x", id[i]);
+      printf("\n");
+    } else {
+      printf("No ICC profile in %s\n", argv[2]);
+    }
+    delete exifInfo;
+    return 0;
+  } else if (strcmp(argv[1], "-d") == 0 && argc > 3) {
+    // Only the tags which differ between two files
+    exif::EXIFInfo other;
+    std::vector<exif::TagDiff> diffs;
+    if (!exifInfo->readEXIF(argv[2])) printf("Error reading file %s\n", argv[2]);
+    if (!other.readEXIF(argv[3])) printf("Error reading file %s\n", argv[3]);
+    exifInfo->diff(other, &diffs);
+    for (unsigned long i = 0; i < diffs.size(); i++) {
+      const char *change = diffs.at(i).change == TAG_ADDED ? "added" :
+                           diffs.at(i).change == TAG_REMOVED ? "removed" : "changed";
+      printf("Diff: directory %d tag 0x%04x %s\n", diffs.at(i).directory, diffs.at(i).tag, change);
+    }
+    delete exifInfo;
+    return 0;
+  } else if (strcmp(argv[1], "-f") == 0 && argc > 2) {
+    // Only the fingerprint, without decoding
+    exif::FileSource file(argv[2]);
+    exif::PrefetchSource src(file);
+    exif::Fingerprint fp;
+    if (file.isOpen() && exif::fingerprint(src, exif::fingerprintPolicy(), &fp))
+      printf("Fingerprint: %016llx%016llx\n", (unsigned long long)fp.hi, (unsigned long long)fp.lo);
+    else
+      printf("No EXIF data in %s\n", argv[2]);
+    delete exifInfo;
+    return 0;
+  } else if (strcmp(argv[1], "-") == 0) {
+    // Read a JPEG stream from stdin, only up to the end of the metadata
+    exif::StreamDecoder decoder(exifInfo);
+    unsigned char chunk[4096];
+    size_t len;
+    while (decoder.status() == STREAM_NEED_MORE && (len = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+      decoder.push(chunk, len);
+    }
+    if (decoder.finish() != STREAM_DONE)
+      printf("Error reading stdin");
+  } else if (!exifInfo->readEXIF(argv[1]))
 	  printf("Error reading file %s",argv[1]);
 
   std::string output = exifInfo->toString();
   printf("%s",output.c_str());
+  for (unsigned long i = 0; i < exifInfo->MPImages.size(); i++) {
+    exif::MPImage &image = exifInfo->MPImages.at(i);
+    printf("MPF: Image %lu: type 0x%06x offset %lu size %lu\n", i + 1, image.type(), image.offset, image.size);
+  }
   
   std::string newOutput = std::string("test.jpg");
 
+  delete exifInfo;
   return 0;
 }
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <thread>
+#include "exif.h"
+
+// Remove the GPS data, serial numbers, owner and XMP packets from JPEG files before they are published.
+// The files are stripped in place, or copied into the output directory, by a pool of threads.
+
+int main(int argc, char *argv[]) {
+  unsigned threads = std::thread::hardware_concurrency();
+  std::string outDir;
+  int first = 1;
+  while (first + 1 < argc && argv[first][0] == '-') {
+    if (strcmp(argv[first], "-j") == 0) {
+      threads = (unsigned)strtoul(argv[first + 1], NULL, 10);
+    } else if (strcmp(argv[first], "-o") == 0) {
+      outDir = argv[first + 1];
+    } else {
+      break;
+    }
+    first += 2;
+  }
+  if (first >= argc) {
+    printf("Usage: exifstrip [-j threads] [-o output directory] <JPEG files...>\n");
+    printf("       Without -o the files are stripped in place\n");
+    return -1;
+  }
+  if (threads == 0) threads = 1;
+
+  exif::StripPolicy policy = exif::privacyPolicy();
+  std::vector<std::string> files(argv + first, argv + argc);
+  std::vector<std::string> outputs(files.size());
+  if (!outDir.empty()) {
+    // Files are copied by their name, so two inputs with the same name would overwrite each other
+    std::map<std::string, unsigned long> names;
+    for (unsigned long i = 0; i < files.size(); i++) {
+      size_t slash = files[i].find_last_of('/');
+      outputs[i] = outDir + "/" + (slash == std::string::npos ? files[i] : files[i].substr(slash + 1));
+      std::map<std::string, unsigned long>::iterator found = names.find(outputs[i]);
+      if (found != names.end()) {
+        printf("%s and %s would both be written to %s\n", files[found->second].c_str(), files[i].c_str(),
+               outputs[i].c_str());
+        return -1;
+      }
+      names[outputs[i]] = i;
+    }
+  }
+  std::vector<int> removed(files.size());
+  std::vector<char> ok(files.size());
+  std::atomic<unsigned long> next(0);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads && t < files.size(); t++) {
+    workers.push_back(std::thread([&]() {
+      for (unsigned long i = next++; i < files.size(); i = next++) {
+        ok[i] = exif::stripJPEGFile(files[i], outputs[i], policy, &removed[i]);
+      }
+    }));
+  }
+  for (unsigned long t = 0; t < workers.size(); t++) workers[t].join();
+
+  int failed = 0;
+  for (unsigned long i = 0; i < files.size(); i++) {
+    if (ok[i]) {
+      printf("%-40s %3d tags removed\n", files[i].c_str(), removed[i]);
+    } else {
+      printf("%-40s failed\n", files[i].c_str());
+      failed++;
+    }
+  }
+  return failed == 0 ? 0 : 1;
+}
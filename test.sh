@@ -14,6 +14,133 @@ if [ ! -e ./exifprint ]; then
   fi
 fi
 
+# Edit, encode and read back the JPEG files over and over, the header must not grow from save to save
+./exifbench roundtrip 20 test-images/*.jpg > /tmp/roundtrip.actual 2>&1
+if [ $? -ne 0 ]; then
+  echo "FAILED ON roundtrip"
+  cat /tmp/roundtrip.actual
+  exit 1
+fi
+echo "PASS roundtrip"
+
+# Merge the differences of every pair of files, nothing may differ afterwards and layout tags must be left alone
+./exifbench mergecheck test-images/*.jpg test-images/*.tif > /tmp/mergecheck.actual 2>&1
+if [ $? -ne 0 ]; then
+  echo "FAILED ON mergecheck"
+  cat /tmp/mergecheck.actual
+  exit 1
+fi
+echo "PASS mergecheck"
+
+# Fingerprint the files without decoding them, it must match the fingerprint of the decoded tags
+./exifbench fingerprint 1 test-images/*.jpg test-images/*.tif test-images/*.heic test-images/*.png \
+  test-images/*.webp > /tmp/fingerprint.actual 2>&1
+if [ $? -ne 0 ]; then
+  echo "FAILED ON fingerprint"
+  cat /tmp/fingerprint.actual
+  exit 1
+fi
+echo "PASS fingerprint"
+
+# Scan the files reading a small prefix of each, the follow up reads must find the same values as the whole files
+./exifbench scancheck 256 test-images/*.jpg test-images/*.tif test-images/*.heic test-images/*.png \
+  test-images/*.webp > /tmp/scancheck.actual 2>&1
+if [ $? -ne 0 ]; then
+  echo "FAILED ON scancheck"
+  cat /tmp/scancheck.actual
+  exit 1
+fi
+echo "PASS scancheck"
+
+# Stream each JPEG file through stdin, it must decode the same as reading the file
+for jpeg in `ls test-images/*.jpg`; do
+  $TOOL_NAME - < $jpeg > /tmp/`basename $jpeg`.stdin 2>&1
+  $TOOL_NAME $jpeg > /tmp/`basename $jpeg`.file 2>&1
+  if ! diff /tmp/`basename $jpeg`.file /tmp/`basename $jpeg`.stdin > /tmp/diff.out; then
+    echo "FAILED ON stdin $jpeg"
+    cat /tmp/diff.out
+    exit 1
+  fi
+done
+echo "PASS stdin"
+
+# Run the tool with the given arguments and compare the output with the expected file
+check_output() {
+  expected=$1
+  shift
+  $TOOL_NAME "$@" > /tmp/check.actual 2>&1
+  diff $expected /tmp/check.actual > /tmp/diff.out
+  if [[ -s /tmp/diff.out ]] ; then
+    echo "FAILED ON $TOOL_NAME $*"
+    cat /tmp/diff.out
+    exit 1
+  fi
+  echo "PASS $TOOL_NAME $*"
+}
+
+# Salvage EXIF data from a JPEG with garbage between the markers and from bare EXIF data starting at offset 0
+check_output test-images/test1-damaged.jpg.recovered -r test-images/test1-damaged.jpg
+check_output test-images/test1.exif.recovered -r test-images/test1.exif
+
+# XMP properties split over Extended XMP, with entities and character references including invalid ones, and
+# array items of an RDF namespace bound to another prefix
+check_output test-images/test1-xmp.jpg.xmp -x test-images/test1-xmp.jpg
+check_output test-images/test1-xmp-prefix.jpg.xmp -x test-images/test1-xmp-prefix.jpg
+
+# ICC profile ID of a profile in one APP2 chunk and of the same profile split over three
+check_output test-images/lukas12p.jpg.icc -i test-images/lukas12p.jpg
+check_output test-images/lukas12p-icc3.jpg.icc -i test-images/lukas12p-icc3.jpg
+
+# Strip the GPS and XMP data, everything else must read back the same and stripping again must change nothing
+rm -rf /tmp/strip && mkdir -p /tmp/strip/out /tmp/strip/again /tmp/strip/dup
+./exifstrip -o /tmp/strip/out test-images/test1.jpg test-images/lukas12p.jpg test-images/test1-xmp.jpg \
+  > /tmp/strip.actual 2>&1
+if [ $? -ne 0 ]; then
+  echo "FAILED ON strip"
+  cat /tmp/strip.actual
+  exit 1
+fi
+for jpeg in test1.jpg lukas12p.jpg test1-xmp.jpg; do
+  $TOOL_NAME test-images/$jpeg | grep -v "^GPS:" > /tmp/strip/$jpeg.expected
+  $TOOL_NAME /tmp/strip/out/$jpeg > /tmp/strip/$jpeg.actual 2>&1
+  $TOOL_NAME -x /tmp/strip/out/$jpeg >> /tmp/strip/$jpeg.actual 2>&1
+  if ! diff /tmp/strip/$jpeg.expected /tmp/strip/$jpeg.actual > /tmp/diff.out; then
+    echo "FAILED ON strip $jpeg"
+    cat /tmp/diff.out
+    exit 1
+  fi
+  cp /tmp/strip/out/$jpeg /tmp/strip/again/$jpeg
+done
+./exifstrip /tmp/strip/again/*.jpg > /tmp/strip.actual 2>&1
+for jpeg in test1.jpg lukas12p.jpg test1-xmp.jpg; do
+  if ! cmp -s /tmp/strip/out/$jpeg /tmp/strip/again/$jpeg; then
+    echo "FAILED ON strip again $jpeg"
+    cat /tmp/strip.actual
+    exit 1
+  fi
+done
+# Two inputs with the same name must not be written over each other
+cp test-images/test1.jpg /tmp/strip/dup/test1.jpg
+if ./exifstrip -o /tmp/strip/out test-images/test1.jpg /tmp/strip/dup/test1.jpg > /tmp/strip.actual 2>&1; then
+  echo "FAILED ON strip collision"
+  cat /tmp/strip.actual
+  exit 1
+fi
+echo "PASS strip"
+
+# The other containers and the JPEG fixtures of the newer features, all of which must match
+for image in `ls test-images/test1-*.jpg test-images/lukas12p-icc3.jpg test-images/*.tif test-images/*.heic \
+    test-images/*.png test-images/*.webp`; do
+  $TOOL_NAME $image > /tmp/`basename $image`.actual 2> /tmp/`basename $image`.error
+  diff $image.expected /tmp/`basename $image`.actual > /tmp/diff.out
+  if [[ -s /tmp/diff.out ]] ; then
+    echo "FAILED ON $image"
+    cat /tmp/diff.out
+    exit 1
+  fi
+  echo "PASS $image"
+done
+
 for jpeg in `ls test-images/*.jpg`; do
   $TOOL_NAME $jpeg > /tmp/`basename $jpeg`.actual 2> /tmp/`basename $jpeg`.error
   diff $jpeg.expected /tmp/`basename $jpeg`.actual > /tmp/diff.out